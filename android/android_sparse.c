@@ -59,6 +59,14 @@ int android_sparse_init(struct android_sparse_input *input, size_t blksz,
 	input->error = 0;
 	input->blksz = blksz;
 	input->total_blks = total_blks;
+	input->chunk_bitmasks = NULL;
+
+	/* sparse_header.total_blks is 32 bits */
+	if (total_blks > UINT32_MAX) {
+		fprintf(stderr, "Error: sparse image can't hold %zu blocks\n",
+			total_blks);
+		return -1;
+	}
 
 	input->chunk_bitmasks = alloc_bitmask(input->total_blks);
 	if (!input->chunk_bitmasks)
@@ -109,6 +117,7 @@ int android_sparse_finish(struct android_sparse_input *input, int fd_target,
 	size_t blk = 0, total_chunks = 0;
 	struct sparse_header h = { 0 };
 	uint64_t offset = 0;
+	size_t max_raw_blks;
 	int ret = -1;
 
 	h.magic = cpu_to_le32(SPARSE_HEADER_MAGIC);
@@ -122,6 +131,8 @@ int android_sparse_finish(struct android_sparse_input *input, int fd_target,
 	if (!chunk_bitmasks || input->error)
 		goto freemem;
 
+	max_raw_blks = (UINT32_MAX - sizeof(struct chunk_header)) / input->blksz;
+
 	offset = le32_to_cpu(h.file_hdr_sz);
 	bitmask_foreach_continue(it, chunk_bitmasks) {
 		size_t fs_blocknr = it.start, fs_count = it.bits;
@@ -139,26 +150,36 @@ int android_sparse_finish(struct android_sparse_input *input, int fd_target,
 			total_chunks++;
 		}
 
-		ch.chunk_type = cpu_to_le32(CHUNK_TYPE_RAW);
-		ch.chunk_sz = cpu_to_le32(fs_count);
-		ch.total_sz = cpu_to_le32(fs_count * input->blksz + sizeof(ch));
-		write(fd_target, &ch, sizeof(ch));
+		/* chunk_header.total_sz is 32 bits, split the large chunks */
+		while (fs_count > 0) {
+			size_t n = fs_count;
 
-		total_chunks++;
-		offset += sizeof(ch);
-
-		chunk.fs_blocknr = fs_blocknr;
-		chunk.count = fs_count;
-		ret = write_cb(fd_target, &chunk, private_data);
-		if (ret < 0) {
-			fprintf(stderr, "Error: write sparse chunk for fs block"
-				" #%zu failed\n",
-				fs_blocknr);
-			goto freemem;
-		}
+			if (n > max_raw_blks)
+				n = max_raw_blks;
 
-		offset += fs_count * input->blksz;
-		blk += fs_count;
+			ch.chunk_type = cpu_to_le32(CHUNK_TYPE_RAW);
+			ch.chunk_sz = cpu_to_le32(n);
+			ch.total_sz = cpu_to_le32(n * input->blksz + sizeof(ch));
+			write(fd_target, &ch, sizeof(ch));
+
+			total_chunks++;
+			offset += sizeof(ch);
+
+			chunk.fs_blocknr = fs_blocknr;
+			chunk.count = n;
+			ret = write_cb(fd_target, &chunk, private_data);
+			if (ret < 0) {
+				fprintf(stderr, "Error: write sparse chunk for fs block"
+					" #%zu failed\n",
+					fs_blocknr);
+				goto freemem;
+			}
+
+			offset += (uint64_t)n * input->blksz;
+			fs_blocknr += n;
+			fs_count -= n;
+			blk += n;
+		}
 	}
 
 	if (blk < input->total_blks) {
@@ -77,6 +77,22 @@ int bitmask_memcpy_lsbfirst(struct bitmask *b, const void *src, size_t src_bytes
 	return 0;
 }
 
+/* the reverse of bitmask_memcpy_lsbfirst, bit N is saved in bit N % 8 of
+ * the byte N / 8.
+ */
+int bitmask_export_lsbfirst(const struct bitmask *b, void *dst, size_t dst_bytes)
+{
+	uint8_t *p = dst;
+
+	if (!b || dst_bytes > b->bufsize)
+		return -1;
+
+	for (size_t i = 0; i < dst_bytes; i++)
+		p[i] = reverse8(b->buffer[i]);
+
+	return 0;
+}
+
 static inline size_t get_bit_index_msbfirst(size_t bit_idx, size_t *byte_idx)
 {
 	*byte_idx = bit_idx / 8;
@@ -103,12 +119,31 @@ int bitmask_write(struct bitmask *b, size_t bit_idx, int v)
 	return 0;
 }
 
+/* write the leading and trailing bits one by one and the whole bytes
+ * between them by memset, the bits out of range are not written.
+ */
 static int _bitmask_write_bits(struct bitmask *b, size_t from_bit, size_t bits, int v)
 {
+	size_t end = from_bit + bits;
 	int ret = 0;
 
-	for (size_t i = 0; i < bits; i++)
-		ret += bitmask_write(b, from_bit + i, v);
+	if (end > b->total_bits || end < from_bit) {
+		end = b->total_bits;
+		ret = -1;
+	}
+
+	while (from_bit < end && from_bit % 8)
+		bitmask_write(b, from_bit++, v);
+
+	if (from_bit < end && end - from_bit >= 8) {
+		size_t bytes = (end - from_bit) / 8;
+
+		memset(&b->buffer[from_bit / 8], v ? 0xff : 0, bytes);
+		from_bit += bytes * 8;
+	}
+
+	while (from_bit < end)
+		bitmask_write(b, from_bit++, v);
 
 	return ret;
 }
@@ -130,7 +165,7 @@ int bitmask_unset(struct bitmask *b, size_t bit_idx)
 
 int bitmask_unset_bits(struct bitmask *b, size_t from_bit, size_t bits)
 {
-	return _bitmask_write_bits(b, from_bit, bits, 1);
+	return _bitmask_write_bits(b, from_bit, bits, 0);
 }
 
 int bitmask_get(struct bitmask *b, size_t bit_idx)
@@ -144,7 +179,7 @@ int bitmask_get(struct bitmask *b, size_t bit_idx)
 	return !!(b->buffer[byte] & (1 << bit));
 }
 
-static int _bitmask_first_one(struct bitmask *b, size_t from_bit, uint8_t xor)
+static ssize_t _bitmask_first_one(struct bitmask *b, size_t from_bit, uint8_t xor)
 {
 	for (size_t i = from_bit / 8; i < b->bufsize; i++) {
 		uint8_t mask = b->buffer[i] ^ xor;
@@ -173,12 +208,12 @@ static int _bitmask_first_one(struct bitmask *b, size_t from_bit, uint8_t xor)
 	return -1;
 }
 
-int bitmask_next_zero(struct bitmask *b, size_t from_bit)
+ssize_t bitmask_next_zero(struct bitmask *b, size_t from_bit)
 {
 	return _bitmask_first_one(b, from_bit, 0xff);
 }
 
-int bitmask_next_one(struct bitmask *b, size_t from_bit)
+ssize_t bitmask_next_one(struct bitmask *b, size_t from_bit)
 {
 	return _bitmask_first_one(b, from_bit, 0);
 }
@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 struct bitmask {
 	size_t			total_bits;
@@ -25,22 +26,23 @@ int bitmask_not(struct bitmask *b);
 int bitmask_memset(struct bitmask *b, uint8_t val);
 int bitmask_memcpy(struct bitmask *b, const void *src, size_t src_bytes);
 int bitmask_memcpy_lsbfirst(struct bitmask *b, const void *src, size_t src_bytes);
+int bitmask_export_lsbfirst(const struct bitmask *b, void *dst, size_t dst_bytes);
 int bitmask_get(struct bitmask *b, size_t bit_idx);
-int bitmask_next_zero(struct bitmask *b, size_t from_bit);
-int bitmask_next_one(struct bitmask *b, size_t from_bit);
+ssize_t bitmask_next_zero(struct bitmask *b, size_t from_bit);
+ssize_t bitmask_next_one(struct bitmask *b, size_t from_bit);
 
 struct bitmask *bitmask_xor(const struct bitmask *a, const struct bitmask *b);
 
 #define bitmask_foreach(i, b) \
-	for (int i = bitmask_next_one(b, 0); i >= 0; i = bitmask_next_one(b, i + 1))
+	for (ssize_t i = bitmask_next_one(b, 0); i >= 0; i = bitmask_next_one(b, i + 1))
 
 struct bitmask_continue_iterator {
-	int			start;
-	int			bits;
+	ssize_t			start;
+	size_t			bits;
 	struct bitmask		*b;
 
 	/* private data, do not touch */
-	int			__end;
+	ssize_t			__end;
 };
 
 struct bitmask_continue_iterator bitmask_continue_iterator_init(struct bitmask *b);
@@ -2,6 +2,7 @@
  * simple dd helper library
  * qianfan Zhao
  */
+#define _GNU_SOURCE /* for copy_file_range */
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -9,6 +10,11 @@
 #include <unistd.h>
 #include "imgeditor.h"
 
+#if defined(__GLIBC__) && \
+	(__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE		1
+#endif
+
 /* @fdsrc: the source file descriptor, negative number means copy from /dev/zero
  * @fddst: the target file descriptor, negative number means write to /dev/null
  */
@@ -65,6 +71,79 @@ uint64_t dd64(int fdsrc, int fddst, off64_t offt_src, off64_t offt_dst, uint64_t
 	return n_copied_bytes;
 }
 
+/* let the kernel copy the data without bouncing it in the user space.
+ * Return the bytes copied, it maybe less than @sz if the kernel doesn't
+ * support it (ENOSYS, or EXDEV on the old kernel).
+ */
+static uint64_t copy_file_range64(int fdsrc, int fddst, off64_t offt_src,
+				  off64_t offt_dst, uint64_t sz)
+{
+	uint64_t n_copied_bytes = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (n_copied_bytes < sz) {
+		loff_t off_in = offt_src + n_copied_bytes;
+		loff_t off_out = offt_dst + n_copied_bytes;
+		ssize_t ret;
+
+		ret = copy_file_range(fdsrc, &off_in, fddst, &off_out,
+				      sz - n_copied_bytes, 0);
+		if (ret <= 0)
+			break;
+
+		n_copied_bytes += ret;
+	}
+#endif
+
+	return n_copied_bytes;
+}
+
+uint64_t pdd64(int fdsrc, int fddst, off64_t offt_src, off64_t offt_dst,
+	       uint64_t sz)
+{
+	size_t dd_max_bufsz = 1 << 20; /* 1MiB */
+	uint64_t n_copied_bytes = 0;
+	uint8_t *buffer;
+
+	offt_src += filestart(fdsrc);
+	offt_dst += filestart(fddst);
+
+	n_copied_bytes = copy_file_range64(fdsrc, fddst, offt_src, offt_dst, sz);
+	if (n_copied_bytes == sz)
+		return n_copied_bytes;
+
+	/* copy the remain data by pread/pwrite */
+	sz -= n_copied_bytes;
+
+	buffer = malloc(dd_max_bufsz);
+	if (!buffer)
+		return n_copied_bytes;
+
+	while (sz > 0) {
+		size_t sz_buster = dd_max_bufsz;
+		ssize_t lensrc, lendst;
+
+		if (sz < sz_buster)
+			sz_buster = sz;
+
+		lensrc = pread64(fdsrc, buffer, sz_buster,
+				 offt_src + n_copied_bytes);
+		if (lensrc <= 0)
+			break;
+
+		lendst = pwrite64(fddst, buffer, lensrc,
+				  offt_dst + n_copied_bytes);
+		if (lendst != lensrc)
+			break;
+
+		n_copied_bytes += lensrc;
+		sz -= lensrc;
+	}
+
+	free(buffer);
+	return n_copied_bytes;
+}
+
 size_t dd(int fd_src, int fd_dst, off_t offt_src, off_t offt_dst, size_t sz,
 	  void (*bufscan)(uint8_t *buf, size_t sz_buster, void *p),
 	  void *private_data)
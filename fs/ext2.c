@@ -15,6 +15,13 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include "imgeditor.h"
 #include "ext_common.h"
 #include "ext4_journal.h"
@@ -22,15 +29,26 @@
 #include "libcrc.h"
 #include "android_sparse.h"
 #include "bitmask.h"
+#include "threadpool.h"
+#include "libxopt.h"
 
 struct ext2_editor_private_data;
-static void *alloc_inode_file(struct ext2_editor_private_data *p, uint32_t ino,
-			      uint64_t *ret_filesize);
 static int ext2_whohas_blkno(struct ext2_editor_private_data *p,
-			     uint32_t which_blk,
+			     uint64_t which_blk,
 			     int *ret_ino);
-static int ext2_add_inode_chunks(struct ext2_editor_private_data *p,
-				 struct android_sparse_input *input);
+static int ext2_rmap_load(struct ext2_editor_private_data *p,
+			  const char *cache);
+static int ext2_snapshot_load(struct ext2_editor_private_data *p,
+			      const char *snapshot);
+static int ext2_snapshot_save(struct ext2_editor_private_data *p,
+			      const char *snapshot);
+static const struct ext2_rmap_entry *
+	ext2_rmap_lookup(struct ext2_editor_private_data *p, uint64_t blkno,
+			 uint64_t *next);
+static int ext2_add_bitmap_chunks(struct ext2_editor_private_data *p,
+				  struct android_sparse_input *input);
+static int ext2_verify_inode_chunks(struct ext2_editor_private_data *p,
+				    struct android_sparse_input *input);
 
 static size_t aligned_block(size_t size, size_t block_size)
 {
@@ -571,9 +589,34 @@ enum disk_layout_type {
 
 struct disk_layout {
 	enum disk_layout_type		major_type;
-	uint16_t			group;
-	uint32_t			start_block;
-	uint32_t			len_block;
+	uint32_t			group;
+	uint64_t			start_block;
+	uint64_t			len_block;
+};
+
+/* the reverse map of the blocks used by @ino */
+struct ext2_rmap_entry {
+	uint64_t			start;
+	uint32_t			len;
+	uint32_t			ino;
+};
+
+/* the used part of a block group's inode table, loaded in memory.
+ * the recently used ones are in the head of the lru list.
+ */
+struct ext2_inode_table {
+	struct list_head		lru;
+	uint8_t				*buf;
+	uint32_t			inodes;
+};
+
+/* the filesystem block is replaced by the journal copy when reading,
+ * @pblk is where the copy saved in the image.
+ */
+struct ext2_overlay_block {
+	uint64_t			fs_blocknr;
+	uint64_t			pblk;
+	bool				escaped;
 };
 
 struct ext2_editor_private_data {
@@ -587,6 +630,7 @@ struct ext2_editor_private_data {
 	uint32_t			fragment_size; /* in bytes */
 	uint32_t			inode_size; /* in bytes */
 	uint32_t			n_block_group;
+	uint16_t			descriptor_size; /* in bytes */
 
 	/* block group bitmasks */
 	struct bitmask			**inode_bitmask;
@@ -596,47 +640,99 @@ struct ext2_editor_private_data {
 	struct libcrc32			crc32c_le;
 	struct libcrc16			crc16;
 
-	/* 1T partition has 8192 groups, one group need at no more than 6 item:
+	/* inode table cache, one for each group. protected by @itable_lock
+	 * since the inodes are read by the unpack workers.
+	 */
+	struct ext2_inode_table		*itables;
+	struct list_head		itable_lru;
+	size_t				itable_cache_size;
+	pthread_mutex_t			itable_lock;
+
+	/* one group need at no more than 6 item:
 	 * data bitmap, inode bitmap, inode table,
 	 * backup super block, backup gdt, reserved gdt
 	 */
-#define EXT2_MAX_DISK_LAYOUT_ARRAYS	(8192 * 6)
-	struct disk_layout		layouts[EXT2_MAX_DISK_LAYOUT_ARRAYS];
+	struct disk_layout		*layouts;
 	size_t				n_layout;
+	size_t				max_layout;
+
+	/* block to inode map sorted by the start block, built on demand */
+	struct ext2_rmap_entry		*rmap;
+	size_t				n_rmap;
+	size_t				max_rmap;
+	bool				rmap_loaded;
+
+	/* the blocks replayed from the journal, sorted by fs_blocknr */
+	struct ext2_overlay_block	*overlay;
+	size_t				n_overlay;
+	size_t				max_overlay;
 };
 
 static int ext2_editor_register_layout(struct ext2_editor_private_data *p,
 				       enum disk_layout_type major,
-				       uint16_t group,
-				       uint32_t start_block,
-				       uint32_t len_block)
+				       uint32_t group,
+				       uint64_t start_block,
+				       uint64_t len_block)
 {
-	if (p->n_layout < EXT2_MAX_DISK_LAYOUT_ARRAYS) {
-		struct disk_layout *layout = &p->layouts[p->n_layout];
+	struct disk_layout *layout;
 
-		++p->n_layout;
-		layout->major_type = major;
-		layout->group = group;
-		layout->start_block = start_block;
-		layout->len_block = len_block;
+	if (p->n_layout >= p->max_layout) {
+		size_t max_layout = p->max_layout ? p->max_layout * 2 : 64;
 
-		return 0;
+		layout = realloc(p->layouts, max_layout * sizeof(*layout));
+		if (!layout) {
+			fprintf(stderr, "Error: alloc %zu disk layouts failed\n",
+				max_layout);
+			return -1;
+		}
+
+		p->layouts = layout;
+		p->max_layout = max_layout;
 	}
 
-	return -1;
+	layout = &p->layouts[p->n_layout];
+	++p->n_layout;
+	layout->major_type = major;
+	layout->group = group;
+	layout->start_block = start_block;
+	layout->len_block = len_block;
+
+	return 0;
+}
+
+/* the layouts are sorted by start_block and never overlap, return the
+ * number of layouts started before or at @blkno.
+ */
+static size_t ext2_editor_disk_layout_upper(struct ext2_editor_private_data *p,
+					    uint64_t blkno)
+{
+	size_t lo = 0, hi = p->n_layout;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (p->layouts[mid].start_block <= blkno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
 }
 
 static const struct disk_layout *
 	ext2_editor_disk_layout_match_block(struct ext2_editor_private_data *p,
-					    uint32_t blkno)
+					    uint64_t blkno)
 {
-	for (size_t i = 0; i < p->n_layout; i++) {
-		struct disk_layout *layout = &p->layouts[i];
+	size_t lo = ext2_editor_disk_layout_upper(p, blkno);
+	struct disk_layout *layout;
 
-		if (blkno >= layout->start_block &&
-			blkno < layout->start_block + layout->len_block)
-			return layout;
-	}
+	if (lo == 0)
+		return NULL;
+
+	layout = &p->layouts[lo - 1];
+	if (blkno < layout->start_block + layout->len_block)
+		return layout;
 
 	return NULL;
 }
@@ -661,14 +757,14 @@ static char *format_disk_layout(const struct disk_layout *layout,
 	case DISK_LAYOUT_INODE_BITMAP:
 	case DISK_LAYOUT_INODE_TABLE:
 	case DISK_LAYOUT_RESERVED_GDT:
-		snprintf(buf, bufsz, "%-22s for group %d",
+		snprintf(buf, bufsz, "%-22s for group %u",
 			 string_types[layout->major_type],
 			 layout->group);
 		break;
 	case DISK_LAYOUT_SUPBER_BLOCK:
 	case DISK_LAYOUT_GROUP_DESCRIPTOR:
 		if (layout->group != 0)
-			snprintf(buf, bufsz, "%-22s  in group %d (backup)",
+			snprintf(buf, bufsz, "%-22s  in group %u (backup)",
 				string_types[layout->major_type],
 				layout->group);
 		else
@@ -700,18 +796,13 @@ static int ext2_editor_init(void *private_data)
 	crc16->refin = true;
 	crc16->refout = true;
 
+	pthread_mutex_init(&p->itable_lock, NULL);
+	list_init(&p->itable_lru);
 	return 0;
 }
 
-static void ext2_editor_exit(void *private_data)
+static void ext2_free_bitmasks(struct ext2_editor_private_data *p)
 {
-	struct ext2_editor_private_data *p = private_data;
-
-	if (p->block_groups) {
-		free(p->block_groups);
-		p->block_groups = NULL;
-	}
-
 	if (p->inode_bitmask) {
 		for (size_t i = 0; i < p->n_block_group; i++)
 			bitmask_free(p->inode_bitmask[i]);
@@ -729,6 +820,46 @@ static void ext2_editor_exit(void *private_data)
 	}
 }
 
+static void ext2_editor_exit(void *private_data)
+{
+	struct ext2_editor_private_data *p = private_data;
+
+	if (p->itables) {
+		for (size_t i = 0; i < p->n_block_group; i++)
+			free(p->itables[i].buf);
+
+		free(p->itables);
+		p->itables = NULL;
+		list_init(&p->itable_lru);
+		p->itable_cache_size = 0;
+	}
+
+	if (p->block_groups) {
+		free(p->block_groups);
+		p->block_groups = NULL;
+	}
+
+	ext2_free_bitmasks(p);
+
+	free(p->layouts);
+	p->layouts = NULL;
+	p->n_layout = p->max_layout = 0;
+
+	free(p->rmap);
+	p->rmap = NULL;
+	p->n_rmap = p->max_rmap = 0;
+	p->rmap_loaded = false;
+
+	free(p->overlay);
+	p->overlay = NULL;
+	p->n_overlay = p->max_overlay = 0;
+}
+
+static int ext2_has_compat_feature(struct ext2_sblock *sb, unsigned int flags)
+{
+	return le32_to_cpu(sb->feature_compatibility) & flags;
+}
+
 static int ext2_has_ro_compat_feature(struct ext2_sblock *sb, unsigned int flags)
 {
 	return le32_to_cpu(sb->feature_ro_compat) & flags;
@@ -747,6 +878,41 @@ static int ext2_has_block_group_csum(struct ext2_sblock *sblock)
 			EXT4_FEATURE_RO_COMPAT_GDT_CSUM);
 }
 
+static int ext2_has_incompat_feature(struct ext2_sblock *sb, unsigned int flags)
+{
+	return le32_to_cpu(sb->feature_incompat) & flags;
+}
+
+static uint64_t ext2_total_blocks(struct ext2_sblock *sb)
+{
+	uint64_t blocks = le32_to_cpu(sb->total_blocks);
+
+	if (ext2_has_incompat_feature(sb, EXT4_FEATURE_INCOMPAT_64BIT))
+		blocks |= (uint64_t)le32_to_cpu(sb->total_blocks_high) << 32;
+
+	return blocks;
+}
+
+/* the high 32 bits only exist in the 64 bytes group descriptor */
+static uint64_t ext2_bg_block_number(struct ext2_editor_private_data *p,
+				     __le32 lo, __le32 hi)
+{
+	uint64_t blkno = le32_to_cpu(lo);
+
+	if (p->descriptor_size >= EXT4_MIN_DESC_SIZE_64BIT)
+		blkno |= (uint64_t)le32_to_cpu(hi) << 32;
+
+	return blkno;
+}
+
+#define ext2_bg_block_bitmap(p, bgrp)	\
+	ext2_bg_block_number(p, (bgrp)->block_id, (bgrp)->block_id_high)
+#define ext2_bg_inode_bitmap(p, bgrp)	\
+	ext2_bg_block_number(p, (bgrp)->inode_id, (bgrp)->inode_id_high)
+#define ext2_bg_inode_table(p, bgrp)	\
+	ext2_bg_block_number(p, (bgrp)->inode_table_id,	\
+			     (bgrp)->inode_table_id_high)
+
 static int ext2_check_sblock(struct libcrc32 *crc, int force_type,
 			     struct ext2_sblock *sblock)
 {
@@ -794,7 +960,7 @@ static uint32_t ext2_sblock_log2_size_to_bytes(__le32 log2_size)
 }
 
 static int ext2_inode_block_number(struct ext2_editor_private_data *p, int ino,
-				   uint32_t *blkno, uint32_t *blk_offset)
+				   uint64_t *blkno, uint32_t *blk_offset)
 {
 	struct ext2_sblock *sblock = &p->sblock;
 	struct ext2_block_group *blkgrp = NULL;
@@ -809,32 +975,150 @@ static int ext2_inode_block_number(struct ext2_editor_private_data *p, int ino,
 		return -1;
 
 	blkgrp = &p->block_groups[idx];
-	*blkno = le32_to_cpu(blkgrp->inode_table_id) +
+	*blkno = ext2_bg_inode_table(p, blkgrp) +
 		(ino % le32_to_cpu(sblock->inodes_per_group)) / inodes_per_block;
 	*blk_offset = (ino % inodes_per_block) * p->inode_size;
 
 	return 0;
 }
 
+static int ext2_read_blocks(struct ext2_editor_private_data *p,
+			    uint64_t blkno, uint32_t nblks,
+			    void *buf, size_t bufsz);
+
+/* the number of inodes may be used in this group, the inodes after it are
+ * never initialized and read as zero. only the group descriptors protected
+ * by the checksum tell it, a group whose inodes are all free may still have
+ * the deleted inodes in the table.
+ */
+static uint32_t ext2_group_used_inodes(struct ext2_editor_private_data *p,
+				       uint32_t group)
+{
+	struct ext2_block_group *bgrp = &p->block_groups[group];
+	uint32_t ipg = le32_to_cpu(p->sblock.inodes_per_group);
+	uint32_t unused;
+
+	if (!ext2_has_block_group_csum(&p->sblock))
+		return ipg;
+
+	if (le16_to_cpu(bgrp->bg_flags) & EXT4_BG_INODE_UNINIT)
+		return 0;
+
+	unused = le16_to_cpu(bgrp->bg_itable_unused)
+		| (le16_to_cpu(bgrp->bg_itable_unused_high) << 16);
+	if (unused >= ipg)
+		return 0;
+
+	return ipg - unused;
+}
+
+static void ext2_inode_table_cache_shrink(struct ext2_editor_private_data *p,
+					  size_t needed)
+{
+	size_t limit = get_cache_size_limit();
+
+	/* drop the least recently used tables, but the new table is always
+	 * loaded even if it is larger than the limit.
+	 */
+	while (!list_empty(&p->itable_lru)
+	       && p->itable_cache_size + needed > limit) {
+		struct ext2_inode_table *lru =
+			list_entry(p->itable_lru.prev, struct ext2_inode_table,
+				   lru);
+
+		list_del(&lru->lru);
+		p->itable_cache_size -= (size_t)lru->inodes * p->inode_size;
+		free(lru->buf);
+		lru->buf = NULL;
+		lru->inodes = 0;
+	}
+}
+
+static struct ext2_inode_table *
+	ext2_inode_table_cache_load(struct ext2_editor_private_data *p,
+				    uint32_t group)
+{
+	struct ext2_block_group *bgrp = &p->block_groups[group];
+	struct ext2_inode_table *t = &p->itables[group];
+	uint32_t inodes_per_block = p->block_size / p->inode_size;
+	uint32_t inodes, nblks;
+	size_t sz;
+
+	if (t->buf)
+		return t;
+
+	inodes = ext2_group_used_inodes(p, group);
+	if (inodes == 0)
+		return t;
+
+	/* read the whole blocks of the used inodes */
+	nblks = aligned_length(inodes, inodes_per_block) / inodes_per_block;
+	inodes = nblks * inodes_per_block;
+	if (inodes > le32_to_cpu(p->sblock.inodes_per_group))
+		inodes = le32_to_cpu(p->sblock.inodes_per_group);
+	sz = (size_t)nblks * p->block_size;
+
+	ext2_inode_table_cache_shrink(p, sz);
+
+	t->buf = malloc(sz);
+	if (!t->buf) {
+		fprintf(stderr, "Error: alloc inode table of group %u failed\n",
+			group);
+		return NULL;
+	}
+
+	if (ext2_read_blocks(p, ext2_bg_inode_table(p, bgrp), nblks,
+			     t->buf, sz) < 0) {
+		free(t->buf);
+		t->buf = NULL;
+		return NULL;
+	}
+
+	t->inodes = inodes;
+	list_add(&t->lru, &p->itable_lru);
+	p->itable_cache_size += (size_t)inodes * p->inode_size;
+
+	return t;
+}
+
 static int _ext2_read_inode(struct ext2_editor_private_data *p, int ino,
 			    struct ext2_inode *inode,
-			    uint32_t *ret_blkno, uint32_t *ret_blk_offset)
+			    uint64_t *ret_blkno, uint32_t *ret_blk_offset)
 {
-	uint32_t blkno, blk_offset;
-	int ret;
+	uint32_t ipg = le32_to_cpu(p->sblock.inodes_per_group);
+	uint32_t blk_offset, group, idx;
+	uint64_t blkno;
+	struct ext2_inode_table *t;
+	int ret = 0;
 
 	ret = ext2_inode_block_number(p, ino, &blkno, &blk_offset);
 	if (ret < 0)
 		return ret;
 
-	fileseek(p->fd, blkno * p->block_size + blk_offset);
-	ret = read(p->fd, inode, sizeof(*inode));
-	if (ret != (int)sizeof(*inode)) {
-		fprintf(stderr, "Error: read inode #%d failed(%d)\n",
-			ino, ret);
-		return -1;
+	group = (ino - 1) / ipg;
+	idx = (ino - 1) % ipg;
+
+	pthread_mutex_lock(&p->itable_lock);
+
+	t = ext2_inode_table_cache_load(p, group);
+	if (!t) {
+		fprintf(stderr, "Error: read inode #%d failed\n", ino);
+		ret = -1;
+	} else if (idx < t->inodes) {
+		list_del(&t->lru);
+		list_add(&t->lru, &p->itable_lru);
+		memcpy(inode, t->buf + (size_t)idx * p->inode_size,
+		       sizeof(*inode));
+	} else {
+		/* this inode is in the uninitialized part of the table */
+		memset(inode, 0, sizeof(*inode));
 	}
 
+	pthread_mutex_unlock(&p->itable_lock);
+
+	if (ret < 0)
+		return ret;
+
 	if (ret_blkno)
 		*ret_blkno = blkno;
 	if (ret_blk_offset)
@@ -849,29 +1133,122 @@ static int ext2_read_inode(struct ext2_editor_private_data *p, int ino,
 	return _ext2_read_inode(p, ino, inode, NULL, NULL);
 }
 
+/* the first overlay block which is not less than @blkno */
+static size_t ext2_overlay_lower(struct ext2_editor_private_data *p,
+				 uint64_t blkno)
+{
+	size_t l = 0, r = p->n_overlay;
+
+	while (l < r) {
+		size_t mid = l + (r - l) / 2;
+
+		if (p->overlay[mid].fs_blocknr < blkno)
+			l = mid + 1;
+		else
+			r = mid;
+	}
+
+	return l;
+}
+
+/* replace the blocks in @buf by the journal copies */
+static int ext2_overlay_read(struct ext2_editor_private_data *p,
+			     uint64_t blkno, void *buf, size_t sz)
+{
+	uint64_t end = blkno + aligned_block(sz, p->block_size);
+
+	for (size_t i = ext2_overlay_lower(p, blkno);
+	     i < p->n_overlay && p->overlay[i].fs_blocknr < end; i++) {
+		struct ext2_overlay_block *ob = &p->overlay[i];
+		size_t offset = (ob->fs_blocknr - blkno) * p->block_size;
+		size_t len = p->block_size;
+
+		if (len > sz - offset)
+			len = sz - offset;
+
+		if (filepread(p->fd, buf + offset, len,
+			      (off64_t)ob->pblk * p->block_size) < 0) {
+			fprintf(stderr, "Error: read journal copy of block #%"
+					PRIu64 " failed\n", ob->fs_blocknr);
+			return -1;
+		}
+
+		/* the escaped block starts with the journal magic */
+		if (ob->escaped && len >= sizeof(__be32))
+			*(__be32 *)(buf + offset) =
+				cpu_to_be32(EXT3_JOURNAL_MAGIC_NUMBER);
+	}
+
+	return 0;
+}
+
 static int ext2_read_blocks(struct ext2_editor_private_data *p,
-			    unsigned long blkno, uint32_t nblks,
+			    uint64_t blkno, uint32_t nblks,
 			    void *buf, size_t bufsz)
 {
-	size_t sz = p->block_size * nblks;
-	int n;
+	size_t sz = (size_t)p->block_size * nblks;
 
 	if (sz > bufsz)
 		sz = bufsz;
 
-	fileseek(p->fd, blkno * p->block_size);
-	n = read(p->fd, buf, sz);
-	if (n <= 0 || (size_t)n != sz) {
-		fprintf(stderr, "Error: read %d blocks from #%lu failed\n",
+	if (filepread(p->fd, buf, sz, (off64_t)blkno * p->block_size) < 0) {
+		fprintf(stderr, "Error: read %u blocks from #%" PRIu64 " failed\n",
 			nblks, blkno);
 		return -1;
 	}
 
+	if (p->n_overlay > 0)
+		return ext2_overlay_read(p, blkno, buf, sz);
+
 	return 0;
 }
 
+/* the blocks copied from the image by dd are not overlaid, write the
+ * journal copies of @nblks blocks start from @blkno to @fd_out at
+ * @out_offset, and only @bytes are written.
+ */
+static int ext2_overlay_patch(struct ext2_editor_private_data *p, int fd_out,
+			      uint64_t blkno, uint64_t nblks,
+			      off64_t out_offset, uint64_t bytes)
+{
+	uint8_t *blk = NULL;
+	int ret = 0;
+
+	for (size_t i = ext2_overlay_lower(p, blkno);
+	     i < p->n_overlay && p->overlay[i].fs_blocknr < blkno + nblks; i++) {
+		uint64_t offset = (p->overlay[i].fs_blocknr - blkno) * p->block_size;
+		size_t len = p->block_size;
+
+		if (offset >= bytes)
+			break;
+		if (len > bytes - offset)
+			len = bytes - offset;
+
+		if (!blk) {
+			blk = malloc(p->block_size);
+			if (!blk)
+				return -1;
+		}
+
+		ret = ext2_read_blocks(p, p->overlay[i].fs_blocknr, 1, blk,
+				       p->block_size);
+		if (ret < 0)
+			break;
+
+		if (pwrite64(fd_out, blk, len, out_offset + offset) != (ssize_t)len) {
+			fprintf(stderr, "Error: write replayed block #%" PRIu64
+					" failed\n", p->overlay[i].fs_blocknr);
+			ret = -1;
+			break;
+		}
+	}
+
+	free(blk);
+	return ret;
+}
+
 static void *ext2_alloc_read_block(struct ext2_editor_private_data *p,
-				   unsigned long blkno)
+				   uint64_t blkno)
 {
 	uint8_t *blk = malloc(p->block_size);
 
@@ -885,50 +1262,122 @@ static void *ext2_alloc_read_block(struct ext2_editor_private_data *p,
 	return blk;
 }
 
+/* report the physical blocks used by a inode, include the data blocks,
+ * the indirect blocks and the extent index blocks.
+ */
+struct ext2_block_marker {
+	void			(*mark)(void *arg, uint64_t start, uint64_t len);
+	void			*arg;
+};
+
+static void ext2_block_mark(struct ext2_block_marker *marker,
+			    uint64_t start, uint64_t len)
+{
+	if (marker)
+		marker->mark(marker->arg, start, len);
+}
+
+/* a run of the logical contiguous blocks, it is a hole if @start is zero */
+struct ext2_block_run {
+	uint32_t		start;
+	uint32_t		len;
+};
+
+/* the data blocks of a inode which is not based on extent.
+ * @total: the number of logical blocks, include the holes but not the
+ *         holes at the end of file.
+ */
 struct ext2_inode_blocks {
-	uint32_t		*blocks;
+	struct ext2_block_run	*runs;
+	size_t			n_runs;
 	size_t			total;
 
 	/* private data */
 	size_t			__maxsize;
+	uint32_t		__holes;
 };
 
-static int ext2_inode_blocks_push(struct ext2_editor_private_data *p,
-				  struct ext2_inode_blocks *b,
-				  uint32_t blkno,
-				  struct bitmask *indir_blocks)
+/* @lblk: the logical block number of @run */
+#define ext2_block_run_foreach(b, run, lblk)				\
+	for (size_t __i = 0, lblk = 0;					\
+	     __i < (b)->n_runs && ((run) = &(b)->runs[__i]);		\
+	     lblk += (b)->runs[__i].len, __i++)
+
+static int ext2_inode_blocks_append(struct ext2_inode_blocks *b,
+				    uint32_t start, uint32_t len)
 {
+	struct ext2_block_run *last = NULL;
+
+	if (b->n_runs > 0)
+		last = &b->runs[b->n_runs - 1];
+
+	/* merge it to the last run if they are contiguous */
+	if (last && ((start == 0 && last->start == 0)
+		     || (start != 0 && last->start != 0
+			 && last->start + last->len == start))) {
+		last->len += len;
+		b->total += len;
+		return 0;
+	}
+
 	if (b->__maxsize == 0) {
-		b->total = 0;
+		b->n_runs = 0;
 		b->__maxsize = INDIRECT_BLOCKS;
-		b->blocks = calloc(b->__maxsize, sizeof(*b->blocks));
-	} else if (b->total + 1 > b->__maxsize) {
+		b->runs = calloc(b->__maxsize, sizeof(*b->runs));
+	} else if (b->n_runs + 1 > b->__maxsize) {
 		b->__maxsize *= 2;
-		b->blocks = realloc(b->blocks,
-				    b->__maxsize * sizeof(*b->blocks));
+		b->runs = realloc(b->runs, b->__maxsize * sizeof(*b->runs));
 	}
 
-	if (!b->blocks) {
-		fprintf(stderr, "Error: Alloc %zu inode indir blocks failed\n",
+	if (!b->runs) {
+		fprintf(stderr, "Error: Alloc %zu inode block runs failed\n",
 			b->__maxsize);
 		return -1;
 	}
 
-	if (indir_blocks)
-		bitmask_set(indir_blocks, blkno);
-
-	b->blocks[b->total] = blkno;
-	b->total++;
+	b->runs[b->n_runs].start = start;
+	b->runs[b->n_runs].len = len;
+	b->n_runs++;
+	b->total += len;
 
 	return 0;
 }
 
-#define ext2_inode_read_block_define(name, todo)			\
+/* the holes are appended when the next data block is found, so the holes
+ * at the end of file are dropped.
+ */
+static void ext2_inode_blocks_push_holes(struct ext2_inode_blocks *b,
+					 uint32_t count)
+{
+	b->__holes += count;
+}
+
+static int ext2_inode_blocks_push(struct ext2_editor_private_data *p,
+				  struct ext2_inode_blocks *b,
+				  uint32_t blkno,
+				  struct ext2_block_marker *marker)
+{
+	int ret;
+
+	if (b->__holes > 0) {
+		ret = ext2_inode_blocks_append(b, 0, b->__holes);
+		if (ret < 0)
+			return ret;
+		b->__holes = 0;
+	}
+
+	ext2_block_mark(marker, blkno, 1);
+
+	return ext2_inode_blocks_append(b, blkno, 1);
+}
+
+/* @holes: the number of data blocks addressed by each entry */
+#define ext2_inode_read_block_define(name, todo, holes)			\
 static int								\
 ext2_inode_##name##_blocks_push(struct ext2_editor_private_data *p,	\
 				struct ext2_inode_blocks *b,		\
 				uint32_t blkno,				\
-				struct bitmask *indir_blocks)		\
+				struct ext2_block_marker *marker)	\
 {									\
 	__le32 *blkbuf = ext2_alloc_read_block(p, blkno);		\
 	size_t maxcount = p->block_size / sizeof(__le32);		\
@@ -940,65 +1389,74 @@ ext2_inode_##name##_blocks_push(struct ext2_editor_private_data *p,	\
 		return -1;						\
 	}								\
 									\
-	if (indir_blocks)						\
-		bitmask_set(indir_blocks, blkno);			\
+	ext2_block_mark(marker, blkno, 1);				\
 									\
 	for (size_t i = 0; i < maxcount; i++) {				\
 		uint32_t n = le32_to_cpu(blkbuf[i]);			\
 									\
-		if (n == 0)						\
-			break;						\
+		if (n == 0) {						\
+			ext2_inode_blocks_push_holes(b, (holes));	\
+			continue;					\
+		}							\
 									\
-		if (indir_blocks)					\
-			bitmask_set(indir_blocks, n);			\
-		ret = todo(p, b, n, indir_blocks);			\
+		ret = todo(p, b, n, marker);				\
 		if (ret < 0)						\
-			return ret;					\
+			break;						\
 	}								\
 									\
+	free(blkbuf);							\
 	return ret;							\
 }
 
-ext2_inode_read_block_define(indir, ext2_inode_blocks_push);
-ext2_inode_read_block_define(double_indir, ext2_inode_indir_blocks_push);
-ext2_inode_read_block_define(triple_indir, ext2_inode_double_indir_blocks_push);
+ext2_inode_read_block_define(indir, ext2_inode_blocks_push, 1);
+ext2_inode_read_block_define(double_indir, ext2_inode_indir_blocks_push,
+			     maxcount);
+ext2_inode_read_block_define(triple_indir, ext2_inode_double_indir_blocks_push,
+			     maxcount * maxcount);
 
 static int _ext2_inode_blocks_read(struct ext2_editor_private_data *p,
 				   struct ext2_inode_blocks *b,
 				   struct ext2_inode *inode,
 				   uint32_t ino,
-				   struct bitmask *indir_blocks)
+				   struct ext2_block_marker *marker)
 {
+	uint32_t maxcount = p->block_size / sizeof(__le32);
 	uint32_t blkno;
 	int ret = 0;
 
 	for (int i = 0; i < INDIRECT_BLOCKS; i++) {
 		blkno = le32_to_cpu(inode->b.blocks.dir_blocks[i]);
-		if (blkno == 0)
-			return ret;
+		if (blkno == 0) {
+			ext2_inode_blocks_push_holes(b, 1);
+			continue;
+		}
 
-		ret = ext2_inode_blocks_push(p, b, blkno, indir_blocks);
+		ret = ext2_inode_blocks_push(p, b, blkno, marker);
 		if (ret < 0)
 			return ret;
 	}
 
 	blkno = le32_to_cpu(inode->b.blocks.indir_block);
 	if (blkno) {
-		ret = ext2_inode_indir_blocks_push(p, b, blkno, indir_blocks);
+		ret = ext2_inode_indir_blocks_push(p, b, blkno, marker);
 		if (ret < 0)
 			return ret;
+	} else {
+		ext2_inode_blocks_push_holes(b, maxcount);
 	}
 
 	blkno = le32_to_cpu(inode->b.blocks.double_indir_block);
 	if (blkno) {
-		ret = ext2_inode_double_indir_blocks_push(p, b, blkno, indir_blocks);
+		ret = ext2_inode_double_indir_blocks_push(p, b, blkno, marker);
 		if (ret < 0)
 			return ret;
+	} else {
+		ext2_inode_blocks_push_holes(b, maxcount * maxcount);
 	}
 
 	blkno = le32_to_cpu(inode->b.blocks.triple_indir_block);
 	if (blkno) {
-		ret = ext2_inode_triple_indir_blocks_push(p, b, blkno, indir_blocks);
+		ret = ext2_inode_triple_indir_blocks_push(p, b, blkno, marker);
 		if (ret < 0)
 			return ret;
 	}
@@ -1034,164 +1492,266 @@ static uint64_t ext4_extent_idx_leaf_block(struct ext4_extent_idx *ei)
 	return leaf_start;
 }
 
-struct extent_iterator {
-	struct ext2_inode	inode;
-	struct ext4_extent	*ee;
-	struct ext4_extent	*parent;
-	size_t			total_entries;
+/* one level of the extent tree, the root level is saved in the inode and
+ * the others are loaded in @blk.
+ * @idx: the entry that is walking now.
+ */
+struct extent_path {
+	struct ext4_extent_header	*eh;
+	uint8_t				*blk;
+	uint64_t			blkno;
+	int				idx;
+};
+
+/* a cursor of the extent tree, the index and leaf blocks are loaded on
+ * demand and only one block is cached for each level.
+ * @level: the deepest valid level in @path, the leaf is at @depth.
+ */
+struct extent_cursor {
+	struct ext2_inode		inode;
+	struct ext2_block_marker	*marker;
+	int				depth;
+	int				level;
+	struct extent_path		path[EXT4_EXT_MAX_DEPTH + 1];
 };
 
-static int extent_iterator_appending(struct ext2_editor_private_data *p,
-				     struct extent_iterator *it,
-				     struct ext4_extent_header *eh,
-				     struct bitmask *data_blocks)
+static uint32_t extent_node_lblk(struct ext4_extent_header *eh, int i)
 {
-	int eh_depth = le16_to_cpu(eh->eh_depth);
-	struct ext4_extent_idx *ei;
-	uint8_t *blk;
-	int ret = 0;
+	if (le16_to_cpu(eh->eh_depth) == 0) {
+		struct ext4_extent *ee = (struct ext4_extent *)(eh + 1);
 
-	blk = malloc(p->block_size);
-	if (!blk) {
-		fprintf(stderr, "Error: alloc one block failed\n");
-		return -1;
+		return le32_to_cpu(ee[i].ee_block);
+	} else {
+		struct ext4_extent_idx *ei = (struct ext4_extent_idx *)(eh + 1);
+
+		return le32_to_cpu(ei[i].ei_block);
 	}
+}
 
-	if (le16_to_cpu(eh->eh_depth) > 0) {
-		ei = (struct ext4_extent_idx *)(eh + 1);
-		for (int i = 0; i < le16_to_cpu(eh->eh_entries); i++, ei++) {
-			uint64_t blkno = ext4_extent_idx_leaf_block(ei);
-			struct ext4_extent_header *eh_child;
+/* the last entry that starts at or before @lblk, or the first entry */
+static int extent_node_search(struct ext4_extent_header *eh, uint32_t lblk)
+{
+	int l = 1, r = le16_to_cpu(eh->eh_entries);
 
-			ret = ext2_read_blocks(p, blkno, 1,
-						blk, p->block_size);
-			if (ret < 0)
-				goto done;
+	while (l < r) {
+		int mid = l + (r - l) / 2;
 
-			eh_child = (struct ext4_extent_header *)blk;
-			if (le32_to_cpu(eh_child->eh_magic) != EXT4_EXT_MAGIC) {
-				fprintf(stderr, "Error: EXT4_EXT_MAGIC doesn't match at "
-						"block #0x%" PRIu64 "\n",
-					blkno);
-				ret = -1;
-				goto done;
-			} else if (le16_to_cpu(eh_child->eh_depth) != eh_depth - 1) {
-				fprintf(stderr, "Error: eh_depth doesn't match at "
-						"block #0x%" PRIu64
-						"it should be %d\n",
-					blkno, eh_depth - 1);
-				ret = -1;
-				goto done;
-			}
+		if (extent_node_lblk(eh, mid) <= lblk)
+			l = mid + 1;
+		else
+			r = mid;
+	}
 
-			if (data_blocks)
-				bitmask_set(data_blocks, (size_t)blkno);
+	return l - 1;
+}
 
-			ret = extent_iterator_appending(p, it, eh_child, data_blocks);
-			if (ret < 0)
-				goto done;
-		}
-	} else { /* eh_depth == 0 */
-		size_t loaded_entries = it->total_entries;
+static int extent_node_check(struct ext4_extent_header *eh, int depth,
+			     size_t sz)
+{
+	if (le16_to_cpu(eh->eh_magic) != EXT4_EXT_MAGIC
+	    || le16_to_cpu(eh->eh_depth) != depth
+	    || le16_to_cpu(eh->eh_entries) > le16_to_cpu(eh->eh_max)
+	    || sizeof(*eh) + le16_to_cpu(eh->eh_max)
+			* sizeof(struct ext4_extent) > sz)
+		return -1;
 
-		it->total_entries += le16_to_cpu(eh->eh_entries);
-		it->parent = realloc(it->parent,
-				sizeof(struct ext4_extent) * it->total_entries);
-		if (!it->parent) {
-			fprintf(stderr, "Error: alloc %zu ext4_extent failed\n",
-				it->total_entries);
-			ret = -1;
-			goto done;
-		}
+	return 0;
+}
 
-		/* appending ext4_entry*/
-		memcpy(&it->parent[loaded_entries],
-			eh + 1,
-			le16_to_cpu(eh->eh_entries) * sizeof(struct ext4_extent));
+/* load the child of @level - 1 that is pointed by it's @idx */
+static int extent_cursor_load(struct ext2_editor_private_data *p,
+			      struct extent_cursor *c, int level)
+{
+	struct extent_path *parent = &c->path[level - 1];
+	struct extent_path *path = &c->path[level];
+	struct ext4_extent_idx *ei;
+	uint64_t blkno;
+	int ret;
 
-		if (data_blocks) {
-			struct ext4_extent *ee = &it->parent[loaded_entries];
+	ei = (struct ext4_extent_idx *)(parent->eh + 1) + parent->idx;
+	blkno = ext4_extent_idx_leaf_block(ei);
+	path->idx = 0;
 
-			for (int i = 0; i < le16_to_cpu(eh->eh_entries); i++) {
-				uint64_t start = ext4_extent_start_block(ee);
+	/* it is loaded already when seeking in the same subtree */
+	if (path->eh && path->blkno == blkno)
+		return 0;
 
-				bitmask_set_bits(data_blocks, start,
-						 le16_to_cpu(ee->ee_len));
-				ee++;
-			}
+	if (!path->blk) {
+		path->blk = malloc(p->block_size);
+		if (!path->blk) {
+			fprintf(stderr, "Error: alloc one block failed\n");
+			return -1;
 		}
 	}
 
-done:
+	path->eh = NULL;
+	ret = ext2_read_blocks(p, blkno, 1, path->blk, p->block_size);
 	if (ret < 0)
-		free(it->parent);
-	free(blk);
+		return ret;
 
-	return ret;
+	if (extent_node_check((struct ext4_extent_header *)path->blk,
+			      c->depth - level, p->block_size) < 0) {
+		fprintf(stderr, "Error: bad extent block #%" PRIu64
+				" at depth %d\n",
+			blkno, c->depth - level);
+		return -1;
+	}
+
+	path->eh = (struct ext4_extent_header *)path->blk;
+	path->blkno = blkno;
+	ext2_block_mark(c->marker, blkno, 1);
+
+	return 0;
+}
+
+/* move the cursor to the extent that @lblk is in, or the next extent if
+ * @lblk is a hole.
+ */
+static int extent_cursor_seek(struct ext2_editor_private_data *p,
+			      struct extent_cursor *c, uint32_t lblk)
+{
+	struct extent_path *path;
+	struct ext4_extent *ee;
+	uint32_t len;
+	int ret;
+
+	for (c->level = 0; ; c->level++) {
+		path = &c->path[c->level];
+		path->idx = 0;
+
+		/* the next() will walk the next node of the parent */
+		if (le16_to_cpu(path->eh->eh_entries) == 0)
+			return 0;
+
+		path->idx = extent_node_search(path->eh, lblk);
+		if (c->level == c->depth)
+			break;
+
+		ret = extent_cursor_load(p, c, c->level + 1);
+		if (ret < 0)
+			return ret;
+	}
+
+	/* skip the extent that ends before @lblk */
+	ee = (struct ext4_extent *)(path->eh + 1) + path->idx;
+	len = le16_to_cpu(ee->ee_len);
+	if (len > EXT_INIT_MAX_LEN)
+		len -= EXT_INIT_MAX_LEN;
+
+	if (le32_to_cpu(ee->ee_block) + len <= lblk)
+		path->idx++;
+
+	return 0;
+}
+
+/* returns 1 and saves the next extent in @ret_ee, 0 if all extents are
+ * walked and negative number if error.
+ */
+static int extent_cursor_next(struct ext2_editor_private_data *p,
+			      struct extent_cursor *c,
+			      struct ext4_extent **ret_ee)
+{
+	int ret;
+
+	while (c->level >= 0) {
+		struct extent_path *path = &c->path[c->level];
+
+		if (path->idx >= le16_to_cpu(path->eh->eh_entries)) {
+			/* this node is done, walk the next one of the parent */
+			if (--c->level >= 0)
+				c->path[c->level].idx++;
+			continue;
+		}
+
+		if (c->level == c->depth) {
+			*ret_ee = (struct ext4_extent *)(path->eh + 1) + path->idx;
+			path->idx++;
+			return 1;
+		}
+
+		ret = extent_cursor_load(p, c, c->level + 1);
+		if (ret < 0)
+			return ret;
+		c->level++;
+	}
+
+	return 0;
 }
 
-static int _extent_iterator_init(struct ext2_editor_private_data *p,
-				 struct extent_iterator *it,
-				 uint32_t ino,
-				 struct bitmask *data_blocks)
+static int _extent_cursor_init(struct ext2_editor_private_data *p,
+			       struct extent_cursor *c,
+			       uint32_t ino,
+			       struct ext2_block_marker *marker)
 {
 	struct ext4_extent_header *eh;
-	uint16_t eh_depth;
 	int ret;
 
-	memset(it, 0, sizeof(*it));
+	memset(c, 0, sizeof(*c));
+	c->marker = marker;
 
-	ret = ext2_read_inode(p, ino, &it->inode);
+	ret = ext2_read_inode(p, ino, &c->inode);
 	if (ret < 0)
 		return ret;
 
-	if (!(le32_to_cpu(it->inode.flags) & EXT4_EXTENTS_FL)) {
+	if (!(le32_to_cpu(c->inode.flags) & EXT4_EXTENTS_FL)) {
 		fprintf(stderr, "Error: inode #%d doesn't have EXT4_EXTENTS_FL\n",
 			ino);
 		return -1;
 	}
 
-	eh = (struct ext4_extent_header *)&it->inode.b;
-	eh_depth = le16_to_cpu(eh->eh_depth);
+	eh = (struct ext4_extent_header *)&c->inode.b;
+	c->depth = le16_to_cpu(eh->eh_depth);
 
-	if (le32_to_cpu(eh->eh_magic) != EXT4_EXT_MAGIC) {
-		fprintf(stderr, "Error: bad EXT4_EXT_MAGIC on inode #%d\n",
+	if (c->depth > EXT4_EXT_MAX_DEPTH
+	    || extent_node_check(eh, c->depth, sizeof(c->inode.b)) < 0) {
+		fprintf(stderr, "Error: bad extent header on inode #%d\n",
 			ino);
 		return -1;
 	}
 
-	if (eh_depth > 5) {
-		fprintf(stderr, "Error: bad eh_depth number at inode #%d\n", ino);
-		 return -1;
+	c->path[0].eh = eh;
+
+	/* the cursor is at the first extent */
+	ret = extent_cursor_seek(p, c, 0);
+	if (ret < 0) {
+		for (int i = 1; i <= c->depth; i++)
+			free(c->path[i].blk);
 	}
 
-	return extent_iterator_appending(p, it, eh, data_blocks);
+	return ret;
 }
 
-static int extent_iterator_init(struct ext2_editor_private_data *p,
-				struct extent_iterator *it,
-				uint32_t ino)
+static int extent_cursor_init(struct ext2_editor_private_data *p,
+			      struct extent_cursor *c,
+			      uint32_t ino)
 {
-	return _extent_iterator_init(p, it, ino, NULL);
+	return _extent_cursor_init(p, c, ino, NULL);
 }
 
-static void extent_iterator_exit(struct extent_iterator *it)
+static void extent_cursor_exit(struct extent_cursor *c)
 {
-	free(it->parent);
-	it->total_entries = 0;
-	it->parent = NULL;
-	it->ee = NULL;
+	for (int i = 1; i <= c->depth; i++) {
+		free(c->path[i].blk);
+		c->path[i].blk = NULL;
+		c->path[i].eh = NULL;
+	}
+
+	c->level = -1;
 }
 
-#define extent_list_foreach(it)						\
-	for ((it)->ee = (it)->parent;					\
-	     (unsigned)((it)->ee - (it)->parent) < (it)->total_entries;	\
-	     (it)->ee = (it)->ee + 1)
+/* walk the extents from the cursor, @ret is the return value of
+ * extent_cursor_next and it is zero after all extents are walked.
+ */
+#define extent_cursor_foreach(p, c, ee, ret)				\
+	while (((ret) = extent_cursor_next(p, c, &(ee))) > 0)
 
 /*
  * @dir: a temp variable that used when foreach.
  * @parent: where the ext2_dirent arrays actually loaded location.
  * @dirent_size: total bytes of loaded @parent.
+ *
+ * only the mapped blocks are loaded to @parent, the holes in a directory
+ * have no dirents and are skipped like ext4_readdir does.
  */
 struct dirent_iterator {
 	struct ext2_inode	inode;
@@ -1205,48 +1765,58 @@ static int dirent_iterator_init_dir_blocks(struct ext2_editor_private_data *p,
 					   struct dirent_iterator *it,
 					   uint32_t ino)
 {
-	struct ext2_inode_blocks b = { .blocks = NULL };
+	struct ext2_inode_blocks b = { .runs = NULL };
+	struct ext2_block_run *run;
+	size_t mapped = 0, loaded = 0;
 	int ret;
 
 	ret = ext2_inode_blocks_read(p, &b, &it->inode, ino);
 	if (ret < 0)
 		return ret;
 
-	if (b.total == 0) {
+	ext2_block_run_foreach(&b, run, lblk) {
+		if (run->start != 0)
+			mapped += run->len;
+	}
+
+	if (mapped == 0) {
 		fprintf(stderr, "Error: no dir_blocks defined in inode #%d\n",
 			ino);
-		return -1;
+		ret = -1;
+		goto done;
 	}
 
-	it->dirent_size = b.total * p->block_size;
-	it->parent = calloc(b.total, p->block_size);
+	it->dirent_size = mapped * p->block_size;
+	it->parent = calloc(mapped, p->block_size);
 	if (!it->parent) {
 		fprintf(stderr, "Error: %s alloc %zu blocks for inode #%d "
-			"failed\n", __func__, b.total, ino);
+			"failed\n", __func__, mapped, ino);
 		it->dirent_size = 0;
 		ret = -1;
 		goto done;
 	}
 
-	for (size_t i = 0; i < b.total; i++) {
-		uint32_t blkno = b.blocks[i];
-		int ret;
+	ext2_block_run_foreach(&b, run, lblk) {
+		if (run->start == 0) /* hole */
+			continue;
 
-		ret = ext2_read_blocks(p, blkno, 1,
-				       (void *)it->parent + i * p->block_size,
-				       p->block_size);
+		ret = ext2_read_blocks(p, run->start, run->len,
+				       (void *)it->parent + loaded * p->block_size,
+				       run->len * p->block_size);
 		if (ret < 0) {
-			fprintf(stderr, "Error: read block #%d failed\n",
-				blkno);
+			fprintf(stderr, "Error: read block #%u failed\n",
+				run->start);
 			free(it->parent);
 			it->parent = NULL;
 			it->dirent_size = 0;
 			break;
 		}
+
+		loaded += run->len;
 	}
 
 done:
-	free(b.blocks);
+	free(b.runs);
 	return ret;
 }
 
@@ -1254,8 +1824,9 @@ static int dirent_iterator_init(struct ext2_editor_private_data *p,
 				struct dirent_iterator *it,
 				uint32_t ino)
 {
-	uint32_t total_ee_len = 0;
-	struct extent_iterator eit;
+	uint32_t total_blocks = 0, loaded = 0;
+	struct extent_cursor c;
+	struct ext4_extent *ee;
 	int ret;
 
 	memset(it, 0, sizeof(*it));
@@ -1276,17 +1847,16 @@ static int dirent_iterator_init(struct ext2_editor_private_data *p,
 		return dirent_iterator_init_dir_blocks(p, it, ino);
 	}
 
-	ret = extent_iterator_init(p, &eit, ino);
+	ret = extent_cursor_init(p, &c, ino);
 	if (ret < 0)
 		return ret;
 
-	extent_list_foreach(&eit) {
-		struct ext4_extent *ee = eit.ee;
-
-		total_ee_len += le16_to_cpu(ee->ee_len);
-	}
+	extent_cursor_foreach(p, &c, ee, ret)
+		total_blocks += le16_to_cpu(ee->ee_len);
+	if (ret < 0)
+		goto done;
 
-	it->dirent_size = total_ee_len * p->block_size;
+	it->dirent_size = total_blocks * p->block_size;
 	it->parent = malloc(it->dirent_size);
 	if (!it->parent) {
 		fprintf(stderr, "Error: malloc %d bytes dirent failed\n",
@@ -1296,20 +1866,24 @@ static int dirent_iterator_init(struct ext2_editor_private_data *p,
 	}
 
 	memset(it->parent, 0, it->dirent_size);
-	extent_list_foreach(&eit) {
-		struct ext4_extent *ee = eit.ee;
+	ret = extent_cursor_seek(p, &c, 0);
+	if (ret < 0)
+		goto done;
 
+	extent_cursor_foreach(p, &c, ee, ret) {
 		ret = ext2_read_blocks(p, ext4_extent_start_block(ee),
 				       le16_to_cpu(ee->ee_len),
 				       (void *)(it->parent) +
-				       le16_to_cpu(ee->ee_block) * p->block_size,
+				       loaded * p->block_size,
 				       le16_to_cpu(ee->ee_len) * p->block_size);
 		if (ret < 0)
-			goto done;
+			break;
+
+		loaded += le16_to_cpu(ee->ee_len);
 	}
 
 done:
-	extent_iterator_exit(&eit);
+	extent_cursor_exit(&c);
 	return ret;
 }
 
@@ -1339,7 +1913,7 @@ static int symlink_inode_get_target(struct ext2_editor_private_data *p,
 				    char *target, size_t sz)
 {
 	size_t target_sz = le32_to_cpu(inode->size);
-	unsigned long blkno;
+	uint64_t blkno;
 
 	/* is symlink? */
 	if ((le16_to_cpu(inode->mode) & INODE_MODE_S_MASK) != INODE_MODE_S_IFLINK)
@@ -1352,12 +1926,12 @@ static int symlink_inode_get_target(struct ext2_editor_private_data *p,
 		snprintf(target, sz, "%s", inode->b.symlink);
 		return 0;
 	} else if (!(le32_to_cpu(inode->flags) & EXT4_EXTENTS_FL)) {
-		blkno = inode->b.blocks.dir_blocks[0];
+		blkno = le32_to_cpu(inode->b.blocks.dir_blocks[0]);
 	} else {
 		struct ext4_extent *ee = (void *)inode->b.inline_data
 			+ sizeof(struct ext4_extent_header);
 
-		blkno = le32_to_cpu(ee->ee_start_lo);
+		blkno = ext4_extent_start_block(ee);
 	}
 
 	return ext2_read_blocks(p, blkno, 1, target, target_sz);
@@ -1481,1720 +2055,7194 @@ static int print_dirent(struct ext2_editor_private_data *p, uint32_t ino,
 	return ret;
 }
 
-static void ext2_init_csum_seed(struct ext2_editor_private_data *p)
+/* the directory hash of the htree, it's the same as fs/ext4/hash.c */
+static uint32_t dx_hack_hash(const char *name, int len, bool is_unsigned)
 {
-	struct ext2_sblock *sblock = &p->sblock;
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
 
-	if (le32_to_cpu(sblock->feature_incompat) & EXT4_FEATURE_INCOMPAT_CSUM_SEED) {
-		p->csum_seed = le32_to_cpu(sblock->checksum_seed);
-		return;
+	while (len--) {
+		int c = is_unsigned ? (unsigned char)*name : (signed char)*name;
+
+		name++;
+		hash = hash1 + (hash0 ^ (c * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
 	}
 
-	libcrc32_init_seed(&p->crc32c_le, 0xffffffff);
-	libcrc32_update(&p->crc32c_le, sblock->unique_id, sizeof(sblock->unique_id));
-	p->csum_seed = libcrc32_finish(&p->crc32c_le);
+	return hash0 << 1;
 }
 
-static int qsort_compare_layout(const void *a, const void *b)
+static void dx_str2hashbuf(const char *msg, int len, uint32_t *buf, int num,
+			   bool is_unsigned)
 {
-	const struct disk_layout *la = a, *lb = b;
+	uint32_t pad, val;
 
-	return la->start_block - lb->start_block;
-}
+	pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
 
-static bool is_power_of(int a, int b)
-{
-	while (a > b) {
-		if (a % b)
-			return 0;
-		a /= b;
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+
+	for (int i = 0; i < len; i++) {
+		int c = is_unsigned ? (unsigned char)msg[i] : (signed char)msg[i];
+
+		val = c + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
 	}
 
-	return (a == b);
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
 }
 
-static size_t next_sparse_super_block_number(size_t n)
+static inline uint32_t dx_rol32(uint32_t x, int s)
 {
-	const size_t power_bases[3] = { 3, 5, 7 };
-	size_t min, tmpbuf[3] = { 3, 5, 7 };
+	return (x << s) | (x >> (32 - s));
+}
 
-	if (n == 1)
-		return 3;
+#define DX_MD4_F(x, y, z)	((z) ^ ((x) & ((y) ^ (z))))
+#define DX_MD4_G(x, y, z)	(((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_MD4_H(x, y, z)	((x) ^ (y) ^ (z))
 
-	while (1) {
-		int not_ready = 0;
+#define DX_MD4_ROUND(f, a, b, c, d, x, s)				\
+	(a += f(b, c, d) + (x), a = dx_rol32(a, s))
 
-		for (int j = 0; j < 3; j++) {
-			if (tmpbuf[j] <= n) {
-				tmpbuf[j] *= power_bases[j];
-				not_ready++;
-			}
-		}
+#define DX_MD4_K2		0x5a827999
+#define DX_MD4_K3		0x6ed9eba1
 
-		if (!not_ready)
-			break;
-	}
+static void dx_half_md4_transform(uint32_t buf[4], const uint32_t in[8])
+{
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	DX_MD4_ROUND(DX_MD4_F, a, b, c, d, in[0], 3);
+	DX_MD4_ROUND(DX_MD4_F, d, a, b, c, in[1], 7);
+	DX_MD4_ROUND(DX_MD4_F, c, d, a, b, in[2], 11);
+	DX_MD4_ROUND(DX_MD4_F, b, c, d, a, in[3], 19);
+	DX_MD4_ROUND(DX_MD4_F, a, b, c, d, in[4], 3);
+	DX_MD4_ROUND(DX_MD4_F, d, a, b, c, in[5], 7);
+	DX_MD4_ROUND(DX_MD4_F, c, d, a, b, in[6], 11);
+	DX_MD4_ROUND(DX_MD4_F, b, c, d, a, in[7], 19);
+
+	DX_MD4_ROUND(DX_MD4_G, a, b, c, d, in[1] + DX_MD4_K2, 3);
+	DX_MD4_ROUND(DX_MD4_G, d, a, b, c, in[3] + DX_MD4_K2, 5);
+	DX_MD4_ROUND(DX_MD4_G, c, d, a, b, in[5] + DX_MD4_K2, 9);
+	DX_MD4_ROUND(DX_MD4_G, b, c, d, a, in[7] + DX_MD4_K2, 13);
+	DX_MD4_ROUND(DX_MD4_G, a, b, c, d, in[0] + DX_MD4_K2, 3);
+	DX_MD4_ROUND(DX_MD4_G, d, a, b, c, in[2] + DX_MD4_K2, 5);
+	DX_MD4_ROUND(DX_MD4_G, c, d, a, b, in[4] + DX_MD4_K2, 9);
+	DX_MD4_ROUND(DX_MD4_G, b, c, d, a, in[6] + DX_MD4_K2, 13);
+
+	DX_MD4_ROUND(DX_MD4_H, a, b, c, d, in[3] + DX_MD4_K3, 3);
+	DX_MD4_ROUND(DX_MD4_H, d, a, b, c, in[7] + DX_MD4_K3, 9);
+	DX_MD4_ROUND(DX_MD4_H, c, d, a, b, in[2] + DX_MD4_K3, 11);
+	DX_MD4_ROUND(DX_MD4_H, b, c, d, a, in[6] + DX_MD4_K3, 15);
+	DX_MD4_ROUND(DX_MD4_H, a, b, c, d, in[1] + DX_MD4_K3, 3);
+	DX_MD4_ROUND(DX_MD4_H, d, a, b, c, in[5] + DX_MD4_K3, 9);
+	DX_MD4_ROUND(DX_MD4_H, c, d, a, b, in[0] + DX_MD4_K3, 11);
+	DX_MD4_ROUND(DX_MD4_H, b, c, d, a, in[4] + DX_MD4_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
 
-	min = tmpbuf[0];
-	for (size_t j = 1; j < 3; j++) {
-		if (tmpbuf[j] < min)
-			min = tmpbuf[j];
+static void dx_tea_transform(uint32_t buf[4], const uint32_t in[4])
+{
+	uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+	for (int n = 0; n < 16; n++) {
+		sum += 0x9e3779b9;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
 	}
 
-	return min;
+	buf[0] += b0;
+	buf[1] += b1;
 }
 
-static bool ext2_block_group_has_backup_sb(struct ext2_sblock *sb, size_t group)
+/* returns the major hash of @name, or -1 if @hash_version is unsupported */
+static int ext2_dx_hash(struct ext2_editor_private_data *p, int hash_version,
+			const char *name, int len, uint32_t *ret_hash)
 {
-	if (ext2_has_ro_compat_feature(sb, EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
-		uint8_t power_bases[] = {7, 5, 3};
+	uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	uint32_t in[8], hash;
+	bool seeded = false;
 
-		/* the sequence of powers of 3, 5, and 7:
-		 * 1, 3, 5, 7, 9, 25, 27, 49, 81, ...
-		 */
-		if (group == 1)
-			return true;
+	for (int i = 0; i < 4; i++) {
+		if (p->sblock.hash_seed[i])
+			seeded = true;
+	}
 
-		for (size_t i = 0; i < sizeof(power_bases); i++) {
-			if (is_power_of(group, power_bases[i]))
-				return true;
-		}
+	if (seeded) {
+		for (int i = 0; i < 4; i++)
+			buf[i] = le32_to_cpu(p->sblock.hash_seed[i]);
+	}
 
-		return false;
+	switch (hash_version) {
+	case DX_HASH_LEGACY:
+	case DX_HASH_LEGACY_UNSIGNED:
+		hash = dx_hack_hash(name, len,
+				    hash_version == DX_HASH_LEGACY_UNSIGNED);
+		break;
+	case DX_HASH_HALF_MD4:
+	case DX_HASH_HALF_MD4_UNSIGNED:
+		for (int remain = len; remain > 0; remain -= 32, name += 32) {
+			dx_str2hashbuf(name, remain, in, 8,
+				       hash_version == DX_HASH_HALF_MD4_UNSIGNED);
+			dx_half_md4_transform(buf, in);
+		}
+		hash = buf[1];
+		break;
+	case DX_HASH_TEA:
+	case DX_HASH_TEA_UNSIGNED:
+		for (int remain = len; remain > 0; remain -= 16, name += 16) {
+			dx_str2hashbuf(name, remain, in, 4,
+				       hash_version == DX_HASH_TEA_UNSIGNED);
+			dx_tea_transform(buf, in);
+		}
+		hash = buf[0];
+		break;
+	default: /* siphash is used by the casefolded directory only */
+		return -1;
 	}
 
-	return true;
-}
+	hash &= ~1;
+	if (hash == (EXT4_HTREE_EOF_32BIT << 1))
+		hash = (EXT4_HTREE_EOF_32BIT - 1) << 1;
 
-static int ext2_editor_init_layouts(struct ext2_editor_private_data *p)
-{
-	struct ext2_sblock *sblock = &p->sblock;
-	uint16_t descriptor_size;
+	*ret_hash = hash;
+	return 0;
+}
 
-	descriptor_size = le16_to_cpu(sblock->descriptor_size);
-	/* sblock->descriptor_size maybe zero on some ext2 filesystem */
-	if (descriptor_size == 0)
-		descriptor_size = 32;
+/* map the logical blocks of a directory, the extent cursor is kept
+ * so the index blocks are not read again in the next lookup.
+ */
+struct ext2_dir_map {
+	bool				extent;
+	struct extent_cursor		c;
+	struct ext2_inode_blocks	b;
+};
 
-	/* inode tables */
-	for (size_t group = 0; group < p->n_block_group; group++) {
-		struct ext2_block_group *bgrp = &p->block_groups[group];
-		uint32_t block_start, block_len;
+static int ext2_dir_map_init(struct ext2_editor_private_data *p,
+			     struct ext2_dir_map *m, uint32_t ino,
+			     struct ext2_inode *inode)
+{
+	memset(m, 0, sizeof(*m));
 
-		block_start = group * le32_to_cpu(sblock->blocks_per_group);
+	if (le32_to_cpu(inode->flags) & EXT4_EXTENTS_FL) {
+		m->extent = true;
+		return extent_cursor_init(p, &m->c, ino);
+	}
 
-		/* super block */
-		if (group == 0 || ext2_block_group_has_backup_sb(sblock, group)) {
-			ext2_editor_register_layout(p, DISK_LAYOUT_SUPBER_BLOCK,
-						    group,
-						    block_start, 1);
+	return ext2_inode_blocks_read(p, &m->b, inode, ino);
+}
 
-			/* block descriptor */
-			block_start += 1;
-			block_len = aligned_block(p->n_block_group * descriptor_size,
-						p->block_size);
-			ext2_editor_register_layout(p, DISK_LAYOUT_GROUP_DESCRIPTOR,
-						group, block_start, block_len);
-			block_start += block_len;
+static void ext2_dir_map_exit(struct ext2_dir_map *m)
+{
+	if (m->extent)
+		extent_cursor_exit(&m->c);
+	else
+		free(m->b.runs);
+}
 
-			/* Reserved GDT */
-			block_len = le16_to_cpu(sblock->reserved_gdt_blocks);
-			if (block_len > 0) {
-				ext2_editor_register_layout(p, DISK_LAYOUT_RESERVED_GDT,
-							group, block_start, block_len);
-				block_start += block_len;
-			}
-		}
+static int ext2_dir_map_read(struct ext2_editor_private_data *p,
+			     struct ext2_dir_map *m, uint32_t lblk,
+			     void *blk)
+{
+	uint64_t pblk = 0;
 
-		ext2_editor_register_layout(p, DISK_LAYOUT_INODE_BITMAP, group,
-					    le32_to_cpu(bgrp->inode_id),
-					    1);
+	if (m->extent) {
+		struct ext4_extent *ee;
+		int ret;
 
-		ext2_editor_register_layout(p, DISK_LAYOUT_DATA_BLOCK_BITMAP,
-					    group,
-					    le32_to_cpu(bgrp->block_id),
-					    1);
+		ret = extent_cursor_seek(p, &m->c, lblk);
+		if (ret == 0)
+			ret = extent_cursor_next(p, &m->c, &ee);
+		if (ret < 0)
+			return ret;
 
-		block_len = aligned_block(
-			p->inode_size * le32_to_cpu(sblock->inodes_per_group),
-			p->block_size);
+		if (ret > 0 && lblk >= le32_to_cpu(ee->ee_block)
+		    && lblk - le32_to_cpu(ee->ee_block) < le16_to_cpu(ee->ee_len))
+			pblk = ext4_extent_start_block(ee)
+				+ (lblk - le32_to_cpu(ee->ee_block));
+	} else {
+		struct ext2_block_run *run;
 
-		ext2_editor_register_layout(p, DISK_LAYOUT_INODE_TABLE, group,
-					    le32_to_cpu(bgrp->inode_table_id),
-					    block_len);
+		ext2_block_run_foreach(&m->b, run, run_lblk) {
+			if (lblk < run_lblk + run->len) {
+				if (lblk >= run_lblk && run->start)
+					pblk = run->start + (lblk - run_lblk);
+				break;
+			}
+		}
 	}
 
-	/* sort it */
-	qsort(p->layouts, p->n_layout, sizeof(p->layouts[0]),
-		qsort_compare_layout);
+	if (pblk == 0) {
+		fprintf(stderr, "Error: directory block #%u is a hole\n", lblk);
+		return -1;
+	}
 
-	return 0;
+	return ext2_read_blocks(p, pblk, 1, blk, p->block_size);
 }
 
-static int ext2_alloc_bitmasks(struct ext2_editor_private_data *p)
+/* search @name in one directory block, returns 1 if found */
+static int ext2_dirblock_search(struct ext2_editor_private_data *p,
+				uint8_t *blk, const char *name, int len,
+				uint32_t *ret_ino)
 {
-	p->inode_bitmask = calloc(p->n_block_group, sizeof(struct bitmask *));
-	if (!p->inode_bitmask)
-		return -1;
-
-	p->data_block_bitmask = calloc(p->n_block_group, sizeof(struct bitmask *));
-	if (!p->data_block_bitmask)
-		return -1;
-
-	for (size_t i = 0; i < p->n_block_group; i++) {
-		struct ext2_block_group *bgrp = &p->block_groups[i];
-		struct bitmask *inode_bitmask, *data_bitmask;
-
-		inode_bitmask = alloc_bitmask(p->block_size * 8);
-		if (!inode_bitmask)
-			return -1;
+	for (size_t offset = 0; offset + sizeof(struct ext2_dirent) <= p->block_size; ) {
+		struct ext2_dirent *de = (struct ext2_dirent *)(blk + offset);
+		size_t direntlen = le16_to_cpu(de->direntlen);
 
-		data_bitmask = alloc_bitmask(p->block_size * 8);
-		if (!data_bitmask)
+		if (direntlen < sizeof(*de) || offset + direntlen > p->block_size) {
+			fprintf(stderr, "Error: bad direntlen %zu\n", direntlen);
 			return -1;
+		}
 
-		p->inode_bitmask[i] = inode_bitmask;
-		p->data_block_bitmask[i] = data_bitmask;
+		if (le32_to_cpu(de->inode) != 0 && de->namelen == len
+		    && sizeof(*de) + len <= direntlen
+		    && !memcmp(de + 1, name, len)) {
+			*ret_ino = le32_to_cpu(de->inode);
+			return 1;
+		}
 
-		ext2_read_blocks(p, le32_to_cpu(bgrp->inode_id), 1,
-				 inode_bitmask->buffer, p->block_size);
-		ext2_read_blocks(p, le32_to_cpu(bgrp->block_id), 1,
-				 data_bitmask->buffer, p->block_size);
+		offset += direntlen;
 	}
 
 	return 0;
 }
 
-static int64_t ext2_total_size(void *private_data, int fd);
+/* the htree path from the root to the leaf */
+struct ext2_dx_frame {
+	uint8_t			*blk;
+	struct dx_entry		*entries;
+	int			count;
+	int			at;
+};
 
-static int ext2_detect(void *private_data, int force_type, int fd)
+struct ext2_dx_lookup {
+	struct ext2_editor_private_data	*p;
+	struct ext2_dir_map		map;
+	int				levels;
+	struct ext2_dx_frame		frames[EXT4_HTREE_LEVEL];
+	uint8_t				*leaf;
+};
+
+/* the htree can't be used, search the directory linearly */
+#define EXT2_DX_LINEAR			2
+
+static int ext2_dx_frame_load(struct ext2_dx_lookup *l, int level,
+			      uint32_t lblk, size_t count_offset)
 {
-	struct ext2_editor_private_data *p = private_data;
-	struct ext2_sblock *sblock = &p->sblock;
-	uint16_t descriptor_size;
+	struct ext2_editor_private_data *p = l->p;
+	struct ext2_dx_frame *frame = &l->frames[level];
+	struct dx_countlimit *cl;
 	int ret;
 
-	/* save fd to private_data */
-	p->fd = fd;
-
-	fileseek(fd, SUPERBLOCK_START);
-	ret = fileread(fd, sblock, sizeof(*sblock));
+	ret = ext2_dir_map_read(p, &l->map, lblk, frame->blk);
 	if (ret < 0)
 		return ret;
 
-	/* NOTE:
-	 *
-	 * The block group descriptor is layouting after super block.
-	 * We need check the block group descriptor's checksum to detect
-	 * this image since we have many backup supber blocks but only one
-	 * block group descriptor.
-	 */
-	if (imgeditor_in_search_mode() && ext2_has_block_group_csum(sblock) == 0)
+	cl = (struct dx_countlimit *)(frame->blk + count_offset);
+	frame->entries = (struct dx_entry *)cl;
+	frame->count = le16_to_cpu(cl->count);
+	frame->at = 0;
+
+	if (frame->count == 0 || frame->count > le16_to_cpu(cl->limit)
+	    || count_offset + le16_to_cpu(cl->limit) * sizeof(struct dx_entry)
+			> p->block_size) {
+		fprintf(stderr, "Error: bad htree node at directory block #%u\n",
+			lblk);
 		return -1;
+	}
 
-	ret = ext2_check_sblock(&p->crc32c_le, force_type, sblock);
-	if (ret < 0)
-		return ret;
+	return 0;
+}
 
-	ext2_init_csum_seed(p);
+/* the first entry saves dx_countlimit and it's hash is zero */
+static uint32_t ext2_dx_entry_hash(struct ext2_dx_frame *frame, int i)
+{
+	return i == 0 ? 0 : le32_to_cpu(frame->entries[i].hash);
+}
 
-	p->block_size = ext2_sblock_log2_size_to_bytes(sblock->log2_block_size);
-	p->fragment_size = ext2_sblock_log2_size_to_bytes(sblock->log2_fragment_size);
-	p->n_block_group =
-		aligned_length((sblock->total_blocks - sblock->first_data_block),
-				sblock->blocks_per_group) / sblock->blocks_per_group;
+static uint32_t ext2_dx_entry_block(struct ext2_dx_frame *frame, int i)
+{
+	return le32_to_cpu(frame->entries[i].block) & 0x0fffffff;
+}
 
-	/* The default blocks_per_group is 32K,
-	 * one group = 32K * 4K = 128M,
-	 * for a 1T partition it need 1T / 128M = 1024 * 1024 / 128 = 8192
-	 */
-	if (p->n_block_group > 8192) {
-		fprintf_if_force_type("Error: too many block groups(%d)\n",
-					p->n_block_group);
-		return -1;
-	}
+/* walk from @level to the leaf, pick the last entry that it's hash is not
+ * larger than @hash in each node.
+ */
+static int ext2_dx_probe(struct ext2_dx_lookup *l, int level, uint32_t hash)
+{
+	for (; ; level++) {
+		struct ext2_dx_frame *frame = &l->frames[level];
+		int left = 1, right = frame->count, ret;
 
-	descriptor_size = le16_to_cpu(sblock->descriptor_size);
-	/* sblock->descriptor_size maybe zero on some ext2 filesystem */
-	if (descriptor_size == 0)
-		descriptor_size = 32;
+		while (left < right) {
+			int mid = left + (right - left) / 2;
 
-	if (descriptor_size > sizeof(struct ext2_block_group)) {
-		fprintf_if_force_type("Error: too large block group "
-					"descriptor size %d\n",
-					descriptor_size);
-		return -1;
-	}
-
-	if (le32_to_cpu(sblock->revision_level) == 0)
-		p->inode_size = 128;
-	else
-		p->inode_size = le16_to_cpu(sblock->inode_size);
-
-	if (filelength(fd) < ext2_total_size(private_data, fd)) {
-		fprintf_if_force_type("Error: file is incompleted\n");
-		return -1;
-	}
-
-	p->block_groups = calloc(p->n_block_group,
-				 sizeof(struct ext2_block_group));
-	if (!p->block_groups) {
-		fprintf(stderr, "Error: alloc %d ext2_block_groups failed\n",
-			p->n_block_group);
-		return -1;
-	}
-
-	/* loading all block groups */
-	fileseek(fd, p->block_size);
-	for (uint32_t i = 0; i < p->n_block_group; i++) {
-		struct ext2_block_group *group = &p->block_groups[i];
-
-		read(fd, group, descriptor_size);
-
-		if (ext2_has_block_group_csum(sblock)) {
-			uint32_t sum;
-
-			if (ext2_has_ro_compat_feature(sblock,
-				EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)) {
-				uint32_t oldcrc;
-
-				oldcrc = group->bg_checksum;
-				group->bg_checksum = 0;
-
-				libcrc32_init_seed(&p->crc32c_le, p->csum_seed);
-				libcrc32_update(&p->crc32c_le, &i, sizeof(i));
-				libcrc32_update(&p->crc32c_le, group, descriptor_size);
-				sum = libcrc32_finish(&p->crc32c_le);
-
-				group->bg_checksum = oldcrc;
-			} else {
-				size_t offset = offsetof(struct ext2_block_group, bg_checksum);
-
-				libcrc16_init_seed(&p->crc16, 0xffff);
-				libcrc16_update(&p->crc16, sblock->unique_id,
-						sizeof(sblock->unique_id));
-				libcrc16_update(&p->crc16, &i, sizeof(i));
-				libcrc16_update(&p->crc16, group, offset);
-
-				offset += sizeof(group->bg_checksum);
-				if (offset < descriptor_size)
-					libcrc16_update(&p->crc16,
-							(void *)group + offset,
-							descriptor_size - offset);
-				sum = libcrc16_finish(&p->crc16);
-			}
-
-			if ((sum & 0xffff) != le32_to_cpu(group->bg_checksum)) {
-				fprintf_if_force_type("Error: bad bg_checksum on "
-					"group descriptor %d (%08x != %08x)\n",
-					i, sum, le32_to_cpu(group->bg_checksum));
-				ext2_editor_exit(p);
-				return -1;
-			}
+			if (ext2_dx_entry_hash(frame, mid) > hash)
+				right = mid;
+			else
+				left = mid + 1;
 		}
-	}
+		frame->at = left - 1;
 
-	ret = ext2_alloc_bitmasks(p);
-	if (ret < 0) {
-		fprintf_if_force_type("Error: load inode/data block bitmap failed");
-		ext2_editor_exit(p);
-		return ret;
-	}
+		if (level == l->levels)
+			break;
 
-	ret = ext2_read_inode(p, EXT2_ROOT_INO, &p->root_inode);
-	if (ret < 0) {
-		fprintf_if_force_type("Error: read root inode failed\n");
-		ext2_editor_exit(p);
-		return ret;
+		/* the node block starts with a fake empty dirent */
+		ret = ext2_dx_frame_load(l, level + 1,
+					 ext2_dx_entry_block(frame, frame->at),
+					 8);
+		if (ret < 0)
+			return ret;
 	}
 
-	ext2_editor_init_layouts(p);
 	return 0;
 }
 
-static int64_t ext2_total_size(void *private_data, int fd)
-{
-	struct ext2_editor_private_data *p = private_data;
-	int64_t sz = le32_to_cpu(p->sblock.total_blocks);
-
-	return sz * p->block_size;
-}
-
-static int ext2_summary(void *private_data, int fd, char *buf, size_t bufsz)
+/* the names that have the same hash maybe saved in the next leaf, and
+ * the lowest bit of the next hash is set.
+ */
+static int ext2_dx_next_leaf(struct ext2_dx_lookup *l, uint32_t hash)
 {
-	struct ext2_editor_private_data *p = private_data;
-	int disk_mb = ext2_total_size(private_data, fd) >> 20;
-
-	snprintf(buf, bufsz,
-		"%dMiB on %.*s",
-		disk_mb,
-		(int)sizeof(p->sblock.last_mounted_on),
-		p->sblock.last_mounted_on);
-	return 0;
-}
+	int level = l->levels, ret;
 
-static int ext2_print_header_info(struct ext2_editor_private_data *p)
-{
-	struct ext2_sblock *sblock = &p->sblock;
+	while (++l->frames[level].at >= l->frames[level].count) {
+		if (level == 0)
+			return 0;
+		level--;
+	}
 
-	structure_print("%-34s: ", sblock, ext2_sblock_structure);
+	if ((ext2_dx_entry_hash(&l->frames[level], l->frames[level].at) & ~1)
+			!= hash)
+		return 0;
 
-	for (uint32_t i = 0; i < p->n_block_group; i++) {
-		struct ext2_block_group *group = &p->block_groups[i];
+	for (; level < l->levels; level++) {
+		struct ext2_dx_frame *frame = &l->frames[level];
 
-		printf("\n");
-		printf("Group %2d: \n", i);
-		structure_print("    %-30s: ", group, ext2_block_group_structure_32);
-		if (le32_to_cpu(sblock->descriptor_size) == 64) {
-			structure_print("    %-30s: ", &group,
-					ext2_block_group_structure_64);
-		}
+		ret = ext2_dx_frame_load(l, level + 1,
+					 ext2_dx_entry_block(frame, frame->at),
+					 8);
+		if (ret < 0)
+			return ret;
 	}
 
-	return 0;
+	return 1;
 }
 
-static int ext2_do_sblock(void *private_data, int fd, int argc, char **argv)
+static int ext2_dx_lookup(struct ext2_editor_private_data *p, uint32_t dir_ino,
+			  struct ext2_inode *dir, const char *name, int len,
+			  uint32_t *ret_ino)
 {
-	struct ext2_editor_private_data *p = private_data;
+	struct ext2_dx_lookup l = { .p = p };
+	int max_levels = EXT4_HTREE_LEVEL_COMPAT;
+	struct dx_root_info *info;
+	int hash_version, ret;
+	uint32_t hash;
+
+	if (ext2_has_incompat_feature(&p->sblock, EXT4_FEATURE_INCOMPAT_LARGEDIR))
+		max_levels = EXT4_HTREE_LEVEL;
+
+	l.frames[0].blk = malloc(p->block_size * (EXT4_HTREE_LEVEL + 1));
+	if (!l.frames[0].blk) {
+		fprintf(stderr, "Error: alloc htree blocks failed\n");
+		return -1;
+	}
 
-	ext2_print_header_info(p);
-	return 0;
-}
+	for (int i = 1; i < EXT4_HTREE_LEVEL; i++)
+		l.frames[i].blk = l.frames[0].blk + i * p->block_size;
+	l.leaf = l.frames[0].blk + EXT4_HTREE_LEVEL * p->block_size;
 
-/* show inode informations */
-static int ext2_do_inode(void *private_data, int fd, int argc, char **argv)
-{
-	struct ext2_editor_private_data *p = private_data;
-	uint32_t blkno, blk_offset;
-	struct ext2_inode inode;
-	int ino = -1;
-	int ret;
+	ret = ext2_dir_map_init(p, &l.map, dir_ino, dir);
+	if (ret < 0) {
+		free(l.frames[0].blk);
+		return ret;
+	}
 
-	if (argc > 1)
-		ino = (int)strtol(argv[1], NULL, 0); /* auto detect dec or hex */
+	/* the root block: ".", "..", dx_root_info and the entries */
+	ret = ext2_dir_map_read(p, &l.map, 0, l.frames[0].blk);
+	if (ret < 0)
+		goto done;
 
-	if (ino < 0) {
-		fprintf(stderr, "Usage: ext2 inode #ino\n");
-		return -1;
+	/* "." and ".." are not hashed */
+	if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'))) {
+		ret = ext2_dirblock_search(p, l.frames[0].blk, name, len, ret_ino);
+		goto done;
 	}
 
-	ret = _ext2_read_inode(p, ino, &inode, &blkno, &blk_offset);
+	info = (struct dx_root_info *)(l.frames[0].blk + 24);
+	hash_version = info->hash_version;
+	if (hash_version <= DX_HASH_TEA
+	    && (le32_to_cpu(p->sblock.flags) & EXT2_FLAGS_UNSIGNED_HASH))
+		hash_version += 3;
+
+	l.levels = info->indirect_levels;
+	if (info->reserved_zero != 0 || info->info_length != 8
+	    || l.levels >= max_levels
+	    || ext2_dx_hash(p, hash_version, name, len, &hash) < 0) {
+		ret = EXT2_DX_LINEAR;
+		goto done;
+	}
+
+	ret = ext2_dx_frame_load(&l, 0, 0, 24 + info->info_length);
 	if (ret < 0)
-		return ret;
+		goto done;
 
-	printf("inode #%d location on blk #%d + 0x%04x\n",
-		ino, blkno, blk_offset);
-	structure_print_ext2_inode("%-30s: ", &inode);
-	return 0;
-}
+	ret = ext2_dx_probe(&l, 0, hash);
+	while (ret == 0) {
+		struct ext2_dx_frame *frame = &l.frames[l.levels];
 
-/* show block raw data */
-static int ext2_do_block(void *private_data, int fd, int argc, char **argv)
-{
-	struct ext2_editor_private_data *p = private_data;
-	int blkno = -1;
-	uint8_t *blk;
+		ret = ext2_dir_map_read(p, &l.map,
+					ext2_dx_entry_block(frame, frame->at),
+					l.leaf);
+		if (ret < 0)
+			break;
 
-	if (argc > 1)
-		blkno = (int)strtol(argv[1], NULL, 0);
+		ret = ext2_dirblock_search(p, l.leaf, name, len, ret_ino);
+		if (ret != 0)
+			break;
 
-	if (blkno < 0) {
-		fprintf(stderr, "Usage: ext2 block #blkno\n");
-		return -1;
+		ret = ext2_dx_next_leaf(&l, hash);
+		if (ret <= 0)
+			break;
+		ret = 0;
 	}
 
-	blk = ext2_alloc_read_block(p, blkno);
-	if (!blk)
-		return -1;
-
-	hexdump(blk, p->block_size, blkno * p->block_size);
+	if (get_verbose_level() > 0)
+		printf("htree lookup %.*s in inode #%u: hash 0x%08x, %d levels\n",
+		       len, name, dir_ino, hash, l.levels + 1);
 
-	free(blk);
-	return 0;
+done:
+	ext2_dir_map_exit(&l.map);
+	free(l.frames[0].blk);
+	return ret;
 }
 
-/* show dirent in block address */
-static int ext2_do_dirent(void *private_data, int fd, int argc, char **argv)
+static int ext2_lookup_linear(struct ext2_editor_private_data *p,
+			      uint32_t dir_ino, const char *name, int len,
+			      uint32_t *ret_ino)
 {
-	struct ext2_editor_private_data *p = private_data;
-	int ret = 0, blkno = -1;
-	unsigned long offset = 0;
-	uint8_t *blk;
-
-	if (argc > 1)
-		blkno = (int)strtol(argv[1], NULL, 0);
-
-	if (blkno < 0) {
-		fprintf(stderr, "Usage: ext2 dirent #blkno\n");
-		return -1;
-	}
-
-	blk = ext2_alloc_read_block(p, blkno);
-	if (!blk)
-		return -1;
+	struct dirent_iterator it;
+	int ret;
 
-	while (1) {
-		struct ext2_dirent *dir = (struct ext2_dirent *)(blk + offset);
+	ret = dirent_iterator_init(p, &it, dir_ino);
+	if (ret < 0)
+		return ret;
 
-		if (offset >= p->block_size)
-			break;
-		if (offset + le16_to_cpu(dir->direntlen) > p->block_size)
-			break;
-		if (le32_to_cpu(dir->inode) == 0)
-			goto next;
+	dirent_list_foreach(&it) {
+		struct ext2_dirent *dir = it.dir;
 
-		if (le16_to_cpu(dir->direntlen) <= (int)sizeof(*dir)) {
-			fprintf(stderr, "Error: bad dirent struct on block #%ld\n",
-				blkno * p->block_size + offset);
+		if (le16_to_cpu(dir->direntlen) <= (int)sizeof(struct ext2_dirent)) {
+			fprintf(stderr, "direntlen is too short\n");
 			ret = -1;
 			break;
 		}
 
-		printf("%08lx: inode:     #%d\n",
-			offset + offsetof(struct ext2_dirent, inode),
-			le32_to_cpu(dir->inode));
-		printf("%08lx: direntlen: %d\n",
-			offset + offsetof(struct ext2_dirent, direntlen),
-			le16_to_cpu(dir->direntlen));
-		printf("%08lx: namelen:   %d\n",
-			offset + offsetof(struct ext2_dirent, namelen),
-			dir->namelen);
-		printf("%08lx: filetype:  %d\n",
-			offset + offsetof(struct ext2_dirent, filetype),
-			dir->filetype);
-		printf("%08lx: name:      %.*s\n",
-			offset + sizeof(struct ext2_dirent),
-			dir->namelen, (const char *)(dir + 1));
-		printf("\n");
-
-	next:
-		offset += le16_to_cpu(dir->direntlen);
+		if (le32_to_cpu(dir->inode) != 0 && dir->namelen == len
+		    && !memcmp(dir + 1, name, len)) {
+			*ret_ino = le32_to_cpu(dir->inode);
+			ret = 1;
+			break;
+		}
 	}
 
-	free(blk);
+	dirent_iterator_exit(&it);
 	return ret;
 }
 
-/* show extent in block address */
-static int ext2_do_extent(void *private_data, int fd, int argc, char **argv)
+/* find @name in the directory, returns 1 if found and 0 if not */
+static int ext2_lookup(struct ext2_editor_private_data *p, uint32_t dir_ino,
+		       const char *name, int len, uint32_t *ret_ino)
 {
-	struct ext2_editor_private_data *p = private_data;
-	struct ext4_extent_header *eh;
-	int blkno = -1;
-	uint8_t *blk;
+	struct ext2_inode dir;
+	uint32_t flags;
+	int ret;
 
-	if (argc > 1)
-		blkno = (int)strtol(argv[1], NULL, 0);
+	ret = ext2_read_inode(p, dir_ino, &dir);
+	if (ret < 0)
+		return ret;
 
-	if (blkno < 0) {
-		fprintf(stderr, "Usage: ext2 extent #blkno\n");
+	if ((le16_to_cpu(dir.mode) & INODE_MODE_S_MASK) != INODE_MODE_S_IFDIR) {
+		fprintf(stderr, "Error: inode #%u is not a directory\n", dir_ino);
 		return -1;
 	}
 
-	blk = ext2_alloc_read_block(p, blkno);
-	if (!blk)
-		return -1;
-
-	eh = (struct ext4_extent_header *)blk;
-	if (le16_to_cpu(eh->eh_magic) != EXT4_EXT_MAGIC) {
-		fprintf(stderr, "Error: magic doesn't match\n");
-		free(blk);
-		return -1;
+	/* the hashed names of casefolded and encrypted directories are not
+	 * the raw name.
+	 */
+	flags = le32_to_cpu(dir.flags);
+	if (ext2_has_compat_feature(&p->sblock, EXT4_FEATURE_COMPAT_DIR_INDEX)
+	    && (flags & EXT4_INDEX_FL)
+	    && !(flags & (EXT4_CASEFOLD_FL | EXT4_ENCRYPT_FL | EXT4_INLINE_DATA_FL))) {
+		ret = ext2_dx_lookup(p, dir_ino, &dir, name, len, ret_ino);
+		if (ret != EXT2_DX_LINEAR)
+			return ret;
 	}
 
-	structure_print_ext4_extent("%-30s: ", eh);
-	free(blk);
-	return 0;
+	return ext2_lookup_linear(p, dir_ino, name, len, ret_ino);
 }
 
-static int ext2_do_list(void *private_data, int fd, int argc, char **argv)
+#define EXT2_MAX_SYMLINKS		8
+
+static int _ext2_namei(struct ext2_editor_private_data *p, uint32_t dir_ino,
+		       const char *path, bool follow, int *nlinks,
+		       uint32_t *ret_ino)
 {
-	struct ext2_editor_private_data *p = private_data;
-	int depth = 2;
+	uint32_t ino = path[0] == '/' ? EXT2_ROOT_INO : dir_ino;
+	const char *name = path;
+	int ret;
 
-	printf("ext2: ext filesystem image\n");
+	while (1) {
+		struct ext2_inode inode;
+		uint32_t parent = ino;
+		const char *end;
+		bool last;
+		int len;
+
+		while (*name == '/')
+			name++;
+		if (*name == '\0')
+			break;
 
-	for (int i = 0; i < argc; i++) {
-		const char *opt = argv[i];
+		end = strchr(name, '/');
+		if (!end)
+			end = name + strlen(name);
+		len = end - name;
 
-		if (!strcmp(opt, "--depth")) {
-			if (++i < argc)
-				depth = atoi(argv[i]);
+		if (len > EXT2_NAME_LEN) {
+			fprintf(stderr, "Error: %.*s: name is too long\n", len, name);
+			return -1;
 		}
-	}
 
-	return print_dirent(p, EXT2_ROOT_INO, 0, depth);
-}
+		ret = ext2_lookup(p, parent, name, len, &ino);
+		if (ret < 0)
+			return ret;
+		if (ret == 0) {
+			fprintf(stderr, "Error: %.*s is not found in %s\n",
+				len, name, path);
+			return -1;
+		}
 
-static size_t journal_descriptor_blocktag_size(uint32_t incompat_features)
-{
-	size_t sz;
+		for (name = end; *name == '/'; name++)
+			;
+		last = *name == '\0';
 
-	/* the size is 16 (without UUID) or 32 bytes when CSUM_V3 */
-	if (incompat_features & JBD2_FEATURE_INCOMPAT_CSUM_V3)
-		return sizeof(struct journal_block_tag3_s);
+		if (!last || follow) {
+			char target[4096] = { 0 };
 
-	/* IF CSUM_V3 is not set, teh size is 8, 12, 24, or 28 bytes */
-	sz = sizeof(struct journal_block_tag_s);
+			ret = ext2_read_inode(p, ino, &inode);
+			if (ret < 0)
+				return ret;
 
-	if (!(incompat_features & JBD2_FEATURE_INCOMPAT_64BIT))
-		sz -= sizeof(__be32); /* t_blocknr_high */
+			if ((le16_to_cpu(inode.mode) & INODE_MODE_S_MASK)
+					!= INODE_MODE_S_IFLINK)
+				continue;
 
-	return sz;
-}
+			if (++(*nlinks) > EXT2_MAX_SYMLINKS) {
+				fprintf(stderr, "Error: too many levels of "
+						"symbolic links in %s\n", path);
+				return -1;
+			}
 
-struct journal_foreach_arg {
-	struct ext2_editor_private_data		*ext;
-	void					*journal_buf;
-	size_t					journal_size;
-
-	struct journal_superblock_t		*sb;
-	int					break_next;
+			ret = symlink_inode_get_target(p, &inode, target,
+						       sizeof(target) - 1);
+			if (ret < 0) {
+				fprintf(stderr, "Error: read symlink target of "
+						"inode #%u failed\n", ino);
+				return ret;
+			}
 
-	int (*class_handler)(struct journal_foreach_arg *arg,
-			     struct journal_header_t *this, void *data,
-			     uint32_t journal_blkno);
+			ret = _ext2_namei(p, parent, target, true, nlinks, &ino);
+			if (ret < 0)
+				return ret;
+		}
+	}
 
-	int (*desc_handler)(struct journal_foreach_arg *arg,
-			    struct journal_header_t *this,
-			    uint64_t fs_blocknr, uint64_t journal_blocknr,
-			    uint32_t flags);
-};
+	*ret_ino = ino;
+	return 0;
+}
 
-static int ext2_journal_print_class(struct journal_foreach_arg *arg,
-				    struct journal_header_t *h,
-				    void *data,
-				    uint32_t journal_blkno)
+/* resolve @path from the root directory, the symlinks in the middle of
+ * @path are always followed, and the last one is followed if @follow.
+ */
+static int ext2_namei(struct ext2_editor_private_data *p, const char *path,
+		      bool follow, uint32_t *ret_ino)
 {
-	struct commit_header *commit = data;
-	struct journal_revoke_header_t *revoke = data;
+	int nlinks = 0;
 
-	if (get_verbose_level() == 0) {
-		uint32_t seq = be32_to_cpu(arg->sb->s_sequence);
-		uint32_t thisseq = be32_to_cpu(h->h_sequence);
+	return _ext2_namei(p, EXT2_ROOT_INO, path, follow, &nlinks, ret_ino);
+}
 
-		if (thisseq < seq)
-			return 0;
+static void ext2_init_csum_seed(struct ext2_editor_private_data *p)
+{
+	struct ext2_sblock *sblock = &p->sblock;
+
+	if (le32_to_cpu(sblock->feature_incompat) & EXT4_FEATURE_INCOMPAT_CSUM_SEED) {
+		p->csum_seed = le32_to_cpu(sblock->checksum_seed);
+		return;
 	}
 
-	switch (be32_to_cpu(h->h_blocktype)) {
-	case EXT3_JOURNAL_DESCRIPTOR_BLOCK:
-	case EXT3_JOURNAL_COMMIT_BLOCK:
-	case EXT3_JOURNAL_SUPERBLOCK_V1:
-	case EXT3_JOURNAL_SUPERBLOCK_V2:
-	case EXT3_JOURNAL_REVOKE_BLOCK:
-		printf("Journal %4d on blk #%-5d ",
-			be32_to_cpu(h->h_sequence), journal_blkno);
-		break;
-	default:
+	libcrc32_init_seed(&p->crc32c_le, 0xffffffff);
+	libcrc32_update(&p->crc32c_le, sblock->unique_id, sizeof(sblock->unique_id));
+	p->csum_seed = libcrc32_finish(&p->crc32c_le);
+}
+
+static int qsort_compare_layout(const void *a, const void *b)
+{
+	const struct disk_layout *la = a, *lb = b;
+
+	if (la->start_block < lb->start_block)
 		return -1;
+
+	return la->start_block > lb->start_block;
+}
+
+static bool is_power_of(int a, int b)
+{
+	while (a > b) {
+		if (a % b)
+			return 0;
+		a /= b;
 	}
 
-	switch (be32_to_cpu(h->h_blocktype)) {
-	case EXT3_JOURNAL_SUPERBLOCK_V1:
-	case EXT3_JOURNAL_SUPERBLOCK_V2:
-		printf("%-13s sequence=%d", "Superblock",
-			be32_to_cpu(arg->sb->s_sequence));
-		break;
-	case EXT3_JOURNAL_DESCRIPTOR_BLOCK:
-		printf("%-13s ", "Descriptor");
-		break;
-	case EXT3_JOURNAL_COMMIT_BLOCK:
-		{
-			char buf[64];
-			struct tm tm = { 0 };
-			time_t t = be64_to_cpu(commit->h_commit_sec);
+	return (a == b);
+}
 
-			printf("%-13s", "Commit");
+static size_t next_sparse_super_block_number(size_t n)
+{
+	const size_t power_bases[3] = { 3, 5, 7 };
+	size_t min, tmpbuf[3] = { 3, 5, 7 };
 
-			localtime_r(&t, &tm);
-			strftime(buf, sizeof(buf), "%FT%T", &tm);
-			printf(" %s.%03d",
-				buf,
-				be32_to_cpu(commit->h_commit_nsec) / 1000000);
+	if (n == 1)
+		return 3;
+
+	while (1) {
+		int not_ready = 0;
+
+		for (int j = 0; j < 3; j++) {
+			if (tmpbuf[j] <= n) {
+				tmpbuf[j] *= power_bases[j];
+				not_ready++;
+			}
 		}
-		break;
-	case EXT3_JOURNAL_REVOKE_BLOCK:
-		printf("%-13s", "Revocation");
-		printf(" count=%d", be32_to_cpu(revoke->r_count) / 4);
-		for (unsigned int i = 0;
-			i < be32_to_cpu(revoke->r_count); i += 4) {
-			__be32 *p_revoke_blk = (void *)(revoke + 1) + i;
 
-			printf(" %d", be32_to_cpu(*p_revoke_blk));
+		if (!not_ready)
+			break;
+	}
+
+	min = tmpbuf[0];
+	for (size_t j = 1; j < 3; j++) {
+		if (tmpbuf[j] < min)
+			min = tmpbuf[j];
+	}
+
+	return min;
+}
+
+static bool ext2_block_group_has_backup_sb(struct ext2_sblock *sb, size_t group)
+{
+	if (ext2_has_ro_compat_feature(sb, EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+		uint8_t power_bases[] = {7, 5, 3};
+
+		/* the sequence of powers of 3, 5, and 7:
+		 * 1, 3, 5, 7, 9, 25, 27, 49, 81, ...
+		 */
+		if (group == 1)
+			return true;
+
+		for (size_t i = 0; i < sizeof(power_bases); i++) {
+			if (is_power_of(group, power_bases[i]))
+				return true;
 		}
-		break;
+
+		return false;
 	}
 
-	printf("\n");
-	return 0;
+	return true;
 }
 
-static int ext2_journal_print_desc(struct journal_foreach_arg *arg,
-				   struct journal_header_t *this,
-				   uint64_t fs_blocknr, uint64_t journal_blocknr,
-				   uint32_t flags)
+static int ext2_editor_init_layouts(struct ext2_editor_private_data *p)
 {
+	struct ext2_sblock *sblock = &p->sblock;
+	int ret = 0;
 
-	char *fs_blocknr_info = NULL, s[256];
+	/* inode tables */
+	for (size_t group = 0; group < p->n_block_group && !ret; group++) {
+		struct ext2_block_group *bgrp = &p->block_groups[group];
+		uint64_t block_start, block_len;
 
-	if (get_verbose_level() == 0) {
-		const struct disk_layout *layout;
-		uint32_t seq = be32_to_cpu(arg->sb->s_sequence);
-		uint32_t thisseq = be32_to_cpu(this->h_sequence);
+		block_start = le32_to_cpu(sblock->first_data_block) +
+			group * (uint64_t)le32_to_cpu(sblock->blocks_per_group);
 
-		if (thisseq < seq)
-			return 0;
+		/* super block */
+		if (group == 0 || ext2_block_group_has_backup_sb(sblock, group)) {
+			ext2_editor_register_layout(p, DISK_LAYOUT_SUPBER_BLOCK,
+						    group,
+						    block_start, 1);
 
-		layout = ext2_editor_disk_layout_match_block(arg->ext,
-							     fs_blocknr);
-		if (!layout) {
-			int ino = -1;
+			/* block descriptor */
+			block_start += 1;
+			block_len = aligned_block((size_t)p->n_block_group *
+						  p->descriptor_size,
+						  p->block_size);
+			ext2_editor_register_layout(p, DISK_LAYOUT_GROUP_DESCRIPTOR,
+						group, block_start, block_len);
+			block_start += block_len;
 
-			if (!ext2_whohas_blkno(arg->ext, fs_blocknr, &ino)) {
-				snprintf(s, sizeof(s), "inode #%d", ino);
-				fs_blocknr_info = s;
+			/* Reserved GDT */
+			block_len = le16_to_cpu(sblock->reserved_gdt_blocks);
+			if (block_len > 0) {
+				ext2_editor_register_layout(p, DISK_LAYOUT_RESERVED_GDT,
+							group, block_start, block_len);
+				block_start += block_len;
 			}
-		} else {
-			fs_blocknr_info =
-				format_disk_layout(layout, s, sizeof(s));
 		}
+
+		ext2_editor_register_layout(p, DISK_LAYOUT_INODE_BITMAP, group,
+					    ext2_bg_inode_bitmap(p, bgrp),
+					    1);
+
+		ext2_editor_register_layout(p, DISK_LAYOUT_DATA_BLOCK_BITMAP,
+					    group,
+					    ext2_bg_block_bitmap(p, bgrp),
+					    1);
+
+		block_len = aligned_block(
+			p->inode_size * le32_to_cpu(sblock->inodes_per_group),
+			p->block_size);
+
+		ret = ext2_editor_register_layout(p, DISK_LAYOUT_INODE_TABLE,
+						  group,
+						  ext2_bg_inode_table(p, bgrp),
+						  block_len);
 	}
 
-	printf("%27sFS blocknr %-8" PRIu64
-		"logged at journal block %-5" PRIu64 " with flags 0x%x",
-		"", fs_blocknr, journal_blocknr, flags);
+	/* sort it */
+	if (p->n_layout > 0)
+		qsort(p->layouts, p->n_layout, sizeof(p->layouts[0]),
+		      qsort_compare_layout);
 
-	if (fs_blocknr_info)
-		printf(" (%s)", fs_blocknr_info);
+	return ret;
+}
 
-	printf("\n");
+/* alloc the empty bitmasks of all groups */
+static int ext2_new_bitmasks(struct ext2_editor_private_data *p)
+{
+	p->inode_bitmask = calloc(p->n_block_group, sizeof(struct bitmask *));
+	if (!p->inode_bitmask)
+		return -1;
+
+	p->data_block_bitmask = calloc(p->n_block_group, sizeof(struct bitmask *));
+	if (!p->data_block_bitmask)
+		return -1;
+
+	for (size_t i = 0; i < p->n_block_group; i++) {
+		p->inode_bitmask[i] = alloc_bitmask(p->block_size * 8);
+		if (!p->inode_bitmask[i])
+			return -1;
+
+		p->data_block_bitmask[i] = alloc_bitmask(p->block_size * 8);
+		if (!p->data_block_bitmask[i])
+			return -1;
+	}
 
 	return 0;
 }
 
-static int ext2_journal_foreach_descriptor(struct journal_foreach_arg *arg,
-					  struct journal_header_t *this,
-					  void *data,
-					  uint32_t journal_start_blkno,
-					  uint32_t *ret_data_blks)
+/* the ext bitmaps are LSB first, the bit N of the bitmask is block
+ * (or inode) N in the group.
+ */
+static int ext2_alloc_bitmasks(struct ext2_editor_private_data *p)
 {
-	uint32_t incompat_features = be32_to_cpu(arg->sb->s_feature_incompat);
-	size_t tagsize = journal_descriptor_blocktag_size(incompat_features);
-	size_t blocksize = be32_to_cpu(arg->sb->s_blocksize);
-	size_t tailsize = 0;
-	uint32_t data_blks = 0;
-	void *p = data;
+	uint8_t *blk;
+	int ret;
 
-	if (incompat_features & JBD2_FEATURE_INCOMPAT_CSUM_V2_3)
-		tailsize = sizeof(struct jbd2_journal_block_tail);
+	ret = ext2_new_bitmasks(p);
+	if (ret < 0)
+		return ret;
 
-	while ((size_t)(p - (void *)this) <= blocksize - tagsize - tailsize) {
-		struct journal_block_tag3_s *tag3 = p;
-		struct journal_block_tag_s *tag = p;
-		uint64_t blocknr = 0;
-		uint32_t flags;
+	blk = malloc(p->block_size);
+	if (!blk)
+		return -1;
+
+	for (size_t i = 0; i < p->n_block_group; i++) {
+		struct ext2_block_group *bgrp = &p->block_groups[i];
+
+		if (!ext2_read_blocks(p, ext2_bg_inode_bitmap(p, bgrp), 1,
+				      blk, p->block_size))
+			bitmask_memcpy_lsbfirst(p->inode_bitmask[i], blk,
+						p->block_size);
+		if (!ext2_read_blocks(p, ext2_bg_block_bitmap(p, bgrp), 1,
+				      blk, p->block_size))
+			bitmask_memcpy_lsbfirst(p->data_block_bitmask[i], blk,
+						p->block_size);
+	}
+
+	free(blk);
+	return 0;
+}
+
+static int64_t ext2_total_size(void *private_data, int fd);
+
+/* crc32c if metadata_csum is enabled, otherwise crc16 of the uuid, the group
+ * number and the descriptor, the bg_checksum itself is skipped.
+ */
+static uint16_t ext2_group_desc_csum(struct ext2_editor_private_data *p,
+				     uint32_t group_idx,
+				     struct ext2_block_group *group)
+{
+	struct ext2_sblock *sblock = &p->sblock;
+	uint16_t descriptor_size = p->descriptor_size;
+	__le32 le_group = cpu_to_le32(group_idx);
+	uint32_t sum;
+
+	if (ext2_has_ro_compat_feature(sblock,
+		EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)) {
+		__le16 oldcrc = group->bg_checksum;
+
+		group->bg_checksum = 0;
+
+		libcrc32_init_seed(&p->crc32c_le, p->csum_seed);
+		libcrc32_update(&p->crc32c_le, &le_group, sizeof(le_group));
+		libcrc32_update(&p->crc32c_le, group, descriptor_size);
+		sum = libcrc32_finish(&p->crc32c_le);
+
+		group->bg_checksum = oldcrc;
+	} else {
+		size_t offset = offsetof(struct ext2_block_group, bg_checksum);
+
+		libcrc16_init_seed(&p->crc16, 0xffff);
+		libcrc16_update(&p->crc16, sblock->unique_id,
+				sizeof(sblock->unique_id));
+		libcrc16_update(&p->crc16, &le_group, sizeof(le_group));
+		libcrc16_update(&p->crc16, group, offset);
+
+		offset += sizeof(group->bg_checksum);
+		if (offset < descriptor_size)
+			libcrc16_update(&p->crc16, (void *)group + offset,
+					descriptor_size - offset);
+		sum = libcrc16_finish(&p->crc16);
+	}
+
+	return sum & 0xffff;
+}
+
+/* loading all block groups, the descriptors are started at the
+ * next block of super block. (block 2 if the block size is 1KiB)
+ */
+static int ext2_load_block_groups(struct ext2_editor_private_data *p,
+				  int force_type)
+{
+	struct ext2_sblock *sblock = &p->sblock;
+	uint16_t descriptor_size = p->descriptor_size;
+	size_t sz = (size_t)p->n_block_group * descriptor_size;
+	uint8_t *gdt;
+	int ret = 0;
+
+	gdt = malloc(aligned_length(sz, p->block_size));
+	if (!gdt) {
+		fprintf(stderr, "Error: alloc group descriptors failed\n");
+		return -1;
+	}
+
+	ret = ext2_read_blocks(p, le32_to_cpu(sblock->first_data_block) + 1ULL,
+			       aligned_block(sz, p->block_size), gdt, sz);
+	if (ret < 0)
+		goto done;
+
+	for (uint32_t i = 0; i < p->n_block_group; i++) {
+		struct ext2_block_group *group = &p->block_groups[i];
+
+		memcpy(group, gdt + (size_t)i * descriptor_size, descriptor_size);
+
+		if (ext2_has_block_group_csum(sblock)) {
+			uint16_t sum = ext2_group_desc_csum(p, i, group);
+
+			if (sum != le16_to_cpu(group->bg_checksum)) {
+				fprintf_if_force_type("Error: bad bg_checksum on "
+					"group descriptor %d (%08x != %08x)\n",
+					i, sum, le16_to_cpu(group->bg_checksum));
+				ret = -1;
+				goto done;
+			}
+		}
+	}
+
+done:
+	free(gdt);
+	return ret;
+}
+
+static int ext2_detect(void *private_data, int force_type, int fd)
+{
+	struct ext2_editor_private_data *p = private_data;
+	struct ext2_sblock *sblock = &p->sblock;
+	uint64_t total_blocks, n_block_group;
+	uint32_t blocks_per_group;
+	uint16_t descriptor_size;
+	bool load_snapshot = false;
+	const char *snapshot;
+	int ret;
+
+	/* save fd to private_data */
+	p->fd = fd;
+
+	fileseek(fd, SUPERBLOCK_START);
+	ret = fileread(fd, sblock, sizeof(*sblock));
+	if (ret < 0)
+		return ret;
+
+	/* NOTE:
+	 *
+	 * The block group descriptor is layouting after super block.
+	 * We need check the block group descriptor's checksum to detect
+	 * this image since we have many backup supber blocks but only one
+	 * block group descriptor.
+	 */
+	if (imgeditor_in_search_mode() && ext2_has_block_group_csum(sblock) == 0)
+		return -1;
+
+	ret = ext2_check_sblock(&p->crc32c_le, force_type, sblock);
+	if (ret < 0)
+		return ret;
+
+	ext2_init_csum_seed(p);
+
+	p->block_size = ext2_sblock_log2_size_to_bytes(sblock->log2_block_size);
+	p->fragment_size = ext2_sblock_log2_size_to_bytes(sblock->log2_fragment_size);
+
+	total_blocks = ext2_total_blocks(sblock);
+	blocks_per_group = le32_to_cpu(sblock->blocks_per_group);
+	if (total_blocks <= le32_to_cpu(sblock->first_data_block)) {
+		fprintf_if_force_type("Error: bad total blocks %" PRIu64 "\n",
+				      total_blocks);
+		return -1;
+	}
+
+	n_block_group = total_blocks - le32_to_cpu(sblock->first_data_block);
+	n_block_group = (n_block_group + blocks_per_group - 1) / blocks_per_group;
+	if (n_block_group > UINT32_MAX) {
+		fprintf_if_force_type("Error: too many block groups(%" PRIu64 ")\n",
+				      n_block_group);
+		return -1;
+	}
+	p->n_block_group = n_block_group;
+
+	/* the descriptor size is 32 bytes if INCOMPAT_64BIT is disabled,
+	 * sblock->descriptor_size maybe zero on some ext2 filesystem.
+	 */
+	descriptor_size = EXT2_MIN_DESC_SIZE;
+	if (ext2_has_incompat_feature(sblock, EXT4_FEATURE_INCOMPAT_64BIT))
+		descriptor_size = le16_to_cpu(sblock->descriptor_size);
+
+	if (descriptor_size < EXT2_MIN_DESC_SIZE ||
+	    descriptor_size > sizeof(struct ext2_block_group)) {
+		fprintf_if_force_type("Error: bad block group "
+					"descriptor size %d\n",
+					descriptor_size);
+		return -1;
+	}
+	p->descriptor_size = descriptor_size;
+
+	if (le32_to_cpu(sblock->revision_level) == 0)
+		p->inode_size = 128;
+	else
+		p->inode_size = le16_to_cpu(sblock->inode_size);
+
+	if (filelength(fd) < ext2_total_size(private_data, fd)) {
+		fprintf_if_force_type("Error: file is incompleted\n");
+		return -1;
+	}
+
+	p->block_groups = calloc(p->n_block_group,
+				 sizeof(struct ext2_block_group));
+	p->itables = calloc(p->n_block_group, sizeof(struct ext2_inode_table));
+	if (!p->block_groups || !p->itables) {
+		fprintf(stderr, "Error: alloc %u ext2_block_groups failed\n",
+			p->n_block_group);
+		ext2_editor_exit(p);
+		return -1;
+	}
+
+	ret = ext2_load_block_groups(p, force_type);
+	if (ret < 0) {
+		ext2_editor_exit(p);
+		return ret;
+	}
+
+	/* the bitmasks and layouts are loaded from the snapshot if it
+	 * matches the super block and the group descriptors.
+	 */
+	snapshot = get_metadata_snapshot();
+	if (snapshot && !ext2_snapshot_load(p, snapshot))
+		load_snapshot = true;
+
+	if (!load_snapshot) {
+		ret = ext2_alloc_bitmasks(p);
+		if (ret < 0) {
+			fprintf_if_force_type("Error: load inode/data block bitmap failed");
+			ext2_editor_exit(p);
+			return ret;
+		}
+	}
+
+	ret = ext2_read_inode(p, EXT2_ROOT_INO, &p->root_inode);
+	if (ret < 0) {
+		fprintf_if_force_type("Error: read root inode failed\n");
+		ext2_editor_exit(p);
+		return ret;
+	}
+
+	if (!load_snapshot) {
+		ret = ext2_editor_init_layouts(p);
+		if (ret < 0) {
+			ext2_editor_exit(p);
+			return ret;
+		}
+
+		/* the detect is called for each offset in the search mode */
+		if (snapshot && !imgeditor_in_search_mode())
+			ext2_snapshot_save(p, snapshot);
+	}
+
+	return 0;
+}
+
+static int64_t ext2_total_size(void *private_data, int fd)
+{
+	struct ext2_editor_private_data *p = private_data;
+	int64_t sz = ext2_total_blocks(&p->sblock);
+
+	return sz * p->block_size;
+}
+
+static int ext2_summary(void *private_data, int fd, char *buf, size_t bufsz)
+{
+	struct ext2_editor_private_data *p = private_data;
+	int disk_mb = ext2_total_size(private_data, fd) >> 20;
+
+	snprintf(buf, bufsz,
+		"%dMiB on %.*s",
+		disk_mb,
+		(int)sizeof(p->sblock.last_mounted_on),
+		p->sblock.last_mounted_on);
+	return 0;
+}
+
+static int ext2_print_header_info(struct ext2_editor_private_data *p)
+{
+	struct ext2_sblock *sblock = &p->sblock;
+
+	structure_print("%-34s: ", sblock, ext2_sblock_structure);
+
+	for (uint32_t i = 0; i < p->n_block_group; i++) {
+		struct ext2_block_group *group = &p->block_groups[i];
+
+		printf("\n");
+		printf("Group %2d: \n", i);
+		structure_print("    %-30s: ", group, ext2_block_group_structure_32);
+		if (p->descriptor_size >= EXT4_MIN_DESC_SIZE_64BIT) {
+			structure_print("    %-30s: ", group,
+					ext2_block_group_structure_64);
+		}
+	}
+
+	return 0;
+}
+
+static int ext2_do_sblock(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+
+	ext2_print_header_info(p);
+	return 0;
+}
+
+/* show inode informations */
+static int ext2_print_inode(struct ext2_editor_private_data *p, int ino)
+{
+	uint32_t blk_offset;
+	struct ext2_inode inode;
+	uint64_t blkno;
+	int ret;
+
+	ret = _ext2_read_inode(p, ino, &inode, &blkno, &blk_offset);
+	if (ret < 0)
+		return ret;
+
+	printf("inode #%d location on blk #%" PRIu64 " + 0x%04x\n",
+		ino, blkno, blk_offset);
+	structure_print_ext2_inode("%-30s: ", &inode);
+	return 0;
+}
+
+static int ext2_do_inode(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	int ino = -1;
+
+	if (argc > 1)
+		ino = (int)strtol(argv[1], NULL, 0); /* auto detect dec or hex */
+
+	if (ino < 0) {
+		fprintf(stderr, "Usage: ext2 inode #ino\n");
+		return -1;
+	}
+
+	return ext2_print_inode(p, ino);
+}
+
+/* stat /path/of/file: the symlink itself is showed */
+static int ext2_do_stat(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	uint32_t ino;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: ext2 stat /path/of/file\n");
+		return -1;
+	}
+
+	ret = ext2_namei(p, argv[1], false, &ino);
+	if (ret < 0)
+		return ret;
+
+	return ext2_print_inode(p, ino);
+}
+
+/* write the file data in [@lblk, @lblk + @nblks) to @fd_out, the hole
+ * before it is filled with zero. @pos is the bytes already written.
+ */
+static int ext2_cat_blocks(struct ext2_editor_private_data *p, int fd_out,
+			   uint64_t filesz, uint64_t *pos, uint64_t lblk,
+			   uint64_t pblk, uint64_t nblks, uint8_t *buf,
+			   size_t bufsz)
+{
+	uint64_t offset = lblk * p->block_size;
+	uint64_t end = offset + nblks * p->block_size;
+
+	if (end > filesz)
+		end = filesz;
+
+	while (*pos < end) {
+		size_t chunk = bufsz;
+
+		if (*pos < offset) { /* hole */
+			uint64_t hole_end = offset < end ? offset : end;
+
+			if (chunk > hole_end - *pos)
+				chunk = hole_end - *pos;
+			memset(buf, 0, chunk);
+		} else {
+			uint64_t blk = pblk + (*pos - offset) / p->block_size;
+			int n;
+
+			if (chunk > end - *pos)
+				chunk = end - *pos;
+
+			/* @pos is block aligned after the hole */
+			n = aligned_block(chunk, p->block_size);
+			if (ext2_read_blocks(p, blk, n, buf, bufsz) < 0)
+				return -1;
+		}
+
+		if (write(fd_out, buf, chunk) != (ssize_t)chunk) {
+			fprintf(stderr, "Error: write failed(%m)\n");
+			return -1;
+		}
+
+		*pos += chunk;
+	}
+
+	return 0;
+}
+
+#define EXT2_CAT_BUFSZ			(1 << 20)
+
+/* cat /path/of/file: write the file to stdout */
+static int ext2_do_cat(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	uint64_t filesz, pos = 0;
+	struct ext2_inode inode;
+	size_t bufsz;
+	uint8_t *buf;
+	uint32_t ino;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: ext2 cat /path/of/file\n");
+		return -1;
+	}
+
+	ret = ext2_namei(p, argv[1], true, &ino);
+	if (ret < 0)
+		return ret;
+
+	ret = ext2_read_inode(p, ino, &inode);
+	if (ret < 0)
+		return ret;
+
+	if ((le16_to_cpu(inode.mode) & INODE_MODE_S_MASK) != INODE_MODE_S_IFREG) {
+		fprintf(stderr, "Error: %s is not a regular file\n", argv[1]);
+		return -1;
+	} else if (le32_to_cpu(inode.flags) & EXT4_INLINE_DATA_FL) {
+		fprintf(stderr, "Error: inline data of %s is not supported\n",
+			argv[1]);
+		return -1;
+	}
+
+	filesz = le32_to_cpu(inode.size_high);
+	filesz = filesz << 32;
+	filesz |= le32_to_cpu(inode.size);
+
+	bufsz = aligned_length(EXT2_CAT_BUFSZ, p->block_size);
+	buf = malloc(bufsz);
+	if (!buf) {
+		fprintf(stderr, "Error: alloc %zu bytes failed\n", bufsz);
+		return -1;
+	}
+
+	/* stdout is used for the file data */
+	fflush(stdout);
+
+	if (le32_to_cpu(inode.flags) & EXT4_EXTENTS_FL) {
+		struct extent_cursor c;
+		struct ext4_extent *ee;
+
+		ret = extent_cursor_init(p, &c, ino);
+		if (ret < 0)
+			goto done;
+
+		extent_cursor_foreach(p, &c, ee, ret) {
+			/* unwritten extent reads as zero */
+			if (le16_to_cpu(ee->ee_len) > EXT_INIT_MAX_LEN)
+				continue;
+
+			ret = ext2_cat_blocks(p, STDOUT_FILENO, filesz, &pos,
+					      le32_to_cpu(ee->ee_block),
+					      ext4_extent_start_block(ee),
+					      le16_to_cpu(ee->ee_len),
+					      buf, bufsz);
+			if (ret < 0)
+				break;
+		}
+
+		extent_cursor_exit(&c);
+	} else {
+		struct ext2_inode_blocks b = { .runs = NULL };
+		struct ext2_block_run *run;
+
+		ret = ext2_inode_blocks_read(p, &b, &inode, ino);
+		if (ret == 0) {
+			ext2_block_run_foreach(&b, run, lblk) {
+				if (run->start == 0) /* hole */
+					continue;
+
+				ret = ext2_cat_blocks(p, STDOUT_FILENO, filesz,
+						      &pos, lblk, run->start,
+						      run->len, buf, bufsz);
+				if (ret < 0)
+					break;
+			}
+		}
+
+		free(b.runs);
+	}
+
+	/* the hole at the end of file */
+	if (ret == 0)
+		ret = ext2_cat_blocks(p, STDOUT_FILENO, filesz, &pos,
+				      aligned_block(filesz, p->block_size), 0, 0,
+				      buf, bufsz);
+done:
+	free(buf);
+	return ret;
+}
+
+/* show block raw data */
+static int ext2_do_block(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	uint64_t blkno;
+	uint8_t *blk;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: ext2 block #blkno\n");
+		return -1;
+	}
+
+	blkno = strtoull(argv[1], NULL, 0);
+	blk = ext2_alloc_read_block(p, blkno);
+	if (!blk)
+		return -1;
+
+	hexdump(blk, p->block_size, blkno * p->block_size);
+
+	free(blk);
+	return 0;
+}
+
+/* show dirent in block address */
+static int ext2_do_dirent(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	unsigned long offset = 0;
+	uint64_t blkno;
+	uint8_t *blk;
+	int ret = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: ext2 dirent #blkno\n");
+		return -1;
+	}
+
+	blkno = strtoull(argv[1], NULL, 0);
+	blk = ext2_alloc_read_block(p, blkno);
+	if (!blk)
+		return -1;
+
+	while (1) {
+		struct ext2_dirent *dir = (struct ext2_dirent *)(blk + offset);
+
+		if (offset >= p->block_size)
+			break;
+		if (offset + le16_to_cpu(dir->direntlen) > p->block_size)
+			break;
+		if (le32_to_cpu(dir->inode) == 0)
+			goto next;
+
+		if (le16_to_cpu(dir->direntlen) <= (int)sizeof(*dir)) {
+			fprintf(stderr, "Error: bad dirent struct on block #%" PRIu64 "\n",
+				blkno * p->block_size + offset);
+			ret = -1;
+			break;
+		}
+
+		printf("%08lx: inode:     #%d\n",
+			offset + offsetof(struct ext2_dirent, inode),
+			le32_to_cpu(dir->inode));
+		printf("%08lx: direntlen: %d\n",
+			offset + offsetof(struct ext2_dirent, direntlen),
+			le16_to_cpu(dir->direntlen));
+		printf("%08lx: namelen:   %d\n",
+			offset + offsetof(struct ext2_dirent, namelen),
+			dir->namelen);
+		printf("%08lx: filetype:  %d\n",
+			offset + offsetof(struct ext2_dirent, filetype),
+			dir->filetype);
+		printf("%08lx: name:      %.*s\n",
+			offset + sizeof(struct ext2_dirent),
+			dir->namelen, (const char *)(dir + 1));
+		printf("\n");
+
+	next:
+		offset += le16_to_cpu(dir->direntlen);
+	}
+
+	free(blk);
+	return ret;
+}
+
+/* show extent in block address */
+static int ext2_do_extent(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	struct ext4_extent_header *eh;
+	uint64_t blkno;
+	uint8_t *blk;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: ext2 extent #blkno\n");
+		return -1;
+	}
+
+	blkno = strtoull(argv[1], NULL, 0);
+
+	blk = ext2_alloc_read_block(p, blkno);
+	if (!blk)
+		return -1;
+
+	eh = (struct ext4_extent_header *)blk;
+	if (le16_to_cpu(eh->eh_magic) != EXT4_EXT_MAGIC) {
+		fprintf(stderr, "Error: magic doesn't match\n");
+		free(blk);
+		return -1;
+	}
+
+	structure_print_ext4_extent("%-30s: ", eh);
+	free(blk);
+	return 0;
+}
+
+static void ext2_print_bmap(uint32_t lblk, uint64_t pblk, const char *note)
+{
+	if (pblk == 0)
+		printf("%u: hole\n", lblk);
+	else
+		printf("%u: %" PRIu64 "%s\n", lblk, pblk, note);
+}
+
+static int ext2_bmap_blocks(struct ext2_editor_private_data *p, uint32_t ino,
+			    struct ext2_inode *inode, uint32_t lblk,
+			    uint32_t count)
+{
+	struct ext2_inode_blocks b = { .runs = NULL };
+	struct ext2_block_run *run;
+	int ret;
+
+	ret = ext2_inode_blocks_read(p, &b, inode, ino);
+	if (ret < 0)
+		return ret;
+
+	for (uint32_t i = lblk; i - lblk < count; i++) {
+		uint64_t pblk = 0;
+
+		ext2_block_run_foreach(&b, run, run_lblk) {
+			if (i < run_lblk + run->len) {
+				if (i >= run_lblk && run->start)
+					pblk = run->start + (i - run_lblk);
+				break;
+			}
+		}
+
+		ext2_print_bmap(i, pblk, "");
+	}
+
+	free(b.runs);
+	return 0;
+}
+
+/* bmap #ino #lblk [#count]: show the physical blocks of a file */
+static int ext2_do_bmap(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	uint32_t ino, lblk, count = 1;
+	struct ext4_extent *ee = NULL;
+	struct extent_cursor c;
+	struct ext2_inode inode;
+	int ret;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: ext2 bmap #ino #lblk [#count]\n");
+		return -1;
+	}
+
+	ino = strtoul(argv[1], NULL, 0);
+	lblk = strtoul(argv[2], NULL, 0);
+	if (argc > 3)
+		count = strtoul(argv[3], NULL, 0);
+
+	if (ino == 0 || ino > le32_to_cpu(p->sblock.total_inodes)) {
+		fprintf(stderr, "Error: bad inode #%u\n", ino);
+		return -1;
+	}
+
+	ret = ext2_read_inode(p, ino, &inode);
+	if (ret < 0)
+		return ret;
+
+	if (!(le32_to_cpu(inode.flags) & EXT4_EXTENTS_FL))
+		return ext2_bmap_blocks(p, ino, &inode, lblk, count);
+
+	ret = extent_cursor_init(p, &c, ino);
+	if (ret < 0)
+		return ret;
+
+	/* only the extents after @lblk are loaded */
+	ret = extent_cursor_seek(p, &c, lblk);
+	if (ret < 0)
+		goto done;
+
+	ret = extent_cursor_next(p, &c, &ee);
+	for (uint32_t i = lblk; ret >= 0 && i - lblk < count; i++) {
+		uint32_t len = 0, start = 0;
+		const char *note = "";
+
+		while (ret > 0) {
+			start = le32_to_cpu(ee->ee_block);
+			len = le16_to_cpu(ee->ee_len);
+			if (len > EXT_INIT_MAX_LEN) {
+				len -= EXT_INIT_MAX_LEN;
+				note = " (unwritten)";
+			}
+
+			if (i < start + len)
+				break;
+
+			note = "";
+			ret = extent_cursor_next(p, &c, &ee);
+		}
+
+		if (ret > 0 && i >= start)
+			ext2_print_bmap(i, ext4_extent_start_block(ee) + (i - start),
+					note);
+		else
+			ext2_print_bmap(i, 0, "");
+	}
+
+done:
+	extent_cursor_exit(&c);
+	return ret < 0 ? ret : 0;
+}
+
+static int ext2_do_list(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	int depth = 2;
+
+	printf("ext2: ext filesystem image\n");
+
+	for (int i = 0; i < argc; i++) {
+		const char *opt = argv[i];
+
+		if (!strcmp(opt, "--depth")) {
+			if (++i < argc)
+				depth = atoi(argv[i]);
+		}
+	}
+
+	return print_dirent(p, EXT2_ROOT_INO, 0, depth);
+}
+
+/* the logical blocks of the journal inode mapping to the filesystem */
+struct ext2_journal_run {
+	uint32_t		lblk;
+	uint32_t		len;
+	uint64_t		pblk;
+};
+
+enum ext2_journal_rec_type {
+	EXT2_JOURNAL_REC_DESCRIPTOR,
+	EXT2_JOURNAL_REC_DATA,
+	EXT2_JOURNAL_REC_REVOKE,
+	EXT2_JOURNAL_REC_COMMIT,
+};
+
+/* one record of the transaction index.
+ * @fs_blocknr: the logged or revoked filesystem block.
+ * @journal_blkno: where the record is saved in the journal, it is the
+ *                 revoke block for EXT2_JOURNAL_REC_REVOKE.
+ * @rank: the tid related to s_sequence, the older transaction is negative.
+ * @order: the position in the log order of this transaction.
+ */
+struct ext2_journal_rec {
+	uint64_t		fs_blocknr;
+	uint32_t		journal_blkno;
+	uint32_t		tid;
+	int32_t			rank;
+	uint32_t		order;
+	uint16_t		type;
+	uint16_t		flags;
+};
+
+/* @start: the first block of this transaction in the log order.
+ * @commit: the commit block, zero if the transaction is not committed.
+ */
+struct ext2_journal_trans {
+	uint32_t		tid;
+	uint32_t		start;
+	uint32_t		commit;
+	size_t			first_rec;
+	size_t			n_rec;
+	size_t			n_data;
+	size_t			n_revoke;
+};
+
+/* the journal is read by chunks, it is never loaded at once. */
+#define EXT2_JOURNAL_CHUNK_SIZE		(1 << 20)
+
+struct ext2_journal {
+	struct ext2_editor_private_data	*p;
+
+	struct ext2_journal_run		*runs;
+	size_t				n_runs;
+	size_t				max_runs;
+	uint32_t			total_blocks;
+
+	/* the first block, include the journal_header_t */
+	uint8_t				*sb_buf;
+	struct journal_superblock_t	*sb;
+
+	uint8_t				*chunk;
+	uint32_t			chunk_start;
+	uint32_t			chunk_blocks;
+	uint32_t			max_chunk_blocks;
+
+	/* the transaction index sorted by tid, the records of one
+	 * transaction are in the log order.
+	 */
+	struct ext2_journal_rec		*recs;
+	size_t				n_recs;
+	size_t				max_recs;
+	struct ext2_journal_trans	*trans;
+	size_t				n_trans;
+
+	/* the data and revoke records sorted by the filesystem block */
+	struct ext2_journal_rec		**blkmap;
+	size_t				n_blkmap;
+};
+
+static int ext2_journal_add_run(struct ext2_journal *j, uint32_t lblk,
+				uint64_t pblk, uint32_t len)
+{
+	if (j->n_runs >= j->max_runs) {
+		size_t max_runs = j->max_runs ? j->max_runs * 2 : 16;
+		struct ext2_journal_run *runs;
+
+		runs = realloc(j->runs, max_runs * sizeof(*runs));
+		if (!runs) {
+			fprintf(stderr, "Error: alloc %zu journal runs failed\n",
+				max_runs);
+			return -1;
+		}
+
+		j->runs = runs;
+		j->max_runs = max_runs;
+	}
+
+	j->runs[j->n_runs].lblk = lblk;
+	j->runs[j->n_runs].pblk = pblk;
+	j->runs[j->n_runs].len = len;
+	j->n_runs++;
+
+	return 0;
+}
+
+static int ext2_journal_load_runs(struct ext2_journal *j, uint32_t ino)
+{
+	struct ext2_editor_private_data *p = j->p;
+	struct extent_cursor c;
+	struct ext4_extent *ee;
+	struct ext2_inode inode;
+	uint64_t filesz;
+	int ret;
+
+	ret = ext2_read_inode(p, ino, &inode);
+	if (ret < 0)
+		return ret;
+
+	if ((le16_to_cpu(inode.mode) & INODE_MODE_S_MASK) != INODE_MODE_S_IFREG) {
+		fprintf(stderr, "Error: journal inode #%u is not a file\n", ino);
+		return -1;
+	}
+
+	filesz = le32_to_cpu(inode.size_high);
+	filesz = filesz << 32;
+	filesz |= le32_to_cpu(inode.size);
+	if (filesz / p->block_size > UINT32_MAX) {
+		fprintf(stderr, "Error: journal inode #%u is too large\n", ino);
+		return -1;
+	}
+
+	j->total_blocks = aligned_block(filesz, p->block_size);
+
+	if (!(le32_to_cpu(inode.flags) & EXT4_EXTENTS_FL)) {
+		struct ext2_inode_blocks b = { .runs = NULL };
+		struct ext2_block_run *run;
+
+		ret = ext2_inode_blocks_read(p, &b, &inode, ino);
+		if (ret == 0) {
+			ext2_block_run_foreach(&b, run, lblk) {
+				if (run->start == 0) /* hole */
+					continue;
+
+				ret = ext2_journal_add_run(j, lblk, run->start,
+							   run->len);
+				if (ret < 0)
+					break;
+			}
+		}
+
+		free(b.runs);
+		return ret;
+	}
+
+	ret = extent_cursor_init(p, &c, ino);
+	if (ret < 0)
+		return ret;
+
+	extent_cursor_foreach(p, &c, ee, ret) {
+		/* unwritten extent reads as zero */
+		if (le16_to_cpu(ee->ee_len) > EXT_INIT_MAX_LEN)
+			continue;
+
+		ret = ext2_journal_add_run(j, le32_to_cpu(ee->ee_block),
+					   ext4_extent_start_block(ee),
+					   le16_to_cpu(ee->ee_len));
+		if (ret < 0)
+			break;
+	}
+
+	extent_cursor_exit(&c);
+	return ret;
+}
+
+/* find the run that @lblk is in, or the next run if @lblk is a hole */
+static size_t ext2_journal_find_run(struct ext2_journal *j, uint32_t lblk)
+{
+	size_t l = 0, r = j->n_runs;
+
+	while (l < r) {
+		size_t mid = l + (r - l) / 2;
+		struct ext2_journal_run *run = &j->runs[mid];
+
+		if (lblk >= run->lblk + run->len)
+			l = mid + 1;
+		else
+			r = mid;
+	}
+
+	return l;
+}
+
+static int ext2_journal_load_chunk(struct ext2_journal *j, uint32_t jblk)
+{
+	struct ext2_editor_private_data *p = j->p;
+	uint32_t n = j->max_chunk_blocks;
+	size_t i = ext2_journal_find_run(j, jblk);
+
+	if (n > j->total_blocks - jblk)
+		n = j->total_blocks - jblk;
+
+	memset(j->chunk, 0, (size_t)n * p->block_size);
+
+	for (; i < j->n_runs && j->runs[i].lblk < jblk + n; i++) {
+		struct ext2_journal_run *run = &j->runs[i];
+		uint32_t start = run->lblk > jblk ? run->lblk : jblk;
+		uint32_t end = run->lblk + run->len;
+
+		if (end > jblk + n)
+			end = jblk + n;
+
+		if (ext2_read_blocks(p, run->pblk + (start - run->lblk),
+				     end - start,
+				     j->chunk + (size_t)(start - jblk) * p->block_size,
+				     (size_t)(end - start) * p->block_size) < 0)
+			return -1;
+	}
+
+	j->chunk_start = jblk;
+	j->chunk_blocks = n;
+	return 0;
+}
+
+/* the returned block is valid until the next call */
+static void *ext2_journal_block(struct ext2_journal *j, uint32_t jblk)
+{
+	if (jblk >= j->total_blocks)
+		return NULL;
+
+	if (j->chunk_blocks == 0 || jblk < j->chunk_start
+	    || jblk >= j->chunk_start + j->chunk_blocks) {
+		if (ext2_journal_load_chunk(j, jblk) < 0) {
+			j->chunk_blocks = 0;
+			return NULL;
+		}
+	}
+
+	return j->chunk + (size_t)(jblk - j->chunk_start) * j->p->block_size;
+}
+
+static void ext2_journal_close(struct ext2_journal *j)
+{
+	free(j->runs);
+	free(j->sb_buf);
+	free(j->chunk);
+	free(j->recs);
+	free(j->trans);
+	free(j->blkmap);
+	memset(j, 0, sizeof(*j));
+}
+
+static int ext2_journal_open(struct ext2_editor_private_data *p,
+			     struct ext2_journal *j)
+{
+	uint32_t ino = le32_to_cpu(p->sblock.journal_inode);
+	struct journal_header_t *h;
+	void *blk;
+
+	memset(j, 0, sizeof(*j));
+	j->p = p;
+
+	if (ino == 0) {
+		fprintf(stderr, "Error: the filesystem doesn't has journal\n");
+		return -1;
+	}
+
+	if (ext2_journal_load_runs(j, ino) < 0)
+		goto failed;
+
+	j->max_chunk_blocks = EXT2_JOURNAL_CHUNK_SIZE / p->block_size;
+	j->chunk = malloc(EXT2_JOURNAL_CHUNK_SIZE);
+	j->sb_buf = malloc(p->block_size);
+	if (!j->chunk || !j->sb_buf) {
+		fprintf(stderr, "Error: alloc journal chunk failed\n");
+		goto failed;
+	}
+
+	blk = ext2_journal_block(j, EXT2_JOURNAL_SUPERBLOCK);
+	if (!blk)
+		goto failed;
+
+	memcpy(j->sb_buf, blk, p->block_size);
+	h = (struct journal_header_t *)j->sb_buf;
+	j->sb = (struct journal_superblock_t *)(h + 1);
+
+	if (be32_to_cpu(h->h_magic) != EXT3_JOURNAL_MAGIC_NUMBER) {
+		fprintf(stderr, "Error: bad journal superblock magic\n");
+		goto failed;
+	}
+
+	if (be32_to_cpu(j->sb->s_blocksize) != p->block_size) {
+		fprintf(stderr, "Error: journal block size %u is not supported\n",
+			be32_to_cpu(j->sb->s_blocksize));
+		goto failed;
+	}
+
+	if (be32_to_cpu(j->sb->s_maxlen) < j->total_blocks)
+		j->total_blocks = be32_to_cpu(j->sb->s_maxlen);
+
+	return 0;
+
+failed:
+	ext2_journal_close(j);
+	return -1;
+}
+
+static size_t journal_descriptor_blocktag_size(uint32_t incompat_features)
+{
+	size_t sz;
+
+	/* the size is 16 (without UUID) or 32 bytes when CSUM_V3 */
+	if (incompat_features & JBD2_FEATURE_INCOMPAT_CSUM_V3)
+		return sizeof(struct journal_block_tag3_s);
+
+	/* IF CSUM_V3 is not set, teh size is 8, 12, 24, or 28 bytes */
+	sz = sizeof(struct journal_block_tag_s);
+
+	if (!(incompat_features & JBD2_FEATURE_INCOMPAT_64BIT))
+		sz -= sizeof(__be32); /* t_blocknr_high */
+
+	return sz;
+}
+
+static size_t journal_revoke_record_size(struct journal_superblock_t *sb)
+{
+	if (be32_to_cpu(sb->s_feature_incompat) & JBD2_FEATURE_INCOMPAT_64BIT)
+		return sizeof(__be64);
+	return sizeof(__be32);
+}
+
+/* the revoke records are started after journal_revoke_header_t, and
+ * r_count is the bytes used in this block, include the headers.
+ */
+static size_t journal_revoke_count(struct journal_superblock_t *sb,
+				   struct journal_header_t *h)
+{
+	struct journal_revoke_header_t *revoke = (void *)(h + 1);
+	size_t used = be32_to_cpu(revoke->r_count);
+	size_t offset = sizeof(*h) + sizeof(*revoke);
+
+	if (used > be32_to_cpu(sb->s_blocksize) || used < offset)
+		return 0;
+
+	return (used - offset) / journal_revoke_record_size(sb);
+}
+
+static uint64_t journal_revoke_blocknr(struct journal_superblock_t *sb,
+				       struct journal_header_t *h, size_t idx)
+{
+	size_t rsz = journal_revoke_record_size(sb);
+	void *record = (void *)h + sizeof(*h)
+			+ sizeof(struct journal_revoke_header_t) + idx * rsz;
+
+	if (rsz == sizeof(__be64))
+		return be64_to_cpu(*(__be64 *)record);
+	return be32_to_cpu(*(__be32 *)record);
+}
+
+struct journal_foreach_arg {
+	struct ext2_editor_private_data		*ext;
+	struct ext2_journal			*j;
+
+	struct journal_superblock_t		*sb;
+	int					break_next;
+	int					error;
+
+	int (*class_handler)(struct journal_foreach_arg *arg,
+			     struct journal_header_t *this, void *data,
+			     uint32_t journal_blkno);
+
+	int (*desc_handler)(struct journal_foreach_arg *arg,
+			    struct journal_header_t *this,
+			    uint64_t fs_blocknr, uint64_t journal_blocknr,
+			    uint32_t flags);
+};
+
+static int ext2_journal_print_class(struct journal_foreach_arg *arg,
+				    struct journal_header_t *h,
+				    void *data,
+				    uint32_t journal_blkno)
+{
+	struct commit_header *commit = data;
+
+	if (get_verbose_level() == 0) {
+		uint32_t seq = be32_to_cpu(arg->sb->s_sequence);
+		uint32_t thisseq = be32_to_cpu(h->h_sequence);
+
+		if (thisseq < seq)
+			return 0;
+	}
+
+	switch (be32_to_cpu(h->h_blocktype)) {
+	case EXT3_JOURNAL_DESCRIPTOR_BLOCK:
+	case EXT3_JOURNAL_COMMIT_BLOCK:
+	case EXT3_JOURNAL_SUPERBLOCK_V1:
+	case EXT3_JOURNAL_SUPERBLOCK_V2:
+	case EXT3_JOURNAL_REVOKE_BLOCK:
+		printf("Journal %4d on blk #%-5d ",
+			be32_to_cpu(h->h_sequence), journal_blkno);
+		break;
+	default:
+		return -1;
+	}
+
+	switch (be32_to_cpu(h->h_blocktype)) {
+	case EXT3_JOURNAL_SUPERBLOCK_V1:
+	case EXT3_JOURNAL_SUPERBLOCK_V2:
+		printf("%-13s sequence=%d", "Superblock",
+			be32_to_cpu(arg->sb->s_sequence));
+		break;
+	case EXT3_JOURNAL_DESCRIPTOR_BLOCK:
+		printf("%-13s ", "Descriptor");
+		break;
+	case EXT3_JOURNAL_COMMIT_BLOCK:
+		{
+			char buf[64];
+			struct tm tm = { 0 };
+			time_t t = be64_to_cpu(commit->h_commit_sec);
+
+			printf("%-13s", "Commit");
+
+			localtime_r(&t, &tm);
+			strftime(buf, sizeof(buf), "%FT%T", &tm);
+			printf(" %s.%03d",
+				buf,
+				be32_to_cpu(commit->h_commit_nsec) / 1000000);
+		}
+		break;
+	case EXT3_JOURNAL_REVOKE_BLOCK:
+		{
+			size_t count = journal_revoke_count(arg->sb, h);
+
+			printf("%-13s", "Revocation");
+			printf(" count=%zu", count);
+			for (size_t i = 0; i < count; i++)
+				printf(" %" PRIu64,
+				       journal_revoke_blocknr(arg->sb, h, i));
+		}
+		break;
+	}
+
+	printf("\n");
+	return 0;
+}
+static int ext2_journal_print_desc(struct journal_foreach_arg *arg,
+				   struct journal_header_t *this,
+				   uint64_t fs_blocknr, uint64_t journal_blocknr,
+				   uint32_t flags)
+{
+
+	char *fs_blocknr_info = NULL, s[256];
+
+	if (get_verbose_level() == 0) {
+		const struct disk_layout *layout;
+		uint32_t seq = be32_to_cpu(arg->sb->s_sequence);
+		uint32_t thisseq = be32_to_cpu(this->h_sequence);
+
+		if (thisseq < seq)
+			return 0;
+
+		layout = ext2_editor_disk_layout_match_block(arg->ext,
+							     fs_blocknr);
+		if (!layout) {
+			int ino = -1;
+
+			if (!ext2_whohas_blkno(arg->ext, fs_blocknr, &ino)) {
+				snprintf(s, sizeof(s), "inode #%d", ino);
+				fs_blocknr_info = s;
+			}
+		} else {
+			fs_blocknr_info =
+				format_disk_layout(layout, s, sizeof(s));
+		}
+	}
+
+	printf("%27sFS blocknr %-8" PRIu64
+		"logged at journal block %-5" PRIu64 " with flags 0x%x",
+		"", fs_blocknr, journal_blocknr, flags);
+
+	if (fs_blocknr_info)
+		printf(" (%s)", fs_blocknr_info);
+
+	printf("\n");
+
+	return 0;
+}
+
+static int ext2_journal_foreach_descriptor(struct journal_foreach_arg *arg,
+					  struct journal_header_t *this,
+					  void *data,
+					  uint32_t journal_start_blkno,
+					  uint32_t *ret_data_blks)
+{
+	uint32_t incompat_features = be32_to_cpu(arg->sb->s_feature_incompat);
+	size_t tagsize = journal_descriptor_blocktag_size(incompat_features);
+	size_t blocksize = be32_to_cpu(arg->sb->s_blocksize);
+	size_t tailsize = 0;
+	uint32_t data_blks = 0;
+	void *p = data;
+
+	if (incompat_features & JBD2_FEATURE_INCOMPAT_CSUM_V2_3)
+		tailsize = sizeof(struct jbd2_journal_block_tail);
+
+	while ((size_t)(p - (void *)this) <= blocksize - tagsize - tailsize) {
+		struct journal_block_tag3_s *tag3 = p;
+		struct journal_block_tag_s *tag = p;
+		uint64_t blocknr = 0;
+		uint32_t flags;
+
+		++data_blks;
+
+		if (incompat_features & JBD2_FEATURE_INCOMPAT_CSUM_V3) {
+			blocknr = be32_to_cpu(tag3->t_blocknr_high);
+			blocknr <<= 32;
+			blocknr |= be32_to_cpu(tag3->t_blocknr);
+			flags = be32_to_cpu(tag3->t_flags);
+		} else {
+			if (incompat_features & JBD2_FEATURE_INCOMPAT_64BIT)
+				blocknr = be32_to_cpu(tag->t_blocknr_high);
+			blocknr <<= 32;
+			blocknr |= be32_to_cpu(tag->t_blocknr);
+			flags = be16_to_cpu(tag->t_flags);
+		}
+
+		if (arg->desc_handler) {
+			arg->desc_handler(arg, this, blocknr,
+					 journal_start_blkno + data_blks,
+					 flags);
+		}
+
+		if (flags & EXT3_JOURNAL_FLAG_LAST_TAG)
+			break;
+
+		p += tagsize;
+		if (!(flags & EXT3_JOURNAL_FLAG_SAME_UUID))
+			p += 16;
+	}
+
+	*ret_data_blks = data_blks;
+	return 0;
+}
+
+static int ext2_foreach_journal(struct journal_foreach_arg *arg)
+{
+	struct ext2_journal *j = arg->j;
+	uint32_t journal_blkno = 0;
+
+	arg->break_next = 0;
+	arg->error = 0;
+	arg->sb = j->sb;
+
+	while (journal_blkno < j->total_blocks) {
+		struct journal_header_t *h;
+		uint32_t blocktype;
+
+		h = ext2_journal_block(j, journal_blkno);
+		if (!h)
+			return -1;
+
+		blocktype = be32_to_cpu(h->h_blocktype);
+		if (be32_to_cpu(h->h_magic) != EXT3_JOURNAL_MAGIC_NUMBER)
+			goto next;
+
+		switch (blocktype) {
+		case EXT3_JOURNAL_DESCRIPTOR_BLOCK:
+		case EXT3_JOURNAL_COMMIT_BLOCK:
+		case EXT3_JOURNAL_SUPERBLOCK_V1:
+		case EXT3_JOURNAL_SUPERBLOCK_V2:
+		case EXT3_JOURNAL_REVOKE_BLOCK:
+			if (arg->class_handler) {
+				arg->class_handler(arg, h, h + 1, journal_blkno);
+				if (arg->break_next)
+					return arg->error;
+			}
+			break;
+		default:
+			goto next;
+		}
+
+		switch (blocktype) {
+		case EXT3_JOURNAL_DESCRIPTOR_BLOCK:
+			{
+				uint32_t n_data_blk = 0;
+
+				/* In general, the dta blocks being written to
+				 * disk through the journal are written
+				 * verbatim into the journal file after the
+				 * descriptor block.
+				 */
+				ext2_journal_foreach_descriptor(arg, h, h + 1,
+								journal_blkno,
+								&n_data_blk);
+
+				journal_blkno += n_data_blk;
+			}
+			break;
+		}
+
+	next:
+		journal_blkno++;
+	}
+
+	return arg->error;
+}
+
+/* the tid is wrapped, compare them based on the s_sequence */
+static int32_t ext2_journal_tid_rank(struct ext2_journal *j, uint32_t tid)
+{
+	return (int32_t)(tid - be32_to_cpu(j->sb->s_sequence));
+}
+
+static int ext2_journal_add_rec(struct ext2_journal *j, int type,
+				uint32_t tid, uint32_t journal_blkno,
+				uint64_t fs_blocknr, uint32_t flags)
+{
+	struct ext2_journal_rec *rec;
+
+	if (j->n_recs >= j->max_recs) {
+		size_t max_recs = j->max_recs ? j->max_recs * 2 : 256;
+
+		rec = realloc(j->recs, max_recs * sizeof(*rec));
+		if (!rec) {
+			fprintf(stderr, "Error: alloc %zu journal records "
+					"failed\n", max_recs);
+			return -1;
+		}
+
+		j->recs = rec;
+		j->max_recs = max_recs;
+	}
+
+	rec = &j->recs[j->n_recs++];
+	rec->type = type;
+	rec->tid = tid;
+	rec->rank = ext2_journal_tid_rank(j, tid);
+	rec->journal_blkno = journal_blkno;
+	rec->fs_blocknr = fs_blocknr;
+	rec->flags = flags;
+	rec->order = 0;
+
+	return 0;
+}
+
+static int ext2_journal_index_class(struct journal_foreach_arg *arg,
+				    struct journal_header_t *h,
+				    void *data,
+				    uint32_t journal_blkno)
+{
+	struct ext2_journal *j = arg->j;
+	uint32_t tid = be32_to_cpu(h->h_sequence);
+	int ret = 0;
+
+	switch (be32_to_cpu(h->h_blocktype)) {
+	case EXT3_JOURNAL_DESCRIPTOR_BLOCK:
+		ret = ext2_journal_add_rec(j, EXT2_JOURNAL_REC_DESCRIPTOR, tid,
+					   journal_blkno, 0, 0);
+		break;
+	case EXT3_JOURNAL_COMMIT_BLOCK:
+		ret = ext2_journal_add_rec(j, EXT2_JOURNAL_REC_COMMIT, tid,
+					   journal_blkno, 0, 0);
+		break;
+	case EXT3_JOURNAL_REVOKE_BLOCK:
+		for (size_t i = 0; ret == 0 && i < journal_revoke_count(arg->sb, h); i++)
+			ret = ext2_journal_add_rec(j, EXT2_JOURNAL_REC_REVOKE,
+					tid, journal_blkno,
+					journal_revoke_blocknr(arg->sb, h, i), 0);
+		break;
+	}
+
+	if (ret < 0) {
+		arg->error = ret;
+		arg->break_next = 1;
+	}
+
+	return ret;
+}
+
+static int ext2_journal_index_desc(struct journal_foreach_arg *arg,
+				   struct journal_header_t *this,
+				   uint64_t fs_blocknr, uint64_t journal_blocknr,
+				   uint32_t flags)
+{
+	int ret;
+
+	ret = ext2_journal_add_rec(arg->j, EXT2_JOURNAL_REC_DATA,
+				   be32_to_cpu(this->h_sequence),
+				   journal_blocknr, fs_blocknr, flags);
+	if (ret < 0)
+		arg->error = ret;
+
+	return ret;
+}
+
+/* the log is a ring buffer between s_first and s_maxlen */
+static uint32_t ext2_journal_log_distance(struct ext2_journal *j,
+					  uint32_t from, uint32_t to)
+{
+	uint32_t first = be32_to_cpu(j->sb->s_first);
+	uint32_t len = j->total_blocks - first;
+
+	return (to + len - from) % len;
+}
+
+static uint32_t ext2_journal_next_log_block(struct ext2_journal *j,
+					    uint32_t blkno)
+{
+	if (++blkno >= j->total_blocks)
+		blkno = be32_to_cpu(j->sb->s_first);
+
+	return blkno;
+}
+
+static int qsort_compare_journal_rec(const void *a, const void *b)
+{
+	const struct ext2_journal_rec *ra = a, *rb = b;
+
+	if (ra->rank != rb->rank)
+		return ra->rank < rb->rank ? -1 : 1;
+	if (ra->order != rb->order)
+		return ra->order < rb->order ? -1 : 1;
+	if (ra->journal_blkno != rb->journal_blkno)
+		return ra->journal_blkno < rb->journal_blkno ? -1 : 1;
+	return 0;
+}
+
+/* sort the data and revoke records by the filesystem block, the records
+ * of the same block are sorted by tid.
+ */
+static int qsort_compare_journal_blkmap(const void *a, const void *b)
+{
+	const struct ext2_journal_rec *ra = *(struct ext2_journal_rec **)a;
+	const struct ext2_journal_rec *rb = *(struct ext2_journal_rec **)b;
+
+	if (ra->fs_blocknr != rb->fs_blocknr)
+		return ra->fs_blocknr < rb->fs_blocknr ? -1 : 1;
+	return ra < rb ? -1 : (ra > rb);
+}
+
+/* the transaction of @recs[0...n] starts at the first block after the
+ * commit block if it is wrapped.
+ */
+static void ext2_journal_index_trans(struct ext2_journal *j,
+				     struct ext2_journal_trans *t,
+				     struct ext2_journal_rec *recs, size_t n)
+{
+	uint32_t start = UINT32_MAX, wrapped = UINT32_MAX;
+
+	memset(t, 0, sizeof(*t));
+	t->tid = recs[0].tid;
+
+	for (size_t i = 0; i < n; i++) {
+		if (recs[i].type == EXT2_JOURNAL_REC_COMMIT)
+			t->commit = recs[i].journal_blkno;
+		else if (recs[i].type == EXT2_JOURNAL_REC_DATA)
+			t->n_data++;
+		else if (recs[i].type == EXT2_JOURNAL_REC_REVOKE)
+			t->n_revoke++;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		uint32_t blkno = recs[i].journal_blkno;
+
+		if (blkno < start)
+			start = blkno;
+		if (t->commit && blkno > t->commit && blkno < wrapped)
+			wrapped = blkno;
+	}
+
+	t->start = wrapped != UINT32_MAX ? wrapped : start;
+
+	for (size_t i = 0; i < n; i++)
+		recs[i].order = ext2_journal_log_distance(j, t->start,
+							  recs[i].journal_blkno);
+}
+
+/* scan the whole journal and build the transaction index */
+static int ext2_journal_build_index(struct ext2_journal *j)
+{
+	struct journal_foreach_arg arg = {
+		.ext			= j->p,
+		.j			= j,
+		.class_handler		= ext2_journal_index_class,
+		.desc_handler		= ext2_journal_index_desc,
+	};
+	size_t n_trans = 0;
+	int ret;
+
+	ret = ext2_foreach_journal(&arg);
+	if (ret < 0)
+		return ret;
+
+	if (j->n_recs == 0)
+		return 0;
+
+	/* group the records by tid */
+	qsort(j->recs, j->n_recs, sizeof(*j->recs), qsort_compare_journal_rec);
+
+	for (size_t i = 0; i < j->n_recs; i++) {
+		if (i == 0 || j->recs[i].tid != j->recs[i - 1].tid)
+			n_trans++;
+	}
+
+	j->trans = calloc(n_trans, sizeof(*j->trans));
+	j->blkmap = calloc(j->n_recs, sizeof(*j->blkmap));
+	if (!j->trans || !j->blkmap) {
+		fprintf(stderr, "Error: alloc %zu journal transactions "
+				"failed\n", n_trans);
+		return -1;
+	}
+
+	for (size_t i = 0, first = 0; i < j->n_recs; i++) {
+		struct ext2_journal_trans *t = &j->trans[j->n_trans];
+
+		if (i + 1 < j->n_recs && j->recs[i + 1].tid == j->recs[i].tid)
+			continue;
+
+		ext2_journal_index_trans(j, t, &j->recs[first], i + 1 - first);
+		t->first_rec = first;
+		t->n_rec = i + 1 - first;
+		j->n_trans++;
+		first = i + 1;
+	}
+
+	/* sort the records in the log order of each transaction */
+	qsort(j->recs, j->n_recs, sizeof(*j->recs), qsort_compare_journal_rec);
+
+	for (size_t i = 0; i < j->n_recs; i++) {
+		struct ext2_journal_rec *rec = &j->recs[i];
+
+		if (rec->type == EXT2_JOURNAL_REC_DATA
+		    || rec->type == EXT2_JOURNAL_REC_REVOKE)
+			j->blkmap[j->n_blkmap++] = rec;
+	}
+
+	qsort(j->blkmap, j->n_blkmap, sizeof(*j->blkmap),
+	      qsort_compare_journal_blkmap);
+
+	return 0;
+}
+
+static struct ext2_journal_trans *
+	ext2_journal_find_trans(struct ext2_journal *j, uint32_t tid)
+{
+	int32_t rank = ext2_journal_tid_rank(j, tid);
+	size_t l = 0, r = j->n_trans;
+
+	while (l < r) {
+		size_t mid = l + (r - l) / 2;
+		int32_t mid_rank = ext2_journal_tid_rank(j, j->trans[mid].tid);
+
+		if (mid_rank == rank)
+			return &j->trans[mid];
+		else if (mid_rank < rank)
+			l = mid + 1;
+		else
+			r = mid;
+	}
+
+	return NULL;
+}
+
+/* the transactions need to replay are started at s_start with tid
+ * s_sequence, and stopped at the first uncommitted one. returns the
+ * number of transactions and saves the first one in @ret_first.
+ */
+static size_t ext2_journal_replay_window(struct ext2_journal *j,
+					 size_t *ret_first)
+{
+	struct ext2_journal_trans *t;
+	uint32_t start = be32_to_cpu(j->sb->s_start);
+	size_t first, n = 0;
+
+	if (start == 0) /* the journal is clean */
+		return 0;
+
+	t = ext2_journal_find_trans(j, be32_to_cpu(j->sb->s_sequence));
+	if (!t || t->start != start)
+		return 0;
+
+	first = t - j->trans;
+	for (size_t i = first; i < j->n_trans; i++) {
+		t = &j->trans[i];
+
+		if (t->commit == 0 || t->start != start)
+			break;
+		if (i > first && t->tid != j->trans[i - 1].tid + 1)
+			break;
+
+		start = ext2_journal_next_log_block(j, t->commit);
+		n++;
+	}
+
+	*ret_first = first;
+	return n;
+}
+
+/* the first record of @fs_blocknr in the blkmap */
+static size_t ext2_journal_blkmap_lower(struct ext2_journal *j,
+				       uint64_t fs_blocknr)
+{
+	size_t l = 0, r = j->n_blkmap;
+
+	while (l < r) {
+		size_t mid = l + (r - l) / 2;
+
+		if (j->blkmap[mid]->fs_blocknr < fs_blocknr)
+			l = mid + 1;
+		else
+			r = mid;
+	}
+
+	return l;
+}
+
+/* the last committed transaction that logged @fs_blocknr */
+static struct ext2_journal_rec *
+	ext2_journal_last_logged(struct ext2_journal *j, uint64_t fs_blocknr)
+{
+	struct ext2_journal_rec *last = NULL;
+
+	for (size_t i = ext2_journal_blkmap_lower(j, fs_blocknr);
+	     i < j->n_blkmap && j->blkmap[i]->fs_blocknr == fs_blocknr; i++) {
+		struct ext2_journal_rec *rec = j->blkmap[i];
+		struct ext2_journal_trans *t;
+
+		if (rec->type != EXT2_JOURNAL_REC_DATA)
+			continue;
+
+		t = ext2_journal_find_trans(j, rec->tid);
+		if (t && t->commit)
+			last = rec;
+	}
+
+	return last;
+}
+
+/* the rank range of the transactions need to replay, returns false if
+ * the journal is clean.
+ */
+static bool ext2_journal_replay_ranks(struct ext2_journal *j,
+				      int32_t *ret_first, int32_t *ret_last)
+{
+	size_t first, n;
+
+	n = ext2_journal_replay_window(j, &first);
+	if (n == 0)
+		return false;
+
+	*ret_first = ext2_journal_tid_rank(j, j->trans[first].tid);
+	*ret_last = ext2_journal_tid_rank(j, j->trans[first + n - 1].tid);
+	return true;
+}
+
+/* find the newest copy and the newest revoke of the block at @idx of the
+ * blkmap in the transactions need to replay. the copy is replayed only if
+ * it is logged after the revoke, the same as jbd2_journal_test_revoke.
+ * returns the index of the next block.
+ */
+static size_t ext2_journal_resolve_block(struct ext2_journal *j, size_t idx,
+					 int32_t first_rank, int32_t last_rank,
+					 struct ext2_journal_rec **ret_data,
+					 struct ext2_journal_rec **ret_revoke)
+{
+	uint64_t fs_blocknr = j->blkmap[idx]->fs_blocknr;
+	struct ext2_journal_rec *data = NULL, *revoke = NULL;
+
+	for (; idx < j->n_blkmap && j->blkmap[idx]->fs_blocknr == fs_blocknr;
+	     idx++) {
+		struct ext2_journal_rec *rec = j->blkmap[idx];
+
+		if (rec->rank < first_rank || rec->rank > last_rank)
+			continue;
+
+		if (rec->type == EXT2_JOURNAL_REC_REVOKE) {
+			if (!revoke || rec->rank > revoke->rank)
+				revoke = rec;
+		} else if (!data || rec->rank >= data->rank) {
+			data = rec;
+		}
+	}
+
+	*ret_data = data;
+	*ret_revoke = revoke;
+	return idx;
+}
+
+static bool ext2_journal_will_replay(struct ext2_journal_rec *data,
+				     struct ext2_journal_rec *revoke)
+{
+	return data && (!revoke || data->rank > revoke->rank);
+}
+
+/* call @fn with the newest copy of each block need to replay, the blocks
+ * revoked by the same or later transaction are skipped.
+ */
+static int ext2_journal_foreach_pending(struct ext2_journal *j,
+			int (*fn)(void *arg, struct ext2_journal_rec *rec),
+			void *arg)
+{
+	int32_t first_rank, last_rank;
+
+	if (!ext2_journal_replay_ranks(j, &first_rank, &last_rank))
+		return 0;
+
+	for (size_t i = 0; i < j->n_blkmap; ) {
+		struct ext2_journal_rec *data, *revoke;
+
+		i = ext2_journal_resolve_block(j, i, first_rank, last_rank,
+					       &data, &revoke);
+		if (ext2_journal_will_replay(data, revoke)) {
+			int ret = fn(arg, data);
+
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int ext2_do_journal_list(struct ext2_journal *j)
+{
+	struct journal_foreach_arg arg = {
+		.ext			= j->p,
+		.j			= j,
+		.class_handler		= ext2_journal_print_class,
+		.desc_handler		= ext2_journal_print_desc,
+	};
+
+	return ext2_foreach_journal(&arg);
+}
+
+static int ext2_do_journal_superblock(struct ext2_journal *j)
+{
+	structure_print("%-30s", j->sb_buf, ext4_journal_header_structure);
+
+	structure_print("%-30s", j->sb, ext4_journal_sblock_structure);
+	return 0;
+}
+
+static int ext2_do_journal_block(int argc, char **argv, struct ext2_journal *j)
+{
+	uint32_t blkno;
+	void *blk;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: journal block #blkno\n");
+		return -1;
+	}
+
+	blkno = (uint32_t)strtoul(argv[1], NULL, 0);
+	if (blkno >= j->total_blocks) {
+		fprintf(stderr, "Error: journal blk #%d overrange\n", blkno);
+		return -1;
+	}
+
+	blk = ext2_journal_block(j, blkno);
+	if (!blk)
+		return -1;
+
+	hexdump(blk, j->p->block_size, 0);
+	return 0;
+}
+
+static int ext2_do_journal_trans(struct ext2_journal *j)
+{
+	size_t first = 0, n;
+	int ret;
+
+	ret = ext2_journal_build_index(j);
+	if (ret < 0)
+		return ret;
+
+	n = ext2_journal_replay_window(j, &first);
+
+	for (size_t i = 0; i < j->n_trans; i++) {
+		struct ext2_journal_trans *t = &j->trans[i];
+
+		if (get_verbose_level() == 0
+		    && ext2_journal_tid_rank(j, t->tid) < 0)
+			continue;
+
+		printf("Transaction %-6u start #%-5u ", t->tid, t->start);
+		if (t->commit)
+			printf("commit #%-5u ", t->commit);
+		else
+			printf("%-13s ", "uncommitted");
+		printf("data %-5zu revoke %-5zu", t->n_data, t->n_revoke);
+		if (i >= first && i < first + n)
+			printf(" pending");
+		printf("\n");
+	}
+
+	return 0;
+}
+
+static int ext2_journal_print_pending(void *arg, struct ext2_journal_rec *rec)
+{
+	printf("FS blocknr %-8" PRIu64 " from journal block %-5u tid %u%s\n",
+	       rec->fs_blocknr, rec->journal_blkno, rec->tid,
+	       rec->flags & EXT3_JOURNAL_FLAG_ESCAPE ? " (escaped)" : "");
+	return 0;
+}
+
+static int ext2_do_journal_pending(struct ext2_journal *j)
+{
+	int ret;
+
+	ret = ext2_journal_build_index(j);
+	if (ret < 0)
+		return ret;
+
+	return ext2_journal_foreach_pending(j, ext2_journal_print_pending, NULL);
+}
+
+static int ext2_do_journal_lookup(int argc, char **argv, struct ext2_journal *j)
+{
+	int32_t first_rank, last_rank;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: journal lookup #fs_blocknr...\n");
+		return -1;
+	}
+
+	ret = ext2_journal_build_index(j);
+	if (ret < 0)
+		return ret;
+
+	if (!ext2_journal_replay_ranks(j, &first_rank, &last_rank)) {
+		/* nothing is replayed, all records are skipped */
+		first_rank = INT32_MAX;
+		last_rank = INT32_MIN;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		uint64_t fs_blocknr = strtoull(argv[i], NULL, 0);
+		struct ext2_journal_rec *data = NULL, *revoke = NULL;
+		size_t idx = ext2_journal_blkmap_lower(j, fs_blocknr);
+
+		if (idx < j->n_blkmap && j->blkmap[idx]->fs_blocknr == fs_blocknr)
+			ext2_journal_resolve_block(j, idx, first_rank, last_rank,
+						   &data, &revoke);
+
+		printf("FS blocknr %-8" PRIu64, fs_blocknr);
+
+		/* the copies out of the replay window are checkpointed */
+		if (!data && !revoke) {
+			data = ext2_journal_last_logged(j, fs_blocknr);
+			if (data)
+				printf(" logged by tid %u at journal block %u, "
+				       "checkpointed\n",
+				       data->tid, data->journal_blkno);
+			else
+				printf(" is not logged\n");
+			continue;
+		}
+
+		if (data)
+			printf(" logged by tid %u at journal block %u",
+			       data->tid, data->journal_blkno);
+		if (revoke)
+			printf("%s revoked by tid %u", data ? "," : "",
+			       revoke->tid);
+		printf(", %s\n", ext2_journal_will_replay(data, revoke)
+				  ? "will be replayed" : "not replayed");
+	}
+
+	return 0;
+}
+
+static int ext2_do_journal(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	struct ext2_journal j;
+	int ret = -1;
+
+	ret = ext2_journal_open(p, &j);
+	if (ret < 0)
+		return ret;
+
+	if (argc <= 1)
+		ret = ext2_do_journal_list(&j);
+	else if (!strcmp(argv[1], "sblock"))
+		ret = ext2_do_journal_superblock(&j);
+	else if (!strcmp(argv[1], "block"))
+		ret = ext2_do_journal_block(argc - 1, argv + 1, &j);
+	else if (!strcmp(argv[1], "trans"))
+		ret = ext2_do_journal_trans(&j);
+	else if (!strcmp(argv[1], "pending"))
+		ret = ext2_do_journal_pending(&j);
+	else if (!strcmp(argv[1], "lookup"))
+		ret = ext2_do_journal_lookup(argc - 1, argv + 1, &j);
+	else {
+		fprintf(stderr, "Error: unknown journal command %s\n", argv[1]);
+		ret = -1;
+	}
+
+	ext2_journal_close(&j);
+	return ret;
+}
+
+/* the journal blocks are saved in the journal inode */
+static int ext2_journal_bmap(struct ext2_journal *j, uint32_t jblk,
+			     uint64_t *ret_pblk)
+{
+	size_t i = ext2_journal_find_run(j, jblk);
+
+	if (i >= j->n_runs || j->runs[i].lblk > jblk) {
+		fprintf(stderr, "Error: journal block #%u is a hole\n", jblk);
+		return -1;
+	}
+
+	*ret_pblk = j->runs[i].pblk + (jblk - j->runs[i].lblk);
+	return 0;
+}
+
+struct ext2_replay_builder {
+	struct ext2_editor_private_data	*p;
+	struct ext2_journal		*j;
+};
+
+/* the pending blocks are sorted by fs_blocknr */
+static int ext2_overlay_add(void *arg, struct ext2_journal_rec *rec)
+{
+	struct ext2_replay_builder *builder = arg;
+	struct ext2_editor_private_data *p = builder->p;
+	struct ext2_overlay_block *ob;
+	uint64_t pblk;
+
+	if (rec->fs_blocknr >= ext2_total_blocks(&p->sblock)) {
+		fprintf(stderr, "Error: journal block #%u logged an overrange "
+				"block #%" PRIu64 "\n",
+			rec->journal_blkno, rec->fs_blocknr);
+		return -1;
+	}
+
+	if (ext2_journal_bmap(builder->j, rec->journal_blkno, &pblk) < 0)
+		return -1;
+
+	if (p->n_overlay >= p->max_overlay) {
+		size_t max_overlay = p->max_overlay ? p->max_overlay * 2 : 256;
+
+		ob = realloc(p->overlay, max_overlay * sizeof(*ob));
+		if (!ob) {
+			fprintf(stderr, "Error: alloc %zu overlay blocks "
+					"failed\n", max_overlay);
+			return -1;
+		}
+
+		p->overlay = ob;
+		p->max_overlay = max_overlay;
+	}
+
+	ob = &p->overlay[p->n_overlay++];
+	ob->fs_blocknr = rec->fs_blocknr;
+	ob->pblk = pblk;
+	ob->escaped = !!(rec->flags & EXT3_JOURNAL_FLAG_ESCAPE);
+
+	return 0;
+}
+
+/* the super block, group descriptors and bitmaps maybe logged in the
+ * journal, load them again through the overlay.
+ */
+static int ext2_reload_metadata(struct ext2_editor_private_data *p)
+{
+	struct ext2_sblock *sblock;
+	uint8_t *blk;
+	int ret = -1;
+
+	blk = malloc(p->block_size + SUPERBLOCK_SIZE);
+	if (!blk)
+		return ret;
+
+	ret = ext2_read_blocks(p, SUPERBLOCK_START / p->block_size, 1, blk,
+			       p->block_size);
+	if (ret < 0)
+		goto done;
+
+	sblock = (struct ext2_sblock *)(blk + SUPERBLOCK_START % p->block_size);
+	ret = ext2_check_sblock(&p->crc32c_le, 1, sblock);
+	if (ret < 0)
+		goto done;
+
+	if (ext2_total_blocks(sblock) != ext2_total_blocks(&p->sblock)
+	    || sblock->log2_block_size != p->sblock.log2_block_size
+	    || sblock->blocks_per_group != p->sblock.blocks_per_group
+	    || sblock->inodes_per_group != p->sblock.inodes_per_group) {
+		fprintf(stderr, "Error: the filesystem is resized in the "
+				"journal\n");
+		ret = -1;
+		goto done;
+	}
+
+	memcpy(&p->sblock, sblock, sizeof(p->sblock));
+
+	ret = ext2_load_block_groups(p, 1);
+	if (ret < 0)
+		goto done;
+
+	ext2_free_bitmasks(p);
+	ret = ext2_alloc_bitmasks(p);
+	if (ret < 0)
+		goto done;
+
+	/* drop the inode table caches */
+	pthread_mutex_lock(&p->itable_lock);
+	for (size_t i = 0; i < p->n_block_group; i++) {
+		free(p->itables[i].buf);
+		memset(&p->itables[i], 0, sizeof(p->itables[i]));
+	}
+	list_init(&p->itable_lru);
+	p->itable_cache_size = 0;
+	pthread_mutex_unlock(&p->itable_lock);
+
+	free(p->rmap);
+	p->rmap = NULL;
+	p->n_rmap = p->max_rmap = 0;
+	p->rmap_loaded = false;
+
+	ret = ext2_read_inode(p, EXT2_ROOT_INO, &p->root_inode);
+done:
+	free(blk);
+	return ret;
+}
+
+/* replay the committed transactions through a copy-on-write overlay, the
+ * image is not touched. returns the number of replayed transactions and
+ * saves the last tid in @ret_last_tid.
+ */
+static int ext2_replay_journal(struct ext2_editor_private_data *p,
+			       struct ext2_journal *j, uint32_t *ret_last_tid)
+{
+	struct ext2_replay_builder builder = { .p = p, .j = j };
+	size_t first = 0, n;
+	int ret;
+
+	ret = ext2_journal_build_index(j);
+	if (ret < 0)
+		return ret;
+
+	n = ext2_journal_replay_window(j, &first);
+	if (n == 0)
+		return 0;
+
+	ret = ext2_journal_foreach_pending(j, ext2_overlay_add, &builder);
+	if (ret < 0)
+		goto failed;
+
+	ret = ext2_reload_metadata(p);
+	if (ret < 0)
+		goto failed;
+
+	*ret_last_tid = j->trans[first + n - 1].tid;
+	return n;
+
+failed:
+	free(p->overlay);
+	p->overlay = NULL;
+	p->n_overlay = p->max_overlay = 0;
+	return ret;
+}
+
+static int ext2_load_replay_overlay(struct ext2_editor_private_data *p)
+{
+	struct ext2_journal j;
+	uint32_t last_tid;
+	int ret;
+
+	if (!ext2_has_incompat_feature(&p->sblock, EXT4_FEATURE_INCOMPAT_RECOVER))
+		return 0;
+
+	ret = ext2_journal_open(p, &j);
+	if (ret < 0)
+		return ret;
+
+	ret = ext2_replay_journal(p, &j, &last_tid);
+	ext2_journal_close(&j);
+
+	return ret < 0 ? ret : 0;
+}
+
+/* mark the journal empty and clear needs_recovery, the same as e2fsck
+ * after replaying.
+ */
+static int ext2_replay_clear_recover(struct ext2_editor_private_data *p,
+				     struct ext2_journal *j, int fd_out,
+				     int replayed, uint32_t last_tid)
+{
+	struct journal_header_t *h = (struct journal_header_t *)j->sb_buf;
+	struct ext2_sblock sblock;
+	uint64_t pblk;
+
+	if (pread64(fd_out, &sblock, sizeof(sblock), SUPERBLOCK_START)
+			!= sizeof(sblock))
+		return -1;
+
+	sblock.feature_incompat &= cpu_to_le32(~EXT4_FEATURE_INCOMPAT_RECOVER);
+	if (ext2_has_sblock_csum(&sblock)) {
+		libcrc32_init_seed(&p->crc32c_le, 0xffffffff);
+		libcrc32_update(&p->crc32c_le, &sblock,
+				offsetof(struct ext2_sblock, checksum));
+		sblock.checksum = cpu_to_le32(libcrc32_finish(&p->crc32c_le));
+	}
+
+	if (pwrite64(fd_out, &sblock, sizeof(sblock), SUPERBLOCK_START)
+			!= sizeof(sblock))
+		return -1;
+
+	/* the next transaction is started after the replayed one */
+	if (replayed > 0)
+		j->sb->s_sequence = cpu_to_be32(last_tid + 2);
+	j->sb->s_start = 0;
+
+	if (be32_to_cpu(j->sb->s_feature_incompat) & JBD2_FEATURE_INCOMPAT_CSUM_V2_3) {
+		__be32 *csum = (__be32 *)(j->sb_buf + JBD2_SUPERBLOCK_CSUM_OFFSET);
+
+		*csum = 0;
+		libcrc32_init_seed(&p->crc32c_le, 0xffffffff);
+		libcrc32_update(&p->crc32c_le, h, JBD2_SUPERBLOCK_SIZE);
+		*csum = cpu_to_be32(libcrc32_finish(&p->crc32c_le));
+	}
+
+	if (ext2_journal_bmap(j, EXT2_JOURNAL_SUPERBLOCK, &pblk) < 0)
+		return -1;
+
+	if (pwrite64(fd_out, j->sb_buf, JBD2_SUPERBLOCK_SIZE,
+		     (off64_t)pblk * p->block_size) != JBD2_SUPERBLOCK_SIZE)
+		return -1;
+
+	return 0;
+}
+
+/* write a recovered image, the committed transactions in the journal
+ * are applied.
+ */
+static int ext2_do_replay(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	uint64_t total_size = ext2_total_size(p, fd);
+	struct ext2_journal j;
+	uint32_t last_tid = 0;
+	int ret, replayed = 0, fd_out;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: replay output.img\n");
+		return -1;
+	}
+
+	ret = ext2_journal_open(p, &j);
+	if (ret < 0)
+		return ret;
+
+	if (p->n_overlay == 0 &&
+	    ext2_has_incompat_feature(&p->sblock, EXT4_FEATURE_INCOMPAT_RECOVER)) {
+		replayed = ext2_replay_journal(p, &j, &last_tid);
+		if (replayed < 0) {
+			ext2_journal_close(&j);
+			return replayed;
+		}
+	}
+
+	fd_out = fileopen(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd_out < 0) {
+		ext2_journal_close(&j);
+		return fd_out;
+	}
+
+	if (pdd64(p->fd, fd_out, 0, 0, total_size) != total_size) {
+		fprintf(stderr, "Error: copy image to %s failed\n", argv[1]);
+		ret = -1;
+		goto done;
+	}
+
+	ret = ext2_overlay_patch(p, fd_out, 0, ext2_total_blocks(&p->sblock),
+				 0, total_size);
+	if (ret < 0)
+		goto done;
+
+	ret = ext2_replay_clear_recover(p, &j, fd_out, replayed, last_tid);
+	if (ret < 0) {
+		fprintf(stderr, "Error: clear needs_recovery of %s failed\n",
+			argv[1]);
+		goto done;
+	}
+
+	printf("%d transactions and %zu blocks replayed\n", replayed,
+	       p->n_overlay);
+done:
+	close(fd_out);
+	ext2_journal_close(&j);
+	return ret;
+}
+
+static int ext2_do_orphan(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	uint32_t total_inodes = le32_to_cpu(p->sblock.total_inodes);
+
+	for (uint32_t i = 1; i < total_inodes; i++) {
+		struct ext2_inode inode;
+		uint32_t dtime;
+		int ret;
+
+		ret = ext2_read_inode(p, i, &inode);
+		if (ret < 0) {
+			fprintf(stderr, "Warnning: scan not completed. "
+					"%d/%d\n",
+				i, total_inodes);
+			break;
+		}
+
+		if (be16_to_cpu(inode.nlinks)) /* inode was alive */
+			continue;
+
+		dtime = le32_to_cpu(inode.dtime);
+		if (dtime && dtime < total_inodes)
+			printf("inode #%-6d in orphan list\n", i);
+	}
+
+	return 0;
+}
+
+static int ext2_do_layout(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+
+	printf("%8s %8s %8s\n", "start", "end", "blocks");
+	for (size_t i = 0; i < p->n_layout; i++) {
+		struct disk_layout *layout = &p->layouts[i];
+		char s[256];
+
+		if (layout->major_type < 0
+			|| layout->major_type >= DISK_LAYOUT_MAX)
+			return -1;
+
+		printf("%8" PRIu64 " %8" PRIu64 " %8" PRIu64 " ",
+			layout->start_block,
+			layout->start_block + layout->len_block - 1,
+			layout->len_block);
+
+		format_disk_layout(layout, s, sizeof(s));
+		printf("%s", s);
+
+		printf("\n");
+	}
+
+	return 0;
+}
+
+struct ext2_layout_map_run {
+	uint64_t			start;
+	uint64_t			len;
+	const char			*role;
+};
+
+static void ext2_layout_map_flush(struct ext2_layout_map_run *run)
+{
+	if (run->len > 0)
+		printf("%8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %s\n",
+			run->start, run->start + run->len - 1, run->len,
+			run->role);
+
+	run->len = 0;
+}
+
+/* merge the continuous blocks with the same role */
+static void ext2_layout_map_add(struct ext2_layout_map_run *run,
+				uint64_t start, uint64_t len, const char *role)
+{
+	if (run->len > 0 && run->start + run->len == start
+	    && !strcmp(run->role, role)) {
+		run->len += len;
+		return;
+	}
+
+	ext2_layout_map_flush(run);
+	run->start = start;
+	run->len = len;
+	run->role = role;
+}
+
+/* classify the blocks in [@blkno, @end) which are not metadata by the block
+ * bitmap, return the first block has different role.
+ */
+static uint64_t ext2_layout_map_data(struct ext2_editor_private_data *p,
+				     struct ext2_layout_map_run *run,
+				     uint64_t blkno, uint64_t end)
+{
+	uint32_t first_data_block = le32_to_cpu(p->sblock.first_data_block);
+	uint32_t bpg = le32_to_cpu(p->sblock.blocks_per_group);
+	struct ext2_block_group *bgrp;
+	uint64_t group, bit, group_end;
+	struct bitmask *b;
+	ssize_t next;
+	int used;
+
+	if (blkno < first_data_block) {
+		if (end > first_data_block)
+			end = first_data_block;
+		ext2_layout_map_add(run, blkno, end - blkno, "reserved");
+		return end;
+	}
+
+	group = (blkno - first_data_block) / bpg;
+	bit = (blkno - first_data_block) % bpg;
+	group_end = first_data_block + (group + 1) * bpg;
+	if (end > group_end)
+		end = group_end;
+
+	bgrp = &p->block_groups[group];
+	b = p->data_block_bitmask[group];
+
+	/* the block bitmap is not initialized */
+	if (ext2_has_block_group_csum(&p->sblock) &&
+	    (le16_to_cpu(bgrp->bg_flags) & EXT4_BG_BLOCK_UNINIT)) {
+		ext2_layout_map_add(run, blkno, end - blkno, "free");
+		return end;
+	}
+
+	used = bitmask_get(b, bit) > 0;
+	next = used ? bitmask_next_zero(b, bit) : bitmask_next_one(b, bit);
+	if (next >= 0 && first_data_block + group * bpg + next < end)
+		end = first_data_block + group * bpg + next;
+
+	ext2_layout_map_add(run, blkno, end - blkno, used ? "data" : "free");
+	return end;
+}
+
+/* show the role of all blocks, one line for each continuous range */
+static int ext2_do_layout_map(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	uint64_t total_blocks = ext2_total_blocks(&p->sblock);
+	struct ext2_layout_map_run run = { .len = 0 };
+	uint64_t blkno = 0;
+	size_t i = 0;
+
+	printf("%8s %8s %8s\n", "start", "end", "blocks");
+
+	while (blkno < total_blocks) {
+		struct disk_layout *layout = i < p->n_layout ? &p->layouts[i] : NULL;
+		uint64_t end = total_blocks;
+		char s[256];
+
+		if (layout && layout->start_block <= blkno) {
+			end = layout->start_block + layout->len_block;
+			i++;
+
+			if (end <= blkno) /* bad layout */
+				continue;
+			if (end > total_blocks)
+				end = total_blocks;
+
+			ext2_layout_map_flush(&run);
+			run.start = blkno;
+			run.len = end - blkno;
+			run.role = format_disk_layout(layout, s, sizeof(s));
+			ext2_layout_map_flush(&run);
+
+			blkno = end;
+			continue;
+		}
+
+		if (layout && layout->start_block < end)
+			end = layout->start_block;
+
+		blkno = ext2_layout_map_data(p, &run, blkno, end);
+	}
+
+	ext2_layout_map_flush(&run);
+	return 0;
+}
+
+/* the blocks are specified as "#blkno" or "#start-#end" */
+static int parse_block_range(const char *s, uint64_t *start, uint64_t *end)
+{
+	char *endp;
+
+	*start = strtoull(s, &endp, 0);
+	if (endp == s)
+		return -1;
+
+	*end = *start;
+	if (*endp == '-') {
+		s = endp + 1;
+		*end = strtoull(s, &endp, 0);
+		if (endp == s)
+			return -1;
+	}
+
+	if (*endp != '\0' || *end < *start)
+		return -1;
+
+	return 0;
+}
+
+static void ext2_whohas_print(uint64_t start, uint64_t end, const char *who)
+{
+	if (start == end)
+		printf("%" PRIu64 ": %s\n", start, who);
+	else
+		printf("%" PRIu64 "-%" PRIu64 ": %s\n", start, end, who);
+}
+
+/* show the owners of blocks [@start, @end], one line for each owner */
+static int ext2_whohas_range(struct ext2_editor_private_data *p,
+			     uint64_t start, uint64_t end)
+{
+	if (end >= ext2_total_blocks(&p->sblock)) {
+		fprintf(stderr, "Error: block #%" PRIu64 " is out of range\n",
+			end);
+		return -1;
+	}
+
+	while (start <= end) {
+		const struct disk_layout *layout;
+		const struct ext2_rmap_entry *e;
+		uint64_t next = end + 1, n;
+		char s[256];
+
+		layout = ext2_editor_disk_layout_match_block(p, start);
+		if (layout) {
+			n = layout->start_block + layout->len_block;
+			format_disk_layout(layout, s, sizeof(s));
+		} else if ((e = ext2_rmap_lookup(p, start, &n)) != NULL) {
+			n = e->start + e->len;
+			snprintf(s, sizeof(s), "inode #%u", e->ino);
+		} else {
+			size_t i = ext2_editor_disk_layout_upper(p, start);
+
+			if (i < p->n_layout && p->layouts[i].start_block < n)
+				n = p->layouts[i].start_block;
+			snprintf(s, sizeof(s), "none");
+		}
+
+		if (n < next)
+			next = n;
+
+		ext2_whohas_print(start, next - 1, s);
+		start = next;
+	}
+
+	return 0;
+}
+
+/* the block list file has one block or block range in each line,
+ * the text after '#' is comment.
+ */
+static int ext2_whohas_file(struct ext2_editor_private_data *p,
+			    const char *filename)
+{
+	size_t linesz = 0;
+	char *line = NULL;
+	int ret = 0;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "Error: open %s failed: %m\n", filename);
+		return -1;
+	}
+
+	while (getline(&line, &linesz, fp) >= 0) {
+		uint64_t start, end;
+		char *s = line, *e;
+
+		line[strcspn(line, "#\r\n")] = '\0';
+		while (*s == ' ' || *s == '\t')
+			s++;
+
+		e = s + strlen(s);
+		while (e > s && (e[-1] == ' ' || e[-1] == '\t'))
+			*--e = '\0';
+
+		if (*s == '\0')
+			continue;
+
+		if (parse_block_range(s, &start, &end) < 0) {
+			fprintf(stderr, "Error: bad block range %s\n", s);
+			ret = -1;
+			continue;
+		}
+
+		if (ext2_whohas_range(p, start, end) < 0)
+			ret = -1;
+	}
+
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+/* whohas [--cache rmap.cache] [--file blocks.txt] #blkno|#start-#end ... */
+static int ext2_do_whohas(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	const char *cache = NULL, *listfile = NULL;
+	const struct disk_layout *layout;
+	uint64_t start = 0, end = 0;
+	int n_ranges = 0;
+	int ret = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--cache") && i + 1 < argc) {
+			cache = argv[++i];
+		} else if (!strcmp(argv[i], "--file") && i + 1 < argc) {
+			listfile = argv[++i];
+		} else if (parse_block_range(argv[i], &start, &end) < 0) {
+			fprintf(stderr, "Error: bad block range %s\n", argv[i]);
+			return -1;
+		} else {
+			n_ranges++;
+		}
+	}
+
+	if (n_ranges == 0 && !listfile) {
+		fprintf(stderr, "Usage: ext2 whohas [--cache rmap.cache] "
+				"[--file blocks.txt] #blkno|#start-#end ...\n");
+		return -1;
+	}
+
+	ret = ext2_rmap_load(p, cache);
+	if (ret < 0)
+		return ret;
+
+	/* only one block */
+	if (n_ranges == 1 && !listfile && start == end) {
+		int ino = -1;
+
+		layout = ext2_editor_disk_layout_match_block(p, start);
+		if (layout) {
+			char s[256];
+
+			format_disk_layout(layout, s, sizeof(s));
+			printf("%s\n", s);
+			return 0;
+		}
+
+		ret = ext2_whohas_blkno(p, start, &ino);
+		if (!ret) {
+			printf("inode #%d\n", ino);
+			return ret;
+		}
+
+		return -1;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--cache") || !strcmp(argv[i], "--file")) {
+			i++;
+			continue;
+		}
+
+		parse_block_range(argv[i], &start, &end);
+		if (ext2_whohas_range(p, start, end) < 0)
+			ret = -1;
+	}
+
+	if (listfile && ext2_whohas_file(p, listfile) < 0)
+		ret = -1;
+
+	return ret;
+}
+
+#ifdef CONFIG_ENABLE_ANDROID
+static int ext2_write_sparse_chunk(int fd_target,
+				   struct android_sparse_chunk *chunk,
+				   void *private_data)
+{
+	off64_t target_offset = lseek64(fd_target, 0, SEEK_CUR);
+	struct ext2_editor_private_data *p = private_data;
+
+	dd64(p->fd, fd_target,
+		(off64_t)chunk->fs_blocknr * p->block_size,
+		target_offset,
+		(off64_t)chunk->count * p->block_size,
+		NULL, NULL);
+
+	if (p->n_overlay > 0)
+		return ext2_overlay_patch(p, fd_target, chunk->fs_blocknr,
+					  chunk->count, target_offset,
+					  (uint64_t)chunk->count * p->block_size);
+	return 0;
+}
+
+static int ext2_do_sparse(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	struct android_sparse_input input;
+	const char *output = NULL;
+	int ret = -1, fd_target;
+	int mismatch = 0;
+	bool verify = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--verify"))
+			verify = true;
+		else
+			output = argv[i];
+	}
+
+	if (!output) {
+		fprintf(stderr, "Usage: sparse [--verify] output.simg\n");
+		return -1;
+	}
+
+	fd_target = fileopen(output, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd_target < 0)
+		goto done;
+
+	android_sparse_init(&input, p->block_size,
+			    ext2_total_blocks(&p->sblock));
+
+	/* appending meta data */
+	for (size_t i = 0; i < p->n_layout; i++) {
+		struct disk_layout *layout = &p->layouts[i];
+
+		android_sparse_add_chunk(&input, layout->start_block,
+					 layout->len_block);
+	}
+
+	ext2_add_bitmap_chunks(p, &input);
+
+	/* the inodes are walked only when verifying since it is slow */
+	if (verify) {
+		mismatch = ext2_verify_inode_chunks(p, &input);
+		if (mismatch > 0)
+			fprintf(stderr, "Error: %d block runs are used by inodes "
+					"but not marked in the block bitmap\n",
+				mismatch);
+	}
+
+	if (input.error) {
+		fprintf(stderr, "Error: add sparse chunks failed. "
+				"(no enough memory?)\n");
+		goto done;
+	}
+
+	ret = android_sparse_finish(&input, fd_target,
+				    ext2_write_sparse_chunk, p);
+	if (ret == 0 && mismatch > 0)
+		ret = -1;
+done:
+	close(fd_target);
+	return ret;
+}
+#endif
+
+/* https://blogs.oracle.com/linux/post/the-resize-inode-in-the-ext4-filesystem */
+static int ext2_do_resize_inode(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	struct ext2_inode inode;
+	uint32_t *dind_buf;
+	uint32_t dind;
+	int ret;
+
+	if (!(le32_to_cpu(p->sblock.feature_compatibility)
+		& EXT4_FEATURE_COMPAT_RESIZE_INODE)) {
+		fprintf(stderr, "No EXT4_FEATURE_COMPAT_RESIZE_INODE\n");
+		return 0;
+	}
+
+	if (!ext2_has_ro_compat_feature(&p->sblock, EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+		fprintf(stderr, "No EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER\n");
+		return 0;
+	}
+
+	ret = ext2_read_inode(p, EXT2_RESIZE_INO, &inode);
+	if (ret < 0)
+		return ret;
+
+	dind = le32_to_cpu(inode.b.blocks.double_indir_block);
+	if (dind == 0) {
+		fprintf(stderr, "Error: double_indir_block in inode 7 is zero\n");
+		return -1;
+	}
+
+	dind_buf = ext2_alloc_read_block(p, dind);
+	if (!dind_buf) {
+		fprintf(stderr, "Error: raad dind block #%d failed\n", dind);
+		return -1;
+	}
+
+	printf("DIND block is: #%d\n", dind);
+
+	printf("%4s  ", " ");
+	for (size_t group = 1; group < p->n_block_group;) {
+		char s[32];
+
+		snprintf(s, sizeof(s), "group%zu", group);
+		printf("%8s ", s);
+
+		group = next_sparse_super_block_number(group);
+	}
+	printf("\n");
+
+	for (uint32_t i = 0; i < p->block_size / sizeof(uint32_t); i++) {
+		uint32_t *ind, ind_blk = dind_buf[i];
+
+		if (ind_blk == 0)
+			continue;
+
+		ind = ext2_alloc_read_block(p, dind_buf[i]);
+		if (!ind) {
+			fprintf(stderr, "Error: read ind block #%d failed\n",
+				dind_buf[i]);
+			free(dind_buf);
+			return -1;
+		}
+
+		printf("%4d: ", i);
+
+		for (uint32_t j = 0; j < p->block_size / sizeof(uint32_t); j++) {
+			uint32_t blk = le32_to_cpu(ind[j]);
+
+			if (blk == 0)
+				break;
+
+			printf("%8d ", blk);
+		}
+
+		printf("\n");
+		free(ind);
+	}
+
+	free(dind_buf);
+	return 0;
+}
+
+/* verify the metadata_csum checksums, one work for each block group */
+struct ext2_fsck_csum_ctx {
+	struct ext2_editor_private_data	*p;
+	pthread_mutex_t			lock;
+	uint64_t			checked;
+	uint64_t			errors;
+};
+
+struct ext2_fsck_csum_work {
+	struct ext2_fsck_csum_ctx	*ctx;
+	uint32_t			group;
+	uint64_t			checked;
+	uint64_t			errors;
+
+	/* the crc table is not shared between threads */
+	struct libcrc32			crc;
+	uint8_t				*blk;
+};
+
+static uint32_t ext2_csum(struct libcrc32 *crc, uint32_t seed,
+			  const void *buf, size_t len)
+{
+	libcrc32_init_seed(crc, seed);
+	libcrc32_update(crc, buf, len);
+	return libcrc32_finish(crc);
+}
+
+/* @ino is zero for the group metadata */
+static void ext2_fsck_csum_report(struct ext2_fsck_csum_work *w,
+				  uint32_t ino, uint64_t blkno, const char *msg)
+{
+	struct ext2_fsck_csum_ctx *ctx = w->ctx;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ino)
+		printf("inode #%u: ", ino);
+	else
+		printf("group %u: ", w->group);
+	printf("block #%" PRIu64 ": %s\n", blkno, msg);
+	pthread_mutex_unlock(&ctx->lock);
+
+	w->errors++;
+}
+
+static void ext2_fsck_csum_check(struct ext2_fsck_csum_work *w,
+				 uint32_t ino, const char *what,
+				 uint64_t blkno, uint32_t calc, uint32_t stored)
+{
+	char msg[128];
+
+	w->checked++;
+	if (calc == stored)
+		return;
+
+	snprintf(msg, sizeof(msg), "bad %s checksum 0x%08x (expected 0x%08x)",
+		 what, stored, calc);
+	ext2_fsck_csum_report(w, ino, blkno, msg);
+}
+
+static void ext2_fsck_csum_bitmaps(struct ext2_fsck_csum_work *w,
+				   struct ext2_block_group *bgrp)
+{
+	struct ext2_editor_private_data *p = w->ctx->p;
+	uint16_t flags = le16_to_cpu(bgrp->bg_flags);
+	uint32_t calc, stored;
+	uint64_t blkno;
+
+	if (!(flags & EXT4_BG_BLOCK_UNINIT)) {
+		blkno = ext2_bg_block_bitmap(p, bgrp);
+		if (ext2_read_blocks(p, blkno, 1, w->blk, p->block_size) < 0) {
+			w->errors++;
+		} else {
+			calc = ext2_csum(&w->crc, p->csum_seed, w->blk,
+				le32_to_cpu(p->sblock.fragments_per_group) / 8);
+			stored = le16_to_cpu(bgrp->bg_block_id_csum);
+			if (p->descriptor_size >= EXT4_MIN_DESC_SIZE_64BIT)
+				stored |= le16_to_cpu(bgrp->bg_block_id_csum_high) << 16;
+			else
+				calc &= 0xffff;
+
+			ext2_fsck_csum_check(w, 0, "block bitmap", blkno,
+					     calc, stored);
+		}
+	}
+
+	if (!(flags & EXT4_BG_INODE_UNINIT)) {
+		blkno = ext2_bg_inode_bitmap(p, bgrp);
+		if (ext2_read_blocks(p, blkno, 1, w->blk, p->block_size) < 0) {
+			w->errors++;
+		} else {
+			calc = ext2_csum(&w->crc, p->csum_seed, w->blk,
+				le32_to_cpu(p->sblock.inodes_per_group) / 8);
+			stored = le16_to_cpu(bgrp->bg_inode_id_csum);
+			if (p->descriptor_size >= EXT4_MIN_DESC_SIZE_64BIT)
+				stored |= le16_to_cpu(bgrp->bg_inode_id_csum_high) << 16;
+			else
+				calc &= 0xffff;
+
+			ext2_fsck_csum_check(w, 0, "inode bitmap", blkno,
+					     calc, stored);
+		}
+	}
+}
+
+/* the htree root and node blocks, returns the offset of dx_countlimit */
+static int ext2_dx_count_offset(struct ext2_editor_private_data *p,
+				uint8_t *blk, uint64_t lblk)
+{
+	struct ext2_dirent *de = (struct ext2_dirent *)blk;
+
+	/* a fake dirent cover the whole node block */
+	if (le32_to_cpu(de->inode) == 0
+	    && le16_to_cpu(de->direntlen) == p->block_size)
+		return 8;
+
+	/* the root block: ".", ".." and dx_root_info */
+	if (lblk == 0 && le16_to_cpu(de->direntlen) == 12) {
+		de = (struct ext2_dirent *)(blk + 12);
+		if (le16_to_cpu(de->direntlen) == p->block_size - 12
+		    && le32_to_cpu(*(__le32 *)(blk + 24)) == 0 /* reserved */
+		    && blk[24 + 5] == 8 /* info_length */)
+			return 32;
+	}
+
+	return -1;
+}
+
+static void ext2_fsck_csum_dirblock(struct ext2_fsck_csum_work *w,
+				    uint32_t ino, uint32_t seed, bool htree,
+				    uint64_t lblk, uint64_t blkno)
+{
+	struct ext2_editor_private_data *p = w->ctx->p;
+	struct ext4_dir_entry_tail *t;
+	int count_offset = -1;
+	uint32_t calc;
+
+	if (ext2_read_blocks(p, blkno, 1, w->blk, p->block_size) < 0) {
+		w->errors++;
+		return;
+	}
+
+	if (htree)
+		count_offset = ext2_dx_count_offset(p, w->blk, lblk);
+
+	if (count_offset > 0) {
+		struct dx_countlimit *c = (void *)w->blk + count_offset;
+		uint16_t limit = le16_to_cpu(c->limit);
+		uint16_t count = le16_to_cpu(c->count);
+		__le32 dummy_csum = 0;
+		struct dx_tail *dt;
+
+		if (count > limit || count_offset + limit * sizeof(struct dx_entry)
+				+ sizeof(struct dx_tail) > p->block_size) {
+			ext2_fsck_csum_report(w, ino, blkno,
+					      "no space for dx tail");
+			return;
+		}
+
+		dt = (struct dx_tail *)((struct dx_entry *)c + limit);
+		libcrc32_init_seed(&w->crc, seed);
+		libcrc32_update(&w->crc, w->blk,
+				count_offset + count * sizeof(struct dx_entry));
+		libcrc32_update(&w->crc, &dt->dt_reserved,
+				sizeof(dt->dt_reserved));
+		libcrc32_update(&w->crc, &dummy_csum, sizeof(dummy_csum));
+		calc = libcrc32_finish(&w->crc);
+
+		ext2_fsck_csum_check(w, ino, "dx node", blkno, calc,
+				     le32_to_cpu(dt->dt_checksum));
+		return;
+	}
+
+	t = (struct ext4_dir_entry_tail *)(w->blk + p->block_size - sizeof(*t));
+	if (t->det_reserved_zero1 || le16_to_cpu(t->det_rec_len) != sizeof(*t)
+	    || t->det_reserved_zero2 || t->det_reserved_ft != EXT4_FT_DIR_CSUM) {
+		ext2_fsck_csum_report(w, ino, blkno,
+				      "no space for dirent tail");
+		return;
+	}
+
+	calc = ext2_csum(&w->crc, seed, w->blk, p->block_size - sizeof(*t));
+	ext2_fsck_csum_check(w, ino, "directory block", blkno, calc,
+			     le32_to_cpu(t->det_checksum));
+}
+
+static int ext2_fsck_csum_extent_node(struct ext2_fsck_csum_work *w,
+				      uint32_t ino, uint32_t seed, int dir,
+				      struct ext4_extent_header *eh)
+{
+	struct ext2_editor_private_data *p = w->ctx->p;
+	int eh_depth = le16_to_cpu(eh->eh_depth);
+	struct ext4_extent_idx *ei;
+	uint8_t *blk;
+	int ret = 0;
+
+	if (eh_depth == 0) {
+		struct ext4_extent *ee = (struct ext4_extent *)(eh + 1);
+
+		/* only the directory blocks has checksum */
+		for (int i = 0; dir && i < le16_to_cpu(eh->eh_entries); i++, ee++) {
+			uint64_t start = ext4_extent_start_block(ee);
+			uint32_t lblk = le32_to_cpu(ee->ee_block);
+			uint32_t len = le16_to_cpu(ee->ee_len);
+
+			if (len > EXT_INIT_MAX_LEN) /* unwritten */
+				continue;
+
+			for (uint32_t j = 0; j < len; j++)
+				ext2_fsck_csum_dirblock(w, ino, seed,
+							dir == 2, lblk + j,
+							start + j);
+		}
+
+		return 0;
+	}
+
+	blk = malloc(p->block_size);
+	if (!blk) {
+		fprintf(stderr, "Error: alloc one block failed\n");
+		return -1;
+	}
+
+	ei = (struct ext4_extent_idx *)(eh + 1);
+	for (int i = 0; i < le16_to_cpu(eh->eh_entries); i++, ei++) {
+		uint64_t blkno = ext4_extent_idx_leaf_block(ei);
+		struct ext4_extent_header *eh_child;
+		struct ext4_extent_tail *et;
+		size_t tail_offset;
+
+		ret = ext2_read_blocks(p, blkno, 1, blk, p->block_size);
+		if (ret < 0)
+			break;
+
+		eh_child = (struct ext4_extent_header *)blk;
+		if (le16_to_cpu(eh_child->eh_magic) != EXT4_EXT_MAGIC
+		    || le16_to_cpu(eh_child->eh_depth) != eh_depth - 1) {
+			fprintf(stderr, "Error: inode #%u: bad extent header "
+					"at block #%" PRIu64 "\n",
+				ino, blkno);
+			ret = -1;
+			break;
+		}
+
+		tail_offset = sizeof(*eh_child) + le16_to_cpu(eh_child->eh_max)
+				* sizeof(struct ext4_extent);
+		if (tail_offset + sizeof(*et) > p->block_size) {
+			ext2_fsck_csum_report(w, ino, blkno,
+					      "no space for extent tail");
+			continue;
+		}
+
+		et = (struct ext4_extent_tail *)(blk + tail_offset);
+		ext2_fsck_csum_check(w, ino, "extent block", blkno,
+				     ext2_csum(&w->crc, seed, blk, tail_offset),
+				     le32_to_cpu(et->et_checksum));
+
+		ret = ext2_fsck_csum_extent_node(w, ino, seed, dir, eh_child);
+		if (ret < 0)
+			break;
+	}
+
+	free(blk);
+	return ret;
+}
+
+static void ext2_fsck_csum_xattr(struct ext2_fsck_csum_work *w,
+				 uint32_t ino, uint64_t blkno)
+{
+	struct ext2_editor_private_data *p = w->ctx->p;
+	struct ext4_xattr_header *h = (struct ext4_xattr_header *)w->blk;
+	__le64 dsk_blkno = cpu_to_le64(blkno);
+	uint32_t seed, stored;
+
+	if (ext2_read_blocks(p, blkno, 1, w->blk, p->block_size) < 0) {
+		w->errors++;
+		return;
+	}
+
+	if (le32_to_cpu(h->h_magic) != EXT4_XATTR_MAGIC) {
+		ext2_fsck_csum_report(w, ino, blkno, "bad xattr magic");
+		return;
+	}
+
+	stored = le32_to_cpu(h->h_checksum);
+	h->h_checksum = 0;
+
+	seed = ext2_csum(&w->crc, p->csum_seed, &dsk_blkno, sizeof(dsk_blkno));
+	ext2_fsck_csum_check(w, ino, "xattr block", blkno,
+			     ext2_csum(&w->crc, seed, w->blk, p->block_size),
+			     stored);
+}
+
+static int ext2_fsck_csum_inode(struct ext2_fsck_csum_work *w, uint32_t ino,
+				uint8_t *raw, uint64_t blkno)
+{
+	struct ext2_editor_private_data *p = w->ctx->p;
+	struct ext2_inode *inode = (struct ext2_inode *)raw;
+	uint32_t flags = le32_to_cpu(inode->flags);
+	uint32_t type = le16_to_cpu(inode->mode) & INODE_MODE_S_MASK;
+	__le32 inum = cpu_to_le32(ino);
+	uint32_t seed, calc, stored;
+	bool has_hi = false;
+	uint64_t acl;
+	int dir = 0;
+
+	seed = ext2_csum(&w->crc, p->csum_seed, &inum, sizeof(inum));
+	seed = ext2_csum(&w->crc, seed, &inode->version, sizeof(inode->version));
+
+	/* the checksum fields are zero when calculating */
+	memcpy(w->blk, raw, p->inode_size);
+	if (p->inode_size > EXT4_GOOD_OLD_INODE_SIZE) {
+		uint16_t extra_isize = le16_to_cpu(*(__le16 *)
+				(raw + EXT4_INODE_EXTRA_ISIZE_OFFSET));
+
+		has_hi = extra_isize >= EXT4_INODE_CSUM_HI_EXTRA_END;
+	}
+
+	stored = le16_to_cpu(*(__le16 *)(raw + EXT4_INODE_CSUM_LO_OFFSET));
+	memset(w->blk + EXT4_INODE_CSUM_LO_OFFSET, 0, sizeof(__le16));
+	if (has_hi) {
+		stored |= le16_to_cpu(*(__le16 *)
+				(raw + EXT4_INODE_CSUM_HI_OFFSET)) << 16;
+		memset(w->blk + EXT4_INODE_CSUM_HI_OFFSET, 0, sizeof(__le16));
+	}
+
+	calc = ext2_csum(&w->crc, seed, w->blk, p->inode_size);
+	if (!has_hi)
+		calc &= 0xffff;
+
+	ext2_fsck_csum_check(w, ino, "inode", blkno, calc, stored);
+
+	/* the high 16 bits of file_acl is saved in osd2 */
+	acl = le32_to_cpu(inode->acl)
+		| ((uint64_t)(le32_to_cpu(inode->osd2[0]) >> 16) << 32);
+	if (acl)
+		ext2_fsck_csum_xattr(w, ino, acl);
+
+	if (flags & EXT4_INLINE_DATA_FL)
+		return 0;
+
+	if (type == INODE_MODE_S_IFDIR)
+		dir = (flags & EXT4_INDEX_FL) ? 2 : 1;
+
+	if (flags & EXT4_EXTENTS_FL) {
+		struct ext4_extent_header *eh =
+			(struct ext4_extent_header *)inode->b.blocks.dir_blocks;
+
+		if (le16_to_cpu(eh->eh_magic) != EXT4_EXT_MAGIC) {
+			fprintf(stderr, "Error: inode #%u: bad extent header\n",
+				ino);
+			return -1;
+		}
+
+		return ext2_fsck_csum_extent_node(w, ino, seed, dir, eh);
+	} else if (dir) {
+		struct ext2_inode_blocks b = { .runs = NULL };
+		struct ext2_inode di;
+		struct ext2_block_run *run;
+		int ret;
+
+		/* the indirect blocks don't have checksum */
+		memcpy(&di, raw, sizeof(di));
+		ret = ext2_inode_blocks_read(p, &b, &di, ino);
+		if (ret == 0) {
+			ext2_block_run_foreach(&b, run, lblk) {
+				if (run->start == 0)
+					continue;
+
+				for (uint32_t j = 0; j < run->len; j++)
+					ext2_fsck_csum_dirblock(w, ino, seed,
+								dir == 2,
+								lblk + j,
+								run->start + j);
+			}
+		}
+
+		free(b.runs);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void ext2_fsck_csum_inodes(struct ext2_fsck_csum_work *w,
+				  struct ext2_block_group *bgrp)
+{
+	struct ext2_editor_private_data *p = w->ctx->p;
+	uint32_t ipg = le32_to_cpu(p->sblock.inodes_per_group);
+	uint32_t inodes_per_block = p->block_size / p->inode_size;
+	uint32_t inodes = ext2_group_used_inodes(p, w->group);
+	uint64_t itable = ext2_bg_inode_table(p, bgrp);
+	uint32_t nblks;
+	uint8_t *buf;
+
+	if (inodes == 0)
+		return;
+
+	nblks = aligned_length(inodes, inodes_per_block) / inodes_per_block;
+	buf = malloc((size_t)nblks * p->block_size);
+	if (!buf) {
+		fprintf(stderr, "Error: alloc %u blocks failed\n", nblks);
+		w->errors++;
+		return;
+	}
+
+	if (ext2_read_blocks(p, itable, nblks, buf,
+			     (size_t)nblks * p->block_size) < 0) {
+		w->errors++;
+		goto done;
+	}
+
+	bitmask_foreach(idx, p->inode_bitmask[w->group]) {
+		uint32_t ino = w->group * ipg + idx + 1;
+
+		if ((size_t)idx >= inodes)
+			break;
+
+		if (ext2_fsck_csum_inode(w, ino, buf + idx * p->inode_size,
+					 itable + idx / inodes_per_block) < 0)
+			w->errors++;
+	}
+
+done:
+	free(buf);
+}
+
+static int ext2_fsck_csum_group_work(void *arg)
+{
+	struct ext2_fsck_csum_work *w = arg;
+	struct ext2_fsck_csum_ctx *ctx = w->ctx;
+	struct ext2_block_group *bgrp = &ctx->p->block_groups[w->group];
+
+	ext2_fsck_csum_bitmaps(w, bgrp);
+	if (!(le16_to_cpu(bgrp->bg_flags) & EXT4_BG_INODE_UNINIT))
+		ext2_fsck_csum_inodes(w, bgrp);
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->checked += w->checked;
+	ctx->errors += w->errors;
+	pthread_mutex_unlock(&ctx->lock);
+
+	free(w->blk);
+	free(w);
+	return 0;
+}
+
+static int ext2_do_fsck_csum(void *private_data, int fd, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	struct ext2_fsck_csum_ctx ctx = { .p = p };
+	struct threadpool *tp;
+	int ret = 0;
+
+	if (!ext2_has_sblock_csum(&p->sblock)) {
+		fprintf(stderr, "Error: metadata_csum is not enabled\n");
+		return -1;
+	}
+
+	tp = alloc_threadpool(get_parallel_jobs(), 0);
+	if (!tp)
+		return -1;
+
+	pthread_mutex_init(&ctx.lock, NULL);
+
+	for (uint32_t group = 0; group < p->n_block_group; group++) {
+		struct ext2_fsck_csum_work *w = calloc(1, sizeof(*w));
+
+		if (w)
+			w->blk = malloc(p->block_size);
+
+		if (!w || !w->blk) {
+			fprintf(stderr, "Error: alloc fsck work failed\n");
+			free(w);
+			ret = -1;
+			break;
+		}
+
+		w->ctx = &ctx;
+		w->group = group;
+		w->crc = p->crc32c_le;
+
+		ret = threadpool_queue_work(tp, ext2_fsck_csum_group_work, w);
+		if (ret < 0) {
+			free(w->blk);
+			free(w);
+			break;
+		}
+	}
+
+	if (threadpool_wait(tp) < 0)
+		ret = -1;
+	threadpool_free(tp);
+	pthread_mutex_destroy(&ctx.lock);
+
+	printf("%" PRIu64 " checksums verified, %" PRIu64 " errors\n",
+	       ctx.checked, ctx.errors);
+
+	if (ctx.errors > 0)
+		ret = -1;
+
+	return ret;
+}
+
+static int ext2_main(void *private_data, int fd, int argc, char **argv)
+{
+	/* list the recovered filesystem */
+	if (argc >= 1 && !strcmp(argv[0], "--replay")) {
+		if (ext2_load_replay_overlay(private_data) < 0)
+			return -1;
+		argc--;
+		argv++;
+	}
+
+	if (argc >= 1) {
+		if (!strcmp(argv[0], "list"))
+			return ext2_do_list(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "sblock"))
+			return ext2_do_sblock(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "inode"))
+			return ext2_do_inode(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "stat"))
+			return ext2_do_stat(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "cat"))
+			return ext2_do_cat(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "block"))
+			return ext2_do_block(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "dirent"))
+			return ext2_do_dirent(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "extent"))
+			return ext2_do_extent(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "bmap"))
+			return ext2_do_bmap(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "journal"))
+			return ext2_do_journal(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "replay"))
+			return ext2_do_replay(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "orphan"))
+			return ext2_do_orphan(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "layout"))
+			return ext2_do_layout(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "layout-map"))
+			return ext2_do_layout_map(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "fsck-csum"))
+			return ext2_do_fsck_csum(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "whohas"))
+			return ext2_do_whohas(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "resize_inode"))
+			return ext2_do_resize_inode(private_data, fd, argc, argv);
+	#ifdef CONFIG_ENABLE_ANDROID
+		else if (!strcmp(argv[0], "sparse"))
+			return ext2_do_sparse(private_data, fd, argc, argv);
+	#endif
+
+		fprintf(stderr, "Error: unknown command %s\n", argv[0]);
+		return -1;
+	}
+
+	return ext2_do_list(private_data, fd, argc, argv);
+}
+
+static int unpack_symlink(struct ext2_editor_private_data *p, uint32_t ino,
+			  int dirfd, const char *link)
+{
+	char symlink_target[4096] = { 0 };
+	struct ext2_inode inode;
+	int ret;
+
+	ret = ext2_read_inode(p, ino, &inode);
+	if (ret < 0)
+		return ret;
+
+	if ((le16_to_cpu(inode.mode) & INODE_MODE_S_IFLINK) == 0) {
+		fprintf(stderr, "Error: unpack symlink %s failed"
+				"(ino #%d is not symlink)\n",
+			inode.b.symlink, ino);
+		return -1;
+	}
+
+	ret = symlink_inode_get_target(p, &inode, symlink_target,
+				       sizeof(symlink_target) - 1);
+	if (ret < 0) {
+		fprintf(stderr, "Error: get symlink target of inode %d failed\n",
+			ino);
+		return ret;
+	}
+
+	unlinkat(dirfd, link, 0);
+	ret = symlinkat(symlink_target, dirfd, link);
+	if (ret < 0) {
+		fprintf(stderr, "Error: Create symlink %s point to %s"
+				"(ino #%d) failed: %m\n",
+			link, symlink_target, ino);
+		return ret;
+	}
+
+	return 0;
+}
+
+/* the regular file is created by the directory walker, and the data is
+ * copied by the worker threads.
+ */
+struct ext2_unpack_work {
+	struct ext2_editor_private_data	*p;
+	struct ext2_inode		inode;
+	uint32_t			ino;
+	uint64_t			filesz;
+	int				fd;
+	char				filename[256];
+};
+
+/* copy @nblks blocks start from the logical block @lblk, the data after
+ * i_size is not copied.
+ */
+static int unpack_file_copy_blocks(struct ext2_unpack_work *w, uint64_t lblk,
+				   uint64_t pblk, uint64_t nblks)
+{
+	struct ext2_editor_private_data *p = w->p;
+	uint64_t offset = lblk * p->block_size;
+	uint64_t bytes = nblks * p->block_size;
+
+	if (offset >= w->filesz)
+		return 0;
+
+	if (bytes > w->filesz - offset)
+		bytes = w->filesz - offset;
+
+	if (pdd64(p->fd, w->fd, pblk * p->block_size, offset, bytes) != bytes) {
+		fprintf(stderr, "Error: saving %s failed\n", w->filename);
+		return -1;
+	}
+
+	if (p->n_overlay > 0)
+		return ext2_overlay_patch(p, w->fd, pblk, nblks, offset, bytes);
+
+	return 0;
+}
+
+static int unpack_file_from_dir_blocks(struct ext2_unpack_work *w)
+{
+	struct ext2_inode_blocks b = { .runs = NULL };
+	struct ext2_block_run *run;
+	int ret;
+
+	ret = ext2_inode_blocks_read(w->p, &b, &w->inode, w->ino);
+	if (ret < 0)
+		return ret;
+
+	ext2_block_run_foreach(&b, run, lblk) {
+		if (run->start == 0) /* hole */
+			continue;
+
+		ret = unpack_file_copy_blocks(w, lblk, run->start, run->len);
+		if (ret < 0)
+			break;
+	}
+
+	free(b.runs);
+	return ret;
+}
+
+static int unpack_file_work(void *arg)
+{
+	struct ext2_unpack_work *w = arg;
+	struct ext2_editor_private_data *p = w->p;
+	uint64_t run_lblk = 0, run_pblk = 0, run_len = 0;
+	struct extent_cursor c;
+	struct ext4_extent *ee;
+	int ret;
+
+	/* the blocks not covered by the extents are holes, they are not
+	 * written and the output file is sparse.
+	 */
+	ret = ftruncate(w->fd, w->filesz);
+	if (ret < 0) {
+		fprintf(stderr, "Error: truncate %s failed(%m)\n", w->filename);
+		goto done;
+	}
+
+	if (!(le32_to_cpu(w->inode.flags) & EXT4_EXTENTS_FL)) {
+		/* this is ext2 based filesystem */
+		ret = unpack_file_from_dir_blocks(w);
+		goto done;
+	}
+
+	ret = extent_cursor_init(p, &c, w->ino);
+	if (ret < 0)
+		goto done;
+
+	/* the physically contiguous extents are merged and copied once */
+	extent_cursor_foreach(p, &c, ee, ret) {
+		uint64_t len = le16_to_cpu(ee->ee_len);
+		uint64_t lblk = le32_to_cpu(ee->ee_block);
+		uint64_t pblk = ext4_extent_start_block(ee);
+
+		/* unwritten extent reads as zero, keep it as a hole */
+		if (len > EXT_INIT_MAX_LEN)
+			continue;
+
+		if (run_len > 0 && lblk == run_lblk + run_len
+		    && pblk == run_pblk + run_len) {
+			run_len += len;
+			continue;
+		}
+
+		if (run_len > 0) {
+			ret = unpack_file_copy_blocks(w, run_lblk, run_pblk,
+						      run_len);
+			if (ret < 0)
+				break;
+		}
+
+		run_lblk = lblk;
+		run_pblk = pblk;
+		run_len = len;
+	}
+	extent_cursor_exit(&c);
+
+	if (ret == 0 && run_len > 0)
+		ret = unpack_file_copy_blocks(w, run_lblk, run_pblk, run_len);
+
+done:
+	close(w->fd);
+	free(w);
+	return ret;
+}
+
+static int unpack_file(struct ext2_editor_private_data *p,
+		       struct threadpool *tp, uint32_t ino,
+		       int dirfd, const char *filename)
+{
+	struct ext2_unpack_work *w;
+	struct ext2_inode inode;
+	uint64_t filesz;
+	int fd, mode;
+	int ret;
+
+	ret = ext2_read_inode(p, ino, &inode);
+	if (ret < 0)
+		return ret;
+
+	if ((le16_to_cpu(inode.mode) & INODE_MODE_S_IFLINK) == 0) {
+		fprintf(stderr, "Error: unpack file %s failed"
+				"(ino #%d is not a file)\n",
+			filename, ino);
+		return -1;
+	}
+
+	filesz = le32_to_cpu(inode.size_high);
+	filesz = filesz << 32;
+	filesz |= le32_to_cpu(inode.size);
+	mode = le16_to_cpu(inode.mode) & INODE_MODE_PERMISSION_MASK;
+
+	fd = openat(dirfd, filename, O_RDWR | O_CREAT | O_TRUNC, mode);
+	if (fd < 0) {
+		fprintf(stderr, "Error: open %s failed(%m)\n", filename);
+		return fd;
+	}
+
+	/* this file maybe already created, the file mode passwd by open
+	 * doesn't work. let's fix it's mode now
+	 */
+	fchmod(fd, mode);
+
+	if (filesz == 0) { /* create a empty file */
+		close(fd);
+		return 0;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		close(fd);
+		return -1;
+	}
+
+	w->p = p;
+	w->inode = inode;
+	w->ino = ino;
+	w->filesz = filesz;
+	w->fd = fd;
+	snprintf(w->filename, sizeof(w->filename), "%s", filename);
+
+	ret = threadpool_queue_work(tp, unpack_file_work, w);
+	if (ret < 0) {
+		close(fd);
+		free(w);
+	}
+
+	return ret;
+}
+
+/* mark all blocks used by inode @ino, include the indirect blocks, the
+ * extent index blocks and the extended attribute block.
+ */
+static int ext2_inode_mark_blocks(struct ext2_editor_private_data *p,
+				  uint32_t ino,
+				  struct ext2_block_marker *marker)
+{
+	struct ext2_inode inode;
+	uint64_t filesz;
+	uint32_t type, acl;
+	int ret;
+
+	ret = ext2_read_inode(p, ino, &inode);
+	if (ret < 0)
+		return ret;
+
+	/* A block number saved in it's b.blocks.double_indir_block
+	 * for reserved gdt used.
+	 * imgeditor tests/fs/ext4/simple_abc.ext4 -- inode 7
+	 */
+	if (ino == EXT2_RESIZE_INO) {
+		uint32_t blknr =
+			le32_to_cpu(inode.b.blocks.double_indir_block);
+
+		if (blknr)
+			ext2_block_mark(marker, blknr, 1);
+
+		return 0;
+	}
+
+	/* empty inode */
+	if (le32_to_cpu(inode.ctime) == 0)
+		return 0;
+
+	acl = le32_to_cpu(inode.acl);
+	if (acl)
+		ext2_block_mark(marker, acl, 1);
+
+	filesz = le32_to_cpu(inode.size_high);
+	filesz = filesz << 32;
+	filesz |= le32_to_cpu(inode.size);
+	if (filesz == 0)
+		return 0;
+
+	/* search in regular file and directory only */
+	type = le16_to_cpu(inode.mode) & INODE_MODE_S_MASK;
+	if (type == INODE_MODE_S_IFLINK) {
+		/* sort symlink doesn't need extra block */
+		if (filesz < sizeof(inode.b.symlink))
+			return 0;
+	} else if (!(type == INODE_MODE_S_IFREG || type == INODE_MODE_S_IFDIR))
+		return 0;
+
+	if (le32_to_cpu(inode.flags) & EXT4_INLINE_DATA_FL)
+		return 0;
+
+	if (!(le32_to_cpu(inode.flags) & EXT4_EXTENTS_FL)) {
+		struct ext2_inode_blocks b = { .runs = NULL };
+
+		ret = _ext2_inode_blocks_read(p, &b, &inode, ino, marker);
+		free(b.runs);
+	} else {
+		struct extent_cursor c;
+		struct ext4_extent *ee;
+
+		/* the index and leaf blocks are marked when loading */
+		ret = _extent_cursor_init(p, &c, ino, marker);
+		if (ret < 0)
+			return ret;
+
+		extent_cursor_foreach(p, &c, ee, ret) {
+			uint32_t len = le16_to_cpu(ee->ee_len);
+
+			/* the blocks of unwritten extent are allocated */
+			if (len > EXT_INIT_MAX_LEN)
+				len -= EXT_INIT_MAX_LEN;
+
+			ext2_block_mark(marker, ext4_extent_start_block(ee), len);
+		}
+
+		extent_cursor_exit(&c);
+	}
+
+	return ret;
+}
+
+struct ext2_rmap_builder {
+	struct ext2_editor_private_data	*p;
+	uint32_t			ino;
+	int				error;
+};
+
+static void ext2_rmap_mark(void *arg, uint64_t start, uint64_t len)
+{
+	struct ext2_rmap_builder *builder = arg;
+	struct ext2_editor_private_data *p = builder->p;
+	struct ext2_rmap_entry *e;
+
+	if (p->n_rmap > 0) {
+		e = &p->rmap[p->n_rmap - 1];
+
+		/* merge it to the last run of the same inode */
+		if (e->ino == builder->ino && e->start + e->len == start
+		    && e->len + len <= UINT32_MAX) {
+			e->len += len;
+			return;
+		}
+	}
+
+	if (p->n_rmap >= p->max_rmap) {
+		size_t max_rmap = p->max_rmap ? p->max_rmap * 2 : 1024;
+
+		e = realloc(p->rmap, max_rmap * sizeof(*e));
+		if (!e) {
+			fprintf(stderr, "Error: alloc %zu rmap entries failed\n",
+				max_rmap);
+			builder->error = -1;
+			return;
+		}
+
+		p->rmap = e;
+		p->max_rmap = max_rmap;
+	}
+
+	e = &p->rmap[p->n_rmap++];
+	e->start = start;
+	e->len = len;
+	e->ino = builder->ino;
+}
+
+static int qsort_compare_rmap(const void *a, const void *b)
+{
+	const struct ext2_rmap_entry *ea = a, *eb = b;
+
+	if (ea->start < eb->start)
+		return -1;
+
+	return ea->start > eb->start;
+}
+
+/* build the reverse map in one pass of all used inodes */
+static int ext2_rmap_build(struct ext2_editor_private_data *p)
+{
+	uint32_t ipg = le32_to_cpu(p->sblock.inodes_per_group);
+	struct ext2_rmap_builder builder = { .p = p };
+	struct ext2_block_marker marker = {
+		.mark = ext2_rmap_mark,
+		.arg = &builder,
+	};
+
+	p->n_rmap = 0;
+
+	for (uint32_t group = 0; group < p->n_block_group; group++) {
+		uint32_t used = ext2_group_used_inodes(p, group);
+
+		for (uint32_t i = 0; i < used; i++) {
+			if (bitmask_get(p->inode_bitmask[group], i) <= 0)
+				continue;
+
+			builder.ino = group * ipg + i + 1;
+			ext2_inode_mark_blocks(p, builder.ino, &marker);
+			if (builder.error < 0)
+				return builder.error;
+		}
+	}
+
+	if (p->n_rmap > 0)
+		qsort(p->rmap, p->n_rmap, sizeof(*p->rmap), qsort_compare_rmap);
+
+	p->rmap_loaded = true;
+	return 0;
+}
+
+#define EXT2_RMAP_CACHE_MAGIC		"E2RMAP01"
+
+/* the super block is changed after any writing, the cache is valid only if
+ * the super block is the same.
+ */
+struct ext2_rmap_cache_header {
+	char				magic[8];
+	__le64				n_rmap;
+	struct ext2_sblock		sblock;
+};
+
+struct ext2_rmap_cache_entry {
+	__le64				start;
+	__le32				len;
+	__le32				ino;
+};
+
+/* the reverse map is saved as one packed little-endian array by the cache
+ * and the snapshot, it is converted in memory and written by one pwrite.
+ */
+static int ext2_rmap_write(const struct ext2_rmap_entry *rmap, size_t n_rmap,
+			   int fd, uint64_t *offset)
+{
+	struct ext2_rmap_cache_entry *ce;
+	size_t sz = n_rmap * sizeof(*ce);
+	ssize_t ret = 0;
+
+	if (n_rmap == 0)
+		return 0;
+
+	ce = malloc(sz);
+	if (!ce)
+		return -1;
+
+	for (size_t i = 0; i < n_rmap; i++) {
+		ce[i].start = cpu_to_le64(rmap[i].start);
+		ce[i].len = cpu_to_le32(rmap[i].len);
+		ce[i].ino = cpu_to_le32(rmap[i].ino);
+	}
+
+	ret = pwrite64(fd, ce, sz, *offset);
+	free(ce);
+	if (ret != (ssize_t)sz)
+		return -1;
+
+	*offset += sz;
+	return 0;
+}
+
+/* load the reverse map from the packed array @ce, the caller makes sure
+ * @n_rmap entries are inside the file.
+ */
+static int ext2_rmap_read(struct ext2_editor_private_data *p,
+			  const struct ext2_rmap_cache_entry *ce,
+			  size_t n_rmap)
+{
+	free(p->rmap);
+	p->n_rmap = p->max_rmap = 0;
+	p->rmap = calloc(n_rmap ? n_rmap : 1, sizeof(*p->rmap));
+	if (!p->rmap)
+		return -1;
+	p->max_rmap = n_rmap ? n_rmap : 1;
+
+	for (; p->n_rmap < n_rmap; p->n_rmap++, ce++) {
+		struct ext2_rmap_entry *e = &p->rmap[p->n_rmap];
+
+		e->start = le64_to_cpu(ce->start);
+		e->len = le32_to_cpu(ce->len);
+		e->ino = le32_to_cpu(ce->ino);
+	}
+
+	p->rmap_loaded = true;
+	return 0;
+}
+
+static int ext2_rmap_load_cache(struct ext2_editor_private_data *p,
+				const char *cache)
+{
+	const struct ext2_rmap_cache_header *h;
+	struct stat st;
+	uint64_t n_rmap;
+	void *base;
+	int fd, ret = -1;
+
+	fd = open(cache, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*h)) {
+		close(fd);
+		return -1;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+
+	/* the count is trusted only if the file has exactly that many entries */
+	h = base;
+	n_rmap = le64_to_cpu(h->n_rmap);
+	if (memcmp(h->magic, EXT2_RMAP_CACHE_MAGIC, sizeof(h->magic))
+	    || memcmp(&h->sblock, &p->sblock, sizeof(h->sblock))
+	    || n_rmap != (st.st_size - sizeof(*h))
+				/ sizeof(struct ext2_rmap_cache_entry)
+	    || (st.st_size - sizeof(*h))
+				% sizeof(struct ext2_rmap_cache_entry))
+		goto done;
+
+	ret = ext2_rmap_read(p, (const void *)(h + 1), n_rmap);
+done:
+	munmap(base, st.st_size);
+	return ret;
+}
+
+static int ext2_rmap_save_cache(struct ext2_editor_private_data *p,
+				const char *cache)
+{
+	struct ext2_rmap_cache_header h = { 0 };
+	uint64_t offset = sizeof(h);
+	int fd;
+
+	fd = fileopen(cache, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0)
+		return fd;
+
+	memcpy(h.magic, EXT2_RMAP_CACHE_MAGIC, sizeof(h.magic));
+	h.n_rmap = cpu_to_le64(p->n_rmap);
+	memcpy(&h.sblock, &p->sblock, sizeof(h.sblock));
+	if (pwrite64(fd, &h, sizeof(h), 0) != sizeof(h)
+	    || ext2_rmap_write(p->rmap, p->n_rmap, fd, &offset) < 0)
+		goto failed;
+
+	close(fd);
+	return 0;
+
+failed:
+	fprintf(stderr, "Error: write rmap cache %s failed: %m\n", cache);
+	close(fd);
+	return -1;
+}
+
+#define EXT2_SNAPSHOT_MAGIC		"E2SNAP01"
+#define EXT2_SNAPSHOT_HAS_RMAP		(1 << 0)
+
+/* the parsed metadata saved by --snapshot, it is followed by the group
+ * descriptors, the inode and data block bitmasks of each group, the
+ * layouts and the reverse map. all offsets are in bytes from the start of
+ * the file.
+ *
+ * the snapshot is valid only if the super block and the group descriptors
+ * are the same with the image, they are changed after any writing.
+ */
+struct ext2_snapshot_header {
+	char				magic[8];
+	__le32				flags;
+	__le32				block_size;
+	__le32				n_block_group;
+	__le32				group_size;
+	__le64				group_offset;
+	__le64				bitmap_offset;
+	__le64				layout_offset;
+	__le64				n_layout;
+	__le64				rmap_offset;
+	__le64				n_rmap;
+	struct ext2_sblock		sblock;
+};
+
+struct ext2_snapshot_layout {
+	__le32				major_type;
+	__le32				group;
+	__le64				start_block;
+	__le64				len_block;
+};
+
+static int ext2_snapshot_write(int fd, const void *buf, size_t sz,
+			       uint64_t *offset)
+{
+	if (pwrite64(fd, buf, sz, *offset) != (ssize_t)sz)
+		return -1;
+
+	*offset += sz;
+	return 0;
+}
+
+/* the inode and data block bitmask of each group are interleaved */
+static int ext2_snapshot_write_bitmaps(struct ext2_editor_private_data *p,
+				       int fd, uint64_t *offset)
+{
+	size_t sz = (size_t)p->n_block_group * 2 * p->block_size;
+	uint8_t *buf, *bitmaps;
+	int ret;
+
+	if (sz == 0)
+		return 0;
+
+	buf = malloc(sz);
+	if (!buf)
+		return -1;
+
+	bitmaps = buf;
+	for (size_t i = 0; i < p->n_block_group; i++) {
+		memcpy(bitmaps, p->inode_bitmask[i]->buffer, p->block_size);
+		bitmaps += p->block_size;
+		memcpy(bitmaps, p->data_block_bitmask[i]->buffer, p->block_size);
+		bitmaps += p->block_size;
+	}
+
+	ret = ext2_snapshot_write(fd, buf, sz, offset);
+	free(buf);
+	return ret;
+}
+
+static int ext2_snapshot_write_layouts(struct ext2_editor_private_data *p,
+				       int fd, uint64_t *offset)
+{
+	struct ext2_snapshot_layout *sl;
+	int ret;
+
+	if (p->n_layout == 0)
+		return 0;
+
+	sl = malloc(p->n_layout * sizeof(*sl));
+	if (!sl)
+		return -1;
+
+	for (size_t i = 0; i < p->n_layout; i++) {
+		struct disk_layout *layout = &p->layouts[i];
+
+		sl[i].major_type = cpu_to_le32(layout->major_type);
+		sl[i].group = cpu_to_le32(layout->group);
+		sl[i].start_block = cpu_to_le64(layout->start_block);
+		sl[i].len_block = cpu_to_le64(layout->len_block);
+	}
+
+	ret = ext2_snapshot_write(fd, sl, p->n_layout * sizeof(*sl), offset);
+	free(sl);
+	return ret;
+}
+
+static int ext2_snapshot_write_all(struct ext2_editor_private_data *p, int fd)
+{
+	size_t group_size = sizeof(struct ext2_block_group);
+	struct ext2_snapshot_header h = { 0 };
+	uint64_t offset = sizeof(h);
+
+	memcpy(h.magic, EXT2_SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.block_size = cpu_to_le32(p->block_size);
+	h.n_block_group = cpu_to_le32(p->n_block_group);
+	h.group_size = cpu_to_le32(group_size);
+	memcpy(&h.sblock, &p->sblock, sizeof(h.sblock));
+
+	h.group_offset = cpu_to_le64(offset);
+	if (ext2_snapshot_write(fd, p->block_groups,
+				p->n_block_group * group_size, &offset) < 0)
+		return -1;
+
+	h.bitmap_offset = cpu_to_le64(offset);
+	if (ext2_snapshot_write_bitmaps(p, fd, &offset) < 0)
+		return -1;
+
+	h.layout_offset = cpu_to_le64(offset);
+	h.n_layout = cpu_to_le64(p->n_layout);
+	if (ext2_snapshot_write_layouts(p, fd, &offset) < 0)
+		return -1;
+
+	if (p->rmap_loaded) {
+		h.flags |= cpu_to_le32(EXT2_SNAPSHOT_HAS_RMAP);
+		h.rmap_offset = cpu_to_le64(offset);
+		h.n_rmap = cpu_to_le64(p->n_rmap);
+
+		if (ext2_rmap_write(p->rmap, p->n_rmap, fd, &offset) < 0)
+			return -1;
+	}
+
+	/* the header is written at last, an incompleted snapshot is never
+	 * loaded.
+	 */
+	offset = 0;
+	return ext2_snapshot_write(fd, &h, sizeof(h), &offset);
+}
+
+/* the snapshot is written to a temp file and renamed, the other process
+ * maybe loading it now.
+ */
+static int ext2_snapshot_save(struct ext2_editor_private_data *p,
+			      const char *snapshot)
+{
+	char tmpfile[1024 + 16];
+	int fd, ret;
+
+	/* the replayed metadata is not the same as the image */
+	if (p->n_overlay > 0)
+		return 0;
+
+	snprintf(tmpfile, sizeof(tmpfile), "%s.%d", snapshot, getpid());
+	fd = fileopen(tmpfile, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0)
+		return fd;
+
+	ret = ext2_snapshot_write_all(p, fd);
+	close(fd);
+
+	if (ret == 0)
+		ret = rename(tmpfile, snapshot);
+
+	if (ret < 0) {
+		fprintf(stderr, "Error: save snapshot %s failed: %m\n", snapshot);
+		unlink(tmpfile);
+	}
+
+	return ret;
+}
+
+static bool ext2_snapshot_range_valid(uint64_t offset, uint64_t n,
+				      uint64_t entry_size, uint64_t filesz)
+{
+	return offset <= filesz && n <= (filesz - offset) / entry_size;
+}
+
+static int ext2_snapshot_load_mapped(struct ext2_editor_private_data *p,
+				     const uint8_t *base, uint64_t filesz)
+{
+	const struct ext2_snapshot_header *h = (const void *)base;
+	size_t group_size = sizeof(struct ext2_block_group);
+	const struct ext2_snapshot_layout *sl;
+	const uint8_t *bitmaps;
+	uint64_t n_layout, n_rmap;
+
+	if (filesz < sizeof(*h)
+	    || memcmp(h->magic, EXT2_SNAPSHOT_MAGIC, sizeof(h->magic))
+	    || le32_to_cpu(h->block_size) != p->block_size
+	    || le32_to_cpu(h->n_block_group) != p->n_block_group
+	    || le32_to_cpu(h->group_size) != group_size
+	    || memcmp(&h->sblock, &p->sblock, sizeof(h->sblock)))
+		return -1;
+
+	n_layout = le64_to_cpu(h->n_layout);
+	n_rmap = le64_to_cpu(h->n_rmap);
+	if (!ext2_snapshot_range_valid(le64_to_cpu(h->group_offset),
+				       p->n_block_group, group_size, filesz)
+	    || !ext2_snapshot_range_valid(le64_to_cpu(h->bitmap_offset),
+					  p->n_block_group * 2ULL,
+					  p->block_size, filesz)
+	    || !ext2_snapshot_range_valid(le64_to_cpu(h->layout_offset),
+					  n_layout, sizeof(*sl), filesz)
+	    || !ext2_snapshot_range_valid(le64_to_cpu(h->rmap_offset),
+					  n_rmap,
+					  sizeof(struct ext2_rmap_cache_entry),
+					  filesz))
+		return -1;
+
+	/* the group descriptors are loaded and checked already */
+	if (memcmp(base + le64_to_cpu(h->group_offset), p->block_groups,
+		   p->n_block_group * group_size))
+		return -1;
+
+	if (ext2_new_bitmasks(p) < 0)
+		return -1;
+
+	bitmaps = base + le64_to_cpu(h->bitmap_offset);
+	for (size_t i = 0; i < p->n_block_group; i++) {
+		bitmask_memcpy(p->inode_bitmask[i], bitmaps, p->block_size);
+		bitmaps += p->block_size;
+		bitmask_memcpy(p->data_block_bitmask[i], bitmaps, p->block_size);
+		bitmaps += p->block_size;
+	}
+
+	p->layouts = calloc(n_layout ? n_layout : 1, sizeof(*p->layouts));
+	if (!p->layouts)
+		return -1;
+	p->max_layout = n_layout ? n_layout : 1;
+
+	sl = (const void *)(base + le64_to_cpu(h->layout_offset));
+	for (p->n_layout = 0; p->n_layout < n_layout; p->n_layout++, sl++) {
+		struct disk_layout *layout = &p->layouts[p->n_layout];
+
+		layout->major_type = le32_to_cpu(sl->major_type);
+		layout->group = le32_to_cpu(sl->group);
+		layout->start_block = le64_to_cpu(sl->start_block);
+		layout->len_block = le64_to_cpu(sl->len_block);
+	}
+
+	if (le32_to_cpu(h->flags) & EXT2_SNAPSHOT_HAS_RMAP) {
+		const struct ext2_rmap_cache_entry *ce =
+			(const void *)(base + le64_to_cpu(h->rmap_offset));
+
+		if (ext2_rmap_read(p, ce, n_rmap) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* load the bitmasks, layouts and the reverse map from @snapshot, returns
+ * negative number if it doesn't match the image.
+ */
+static int ext2_snapshot_load(struct ext2_editor_private_data *p,
+			      const char *snapshot)
+{
+	struct stat st;
+	void *base;
+	int fd, ret;
+
+	fd = open(snapshot, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+
+	ret = ext2_snapshot_load_mapped(p, base, st.st_size);
+	munmap(base, st.st_size);
+
+	if (ret < 0) {
+		/* build them again from the image */
+		ext2_free_bitmasks(p);
+		free(p->layouts);
+		p->layouts = NULL;
+		p->n_layout = p->max_layout = 0;
+		free(p->rmap);
+		p->rmap = NULL;
+		p->n_rmap = p->max_rmap = 0;
+		p->rmap_loaded = false;
+	} else if (get_verbose_level() > 0) {
+		printf("metadata is loaded from snapshot %s\n", snapshot);
+	}
+
+	return ret;
+}
+
+/* load the reverse map from @cache if it is valid, otherwise build it and
+ * save it to @cache.
+ */
+static int ext2_rmap_load(struct ext2_editor_private_data *p,
+			  const char *cache)
+{
+	int ret;
+
+	if (p->rmap_loaded)
+		return 0;
+
+	if (cache && !ext2_rmap_load_cache(p, cache))
+		return 0;
+
+	ret = ext2_rmap_build(p);
+	if (ret < 0)
+		return ret;
+
+	if (cache)
+		ext2_rmap_save_cache(p, cache);
+
+	/* the next run will load the reverse map from the snapshot */
+	if (get_metadata_snapshot())
+		ext2_snapshot_save(p, get_metadata_snapshot());
+
+	return 0;
+}
+
+/* find the entry contains @blkno, @next saves the start block of the next
+ * entry if not found.
+ */
+static const struct ext2_rmap_entry *
+	ext2_rmap_lookup(struct ext2_editor_private_data *p, uint64_t blkno,
+			 uint64_t *next)
+{
+	size_t lo = 0, hi = p->n_rmap;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (p->rmap[mid].start <= blkno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo > 0) {
+		const struct ext2_rmap_entry *e = &p->rmap[lo - 1];
+
+		if (blkno < e->start + e->len)
+			return e;
+	}
+
+	if (next)
+		*next = lo < p->n_rmap ? p->rmap[lo].start : UINT64_MAX;
+
+	return NULL;
+}
+
+static int ext2_whohas_blkno(struct ext2_editor_private_data *p,
+			     uint64_t which_blk,
+			     int *ret_ino)
+{
+	const struct ext2_rmap_entry *e;
+	int ret;
+
+	ret = ext2_rmap_load(p, NULL);
+	if (ret < 0)
+		return ret;
+
+	e = ext2_rmap_lookup(p, which_blk, NULL);
+	if (!e)
+		return -1;
+
+	if (ret_ino)
+		*ret_ino = e->ino;
+
+	return 0;
+}
+
+#if CONFIG_ENABLE_ANDROID
+/* the used blocks are marked in the block bitmaps, except the groups with
+ * BLOCK_UNINIT, only the metadata blocks in the layouts are used in them.
+ */
+static int ext2_add_bitmap_chunks(struct ext2_editor_private_data *p,
+				  struct android_sparse_input *input)
+{
+	uint32_t first_data_block = le32_to_cpu(p->sblock.first_data_block);
+	uint32_t bpg = le32_to_cpu(p->sblock.blocks_per_group);
+	uint64_t total_blocks = ext2_total_blocks(&p->sblock);
+
+	/* the boot block when the block size is 1KiB */
+	if (first_data_block > 0)
+		android_sparse_add_chunk(input, 0, first_data_block);
+
+	for (uint32_t group = 0; group < p->n_block_group; group++) {
+		struct ext2_block_group *bgrp = &p->block_groups[group];
+		uint64_t base = first_data_block + (uint64_t)group * bpg;
+		uint64_t nblks = total_blocks - base;
+
+		if (ext2_has_block_group_csum(&p->sblock) &&
+		    (le16_to_cpu(bgrp->bg_flags) & EXT4_BG_BLOCK_UNINIT))
+			continue;
+
+		if (nblks > bpg)
+			nblks = bpg;
+
+		bitmask_foreach_continue(it, p->data_block_bitmask[group]) {
+			uint64_t len = it.bits;
+
+			if ((uint64_t)it.start >= nblks)
+				break;
+
+			if (len > nblks - it.start)
+				len = nblks - it.start;
+
+			if (get_verbose_level() > 0)
+				printf("add group %u blocks #%" PRIu64 ":%" PRIu64 "\n",
+					group, base + it.start, len);
+
+			android_sparse_add_chunk(input, base + it.start, len);
+		}
+	}
+
+	return 0;
+}
+
+struct ext2_sparse_marker_arg {
+	struct android_sparse_input	*input;
+	uint32_t			ino;
+	int				mismatch;
+};
+
+static void ext2_sparse_mark(void *arg, uint64_t start, uint64_t len)
+{
+	struct ext2_sparse_marker_arg *sparse = arg;
+	struct bitmask *b = sparse->input->chunk_bitmasks;
+	ssize_t unmarked = -1;
+
+	if (get_verbose_level() > 0)
+		printf("add inode #%u blocks #%" PRIu64 ":%" PRIu64 "\n",
+			sparse->ino, start, len);
+
+	if (b)
+		unmarked = bitmask_next_zero(b, start);
+
+	if (unmarked >= 0 && (uint64_t)unmarked < start + len) {
+		fprintf(stderr, "Error: block #%zd of inode #%u is not marked "
+				"in the block bitmap\n",
+			unmarked, sparse->ino);
+		sparse->mismatch++;
+	}
+
+	android_sparse_add_chunk(sparse->input, start, len);
+}
+
+/* walk all inodes and check their blocks are already added by the block
+ * bitmaps, the missing blocks are added too.
+ * Return the number of the mismatched block runs.
+ */
+static int ext2_verify_inode_chunks(struct ext2_editor_private_data *p,
+				    struct android_sparse_input *input)
+{
+	uint32_t ipg = le32_to_cpu(p->sblock.inodes_per_group);
+	struct ext2_sparse_marker_arg arg = { .input = input };
+	struct ext2_block_marker marker = {
+		.mark = ext2_sparse_mark,
+		.arg = &arg,
+	};
+
+	for (uint32_t group = 0; group < p->n_block_group; group++) {
+		uint32_t used = ext2_group_used_inodes(p, group);
+
+		for (uint32_t i = 0; i < used; i++) {
+			if (bitmask_get(p->inode_bitmask[group], i) <= 0)
+				continue;
+
+			arg.ino = group * ipg + i + 1;
+			ext2_inode_mark_blocks(p, arg.ino, &marker);
+		}
+	}
+
+	return arg.mismatch;
+}
+#endif
+
+static int unpack_dirent(struct ext2_editor_private_data *p,
+			 struct threadpool *tp, uint32_t ino,
+			 int parent_fd, const char *dirname)
+{
+	struct dirent_iterator it;
+	char child_name[256];
+	int dirfd = -1;
+	int ret;
+
+	ret = dirent_iterator_init(p, &it, ino);
+	if (ret < 0)
+		return ret;
+
+	if (ino != EXT2_ROOT_INO) {
+		int mode;
+
+		mode = le16_to_cpu(it.inode.mode) & INODE_MODE_PERMISSION_MASK;
+		ret = mkdirat(parent_fd, dirname, mode);
+		if (ret < 0) {
+			switch (errno) {
+			case EEXIST:
+				ret = 0;
+				break;
+			default:
+				fprintf(stderr, "Error: create dir %s with mode %o failed: %m\n",
+					dirname, mode);
+				goto done;
+			}
+		}
+	}
+
+	dirfd = openat(parent_fd, dirname, O_RDONLY | O_DIRECTORY);
+	if (dirfd < 0) {
+		fprintf(stderr, "Error: open dir %s failed: %m\n", dirname);
+		ret = dirfd;
+		goto done;
+	}
+
+	dirent_list_foreach(&it) {
+		struct ext2_dirent *dir = it.dir;
+		const char *filename = (const char *)(dir + 1);
+
+		if (le16_to_cpu(dir->direntlen) <= (int)sizeof(struct ext2_dirent)) {
+			fprintf(stderr, "direntlen is too short\n");
+			ret = -1;
+			break;
+		} else if (le32_to_cpu(dir->inode) == 0) {
+			continue;
+		}
+
+		snprintf(child_name, sizeof(child_name), "%.*s",
+			 dir->namelen, filename);
+
+		switch (dir->filetype) {
+		case EXT4_FT_REG_FILE:
+			ret = unpack_file(p, tp, le32_to_cpu(dir->inode),
+					  dirfd, child_name);
+			break;
+		case EXT4_FT_DIR:
+			/* skip '.' and '..' */
+			if (dir->namelen == 1 && !strncmp(filename, ".", 1))
+				break;
+			if (dir->namelen == 2 && !strncmp(filename, "..", 2))
+				break;
+
+			ret = unpack_dirent(p, tp, le32_to_cpu(dir->inode),
+					    dirfd, child_name);
+			break;
+		case EXT4_FT_SYMLINK:
+			ret = unpack_symlink(p, le32_to_cpu(dir->inode),
+					     dirfd, child_name);
+			break;
+		case EXT4_FT_CHRDEV:
+		case EXT4_FT_BLKDEV:
+		case EXT4_FT_FIFO:
+		case EXT4_FT_SOCK:
+			printf("Warning: ignore %s(ino #%d): "
+				"file type %d is not impl now\n",
+				child_name, le32_to_cpu(dir->inode), dir->filetype);
+			break;
+		case EXT4_FT_UNKNOWN:
+		default:
+			fprintf(stderr, "unknown filetype 0x%x\n", dir->filetype);
+			ret = -1;
+			break;
+		}
+
+		if (ret < 0)
+			break;
+	}
+
+	close(dirfd);
+done:
+	dirent_iterator_exit(&it);
+	return ret;
+}
+
+/* unpack one file or directory to @dirout */
+static int unpack_path(struct ext2_editor_private_data *p,
+		       struct threadpool *tp, const char *path,
+		       const char *dirout)
+{
+	struct ext2_inode inode;
+	const char *filename;
+	uint32_t ino;
+	int dirfd, ret;
+
+	ret = ext2_namei(p, path, false, &ino);
+	if (ret < 0)
+		return ret;
+
+	ret = ext2_read_inode(p, ino, &inode);
+	if (ret < 0)
+		return ret;
+
+	if ((le16_to_cpu(inode.mode) & INODE_MODE_S_MASK) == INODE_MODE_S_IFDIR)
+		return unpack_dirent(p, tp, ino, AT_FDCWD, dirout);
+
+	dirfd = openat(AT_FDCWD, dirout, O_RDONLY | O_DIRECTORY);
+	if (dirfd < 0) {
+		fprintf(stderr, "Error: open dir %s failed: %m\n", dirout);
+		return dirfd;
+	}
+
+	filename = strrchr(path, '/');
+	filename = filename ? filename + 1 : path;
+
+	switch (le16_to_cpu(inode.mode) & INODE_MODE_S_MASK) {
+	case INODE_MODE_S_IFREG:
+		ret = unpack_file(p, tp, ino, dirfd, filename);
+		break;
+	case INODE_MODE_S_IFLINK:
+		ret = unpack_symlink(p, ino, dirfd, filename);
+		break;
+	default:
+		fprintf(stderr, "Error: unpack %s is not supported\n", path);
+		ret = -1;
+		break;
+	}
+
+	close(dirfd);
+	return ret;
+}
+
+/* --unpack image -- [--replay] [--path /path/of/file-or-dir] */
+static int ext2_unpack(void *private_data, int fd, const char *dirout, int argc, char **argv)
+{
+	struct ext2_editor_private_data *p = private_data;
+	const char *path = NULL;
+	struct threadpool *tp;
+	int ret, ret_wait;
+
+	for (int i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "--replay")) {
+			ret = ext2_load_replay_overlay(p);
+			if (ret < 0)
+				return ret;
+		} else if (!strcmp(argv[i], "--path") && i + 1 < argc) {
+			path = argv[++i];
+		}
+	}
+
+	/* the directory tree is walked in this thread, and the file data is
+	 * copied by the worker threads.
+	 */
+	tp = alloc_threadpool(get_parallel_jobs(), 0);
+	if (!tp)
+		return -1;
+
+	if (path)
+		ret = unpack_path(p, tp, path, dirout);
+	else
+		ret = unpack_dirent(p, tp, EXT2_ROOT_INO, AT_FDCWD, dirout);
+	ret_wait = threadpool_wait(tp);
+	threadpool_free(tp);
+
+	return ret < 0 ? ret : ret_wait;
+}
+
+/* build an ext4 image from a directory:
+ * imgeditor --type ext2 --pack dir out.img -- [OPTIONS]
+ *
+ * the blocks are allocated continuously from the first group and the files
+ * are saved in extents. the metadata is written by the main thread and the
+ * file data is copied by the worker threads.
+ */
+#define EXT2_PACK_INODE_RATIO		16384
+#define EXT2_PACK_FIRST_INO		11
+#define EXT2_PACK_LPF_INO		EXT2_PACK_FIRST_INO
+
+struct ext2_pack_node {
+	char				*path; /* NULL if not exist in the source */
+	const char			*name;
+	struct stat			st;
+
+	struct ext2_pack_node		*parent;
+	struct ext2_pack_node		**children;
+	size_t				n_children;
+	size_t				max_children;
+
+	/* the hard link target, the inode is shared with it */
+	struct ext2_pack_node		*link;
+
+	uint32_t			ino;
+	uint32_t			nlinks;
+
+	/* the directory blocks and the slow symlink target */
+	uint8_t				*data;
+	uint64_t			nblocks;
+
+	/* the extents of the data blocks and the blocks of the extent tree */
+	struct ext4_extent		*extents;
+	size_t				n_extents;
+	uint64_t			*tree_blocks;
+	size_t				n_tree_blocks;
+	int				tree_depth;
+};
+
+struct ext2_pack_arg {
+	const char			*size;
+	int				block_size;
+	int				inode_size;
+	unsigned long			inodes;
+	const char			*label;
+	const char			*uuid;
+	const char			*hash_seed;
+	const char			*features;
+	unsigned long			timestamp;
+	bool				sparse;
+};
+
+struct ext2_pack_context {
+	struct ext2_editor_private_data	*p;
+	struct ext2_pack_arg		arg;
+	int				fd;
+
+	struct ext2_pack_node		*root;
+	/* the nodes sorted by inode number, the hard links are not included */
+	struct ext2_pack_node		**inodes;
+	uint32_t			n_inodes;
+	uint32_t			last_ino;
+
+	/* the blocks used by directories, files and extent trees */
+	uint64_t			data_blocks;
+
+	bool				metadata_csum;
+	bool				is_64bit;
+	bool				dir_index;
+
+	/* all inode times are @arg.timestamp, the times of the source files
+	 * are changed by walking them.
+	 */
+	bool				fixed_time;
+
+	/* the allocator cursor */
+	uint32_t			alloc_group;
+	uint32_t			alloc_offset;
+};
+
+static int ext2_pack_add_child(struct ext2_pack_node *dir,
+			       struct ext2_pack_node *child)
+{
+	if (dir->n_children >= dir->max_children) {
+		size_t max_children = dir->max_children ?
+					dir->max_children * 2 : 16;
+		struct ext2_pack_node **children;
+
+		children = realloc(dir->children,
+				   max_children * sizeof(*children));
+		if (!children) {
+			fprintf(stderr, "Error: alloc %zu children failed\n",
+				max_children);
+			return -1;
+		}
+
+		dir->children = children;
+		dir->max_children = max_children;
+	}
+
+	child->parent = dir;
+	dir->children[dir->n_children++] = child;
+	return 0;
+}
+
+static struct ext2_pack_node *ext2_pack_new_node(const char *path)
+{
+	struct ext2_pack_node *n = calloc(1, sizeof(*n));
+
+	if (!n) {
+		fprintf(stderr, "Error: alloc pack node failed\n");
+		return NULL;
+	}
+
+	if (path) {
+		n->path = strdup(path);
+		if (!n->path) {
+			free(n);
+			return NULL;
+		}
+
+		n->name = strrchr(n->path, '/');
+		n->name = n->name ? n->name + 1 : n->path;
+	}
+
+	return n;
+}
+
+static void ext2_pack_free_node(struct ext2_pack_node *n)
+{
+	for (size_t i = 0; i < n->n_children; i++)
+		ext2_pack_free_node(n->children[i]);
+
+	free(n->children);
+	free(n->path);
+	free(n->data);
+	free(n->extents);
+	free(n->tree_blocks);
+	free(n);
+}
+
+static int ext2_pack_compare_name(const void *a, const void *b)
+{
+	const struct ext2_pack_node *na = *(const struct ext2_pack_node **)a;
+	const struct ext2_pack_node *nb = *(const struct ext2_pack_node **)b;
+
+	return strcmp(na->name, nb->name);
+}
+
+/* the children are sorted by name, so the image is the same for the same
+ * directory tree.
+ */
+static int ext2_pack_scan(struct ext2_pack_context *c,
+			  struct ext2_pack_node *dir)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	DIR *dp;
+	int ret = 0;
+
+	dp = opendir(dir->path);
+	if (!dp) {
+		fprintf(stderr, "Error: open dir %s failed: %m\n", dir->path);
+		return -1;
+	}
+
+	while ((d = readdir(dp)) != NULL && ret == 0) {
+		struct ext2_pack_node *n;
+
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+
+		/* lost+found is created by us and .imgeditor is the type
+		 * marker created by --unpack.
+		 */
+		if (dir == c->root && (!strcmp(d->d_name, "lost+found")
+				       || !strcmp(d->d_name, ".imgeditor")))
+			continue;
 
-		++data_blks;
+		if (strlen(d->d_name) > EXT2_NAME_LEN) {
+			fprintf(stderr, "Error: the name of %s/%s is too long\n",
+				dir->path, d->d_name);
+			ret = -1;
+			break;
+		}
 
-		if (incompat_features & JBD2_FEATURE_INCOMPAT_CSUM_V3) {
-			blocknr = be32_to_cpu(tag3->t_blocknr_high);
-			blocknr <<= 32;
-			blocknr |= be32_to_cpu(tag3->t_blocknr);
-			flags = be32_to_cpu(tag3->t_flags);
-		} else {
-			if (incompat_features & JBD2_FEATURE_INCOMPAT_64BIT)
-				blocknr = be32_to_cpu(tag->t_blocknr_high);
-			blocknr <<= 32;
-			blocknr |= be32_to_cpu(tag->t_blocknr);
-			flags = be16_to_cpu(tag->t_flags);
+		snprintf(path, sizeof(path), "%s/%s", dir->path, d->d_name);
+		n = ext2_pack_new_node(path);
+		if (!n) {
+			ret = -1;
+			break;
 		}
 
-		if (arg->desc_handler) {
-			arg->desc_handler(arg, this, blocknr,
-					 journal_start_blkno + data_blks,
-					 flags);
+		if (lstat(path, &n->st) < 0) {
+			fprintf(stderr, "Error: stat %s failed: %m\n", path);
+			ext2_pack_free_node(n);
+			ret = -1;
+			break;
 		}
 
-		if (flags & EXT3_JOURNAL_FLAG_LAST_TAG)
+		ret = ext2_pack_add_child(dir, n);
+		if (ret < 0) {
+			ext2_pack_free_node(n);
 			break;
+		}
 
-		p += tagsize;
-		if (!(flags & EXT3_JOURNAL_FLAG_SAME_UUID))
-			p += 16;
+		c->n_inodes++;
+		if (S_ISDIR(n->st.st_mode))
+			ret = ext2_pack_scan(c, n);
 	}
 
-	*ret_data_blks = data_blks;
-	return 0;
+	closedir(dp);
+
+	if (dir->n_children > 1)
+		qsort(dir->children, dir->n_children, sizeof(dir->children[0]),
+		      ext2_pack_compare_name);
+
+	return ret;
 }
 
-static int ext2_foreach_journal(struct journal_foreach_arg *arg)
+static void ext2_pack_collect_links(struct ext2_pack_node *dir,
+				    struct ext2_pack_node **links,
+				    size_t *n_links)
 {
-	void *p = arg->journal_buf;
-	uint32_t journal_blkno = 0;
+	for (size_t i = 0; i < dir->n_children; i++) {
+		struct ext2_pack_node *n = dir->children[i];
 
-	arg->break_next = 0;
-	arg->sb = arg->journal_buf + sizeof(struct journal_header_t);
+		if (S_ISDIR(n->st.st_mode))
+			ext2_pack_collect_links(n, links, n_links);
+		else if (n->path && n->st.st_nlink > 1)
+			links[(*n_links)++] = n;
+	}
+}
 
-	while (p - arg->journal_buf < (int)arg->journal_size) {
-		struct journal_header_t *h = p;
-		uint32_t blocktype = be32_to_cpu(h->h_blocktype);
-		uint32_t skip_size = be32_to_cpu(arg->sb->s_blocksize);
+static int ext2_pack_compare_link(const void *a, const void *b)
+{
+	const struct ext2_pack_node *na = *(const struct ext2_pack_node **)a;
+	const struct ext2_pack_node *nb = *(const struct ext2_pack_node **)b;
 
-		if (be32_to_cpu(h->h_magic) != EXT3_JOURNAL_MAGIC_NUMBER)
-			goto next;
+	if (na->st.st_dev != nb->st.st_dev)
+		return na->st.st_dev < nb->st.st_dev ? -1 : 1;
+	if (na->st.st_ino != nb->st.st_ino)
+		return na->st.st_ino < nb->st.st_ino ? -1 : 1;
 
-		switch (blocktype) {
-		case EXT3_JOURNAL_DESCRIPTOR_BLOCK:
-		case EXT3_JOURNAL_COMMIT_BLOCK:
-		case EXT3_JOURNAL_SUPERBLOCK_V1:
-		case EXT3_JOURNAL_SUPERBLOCK_V2:
-		case EXT3_JOURNAL_REVOKE_BLOCK:
-			if (arg->class_handler) {
-				arg->class_handler(arg, h, h + 1, journal_blkno);
-				if (arg->break_next)
-					return 0;
-			}
-			break;
-		default:
-			goto next;
-		}
+	/* the first one in the tree owns the inode */
+	return strcmp(na->path, nb->path);
+}
 
-		switch (blocktype) {
-		case EXT3_JOURNAL_DESCRIPTOR_BLOCK:
-			{
-				uint32_t n_data_blk = 0;
+/* the files have the same st_dev and st_ino share one inode */
+static int ext2_pack_resolve_links(struct ext2_pack_context *c)
+{
+	struct ext2_pack_node **links;
+	size_t n_links = 0;
 
-				/* In general, the dta blocks being written to
-				 * disk through the journal are written
-				 * verbatim into the journal file after the
-				 * descriptor block.
-				 */
-				ext2_journal_foreach_descriptor(arg, h, h + 1,
-								journal_blkno,
-								&n_data_blk);
+	links = calloc(c->n_inodes + 1, sizeof(*links));
+	if (!links) {
+		fprintf(stderr, "Error: alloc hard link table failed\n");
+		return -1;
+	}
 
-				journal_blkno += n_data_blk;
-				skip_size +=
-					(n_data_blk * be32_to_cpu(arg->sb->s_blocksize));
-			}
-			break;
-		}
+	ext2_pack_collect_links(c->root, links, &n_links);
+	if (n_links > 1)
+		qsort(links, n_links, sizeof(links[0]), ext2_pack_compare_link);
 
-	next:
-		p += skip_size;
-		journal_blkno++;
+	for (size_t i = 1; i < n_links; i++) {
+		struct ext2_pack_node *prev = links[i - 1];
+
+		if (prev->st.st_dev == links[i]->st.st_dev
+		    && prev->st.st_ino == links[i]->st.st_ino) {
+			links[i]->link = prev->link ? prev->link : prev;
+			c->n_inodes--;
+		}
 	}
 
+	free(links);
 	return 0;
 }
 
-static int ext2_do_journal_list(struct ext2_editor_private_data *ext2,
-				void *journal_buf, size_t journal_size)
+static void ext2_pack_assign_ino(struct ext2_pack_context *c,
+				 struct ext2_pack_node *dir)
 {
-	struct journal_foreach_arg arg = {
-		.ext			= ext2,
-		.journal_buf		= journal_buf,
-		.journal_size		= journal_size,
-		.class_handler		= ext2_journal_print_class,
-		.desc_handler		= ext2_journal_print_desc,
-	};
+	for (size_t i = 0; i < dir->n_children; i++) {
+		struct ext2_pack_node *n = dir->children[i];
 
-	return ext2_foreach_journal(&arg);
+		if (n->link) {
+			n->link->nlinks++;
+			continue;
+		}
+
+		if (!n->ino)
+			n->ino = ++c->last_ino;
+		c->inodes[n->ino] = n;
+		n->nlinks = 1;
+
+		if (S_ISDIR(n->st.st_mode)) {
+			/* "." in itself and ".." in the parent */
+			n->nlinks++;
+			dir->nlinks++;
+			ext2_pack_assign_ino(c, n);
+		}
+	}
 }
 
-static int ext2_do_journal_superblock(void *journal_buf, size_t journal_size)
+static uint8_t ext2_pack_filetype(mode_t mode)
 {
-	structure_print("%-30s", journal_buf, ext4_journal_header_structure);
+	switch (mode & S_IFMT) {
+	case S_IFREG:
+		return EXT4_FT_REG_FILE;
+	case S_IFDIR:
+		return EXT4_FT_DIR;
+	case S_IFCHR:
+		return EXT4_FT_CHRDEV;
+	case S_IFBLK:
+		return EXT4_FT_BLKDEV;
+	case S_IFIFO:
+		return EXT4_FT_FIFO;
+	case S_IFSOCK:
+		return EXT4_FT_SOCK;
+	case S_IFLNK:
+		return EXT4_FT_SYMLINK;
+	}
 
-	structure_print("%-30s",
-			journal_buf + sizeof(struct journal_header_t),
-			ext4_journal_sblock_structure);
-	return 0;
+	return EXT4_FT_UNKNOWN;
 }
 
-static int ext2_do_journal_block(int argc, char **argv,
-				 void *journal_buf, size_t journal_size)
+#define ext2_dirent_len(namelen)	aligned_length(sizeof(struct ext2_dirent) + (namelen), 4)
+
+/* append a dirent to the directory blocks, the last dirent of each block
+ * covers the free space.
+ */
+static int ext2_pack_add_dirent(struct ext2_pack_context *c,
+				struct ext2_pack_node *dir,
+				size_t *used, struct ext2_dirent **last,
+				uint32_t ino, const char *name, uint8_t filetype)
 {
-	struct journal_superblock_t *sb = journal_buf + sizeof(struct journal_header_t);
-	uint32_t blksize = be32_to_cpu(sb->s_blocksize);
-	uint32_t blkno;
+	size_t block_size = c->p->block_size;
+	size_t tail = c->metadata_csum ? sizeof(struct ext4_dir_entry_tail) : 0;
+	size_t namelen = strlen(name), reclen = ext2_dirent_len(namelen);
+	size_t block_end = (dir->nblocks ? dir->nblocks : 1) * block_size - tail;
+	struct ext2_dirent *de;
+
+	if (!dir->data || *used + reclen > block_end) {
+		uint8_t *data;
+
+		data = realloc(dir->data, (dir->nblocks + 1) * block_size);
+		if (!data) {
+			fprintf(stderr, "Error: alloc directory block failed\n");
+			return -1;
+		}
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage: journal block #blkno\n");
-		return -1;
+		memset(data + dir->nblocks * block_size, 0, block_size);
+		dir->data = data;
+		*used = dir->nblocks * block_size;
+		dir->nblocks++;
+		*last = NULL;
+		block_end = dir->nblocks * block_size - tail;
 	}
 
-	blkno = (uint32_t)strtol(argv[1], NULL, 10);
-	if (blkno * blksize >= journal_size) {
-		fprintf(stderr, "Error: journal blk #%d overrange\n", blkno);
-		return -1;
-	}
+	de = (struct ext2_dirent *)(dir->data + *used);
+	de->inode = cpu_to_le32(ino);
+	de->direntlen = cpu_to_le16(block_end - *used);
+	de->namelen = namelen;
+	de->filetype = filetype;
+	memcpy(de + 1, name, namelen);
 
-	hexdump(journal_buf + blkno * blksize, blksize, 0);
+	/* the previous one is shorten to the real length */
+	if (*last)
+		(*last)->direntlen = cpu_to_le16((uint8_t *)de - (uint8_t *)*last);
+
+	*last = (struct ext2_dirent *)(dir->data + *used);
+	*used += reclen;
 	return 0;
 }
 
-static int ext2_do_journal(void *private_data, int fd, int argc, char **argv)
+static void ext2_pack_add_dirent_tails(struct ext2_pack_context *c,
+				       struct ext2_pack_node *dir)
 {
-	struct ext2_editor_private_data *p = private_data;
-	uint64_t journal_size;
-	void *journal_buf;
-	int ret = -1;
+	size_t block_size = c->p->block_size;
 
-	journal_buf = alloc_inode_file(p, le32_to_cpu(p->sblock.journal_inode),
-				       &journal_size);
-	if (!journal_buf)
-		return -1;
+	for (uint64_t i = 0; i < dir->nblocks; i++) {
+		struct ext4_dir_entry_tail *t = (struct ext4_dir_entry_tail *)
+			(dir->data + (i + 1) * block_size - sizeof(*t));
 
-	if (argc <= 1)
-		ret = ext2_do_journal_list(p, journal_buf, journal_size);
-	else if (!strcmp(argv[1], "sblock"))
-		ret = ext2_do_journal_superblock(journal_buf, journal_size);
-	else if (!strcmp(argv[1], "block"))
-		ret = ext2_do_journal_block(argc - 1, argv + 1, journal_buf, journal_size);
+		t->det_rec_len = cpu_to_le16(sizeof(*t));
+		t->det_reserved_ft = EXT4_FT_DIR_CSUM;
+	}
+}
+
+static int ext2_pack_build_dir(struct ext2_pack_context *c,
+			       struct ext2_pack_node *dir)
+{
+	uint32_t parent_ino = dir->parent ? dir->parent->ino : dir->ino;
+	struct ext2_dirent *last = NULL;
+	size_t used = 0;
+	int ret;
+
+	ret = ext2_pack_add_dirent(c, dir, &used, &last, dir->ino, ".",
+				   EXT4_FT_DIR);
+	if (ret == 0)
+		ret = ext2_pack_add_dirent(c, dir, &used, &last, parent_ino,
+					   "..", EXT4_FT_DIR);
+
+	for (size_t i = 0; ret == 0 && i < dir->n_children; i++) {
+		struct ext2_pack_node *n = dir->children[i];
+		struct ext2_pack_node *target = n->link ? n->link : n;
+
+		ret = ext2_pack_add_dirent(c, dir, &used, &last, target->ino,
+					   n->name,
+					   ext2_pack_filetype(target->st.st_mode));
+	}
+
+	if (ret == 0 && c->metadata_csum)
+		ext2_pack_add_dirent_tails(c, dir);
 
-	free(journal_buf);
 	return ret;
 }
 
-static int ext2_do_orphan(void *private_data, int fd, int argc, char **argv)
+/* build the directory blocks and load the slow symlinks */
+static int ext2_pack_build_data(struct ext2_pack_context *c)
 {
-	struct ext2_editor_private_data *p = private_data;
-	uint32_t total_inodes = le32_to_cpu(p->sblock.total_inodes);
+	size_t block_size = c->p->block_size;
 
-	for (uint32_t i = 1; i < total_inodes; i++) {
-		struct ext2_inode inode;
-		uint32_t dtime;
+	for (uint32_t ino = EXT2_ROOT_INO; ino <= c->last_ino; ino++) {
+		struct ext2_pack_node *n = c->inodes[ino];
+		char target[PATH_MAX];
+		ssize_t len;
 		int ret;
 
-		ret = ext2_read_inode(p, i, &inode);
-		if (ret < 0) {
-			fprintf(stderr, "Warnning: scan not completed. "
-					"%d/%d\n",
-				i, total_inodes);
+		if (!n)
+			continue;
+
+		switch (n->st.st_mode & S_IFMT) {
+		case S_IFDIR:
+			ret = ext2_pack_build_dir(c, n);
+			if (ret < 0)
+				return ret;
 			break;
-		}
+		case S_IFREG:
+			n->nblocks = aligned_block(n->st.st_size, block_size);
+			break;
+		case S_IFLNK:
+			len = readlink(n->path, target, sizeof(target));
+			if (len < 0 || len >= (ssize_t)sizeof(target)
+			    || len >= (ssize_t)block_size) {
+				fprintf(stderr, "Error: read link %s failed\n",
+					n->path);
+				return -1;
+			}
 
-		if (be16_to_cpu(inode.nlinks)) /* inode was alive */
-			continue;
+			n->data = calloc(1, block_size);
+			if (!n->data)
+				return -1;
 
-		dtime = le32_to_cpu(inode.dtime);
-		if (dtime && dtime < total_inodes)
-			printf("inode #%-6d in orphan list\n", i);
+			memcpy(n->data, target, len);
+			n->st.st_size = len;
+
+			/* the fast symlink is saved in the inode */
+			if (len >= (ssize_t)sizeof(((struct ext2_inode *)0)->b.symlink))
+				n->nblocks = 1;
+			break;
+		}
+
+		if (n->nblocks >= UINT32_MAX) {
+			fprintf(stderr, "Error: %s is too large\n", n->path);
+			return -1;
+		}
 	}
 
 	return 0;
 }
 
-static int ext2_do_layout(void *private_data, int fd, int argc, char **argv)
+static uint32_t ext2_pack_extents_per_block(struct ext2_pack_context *c)
 {
-	struct ext2_editor_private_data *p = private_data;
+	return (c->p->block_size - sizeof(struct ext4_extent_header))
+		/ sizeof(struct ext4_extent);
+}
 
-	printf("%8s %8s %8s\n", "start", "end", "blocks");
-	for (size_t i = 0; i < p->n_layout; i++) {
-		struct disk_layout *layout = &p->layouts[i];
-		char s[256];
+/* the inode saves 4 extents, more extents are saved in the tree */
+#define EXT2_INODE_EXTENTS						\
+	((sizeof(((struct ext2_inode *)0)->b.blocks)			\
+	  - sizeof(struct ext4_extent_header)) / sizeof(struct ext4_extent))
 
-		if (layout->major_type < 0
-			|| layout->major_type >= DISK_LAYOUT_MAX)
-			return -1;
+static uint64_t ext2_pack_tree_blocks(struct ext2_pack_context *c,
+				      uint64_t n_extents, int *depth)
+{
+	uint32_t per_block = ext2_pack_extents_per_block(c);
+	uint64_t blocks = 0;
+
+	*depth = 0;
+	while (n_extents > EXT2_INODE_EXTENTS) {
+		n_extents = (n_extents + per_block - 1) / per_block;
+		blocks += n_extents;
+		++*depth;
+	}
 
-		printf("%8d %8d %8d ",
-			layout->start_block,
-			layout->start_block + layout->len_block - 1,
-			layout->len_block);
+	return blocks;
+}
 
-		format_disk_layout(layout, s, sizeof(s));
-		printf("%s", s);
+/* the data blocks of all files include the extent trees, the extents
+ * are split by the group metadata in the worst case.
+ */
+static uint64_t ext2_pack_estimate_blocks(struct ext2_pack_context *c,
+					  uint32_t group_data_blocks)
+{
+	uint64_t total = 0;
 
-		printf("\n");
+	for (uint32_t ino = EXT2_ROOT_INO; ino <= c->last_ino; ino++) {
+		struct ext2_pack_node *n = c->inodes[ino];
+		uint64_t n_extents;
+		int depth;
+
+		if (!n || !n->nblocks)
+			continue;
+
+		n_extents = n->nblocks / group_data_blocks + 2;
+		if (group_data_blocks > EXT_INIT_MAX_LEN)
+			n_extents += n->nblocks / EXT_INIT_MAX_LEN;
+
+		total += n->nblocks + ext2_pack_tree_blocks(c, n_extents, &depth);
 	}
 
-	return 0;
+	return total;
 }
 
-/* show extent in block address */
-static int ext2_do_whohas(void *private_data, int fd, int argc, char **argv)
+static unsigned long long ext2_pack_parse_size(const char *s)
 {
-	struct ext2_editor_private_data *p = private_data;
-	const struct disk_layout *layout;
-	int ino = -1, blkno = -1;
-	int ret;
+	unsigned long long n;
+	char *endp;
+
+	n = strtoull(s, &endp, 0);
+	switch (*endp) {
+	case 'T':
+		n <<= 10;
+		/* fallthrough */
+	case 'G':
+		n <<= 10;
+		/* fallthrough */
+	case 'M':
+		n <<= 10;
+		/* fallthrough */
+	case 'K':
+	case 'k':
+		n <<= 10;
+		endp++;
+		break;
+	}
 
-	if (argc > 1)
-		blkno = (int)strtol(argv[1], NULL, 0);
+	if (!strcmp(endp, "iB") || !strcmp(endp, "B"))
+		endp += strlen(endp);
 
-	if (blkno < 0) {
-		fprintf(stderr, "Usage: ext2 whohas #blkno\n");
-		return -1;
-	}
+	return *endp == '\0' ? n : 0;
+}
 
-	layout = ext2_editor_disk_layout_match_block(p, blkno);
-	if (layout) {
-		char s[256];
+static int ext2_pack_parse_uuid(const char *s, uint8_t *uuid)
+{
+	for (int i = 0; i < 16; i++) {
+		unsigned int byte;
 
-		format_disk_layout(layout, s, sizeof(s));
-		printf("%s\n", s);
-		return 0;
+		if (*s == '-')
+			s++;
+
+		if (!isxdigit(s[0]) || !isxdigit(s[1])
+		    || sscanf(s, "%2x", &byte) != 1)
+			return -1;
+
+		uuid[i] = byte;
+		s += 2;
 	}
 
-	ret = ext2_whohas_blkno(p, blkno, &ino);
-	if (!ret) {
-		printf("inode #%d\n", ino);
+	return *s == '\0' ? 0 : -1;
+}
+
+/* the random uuid (version 4) is used if @s is NULL */
+static int ext2_pack_uuid(const char *s, const char *name, void *uuid)
+{
+	uint8_t *u = uuid;
+	int fd, ret;
+
+	if (s) {
+		ret = ext2_pack_parse_uuid(s, u);
+		if (ret < 0)
+			fprintf(stderr, "Error: bad %s %s\n", name, s);
 		return ret;
 	}
 
-	return -1;
+	fd = fileopen("/dev/urandom", O_RDONLY, 0);
+	if (fd < 0)
+		return fd;
+
+	ret = fileread(fd, u, 16);
+	close(fd);
+
+	u[6] = (u[6] & 0x0f) | 0x40;
+	u[8] = (u[8] & 0x3f) | 0x80;
+	return ret;
 }
 
-#ifdef CONFIG_ENABLE_ANDROID
-static int ext2_write_sparse_chunk(int fd_target,
-				   struct android_sparse_chunk *chunk,
-				   void *private_data)
+static int ext2_pack_parse_features(struct ext2_pack_context *c)
 {
-	off64_t target_offset = lseek64(fd_target, 0, SEEK_CUR);
-	struct ext2_editor_private_data *p = private_data;
+	char features[256], *saveptr, *f;
+
+	if (!c->arg.features)
+		return 0;
+
+	snprintf(features, sizeof(features), "%s", c->arg.features);
+	for (f = strtok_r(features, ",", &saveptr); f;
+	     f = strtok_r(NULL, ",", &saveptr)) {
+		bool enable = *f != '^';
+
+		if (!enable)
+			f++;
+
+		if (!strcmp(f, "metadata_csum"))
+			c->metadata_csum = enable;
+		else if (!strcmp(f, "64bit"))
+			c->is_64bit = enable;
+		else if (!strcmp(f, "dir_index"))
+			c->dir_index = enable;
+		else {
+			fprintf(stderr, "Error: feature %s is not supported\n",
+				f);
+			return -1;
+		}
+	}
 
-	dd64(p->fd, fd_target,
-		chunk->fs_blocknr * p->block_size,
-		target_offset,
-		chunk->count * p->block_size,
-		NULL, NULL);
 	return 0;
 }
 
-static int ext2_do_sparse(void *private_data, int fd, int argc, char **argv)
+static uint32_t ext2_pack_group_overhead(struct ext2_pack_context *c,
+					 uint32_t group)
 {
-	struct ext2_editor_private_data *p = private_data;
-	struct android_sparse_input input;
-	int ret = -1, fd_target;
+	struct ext2_editor_private_data *p = c->p;
+	uint32_t ipg = le32_to_cpu(p->sblock.inodes_per_group);
+	uint32_t blocks = 2 + aligned_block((size_t)ipg * p->inode_size,
+					    p->block_size);
 
-	if (argc < 2) {
-		fprintf(stderr, "Usage: sparse output.simg\n");
+	if (group == 0 || ext2_block_group_has_backup_sb(&p->sblock, group))
+		blocks += 1 + aligned_block((size_t)p->n_block_group
+					    * p->descriptor_size,
+					    p->block_size);
+
+	return blocks;
+}
+
+/* set the group count and the inodes per group for @total_blocks, returns
+ * the number of free blocks after the metadata.
+ */
+static int64_t ext2_pack_layout_groups(struct ext2_pack_context *c,
+				       uint64_t *total_blocks, bool fixed)
+{
+	struct ext2_editor_private_data *p = c->p;
+	struct ext2_sblock *sb = &p->sblock;
+	uint32_t first_data_block = le32_to_cpu(sb->first_data_block);
+	uint32_t bpg = le32_to_cpu(sb->blocks_per_group);
+	uint32_t inodes_per_block = p->block_size / p->inode_size;
+	uint64_t n_groups, inodes, ipg, last, overhead = 0;
+
+	n_groups = (*total_blocks - first_data_block + bpg - 1) / bpg;
+	if (n_groups > UINT32_MAX)
+		return -1;
+	p->n_block_group = n_groups;
+
+	inodes = c->arg.inodes;
+	if (!inodes)
+		inodes = *total_blocks * p->block_size / EXT2_PACK_INODE_RATIO;
+	if (inodes < c->last_ino)
+		inodes = c->last_ino;
+
+	ipg = (inodes + n_groups - 1) / n_groups;
+	ipg = aligned_length(ipg, inodes_per_block);
+	ipg = aligned_length(ipg, 8);
+	if (ipg > bpg)
+		ipg = bpg;
+	if (ipg * n_groups < c->last_ino) {
+		fprintf(stderr, "Error: %u inodes are requested but only "
+				"%" PRIu64 " can be used\n",
+			c->last_ino, ipg * n_groups);
 		return -1;
 	}
+	sb->inodes_per_group = cpu_to_le32(ipg);
+
+	for (uint32_t group = 0; group < n_groups; group++)
+		overhead += ext2_pack_group_overhead(c, group);
+
+	/* the last group should be large enough for its metadata */
+	last = *total_blocks - first_data_block - (n_groups - 1) * bpg;
+	if (last < ext2_pack_group_overhead(c, n_groups - 1) + 64) {
+		if (!fixed) {
+			*total_blocks += ext2_pack_group_overhead(c, n_groups - 1)
+					 + 64 - last;
+			return ext2_pack_layout_groups(c, total_blocks, fixed);
+		} else if (n_groups == 1) {
+			fprintf(stderr, "Error: %" PRIu64 " blocks are too small "
+					"for a filesystem\n",
+				*total_blocks);
+			return -1;
+		}
 
-	fd_target = fileopen(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0664);
-	if (fd_target < 0)
-		goto done;
+		*total_blocks -= last;
+		return ext2_pack_layout_groups(c, total_blocks, fixed);
+	}
 
-	android_sparse_init(&input, p->block_size,
-			    le32_to_cpu(p->sblock.total_blocks));
+	return *total_blocks - first_data_block - overhead;
+}
 
-	/* appending meta data */
-	for (size_t i = 0; i < p->n_layout; i++) {
-		struct disk_layout *layout = &p->layouts[i];
+static int ext2_pack_init_geometry(struct ext2_pack_context *c)
+{
+	struct ext2_editor_private_data *p = c->p;
+	struct ext2_sblock *sb = &p->sblock;
+	uint64_t total_blocks = 0, need;
+	uint32_t group_data_blocks;
+	int64_t free_blocks;
+	bool fixed = false;
+
+	if (c->arg.size) {
+		total_blocks = ext2_pack_parse_size(c->arg.size) / p->block_size;
+		if (total_blocks == 0) {
+			fprintf(stderr, "Error: bad size %s\n", c->arg.size);
+			return -1;
+		}
+		fixed = true;
+	}
+
+	if (total_blocks > UINT32_MAX)
+		c->is_64bit = true;
+
+	p->descriptor_size = c->is_64bit ? EXT4_MIN_DESC_SIZE_64BIT
+					 : EXT2_MIN_DESC_SIZE;
+	sb->first_data_block = cpu_to_le32(p->block_size == 1024 ? 1 : 0);
+	sb->blocks_per_group = cpu_to_le32(p->block_size * 8);
+	sb->fragments_per_group = sb->blocks_per_group;
+	sb->feature_ro_compat = cpu_to_le32(EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER);
+
+	/* the data blocks of a group without backup super block */
+	group_data_blocks = p->block_size * 8 - 2
+		- p->block_size * 8 * p->inode_size / EXT2_PACK_INODE_RATIO;
+	need = ext2_pack_estimate_blocks(c, group_data_blocks);
+
+	if (!fixed) {
+		/* 12.5% free space */
+		total_blocks = le32_to_cpu(sb->first_data_block)
+				+ need + need / 8 + 1024;
+		for (int i = 0; i < 64; i++) {
+			free_blocks = ext2_pack_layout_groups(c, &total_blocks,
+							      false);
+			if (free_blocks < 0)
+				return -1;
+			if ((uint64_t)free_blocks >= need + need / 8)
+				break;
+			total_blocks += need + need / 8 - free_blocks;
+		}
+	}
 
-		android_sparse_add_chunk(&input, layout->start_block,
-					 layout->len_block);
+	free_blocks = ext2_pack_layout_groups(c, &total_blocks, true);
+	if (free_blocks < 0 || (uint64_t)free_blocks < need) {
+		fprintf(stderr, "Error: the image is too small, %" PRIu64
+				" blocks are requested\n",
+			need);
+		return -1;
 	}
 
-	ext2_add_inode_chunks(p, &input);
-	if (input.error) {
-		fprintf(stderr, "Error: add sparse chunks failed. "
-				"(no enough memory?)\n");
-		goto done;
+	if (total_blocks > UINT32_MAX && !c->is_64bit) {
+		fprintf(stderr, "Error: 64bit feature is requested for %"
+				PRIu64 " blocks\n",
+			total_blocks);
+		return -1;
 	}
 
-	ret = android_sparse_finish(&input, fd_target,
-				    ext2_write_sparse_chunk, p);
-done:
-	close(fd_target);
-	return ret;
+	sb->total_blocks = cpu_to_le32(total_blocks);
+	sb->total_blocks_high = cpu_to_le32(total_blocks >> 32);
+	sb->total_inodes = cpu_to_le32(le32_to_cpu(sb->inodes_per_group)
+				       * p->n_block_group);
+	return 0;
 }
-#endif
 
-/* https://blogs.oracle.com/linux/post/the-resize-inode-in-the-ext4-filesystem */
-static int ext2_do_resize_inode(void *private_data, int fd, int argc, char **argv)
+static void ext2_pack_init_sblock(struct ext2_pack_context *c)
 {
-	struct ext2_editor_private_data *p = private_data;
-	struct ext2_inode inode;
-	uint32_t *dind_buf;
-	uint32_t dind;
-	int ret;
+	struct ext2_editor_private_data *p = c->p;
+	struct ext2_sblock *sb = &p->sblock;
+	uint32_t incompat = EXT4_FEATURE_INCOMPAT_FILETYPE
+			  | EXT4_FEATURE_INCOMPAT_EXTENTS;
+	uint32_t ro_compat = EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER
+			   | EXT4_FEATURE_RO_COMPAT_LARGE_FILE
+			   | EXT4_FEATURE_RO_COMPAT_DIR_NLINK;
+	uint32_t now = c->arg.timestamp;
+
+	if (c->is_64bit) {
+		incompat |= EXT4_FEATURE_INCOMPAT_64BIT;
+		sb->descriptor_size = cpu_to_le16(p->descriptor_size);
+	}
 
-	if (!(le32_to_cpu(p->sblock.feature_compatibility)
-		& EXT4_FEATURE_COMPAT_RESIZE_INODE)) {
-		fprintf(stderr, "No EXT4_FEATURE_COMPAT_RESIZE_INODE\n");
-		return 0;
+	if (p->inode_size > EXT4_GOOD_OLD_INODE_SIZE) {
+		ro_compat |= EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE;
+		sb->min_extra_inode_size = cpu_to_le16(sizeof(struct ext4_inode_extra));
+		sb->want_extra_inode_size = cpu_to_le16(sizeof(struct ext4_inode_extra));
 	}
 
-	if (!ext2_has_ro_compat_feature(&p->sblock, EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
-		fprintf(stderr, "No EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER\n");
-		return 0;
+	if (c->metadata_csum) {
+		ro_compat |= EXT4_FEATURE_RO_COMPAT_METADATA_CSUM;
+		sb->checksum_type = 1; /* crc32c */
+	} else {
+		ro_compat |= EXT4_FEATURE_RO_COMPAT_GDT_CSUM;
 	}
 
-	ret = ext2_read_inode(p, EXT2_RESIZE_INO, &inode);
-	if (ret < 0)
-		return ret;
+	if (c->dir_index) {
+		sb->feature_compatibility = cpu_to_le32(EXT4_FEATURE_COMPAT_DIR_INDEX);
+		sb->default_hash_version = DX_HASH_HALF_MD4;
+	}
 
-	dind = le32_to_cpu(inode.b.blocks.double_indir_block);
-	if (dind == 0) {
-		fprintf(stderr, "Error: double_indir_block in inode 7 is zero\n");
+	sb->feature_incompat = cpu_to_le32(incompat);
+	sb->feature_ro_compat = cpu_to_le32(ro_compat);
+
+	sb->log2_block_size = cpu_to_le32(__builtin_ctz(p->block_size)
+					  - EXT2_MIN_BLOCK_LOG_SIZE);
+	sb->log2_fragment_size = sb->log2_block_size;
+	sb->magic = cpu_to_le16(EXT2_MAGIC);
+	sb->fs_state = cpu_to_le16(1); /* cleanly umounted */
+	sb->error_handling = cpu_to_le16(1); /* continue */
+	sb->max_mnt_count = cpu_to_le16(0xffff);
+	sb->revision_level = cpu_to_le32(1); /* dynamic inode size */
+	sb->first_inode = cpu_to_le32(EXT2_PACK_FIRST_INO);
+	sb->inode_size = cpu_to_le16(p->inode_size);
+	sb->utime = cpu_to_le32(now);
+	sb->lastcheck = cpu_to_le32(now);
+	sb->mkfs_time = cpu_to_le32(now);
+	sb->flags = cpu_to_le32((char)-1 < 0 ? EXT2_FLAGS_SIGNED_HASH
+					     : EXT2_FLAGS_UNSIGNED_HASH);
+
+	if (c->arg.label)
+		memcpy(sb->volume_name, c->arg.label,
+		       strnlen(c->arg.label, sizeof(sb->volume_name)));
+
+	p->fragment_size = p->block_size;
+	ext2_init_csum_seed(p);
+}
+
+static int ext2_pack_init_groups(struct ext2_pack_context *c)
+{
+	struct ext2_editor_private_data *p = c->p;
+	uint32_t first_data_block = le32_to_cpu(p->sblock.first_data_block);
+	uint32_t bpg = le32_to_cpu(p->sblock.blocks_per_group);
+	uint64_t total_blocks = ext2_total_blocks(&p->sblock);
+	uint32_t group_block = first_data_block;
+	int ret;
+
+	p->block_groups = calloc(p->n_block_group, sizeof(*p->block_groups));
+	if (!p->block_groups) {
+		fprintf(stderr, "Error: alloc %u ext2_block_groups failed\n",
+			p->n_block_group);
 		return -1;
 	}
 
-	dind_buf = ext2_alloc_read_block(p, dind);
-	if (!dind_buf) {
-		fprintf(stderr, "Error: raad dind block #%d failed\n", dind);
-		return -1;
+	/* the bitmaps and the inode table are saved after the backup
+	 * super block and the group descriptors.
+	 */
+	for (uint32_t group = 0; group < p->n_block_group; group++) {
+		struct ext2_block_group *bgrp = &p->block_groups[group];
+		uint64_t blkno = group_block + ext2_pack_group_overhead(c, group)
+			- 2 - aligned_block((size_t)p->inode_size
+				* le32_to_cpu(p->sblock.inodes_per_group),
+				p->block_size);
+
+		bgrp->block_id = cpu_to_le32(blkno);
+		bgrp->block_id_high = cpu_to_le32(blkno >> 32);
+		blkno++;
+		bgrp->inode_id = cpu_to_le32(blkno);
+		bgrp->inode_id_high = cpu_to_le32(blkno >> 32);
+		blkno++;
+		bgrp->inode_table_id = cpu_to_le32(blkno);
+		bgrp->inode_table_id_high = cpu_to_le32(blkno >> 32);
+		bgrp->bg_flags = cpu_to_le16(EXT4_BG_INODE_ZEROED);
+
+		group_block += bpg;
 	}
 
-	printf("DIND block is: #%d\n", dind);
+	ret = ext2_new_bitmasks(p);
+	if (ret < 0)
+		return ret;
 
-	printf("%4s  ", " ");
-	for (size_t group = 1; group < p->n_block_group;) {
-		char s[32];
+	ret = ext2_editor_init_layouts(p);
+	if (ret < 0)
+		return ret;
 
-		snprintf(s, sizeof(s), "group%zu", group);
-		printf("%8s ", s);
+	for (size_t i = 0; i < p->n_layout; i++) {
+		struct disk_layout *layout = &p->layouts[i];
 
-		group = next_sparse_super_block_number(group);
+		bitmask_set_bits(p->data_block_bitmask[layout->group],
+				 layout->start_block - first_data_block
+				 - (uint64_t)layout->group * bpg,
+				 layout->len_block);
 	}
-	printf("\n");
 
-	for (uint32_t i = 0; i < p->block_size / sizeof(uint32_t); i++) {
-		uint32_t *ind, ind_blk = dind_buf[i];
+	/* the blocks after the end of filesystem are marked as used */
+	group_block = first_data_block + (uint64_t)(p->n_block_group - 1) * bpg;
+	if (total_blocks - group_block < bpg)
+		bitmask_set_bits(p->data_block_bitmask[p->n_block_group - 1],
+				 total_blocks - group_block,
+				 bpg - (total_blocks - group_block));
 
-		if (ind_blk == 0)
-			continue;
+	return 0;
+}
 
-		ind = ext2_alloc_read_block(p, dind_buf[i]);
-		if (!ind) {
-			fprintf(stderr, "Error: read ind block #%d failed\n",
-				dind_buf[i]);
-			free(dind_buf);
-			return -1;
-		}
+/* allocate at most @count continuous blocks, returns the length */
+static uint32_t ext2_pack_alloc_blocks(struct ext2_pack_context *c,
+				       uint64_t count, uint64_t *blkno)
+{
+	struct ext2_editor_private_data *p = c->p;
+	uint32_t first_data_block = le32_to_cpu(p->sblock.first_data_block);
+	uint32_t bpg = le32_to_cpu(p->sblock.blocks_per_group);
 
-		printf("%4d: ", i);
+	if (count > EXT_INIT_MAX_LEN)
+		count = EXT_INIT_MAX_LEN;
 
-		for (uint32_t j = 0; j < p->block_size / sizeof(uint32_t); j++) {
-			uint32_t blk = le32_to_cpu(ind[j]);
+	for (; c->alloc_group < p->n_block_group;
+	     c->alloc_group++, c->alloc_offset = 0) {
+		struct bitmask *b = p->data_block_bitmask[c->alloc_group];
+		ssize_t start, end;
+		uint32_t len;
 
-			if (blk == 0)
-				break;
+		start = bitmask_next_zero(b, c->alloc_offset);
+		if (start < 0 || start >= bpg)
+			continue;
 
-			printf("%8d ", blk);
-		}
+		end = bitmask_next_one(b, start);
+		if (end < 0 || end > bpg)
+			end = bpg;
 
-		printf("\n");
-		free(ind);
+		len = end - start;
+		if (len > count)
+			len = count;
+
+		bitmask_set_bits(b, start, len);
+		c->alloc_offset = start + len;
+		*blkno = first_data_block + (uint64_t)c->alloc_group * bpg + start;
+		return len;
 	}
 
-	free(dind_buf);
 	return 0;
 }
 
-static int ext2_main(void *private_data, int fd, int argc, char **argv)
+static void ext2_pack_set_extent(struct ext4_extent *ee, uint32_t lblk,
+				 uint64_t pblk, uint32_t len)
 {
-	if (argc >= 1) {
-		if (!strcmp(argv[0], "list"))
-			return ext2_do_list(private_data, fd, argc, argv);
-		else if (!strcmp(argv[0], "sblock"))
-			return ext2_do_sblock(private_data, fd, argc, argv);
-		else if (!strcmp(argv[0], "inode"))
-			return ext2_do_inode(private_data, fd, argc, argv);
-		else if (!strcmp(argv[0], "block"))
-			return ext2_do_block(private_data, fd, argc, argv);
-		else if (!strcmp(argv[0], "dirent"))
-			return ext2_do_dirent(private_data, fd, argc, argv);
-		else if (!strcmp(argv[0], "extent"))
-			return ext2_do_extent(private_data, fd, argc, argv);
-		else if (!strcmp(argv[0], "journal"))
-			return ext2_do_journal(private_data, fd, argc, argv);
-		else if (!strcmp(argv[0], "orphan"))
-			return ext2_do_orphan(private_data, fd, argc, argv);
-		else if (!strcmp(argv[0], "layout"))
-			return ext2_do_layout(private_data, fd, argc, argv);
-		else if (!strcmp(argv[0], "whohas"))
-			return ext2_do_whohas(private_data, fd, argc, argv);
-		else if (!strcmp(argv[0], "resize_inode"))
-			return ext2_do_resize_inode(private_data, fd, argc, argv);
-	#ifdef CONFIG_ENABLE_ANDROID
-		else if (!strcmp(argv[0], "sparse"))
-			return ext2_do_sparse(private_data, fd, argc, argv);
-	#endif
+	ee->ee_block = cpu_to_le32(lblk);
+	ee->ee_len = cpu_to_le16(len);
+	ee->ee_start_hi = cpu_to_le16(pblk >> 32);
+	ee->ee_start_lo = cpu_to_le32(pblk);
+}
 
-		fprintf(stderr, "Error: unknown command %s\n", argv[0]);
+static int ext2_pack_alloc_node(struct ext2_pack_context *c,
+				struct ext2_pack_node *n)
+{
+	uint64_t lblk = 0, tree_blocks;
+	size_t max_extents = 0;
+
+	while (lblk < n->nblocks) {
+		uint64_t pblk;
+		uint32_t len;
+
+		len = ext2_pack_alloc_blocks(c, n->nblocks - lblk, &pblk);
+		if (len == 0)
+			goto nospace;
+
+		/* merge it if the previous group is full */
+		if (n->n_extents > 0) {
+			struct ext4_extent *prev = &n->extents[n->n_extents - 1];
+			uint32_t prev_len = le16_to_cpu(prev->ee_len);
+
+			if (ext4_extent_start_block(prev) + prev_len == pblk
+			    && prev_len + len <= EXT_INIT_MAX_LEN) {
+				prev->ee_len = cpu_to_le16(prev_len + len);
+				lblk += len;
+				continue;
+			}
+		}
+
+		if (n->n_extents >= max_extents) {
+			struct ext4_extent *extents;
+
+			max_extents = max_extents ? max_extents * 2 : 4;
+			extents = realloc(n->extents,
+					  max_extents * sizeof(*extents));
+			if (!extents) {
+				fprintf(stderr, "Error: alloc extents failed\n");
+				return -1;
+			}
+			n->extents = extents;
+		}
+
+		ext2_pack_set_extent(&n->extents[n->n_extents++], lblk, pblk, len);
+		lblk += len;
+	}
+
+	tree_blocks = ext2_pack_tree_blocks(c, n->n_extents, &n->tree_depth);
+	if (tree_blocks == 0)
+		return 0;
+
+	n->tree_blocks = calloc(tree_blocks, sizeof(*n->tree_blocks));
+	if (!n->tree_blocks)
 		return -1;
+
+	for (; n->n_tree_blocks < tree_blocks; n->n_tree_blocks++) {
+		if (!ext2_pack_alloc_blocks(c, 1,
+				&n->tree_blocks[n->n_tree_blocks]))
+			goto nospace;
 	}
 
-	return ext2_do_list(private_data, fd, argc, argv);
+	c->data_blocks += tree_blocks;
+	return 0;
+
+nospace:
+	fprintf(stderr, "Error: no space left for inode #%u\n", n->ino);
+	return -1;
 }
 
-static int unpack_symlink(struct ext2_editor_private_data *p, uint32_t ino,
-			  const char *link)
+static int ext2_pack_alloc(struct ext2_pack_context *c)
 {
-	char symlink_target[4096] = { 0 };
-	struct ext2_inode inode;
-	int ret;
+	for (uint32_t ino = EXT2_ROOT_INO; ino <= c->last_ino; ino++) {
+		struct ext2_pack_node *n = c->inodes[ino];
+		int ret;
 
-	ret = ext2_read_inode(p, ino, &inode);
-	if (ret < 0)
-		return ret;
+		if (!n)
+			continue;
 
-	if ((le16_to_cpu(inode.mode) & INODE_MODE_S_IFLINK) == 0) {
-		fprintf(stderr, "Error: unpack symlink %s failed"
-				"(ino #%d is not symlink)\n",
-			inode.b.symlink, ino);
-		return -1;
-	}
+		ret = ext2_pack_alloc_node(c, n);
+		if (ret < 0)
+			return ret;
 
-	ret = symlink_inode_get_target(p, &inode, symlink_target,
-				       sizeof(symlink_target) - 1);
-	if (ret < 0) {
-		fprintf(stderr, "Error: get symlink target of inode %d failed\n",
-			ino);
-		return ret;
+		c->data_blocks += n->nblocks;
 	}
 
-	unlink(link);
-	ret = symlink(symlink_target, link);
-	if (ret < 0) {
-		fprintf(stderr, "Error: Create symlink %s point to %s"
-				"(ino #%d) failed: %m\n",
-			link, symlink_target, ino);
-		return ret;
+	return 0;
+}
+
+static int ext2_pack_pwrite(struct ext2_pack_context *c, const void *buf,
+			    size_t sz, uint64_t offset)
+{
+	if (pwrite64(c->fd, buf, sz, offset) != (ssize_t)sz) {
+		fprintf(stderr, "Error: write %zu bytes at %" PRIu64
+				" failed: %m\n",
+			sz, offset);
+		return -1;
 	}
 
 	return 0;
 }
 
-static int unpack_file_from_dir_blocks(struct ext2_editor_private_data *p,
-				       struct ext2_inode *inode, uint32_t ino,
-				       const char *filename, int fd)
+static uint32_t ext2_pack_inode_csum_seed(struct ext2_pack_context *c,
+					  uint32_t ino)
 {
-	struct ext2_inode_blocks b = { .blocks = NULL };
-	uint32_t filesize = le32_to_cpu(inode->size);
-	size_t copied = 0;
-	int ret;
+	struct ext2_editor_private_data *p = c->p;
+	__le32 inum = cpu_to_le32(ino), gen = 0;
+	uint32_t seed;
 
-	ret = ext2_inode_blocks_read(p, &b, inode, ino);
-	if (ret < 0)
-		return ret;
+	seed = ext2_csum(&p->crc32c_le, p->csum_seed, &inum, sizeof(inum));
+	return ext2_csum(&p->crc32c_le, seed, &gen, sizeof(gen));
+}
 
-	if (filesize > b.total * p->block_size) {
-		fprintf(stderr, "Error: unpack %s failed(filesize %u and "
-			"dir_blocks %zu doesn't match)\n",
-			filename, filesize, b.total);
-		ret = -1;
-		goto done;
-	}
+/* the checksum fields of @raw are zero when calculating */
+static void ext2_pack_inode_csum(struct ext2_pack_context *c, uint32_t ino,
+				 uint8_t *raw)
+{
+	struct ext2_editor_private_data *p = c->p;
+	bool has_hi = false;
+	uint32_t sum;
+
+	if (p->inode_size > EXT4_GOOD_OLD_INODE_SIZE)
+		has_hi = le16_to_cpu(*(__le16 *)(raw + EXT4_INODE_EXTRA_ISIZE_OFFSET))
+			 >= EXT4_INODE_CSUM_HI_EXTRA_END;
+
+	sum = ext2_csum(&p->crc32c_le, ext2_pack_inode_csum_seed(c, ino),
+			raw, p->inode_size);
+	*(__le16 *)(raw + EXT4_INODE_CSUM_LO_OFFSET) = cpu_to_le16(sum);
+	if (has_hi)
+		*(__le16 *)(raw + EXT4_INODE_CSUM_HI_OFFSET) = cpu_to_le16(sum >> 16);
+}
+
+/* the extent tree is built from the bottom, @i_block saves the root */
+static int ext2_pack_write_extents(struct ext2_pack_context *c,
+				   struct ext2_pack_node *n,
+				   struct ext4_extent_header *root)
+{
+	struct ext2_editor_private_data *p = c->p;
+	uint32_t per_block = ext2_pack_extents_per_block(c);
+	struct ext4_extent *entries = n->extents;
+	uint64_t *tree_blocks = n->tree_blocks;
+	size_t n_entries = n->n_extents;
+	uint8_t *blk;
+	int ret = 0;
 
-	for (size_t i = 0; i < b.total && filesize > 0; i++) {
-		uint32_t chunk_sz = filesize;
+	blk = malloc(p->block_size);
+	if (!blk)
+		return -1;
+
+	/* the extent index has the same size with the extent, so the next
+	 * level is saved in @entries again.
+	 */
+	for (int depth = 0; depth < n->tree_depth; depth++) {
+		size_t n_nodes = (n_entries + per_block - 1) / per_block;
+
+		for (size_t i = 0; i < n_nodes && ret == 0; i++) {
+			struct ext4_extent_header *eh = (void *)blk;
+			size_t count = n_entries - i * per_block;
+			struct ext4_extent_idx *ei;
+			size_t tail_offset;
+
+			if (count > per_block)
+				count = per_block;
+
+			memset(blk, 0, p->block_size);
+			eh->eh_magic = cpu_to_le16(EXT4_EXT_MAGIC);
+			eh->eh_entries = cpu_to_le16(count);
+			eh->eh_max = cpu_to_le16(per_block);
+			eh->eh_depth = cpu_to_le16(depth);
+			memcpy(eh + 1, &entries[i * per_block],
+			       count * sizeof(*entries));
+
+			tail_offset = sizeof(*eh) + per_block * sizeof(*entries);
+			if (c->metadata_csum) {
+				struct ext4_extent_tail *et = (void *)blk + tail_offset;
+				uint32_t seed = ext2_pack_inode_csum_seed(c, n->ino);
+
+				et->et_checksum = cpu_to_le32(
+					ext2_csum(&p->crc32c_le, seed, blk,
+						  tail_offset));
+			}
 
-		if (chunk_sz > p->block_size)
-			chunk_sz = p->block_size;
+			ret = ext2_pack_pwrite(c, blk, p->block_size,
+					       tree_blocks[i] * p->block_size);
 
-		dd(p->fd, fd, b.blocks[i] * p->block_size, copied, chunk_sz,
-		   NULL, NULL);
+			/* the index of this node, the first logical block
+			 * is the same.
+			 */
+			ei = (struct ext4_extent_idx *)&entries[i];
+			ei->ei_block = ((struct ext4_extent *)(eh + 1))->ee_block;
+			ei->ei_leaf_lo = cpu_to_le32(tree_blocks[i]);
+			ei->ei_leaf_hi = cpu_to_le16(tree_blocks[i] >> 32);
+			ei->ei_unused = 0;
+		}
 
-		filesize -= chunk_sz;
-		copied += chunk_sz;
+		tree_blocks += n_nodes;
+		n_entries = n_nodes;
 	}
 
-done:
-	free(b.blocks);
+	root->eh_magic = cpu_to_le16(EXT4_EXT_MAGIC);
+	root->eh_entries = cpu_to_le16(n_entries);
+	root->eh_max = cpu_to_le16(EXT2_INODE_EXTENTS);
+	root->eh_depth = cpu_to_le16(n->tree_depth);
+	memcpy(root + 1, entries, n_entries * sizeof(*entries));
+
+	free(blk);
 	return ret;
 }
 
-static int unpack_file(struct ext2_editor_private_data *p, uint32_t ino,
-		       const char *filename)
+static uint32_t ext2_pack_time_extra(const struct timespec *ts)
 {
-	struct ext2_inode inode;
-	struct extent_iterator it;
-	uint64_t filesz;
-	int fd, mode;
-	int ret;
+	uint64_t sec = ts->tv_sec;
 
-	ret = ext2_read_inode(p, ino, &inode);
-	if (ret < 0)
-		return ret;
+	return (((sec - (int32_t)sec) >> 32) & 3) | (ts->tv_nsec << 2);
+}
 
-	if ((le16_to_cpu(inode.mode) & INODE_MODE_S_IFLINK) == 0) {
-		fprintf(stderr, "Error: unpack file %s failed"
-				"(ino #%d is not a file)\n",
-			filename, ino);
+static int ext2_pack_fill_inode(struct ext2_pack_context *c,
+				struct ext2_pack_node *n, uint8_t *raw)
+{
+	struct ext2_editor_private_data *p = c->p;
+	struct ext2_inode *inode = (struct ext2_inode *)raw;
+	struct timespec atime = n->st.st_atim, ctime = n->st.st_ctim;
+	struct timespec mtime = n->st.st_mtim;
+	uint64_t size = n->st.st_size, sectors;
+	uint32_t flags = 0;
+	int ret = 0;
+
+	if (c->fixed_time) {
+		atime.tv_sec = ctime.tv_sec = mtime.tv_sec = c->arg.timestamp;
+		atime.tv_nsec = ctime.tv_nsec = mtime.tv_nsec = 0;
+	}
+
+	if (S_ISDIR(n->st.st_mode))
+		size = n->nblocks * p->block_size;
+
+	sectors = (n->nblocks + n->n_tree_blocks) * (p->block_size / 512);
+	if (sectors > UINT32_MAX) {
+		fprintf(stderr, "Error: %s is too large\n", n->path);
 		return -1;
 	}
 
-	filesz = le32_to_cpu(inode.size_high);
-	filesz = filesz << 32;
-	filesz |= le32_to_cpu(inode.size);
-	mode = le16_to_cpu(inode.mode) & INODE_MODE_PERMISSION_MASK;
+	inode->mode = cpu_to_le16(n->st.st_mode);
+	inode->uid = cpu_to_le16(n->st.st_uid);
+	inode->gid = cpu_to_le16(n->st.st_gid);
+	inode->osd2[1] = cpu_to_le32((n->st.st_uid >> 16)
+				     | ((n->st.st_gid >> 16) << 16));
+	inode->size = cpu_to_le32(size);
+	inode->size_high = cpu_to_le32(size >> 32);
+	inode->atime = cpu_to_le32(atime.tv_sec);
+	inode->ctime = cpu_to_le32(ctime.tv_sec);
+	inode->mtime = cpu_to_le32(mtime.tv_sec);
+	inode->nlinks = cpu_to_le16(n->nlinks >= 65000 ? 1 : n->nlinks);
+	inode->blockcnt = cpu_to_le32(sectors);
+
+	switch (n->st.st_mode & S_IFMT) {
+	case S_IFCHR:
+	case S_IFBLK:
+		if (major(n->st.st_rdev) < 256 && minor(n->st.st_rdev) < 256) {
+			inode->b.blocks.dir_blocks[0] = cpu_to_le32(
+				(major(n->st.st_rdev) << 8)
+				| minor(n->st.st_rdev));
+		} else {
+			inode->b.blocks.dir_blocks[1] = cpu_to_le32(
+				(minor(n->st.st_rdev) & 0xff)
+				| (major(n->st.st_rdev) << 8)
+				| ((minor(n->st.st_rdev) & ~0xff) << 12));
+		}
+		break;
+	case S_IFLNK:
+		if (n->nblocks == 0) {
+			memcpy(inode->b.symlink, n->data, size);
+			break;
+		}
+		/* fallthrough */
+	case S_IFREG:
+	case S_IFDIR:
+		flags |= EXT4_EXTENTS_FL;
+		ret = ext2_pack_write_extents(c, n,
+			(struct ext4_extent_header *)inode->b.blocks.dir_blocks);
+		break;
+	}
+	inode->flags = cpu_to_le32(flags);
 
-	fd = fileopen(filename, O_RDWR | O_CREAT | O_TRUNC, mode);
-	if (fd < 0)
-		return fd;
+	if (p->inode_size > EXT4_GOOD_OLD_INODE_SIZE) {
+		struct ext4_inode_extra *extra = (void *)(raw + EXT4_GOOD_OLD_INODE_SIZE);
 
-	if (filesz == 0) /* create a empty file */
-		goto done;
+		extra->i_extra_isize = cpu_to_le16(sizeof(*extra));
+		extra->i_atime_extra = cpu_to_le32(ext2_pack_time_extra(&atime));
+		extra->i_ctime_extra = cpu_to_le32(ext2_pack_time_extra(&ctime));
+		extra->i_mtime_extra = cpu_to_le32(ext2_pack_time_extra(&mtime));
+		extra->i_crtime = cpu_to_le32(c->arg.timestamp);
+	}
 
-	if (!(le32_to_cpu(inode.flags) & EXT4_EXTENTS_FL)) {
-		/* this is ext2 based filesystem */
-		ret = unpack_file_from_dir_blocks(p, &inode, ino, filename, fd);
-		goto done;
+	if (c->metadata_csum)
+		ext2_pack_inode_csum(c, n->ino, raw);
+
+	return ret;
+}
+
+/* write the inode table of @group, the inodes after the last used one are
+ * kept as zero.
+ */
+static int ext2_pack_write_inodes(struct ext2_pack_context *c, uint32_t group,
+				  uint32_t *used_dirs, uint32_t *used_inodes)
+{
+	struct ext2_editor_private_data *p = c->p;
+	uint32_t ipg = le32_to_cpu(p->sblock.inodes_per_group);
+	uint32_t first = group * ipg + 1, count;
+	uint8_t *itable;
+	int ret = 0;
+
+	*used_dirs = 0;
+	*used_inodes = 0;
+	if (first > c->last_ino)
+		return 0;
+
+	count = c->last_ino - first + 1;
+	if (count > ipg)
+		count = ipg;
+
+	itable = calloc(count, p->inode_size);
+	if (!itable) {
+		fprintf(stderr, "Error: alloc inode table failed\n");
+		return -1;
 	}
 
-	ret = extent_iterator_init(p, &it, ino);
-	if (ret < 0)
-		goto done;
+	for (uint32_t i = 0; i < count && ret == 0; i++) {
+		struct ext2_pack_node *n = c->inodes[first + i];
 
-	extent_list_foreach(&it) {
-		struct ext4_extent *ee = it.ee;
-		size_t sz, bytes = p->block_size * le16_to_cpu(ee->ee_len);
-
-		if (bytes > filesz)
-			bytes = filesz;
-
-		sz = dd(p->fd, fd,
-			ext4_extent_start_block(ee) * p->block_size,
-			le32_to_cpu(ee->ee_block) * p->block_size,
-			bytes,
-			NULL, NULL);
-		if (sz != bytes) {
-			fprintf(stderr, "Error: saving %s failed\n",
-				filename);
-			ret = -1;
-			break;
+		/* the reserved inodes are used but zeroed */
+		bitmask_set(p->inode_bitmask[group], i);
+		if (!n) {
+			if (c->metadata_csum)
+				ext2_pack_inode_csum(c, first + i,
+						     itable + i * p->inode_size);
+			continue;
 		}
 
-		filesz -= bytes;
+		ret = ext2_pack_fill_inode(c, n, itable + i * p->inode_size);
+		if (S_ISDIR(n->st.st_mode))
+			++*used_dirs;
 	}
-	extent_iterator_exit(&it);
 
-done:
-	close(fd);
-	/* this file maybe already created, the file mode passwd by open
-	 * doesn't work. let's fix it's mode now
-	 */
-	chmod(filename, mode);
+	if (ret == 0)
+		ret = ext2_pack_pwrite(c, itable, (size_t)count * p->inode_size,
+			ext2_bg_inode_table(p, &p->block_groups[group])
+			* p->block_size);
 
+	*used_inodes = count;
+	free(itable);
 	return ret;
 }
 
-static int load_file_from_dir_blocks(struct ext2_editor_private_data *p,
-				       struct ext2_inode *inode, uint32_t ino,
-				       void *buf, uint64_t bufsz)
+static uint32_t ext2_pack_used_blocks(struct ext2_pack_context *c,
+				      uint32_t group)
+{
+	uint32_t used = 0;
+
+	bitmask_foreach_continue(it, c->p->data_block_bitmask[group])
+		used += it.bits;
+
+	return used;
+}
+
+static int ext2_pack_write_group(struct ext2_pack_context *c, uint32_t group,
+				 uint8_t *blk, uint64_t *free_blocks,
+				 uint64_t *free_inodes)
 {
-	struct ext2_inode_blocks b = { .blocks = NULL };
-	size_t copied = 0;
+	struct ext2_editor_private_data *p = c->p;
+	struct ext2_block_group *bgrp = &p->block_groups[group];
+	uint32_t ipg = le32_to_cpu(p->sblock.inodes_per_group);
+	uint32_t bpg = le32_to_cpu(p->sblock.blocks_per_group);
+	uint32_t used_dirs, used_inodes, nfree, sum;
 	int ret;
 
-	ret = ext2_inode_blocks_read(p, &b, inode, ino);
+	ret = ext2_pack_write_inodes(c, group, &used_dirs, &used_inodes);
 	if (ret < 0)
 		return ret;
 
-	if (bufsz > b.total * p->block_size) {
-		fprintf(stderr, "Error: load inode #%d failed(bufsize %ld and "
-			"dir_blocks size %zu doesn't match)\n",
-			ino, (long)bufsz, b.total);
-		ret = -1;
-		goto done;
+	nfree = bpg - ext2_pack_used_blocks(c, group);
+	bgrp->free_blocks = cpu_to_le16(nfree);
+	bgrp->free_blocks_high = cpu_to_le16(nfree >> 16);
+	*free_blocks += nfree;
+
+	nfree = ipg - used_inodes;
+	bgrp->free_inodes = cpu_to_le16(nfree);
+	bgrp->free_inodes_high = cpu_to_le16(nfree >> 16);
+	bgrp->bg_itable_unused = cpu_to_le16(nfree);
+	bgrp->bg_itable_unused_high = cpu_to_le16(nfree >> 16);
+	*free_inodes += nfree;
+
+	bgrp->used_dir_cnt = cpu_to_le16(used_dirs);
+	bgrp->used_dir_cnt_high = cpu_to_le16(used_dirs >> 16);
+
+	/* block bitmap */
+	bitmask_export_lsbfirst(p->data_block_bitmask[group], blk, p->block_size);
+	if (c->metadata_csum) {
+		sum = ext2_csum(&p->crc32c_le, p->csum_seed, blk, bpg / 8);
+		bgrp->bg_block_id_csum = cpu_to_le16(sum);
+		bgrp->bg_block_id_csum_high = cpu_to_le16(sum >> 16);
 	}
 
-	for (size_t i = 0; i < b.total && bufsz > 0; i++) {
-		uint32_t chunk_sz = bufsz;
-
-		if (chunk_sz > p->block_size)
-			chunk_sz = p->block_size;
-
-		fileseek(p->fd, b.blocks[i] * p->block_size);
-		read(p->fd, buf + copied, chunk_sz);
+	ret = ext2_pack_pwrite(c, blk, p->block_size,
+			       ext2_bg_block_bitmap(p, bgrp) * p->block_size);
+	if (ret < 0)
+		return ret;
 
-		copied += chunk_sz;
-		bufsz -= chunk_sz;
+	/* inode bitmap, the bits after the inodes per group are padded */
+	bitmask_export_lsbfirst(p->inode_bitmask[group], blk, p->block_size);
+	memset(blk + ipg / 8, 0xff, p->block_size - ipg / 8);
+	if (c->metadata_csum) {
+		sum = ext2_csum(&p->crc32c_le, p->csum_seed, blk, ipg / 8);
+		bgrp->bg_inode_id_csum = cpu_to_le16(sum);
+		bgrp->bg_inode_id_csum_high = cpu_to_le16(sum >> 16);
 	}
 
-done:
-	free(b.blocks);
-	return ret;
+	return ext2_pack_pwrite(c, blk, p->block_size,
+				ext2_bg_inode_bitmap(p, bgrp) * p->block_size);
 }
 
-static void *alloc_inode_file(struct ext2_editor_private_data *p, uint32_t ino,
-			      uint64_t *ret_filesize)
+static int ext2_pack_write_sblock_gdt(struct ext2_pack_context *c)
 {
-	struct ext2_inode inode;
-	struct extent_iterator it;
-	void *buf = NULL;
-	uint64_t filesz;
-	int ret;
-
-	ret = ext2_read_inode(p, ino, &inode);
-	if (ret < 0)
-		return buf;
+	struct ext2_editor_private_data *p = c->p;
+	size_t gdt_size = (size_t)p->n_block_group * p->descriptor_size;
+	struct ext2_sblock sb;
+	uint8_t *gdt;
+	int ret = 0;
 
-	if ((le16_to_cpu(inode.mode) & INODE_MODE_S_IFLINK) == 0) {
-		fprintf(stderr, "Error: alloc inode file #%d failed"
-				"(not a file)\n", ino);
-		return buf;
+	gdt = calloc(1, aligned_length(gdt_size, p->block_size));
+	if (!gdt) {
+		fprintf(stderr, "Error: alloc group descriptors failed\n");
+		return -1;
 	}
 
-	filesz = le32_to_cpu(inode.size_high);
-	filesz = filesz << 32;
-	filesz |= le32_to_cpu(inode.size);
-	*ret_filesize = filesz;
-
-	buf = calloc(1, filesz);
-	if (!buf)
-		return buf;
-
-	if (filesz == 0) /* empty file */
-		return buf;
-
-	if (!(le32_to_cpu(inode.flags) & EXT4_EXTENTS_FL)) {
-		/* this is ext2 based filesystem */
-		ret = load_file_from_dir_blocks(p, &inode, ino, buf, filesz);
-		if (ret < 0) {
-			free(buf);
-			return NULL;
-		}
+	for (uint32_t i = 0; i < p->n_block_group; i++) {
+		struct ext2_block_group *bgrp = &p->block_groups[i];
 
-		return buf;
+		bgrp->bg_checksum = cpu_to_le16(ext2_group_desc_csum(p, i, bgrp));
+		memcpy(gdt + (size_t)i * p->descriptor_size, bgrp,
+		       p->descriptor_size);
 	}
 
-	ret = extent_iterator_init(p, &it, ino);
-	if (ret < 0) {
-		free(buf);
-		return NULL;
+	for (size_t i = 0; i < p->n_layout && ret == 0; i++) {
+		struct disk_layout *layout = &p->layouts[i];
+		uint64_t offset = layout->start_block * p->block_size;
+
+		switch (layout->major_type) {
+		case DISK_LAYOUT_SUPBER_BLOCK:
+			memcpy(&sb, &p->sblock, sizeof(sb));
+			sb.block_group_number = cpu_to_le16(layout->group);
+			if (c->metadata_csum)
+				sb.checksum = cpu_to_le32(
+					ext2_csum(&p->crc32c_le, 0xffffffff, &sb,
+					  offsetof(struct ext2_sblock, checksum)));
+
+			if (layout->group == 0)
+				offset = SUPERBLOCK_START;
+			ret = ext2_pack_pwrite(c, &sb, sizeof(sb), offset);
+			break;
+		case DISK_LAYOUT_GROUP_DESCRIPTOR:
+			ret = ext2_pack_pwrite(c, gdt,
+				aligned_length(gdt_size, p->block_size), offset);
+			break;
+		default:
+			break;
+		}
 	}
 
-	extent_list_foreach(&it) {
-		struct ext4_extent *ee = it.ee;
-		size_t bytes = p->block_size * le16_to_cpu(ee->ee_len);
+	free(gdt);
+	return ret;
+}
 
-		if (bytes > filesz)
-			bytes = filesz;
+struct ext2_pack_copy_work {
+	const char			*path;
+	int				fd;
+	uint64_t			offset;
+	uint64_t			target;
+	uint64_t			size;
+};
 
-		fileseek(p->fd,
-			ext4_extent_start_block(ee) * p->block_size);
+static int ext2_pack_copy_work(void *arg)
+{
+	struct ext2_pack_copy_work *w = arg;
+	int fd, ret = 0;
 
-		read(p->fd,
-		     buf + le32_to_cpu(ee->ee_block) * p->block_size,
-		     bytes);
+	fd = open(w->path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Error: open %s failed: %m\n", w->path);
+		free(w);
+		return fd;
+	}
 
-		filesz -= bytes;
+	if (pdd64(fd, w->fd, w->offset, w->target, w->size) != w->size) {
+		fprintf(stderr, "Error: copy %s failed\n", w->path);
+		ret = -1;
 	}
-	extent_iterator_exit(&it);
 
-	return buf;
+	close(fd);
+	free(w);
+	return ret;
 }
 
-static int ext2_whohas_blkno(struct ext2_editor_private_data *p,
-			     uint32_t which_blk,
-			     int *ret_ino)
+/* write the directory and symlink blocks, and copy the file data by
+ * the threadpool.
+ */
+static int ext2_pack_write_data(struct ext2_pack_context *c,
+				struct threadpool *tp)
 {
-	struct ext2_sblock *sb = &p->sblock;
-	int inodes_used = le32_to_cpu(sb->total_inodes)
-			- le32_to_cpu(sb->free_inodes);
-	struct bitmask *data_blocks
-			= alloc_bitmask(le32_to_cpu(sb->total_blocks));
-	int ret_found = -1;
-
-	if (!data_blocks) {
-		fprintf(stderr, "Error: alloc bitmask failed\n");
-		return -1;
-	}
+	struct ext2_editor_private_data *p = c->p;
 
-	for (int ino = 1; ino <= inodes_used; ino++) {
-		struct ext2_inode inode;
-		uint64_t filesz;
-		uint32_t type;
-		int ret;
+	for (uint32_t ino = EXT2_ROOT_INO; ino <= c->last_ino; ino++) {
+		struct ext2_pack_node *n = c->inodes[ino];
+		uint32_t seed = 0;
 
-		bitmask_memset(data_blocks, 0);
-
-		ret = ext2_read_inode(p, ino, &inode);
-		if (ret < 0)
+		if (!n || !n->nblocks)
 			continue;
 
-		/* A block number saved in it's b.blocks.double_indir_block
-		 * for reserved gdt used.
-		 * imgeditor tests/fs/ext4/simple_abc.ext4 -- inode 7
-		 */
-		if (ino == EXT2_RESIZE_INO) {
-			uint32_t blknr =
-				le32_to_cpu(inode.b.blocks.double_indir_block);
+		if (c->metadata_csum && S_ISDIR(n->st.st_mode))
+			seed = ext2_pack_inode_csum_seed(c, n->ino);
+
+		for (size_t i = 0; i < n->n_extents; i++) {
+			struct ext4_extent *ee = &n->extents[i];
+			uint64_t lblk = le32_to_cpu(ee->ee_block);
+			uint64_t pblk = ext4_extent_start_block(ee);
+			uint64_t len = le16_to_cpu(ee->ee_len);
+			struct ext2_pack_copy_work *w;
+			int ret;
+
+			if (n->data) {
+				uint8_t *data = n->data + lblk * p->block_size;
+
+				for (uint64_t j = 0; seed && j < len; j++) {
+					uint8_t *blk = data + j * p->block_size;
+					struct ext4_dir_entry_tail *t = (void *)
+						(blk + p->block_size - sizeof(*t));
+
+					t->det_checksum = cpu_to_le32(
+						ext2_csum(&p->crc32c_le, seed, blk,
+							  p->block_size - sizeof(*t)));
+				}
+
+				ret = ext2_pack_pwrite(c, data, len * p->block_size,
+						       pblk * p->block_size);
+				if (ret < 0)
+					return ret;
+				continue;
+			}
 
-			if (blknr)
-				bitmask_set(data_blocks, blknr);
+			w = calloc(1, sizeof(*w));
+			if (!w)
+				return -1;
 
-			goto compare_blknr;
+			w->path = n->path;
+			w->fd = c->fd;
+			w->offset = lblk * p->block_size;
+			w->target = pblk * p->block_size;
+			w->size = len * p->block_size;
+			if (w->offset + w->size > (uint64_t)n->st.st_size)
+				w->size = n->st.st_size - w->offset;
+
+			ret = threadpool_queue_work(tp, ext2_pack_copy_work, w);
+			if (ret < 0) {
+				free(w);
+				return ret;
+			}
 		}
+	}
 
-		filesz = le32_to_cpu(inode.size_high);
-		filesz = filesz << 32;
-		filesz |= le32_to_cpu(inode.size);
-		if (filesz == 0)
-			continue;
-
-		/* empty inode */
-		if (le32_to_cpu(inode.ctime) == 0)
-			continue;
+	return 0;
+}
 
-		/* search in regular file and directory only */
-		type = le32_to_cpu(inode.mode) & INODE_MODE_S_MASK;
-		if (type == INODE_MODE_S_IFLINK) {
-			/* sort symlink doesn't need extra block */
-			if (filesz < sizeof(inode.b.symlink))
-				continue;
-		} else if (!(type == INODE_MODE_S_IFREG || type == INODE_MODE_S_IFDIR))
-			continue;
+static int ext2_pack_write(struct ext2_pack_context *c)
+{
+	struct ext2_editor_private_data *p = c->p;
+	uint64_t free_blocks = 0, free_inodes = 0;
+	struct threadpool *tp;
+	int ret, ret_wait;
+	uint8_t *blk;
 
-		if (!(le32_to_cpu(inode.flags) & EXT4_EXTENTS_FL)) {
-			struct ext2_inode_blocks b = { .blocks = NULL };
+	if (ftruncate64(c->fd, ext2_total_blocks(&p->sblock) * p->block_size) < 0) {
+		fprintf(stderr, "Error: truncate the image failed: %m\n");
+		return -1;
+	}
 
-			ret = _ext2_inode_blocks_read(p, &b, &inode, ino,
-						      data_blocks);
-			if (ret < 0)
-				continue;
+	tp = alloc_threadpool(get_parallel_jobs(), 0);
+	if (!tp)
+		return -1;
 
-			free(b.blocks);
-		} else {
-			struct extent_iterator it;
+	blk = malloc(p->block_size);
+	if (!blk) {
+		threadpool_free(tp);
+		return -1;
+	}
 
-			ret = _extent_iterator_init(p, &it, ino, data_blocks);
-			if (ret < 0)
-				continue;
+	/* the file data is copied while the metadata is being written */
+	ret = ext2_pack_write_data(c, tp);
+	for (uint32_t group = 0; group < p->n_block_group && ret == 0; group++)
+		ret = ext2_pack_write_group(c, group, blk, &free_blocks,
+					    &free_inodes);
 
-			extent_iterator_exit(&it);
-		}
+	ret_wait = threadpool_wait(tp);
+	threadpool_free(tp);
+	free(blk);
+	if (ret == 0)
+		ret = ret_wait;
+	if (ret < 0)
+		return ret;
 
-	compare_blknr:
-		if (bitmask_get(data_blocks, which_blk)) {
-			if (ret_ino)
-				*ret_ino = ino;
-			ret_found = 0;
-			break;
-		}
-	}
+	p->sblock.free_blocks = cpu_to_le32(free_blocks);
+	p->sblock.free_blocks_high = cpu_to_le32(free_blocks >> 32);
+	p->sblock.free_inodes = cpu_to_le32(free_inodes);
 
-	bitmask_free(data_blocks);
-	return ret_found;
+	return ext2_pack_write_sblock_gdt(c);
 }
 
-#if CONFIG_ENABLE_ANDROID
-static int android_sparse_add_bitmask_chunks(struct android_sparse_input *input,
-					     struct bitmask *b,
-					     int ino)
+static int ext2_pack_tree(struct ext2_pack_context *c, const char *dir)
 {
-	int start = 0;
-
-	while (1) {
-		int end;
+	struct ext2_editor_private_data *p = c->p;
+	struct ext2_pack_node *lpf;
+	int ret;
 
-		start = bitmask_next_one(b, start);
-		if (start < 0)
-			break;
+	c->root = ext2_pack_new_node(dir);
+	if (!c->root)
+		return -1;
 
-		end = bitmask_next_zero(b, start + 1);
-		if (end < 0) {
-			if (get_verbose_level() > 0)
-				printf("add inode #%d blocks #%d:%zu\n",
-					ino, start, b->total_bits - start);
-			android_sparse_add_chunk(input, start,
-						 b->total_bits - start);
-			break;
-		}
+	if (stat(dir, &c->root->st) < 0 || !S_ISDIR(c->root->st.st_mode)) {
+		fprintf(stderr, "Error: %s is not a directory\n", dir);
+		return -1;
+	}
+	c->root->ino = EXT2_ROOT_INO;
 
-		if (get_verbose_level() > 0)
-			printf("add inode #%d blocks #%d:%d\n",
-				ino, start, end - start);
-		android_sparse_add_chunk(input, start, end - start);
-		start = end;
+	/* lost+found is the first inode after the reserved inodes */
+	lpf = ext2_pack_new_node(NULL);
+	if (!lpf)
+		return -1;
+	lpf->name = "lost+found";
+	lpf->ino = EXT2_PACK_LPF_INO;
+	lpf->st.st_mode = S_IFDIR | 0700;
+	lpf->st.st_atim.tv_sec = c->arg.timestamp;
+	lpf->st.st_mtim = lpf->st.st_ctim = lpf->st.st_atim;
+	if (ext2_pack_add_child(c->root, lpf) < 0) {
+		ext2_pack_free_node(lpf);
+		return -1;
 	}
 
-	return 0;
-}
+	ret = ext2_pack_scan(c, c->root);
+	if (ret < 0)
+		return ret;
 
-static int ext2_add_inode_chunks(struct ext2_editor_private_data *p,
-				 struct android_sparse_input *input)
-{
-	struct ext2_sblock *sb = &p->sblock;
-	int inodes_used = le32_to_cpu(sb->total_inodes)
-			- le32_to_cpu(sb->free_inodes);
-	struct bitmask *data_blocks
-			= alloc_bitmask(le32_to_cpu(sb->total_blocks));
+	ret = ext2_pack_resolve_links(c);
+	if (ret < 0)
+		return ret;
 
-	if (!data_blocks) {
-		fprintf(stderr, "Error: alloc bitmask failed\n");
+	c->inodes = calloc(EXT2_PACK_FIRST_INO + c->n_inodes + 1,
+			   sizeof(*c->inodes));
+	if (!c->inodes) {
+		fprintf(stderr, "Error: alloc %u inodes failed\n", c->n_inodes);
 		return -1;
 	}
 
-	for (int ino = 1; ino <= inodes_used; ino++) {
-		struct ext2_inode inode;
-		uint64_t filesz;
-		uint32_t type;
-		int ret;
+	c->last_ino = EXT2_PACK_LPF_INO;
+	c->inodes[EXT2_ROOT_INO] = c->root;
+	c->root->nlinks = 2;
+	ext2_pack_assign_ino(c, c->root);
 
-		bitmask_memset(data_blocks, 0);
+	ret = ext2_pack_build_data(c);
+	if (ret < 0)
+		return ret;
 
-		ret = ext2_read_inode(p, ino, &inode);
-		if (ret < 0)
-			continue;
+	ret = ext2_pack_init_geometry(c);
+	if (ret < 0)
+		return ret;
 
-		/* A block number saved in it's b.blocks.double_indir_block
-		 * for reserved gdt used.
-		 * imgeditor tests/fs/ext4/simple_abc.ext4 -- inode 7
-		 */
-		if (ino == EXT2_RESIZE_INO) {
-			uint32_t blknr =
-				le32_to_cpu(inode.b.blocks.double_indir_block);
-
-			if (blknr) {
-				bitmask_set(data_blocks, blknr);
-				android_sparse_add_bitmask_chunks(input,
-								  data_blocks,
-								  ino);
-			}
+	ext2_pack_init_sblock(c);
 
-			continue;
-		}
+	ret = ext2_pack_init_groups(c);
+	if (ret < 0)
+		return ret;
 
-		filesz = le32_to_cpu(inode.size_high);
-		filesz = filesz << 32;
-		filesz |= le32_to_cpu(inode.size);
-		if (filesz == 0)
-			continue;
+	ret = ext2_pack_alloc(c);
+	if (ret < 0)
+		return ret;
 
-		/* empty inode */
-		if (le32_to_cpu(inode.ctime) == 0)
-			continue;
+	if (get_verbose_level() > 0)
+		printf("%u inodes, %" PRIu64 " data blocks in %u groups\n",
+		       c->last_ino, c->data_blocks, p->n_block_group);
 
-		/* search in regular file and directory only */
-		type = le32_to_cpu(inode.mode) & INODE_MODE_S_MASK;
-		if (type == INODE_MODE_S_IFLINK) {
-			/* sort symlink doesn't need extra block */
-			if (filesz < sizeof(inode.b.symlink))
-				continue;
-		} else if (!(type == INODE_MODE_S_IFREG || type == INODE_MODE_S_IFDIR))
-			continue;
+	return 0;
+}
 
-		if (!(le32_to_cpu(inode.flags) & EXT4_EXTENTS_FL)) {
-			struct ext2_inode_blocks b = { .blocks = NULL };
+#ifdef CONFIG_ENABLE_ANDROID
+/* the raw image is built in a temporary file and only the used blocks are
+ * saved in the sparse image.
+ */
+static int ext2_pack_sparse(struct ext2_pack_context *c, int fd_outimg)
+{
+	struct ext2_editor_private_data *p = c->p;
+	struct android_sparse_input input;
+	char outpath[PATH_MAX], rawpath[PATH_MAX + 8];
+	char proc_fd[64];
+	ssize_t len;
+	int ret;
 
-			ret = _ext2_inode_blocks_read(p, &b, &inode, ino,
-						      data_blocks);
-			if (ret < 0)
-				continue;
+	snprintf(proc_fd, sizeof(proc_fd), "/proc/self/fd/%d", fd_outimg);
+	len = readlink(proc_fd, outpath, sizeof(outpath) - 1);
+	if (len < 0) {
+		fprintf(stderr, "Error: get the path of output image failed\n");
+		return -1;
+	}
+	outpath[len] = '\0';
 
-			android_sparse_add_bitmask_chunks(input,
-							  data_blocks,
-							  ino);
-			free(b.blocks);
-		} else {
-			struct extent_iterator it;
+	snprintf(rawpath, sizeof(rawpath), "%s.raw", outpath);
+	c->fd = fileopen(rawpath, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (c->fd < 0)
+		return c->fd;
+	unlink(rawpath);
 
-			ret = _extent_iterator_init(p, &it, ino, data_blocks);
-			if (ret < 0)
-				continue;
+	ret = ext2_pack_write(c);
+	if (ret < 0)
+		goto done;
 
-			android_sparse_add_bitmask_chunks(input,
-							  data_blocks,
-							  ino);
-			extent_iterator_exit(&it);
-		}
+	p->fd = c->fd;
+	android_sparse_init(&input, p->block_size,
+			    ext2_total_blocks(&p->sblock));
+	for (size_t i = 0; i < p->n_layout; i++)
+		android_sparse_add_chunk(&input, p->layouts[i].start_block,
+					 p->layouts[i].len_block);
+	ext2_add_bitmap_chunks(p, &input);
+
+	if (input.error) {
+		fprintf(stderr, "Error: add sparse chunks failed. "
+				"(no enough memory?)\n");
+		ret = -1;
+		goto done;
 	}
 
-	bitmask_free(data_blocks);
-	return 0;
+	ret = android_sparse_finish(&input, fd_outimg,
+				    ext2_write_sparse_chunk, p);
+done:
+	close(c->fd);
+	return ret;
 }
 #endif
 
-static int unpack_dirent(struct ext2_editor_private_data *p, uint32_t ino,
-			 const char *parent_dir)
+static const struct xopt_option ext2_pack_options[] = {
+	{
+		.name		= 'b',
+		.type		= XOPT_TYPE_INT_DEC,
+		.offset		= offsetof(struct ext2_pack_arg, block_size),
+	}, {
+		.name		= 'I',
+		.type		= XOPT_TYPE_INT_DEC,
+		.offset		= offsetof(struct ext2_pack_arg, inode_size),
+	}, {
+		.name		= 'N',
+		.type		= XOPT_TYPE_ULONG_DEC,
+		.offset		= offsetof(struct ext2_pack_arg, inodes),
+	}, {
+		.name		= 'L',
+		.type		= XOPT_TYPE_STRING,
+		.offset		= offsetof(struct ext2_pack_arg, label),
+	}, {
+		.name		= 'U',
+		.type		= XOPT_TYPE_STRING,
+		.offset		= offsetof(struct ext2_pack_arg, uuid),
+	}, {
+		.name		= 'O',
+		.type		= XOPT_TYPE_STRING,
+		.offset		= offsetof(struct ext2_pack_arg, features),
+	}, {
+		.long_name	= "size",
+		.type		= XOPT_TYPE_STRING,
+		.offset		= offsetof(struct ext2_pack_arg, size),
+	}, {
+		.long_name	= "hash-seed",
+		.type		= XOPT_TYPE_STRING,
+		.offset		= offsetof(struct ext2_pack_arg, hash_seed),
+	}, {
+		.long_name	= "timestamp",
+		.type		= XOPT_TYPE_ULONG_DEC,
+		.offset		= offsetof(struct ext2_pack_arg, timestamp),
+	}, {
+		.long_name	= "sparse",
+		.type		= XOPT_TYPE_BOOL,
+		.offset		= offsetof(struct ext2_pack_arg, sparse),
+	},
+	LIBXOPT_NULLOPTION,
+};
+
+static void ext2_pack_usage(void)
+{
+	fprintf(stderr, "Usage: imgeditor --type ext2 --pack dir out.img -- [OPTIONS]\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  --size size          The image size, such as 64M. Default is the size of dir and 12.5%% free space\n");
+	fprintf(stderr, "  -b block-size        1024, 2048 or 4096. Default is 4096\n");
+	fprintf(stderr, "  -I inode-size        128 or 256. Default is 256\n");
+	fprintf(stderr, "  -N inodes            The number of inodes\n");
+	fprintf(stderr, "  -L label             The volume label\n");
+	fprintf(stderr, "  -U uuid              The filesystem uuid. Default is random\n");
+	fprintf(stderr, "  --hash-seed uuid     The htree hash seed. Default is random\n");
+	fprintf(stderr, "  --timestamp epoch    The time of the filesystem and all inodes. Default is now\n");
+	fprintf(stderr, "  -O features          [^]metadata_csum,[^]64bit,[^]dir_index\n");
+#ifdef CONFIG_ENABLE_ANDROID
+	fprintf(stderr, "  --sparse             Save as android sparse image\n");
+#endif
+}
+
+static int ext2_pack(void *private_data, const char *dir, int fd_outimg,
+		     int argc, char **argv)
 {
-	struct dirent_iterator it;
-	char child_name[1024];
+	struct ext2_editor_private_data *p = private_data;
+	struct ext2_pack_context c = {
+		.p = p,
+		.fd = fd_outimg,
+		.arg = {
+			.block_size = 4096,
+			.inode_size = 256,
+			.timestamp = ULONG_MAX,
+		},
+		.metadata_csum = true,
+		.dir_index = true,
+	};
+	struct xopt *xopt = libxopt_new(ext2_pack_options,
+					LIBXOPT_FLAG_KEEPFIRST);
 	int ret;
 
-	ret = dirent_iterator_init(p, &it, ino);
-	if (ret < 0)
+	ret = libxopt_parse(xopt, argc, argv, &c.arg);
+	if (ret < 0) {
+		fprintf(stderr, "Error: %s\n", libxopt_get_error(xopt));
+		libxopt_free(xopt);
+		ext2_pack_usage();
 		return ret;
+	}
+	libxopt_free(xopt);
 
-	if (ino != EXT2_ROOT_INO) {
-		int mode;
+	c.fixed_time = c.arg.timestamp != ULONG_MAX;
+	if (!c.fixed_time)
+		c.arg.timestamp = time(NULL);
 
-		mode = le16_to_cpu(it.inode.mode) & INODE_MODE_PERMISSION_MASK;
-		ret = mkdir(parent_dir, mode);
-		if (ret < 0) {
-			switch (errno) {
-			case EEXIST:
-				ret = 0;
-				break;
-			default:
-				fprintf(stderr, "Error: create dir %s with mode %o failed: %m\n",
-					parent_dir, mode);
-				goto done;
-			}
-		}
+	if ((c.arg.block_size != 1024 && c.arg.block_size != 2048
+	     && c.arg.block_size != 4096)
+	    || (c.arg.inode_size != 128 && c.arg.inode_size != 256)) {
+		ext2_pack_usage();
+		return -1;
 	}
 
-	dirent_list_foreach(&it) {
-		struct ext2_dirent *dir = it.dir;
-		const char *filename = (const char *)(dir + 1);
-
-		if (le16_to_cpu(dir->direntlen) <= (int)sizeof(struct ext2_dirent)) {
-			fprintf(stderr, "direntlen is too short\n");
-			return -1;
-		} else if (le32_to_cpu(dir->inode) == 0) {
-			continue;
-		}
+#ifndef CONFIG_ENABLE_ANDROID
+	if (c.arg.sparse) {
+		fprintf(stderr, "Error: android sparse is not enabled\n");
+		return -1;
+	}
+#endif
 
-		snprintf(child_name, sizeof(child_name), "%s/%.*s",
-			 parent_dir, dir->namelen, filename);
+	ret = ext2_pack_parse_features(&c);
+	if (ret < 0)
+		return ret;
 
-		switch (dir->filetype) {
-		case EXT4_FT_REG_FILE:
-			ret = unpack_file(p, le32_to_cpu(dir->inode), child_name);
-			break;
-		case EXT4_FT_DIR:
-			/* skip '.' and '..' */
-			if (dir->namelen == 1 && !strncmp(filename, ".", 1))
-				break;
-			if (dir->namelen == 2 && !strncmp(filename, "..", 2))
-				break;
+	p->block_size = c.arg.block_size;
+	p->inode_size = c.arg.inode_size;
 
-			ret = unpack_dirent(p, le32_to_cpu(dir->inode), child_name);
-			break;
-		case EXT4_FT_SYMLINK:
-			ret = unpack_symlink(p, le32_to_cpu(dir->inode), child_name);
-			break;
-		case EXT4_FT_CHRDEV:
-		case EXT4_FT_BLKDEV:
-		case EXT4_FT_FIFO:
-		case EXT4_FT_SOCK:
-			printf("Warning: ignore %s(ino #%d): "
-				"file type %d is not impl now\n",
-				filename, le32_to_cpu(dir->inode), dir->filetype);
-			break;
-		case EXT4_FT_UNKNOWN:
-		default:
-			fprintf(stderr, "unknown filetype 0x%x\n", dir->filetype);
-			ret = -1;
-			break;
-		}
+	ret = ext2_pack_uuid(c.arg.uuid, "uuid", p->sblock.unique_id);
+	if (ret == 0)
+		ret = ext2_pack_uuid(c.arg.hash_seed, "hash seed",
+				     p->sblock.hash_seed);
+	if (ret == 0)
+		ret = ext2_pack_tree(&c, dir);
 
-		if (ret < 0)
-			break;
+	if (ret == 0) {
+#ifdef CONFIG_ENABLE_ANDROID
+		if (c.arg.sparse)
+			ret = ext2_pack_sparse(&c, fd_outimg);
+		else
+#endif
+			ret = ext2_pack_write(&c);
 	}
 
-done:
-	dirent_iterator_exit(&it);
+	if (c.root)
+		ext2_pack_free_node(c.root);
+	free(c.inodes);
 	return ret;
 }
 
-static int ext2_unpack(void *private_data, int fd, const char *dirout, int argc, char **argv)
-{
-	struct ext2_editor_private_data *p = private_data;
-
-	return unpack_dirent(p, EXT2_ROOT_INO, dirout);
-}
-
 static const uint8_t ext2_disk_magic[2] = {
 	(EXT2_MAGIC >> 0) & 0xff,
 	(EXT2_MAGIC >> 8) & 0xff,
@@ -3212,6 +9260,7 @@ static struct imgeditor ext2_editor = {
 	.detect			= ext2_detect,
 	.list			= ext2_main,
 	.unpack			= ext2_unpack,
+	.pack			= ext2_pack,
 	.total_size		= ext2_total_size,
 	.summary		= ext2_summary,
 
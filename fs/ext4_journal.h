@@ -113,6 +113,12 @@ struct journal_block_tag_s
 	__be32		t_blocknr_high; /* most-significant high 32bits. */
 };
 
+/* The journal superblock is 1024 bytes include the journal_header_t,
+ * and s_checksum is saved at the end of s_padding.
+ */
+#define JBD2_SUPERBLOCK_SIZE		1024
+#define JBD2_SUPERBLOCK_CSUM_OFFSET	0xFC
+
 /* Tail of descriptor or revoke block, for checksumming */
 struct jbd2_journal_block_tail {
 	__be32		t_checksum;
@@ -116,6 +116,9 @@
 #define EXT4_FEATURE_INCOMPAT_ENCRYPT		0x10000
 #define EXT4_FEATURE_INCOMPAT_CASEFOLD		0x20000
 
+#define EXT2_MIN_DESC_SIZE			32
+#define EXT4_MIN_DESC_SIZE_64BIT		64
+
 /* The ext2 superblock.  */
 struct ext2_sblock {
 	__le32 total_inodes;
@@ -272,6 +275,11 @@ struct ext2_inode {
 	__le32 osd2[3];
 };
 
+/* ext2_block_group.bg_flags */
+#define EXT4_BG_INODE_UNINIT			0x0001 /* Inode table/bitmap not in use */
+#define EXT4_BG_BLOCK_UNINIT			0x0002 /* Block bitmap not in use */
+#define EXT4_BG_INODE_ZEROED			0x0004 /* On-disk itable initialized to zero */
+
 #define INODE_MODE_PERMISSION_MASK		0x0fff
 #define INODE_MODE_S_MASK			0xf000
 
@@ -373,6 +381,8 @@ struct ext2_inode {
 
 
 /* The header of an ext2 directory entry. */
+#define EXT2_NAME_LEN			255
+
 struct ext2_dirent {
 	__le32 inode;
 	__le16 direntlen;
@@ -410,6 +420,13 @@ struct ext4_extent {
 	__le32	ee_start_lo;	/* low 32 bits of physical block */
 };
 
+/*
+ * The max ee_len of an initialized extent, the extent is unwritten
+ * (preallocated and reads as zero) if ee_len is larger than it, and the
+ * actual length is ee_len - EXT_INIT_MAX_LEN.
+ */
+#define EXT_INIT_MAX_LEN		(1UL << 15)
+
 /*
  * This is index on-disk structure.
  * It's used at all the levels except the bottom.
@@ -432,5 +449,110 @@ struct ext4_extent_header {
 };
 
 #define EXT4_EXT_MAGIC			0xf30a
+#define EXT4_EXT_MAX_DEPTH		5
+
+/*
+ * The checksum of the extent index and leaf block is saved after the
+ * eh_max entries.
+ */
+struct ext4_extent_tail {
+	__le32	et_checksum;	/* crc32c(uuid+inum+extent_block) */
+};
+
+/*
+ * The raw inode checksum fields, i_checksum_hi only exists if
+ * i_extra_isize is large enough.
+ */
+#define EXT4_GOOD_OLD_INODE_SIZE	128
+#define EXT4_INODE_CSUM_LO_OFFSET	0x7c
+#define EXT4_INODE_EXTRA_ISIZE_OFFSET	0x80
+#define EXT4_INODE_CSUM_HI_OFFSET	0x82
+#define EXT4_INODE_CSUM_HI_EXTRA_END	4
+
+/* the fields after the 128 bytes ext2_inode, i_extra_isize is the size of
+ * the fields in use.
+ */
+struct ext4_inode_extra {
+	__le16	i_extra_isize;
+	__le16	i_checksum_hi;	/* crc32c(uuid+inum+inode) BE */
+	__le32	i_ctime_extra;	/* extra change time (nsec << 2 | epoch) */
+	__le32	i_mtime_extra;	/* extra modification time */
+	__le32	i_atime_extra;	/* extra access time */
+	__le32	i_crtime;	/* file creation time */
+	__le32	i_crtime_extra;	/* extra file creation time */
+	__le32	i_version_hi;	/* high 32 bits for 64-bit version */
+	__le32	i_projid;	/* project id */
+};
+
+/*
+ * The fake directory entry at the end of the leaf block, which saves
+ * the checksum of this block.
+ */
+struct ext4_dir_entry_tail {
+	__le32	det_reserved_zero1;	/* Pretend to be unused */
+	__le16	det_rec_len;		/* 12 */
+	__u8	det_reserved_zero2;	/* Zero name length */
+	__u8	det_reserved_ft;	/* 0xDE, fake file type */
+	__le32	det_checksum;		/* crc32c(uuid+inum+dirblock) */
+};
+
+#define EXT4_FT_DIR_CSUM		0xDE
+
+/* the htree root is saved in the first directory block after the "."
+ * and ".." entries.
+ */
+struct dx_root_info {
+	__le32	reserved_zero;
+	__u8	hash_version;
+	__u8	info_length;	/* 8 */
+	__u8	indirect_levels;
+	__u8	unused_flags;
+};
+
+#define DX_HASH_LEGACY			0
+#define DX_HASH_HALF_MD4		1
+#define DX_HASH_TEA			2
+#define DX_HASH_LEGACY_UNSIGNED		3
+#define DX_HASH_HALF_MD4_UNSIGNED	4
+#define DX_HASH_TEA_UNSIGNED		5
+#define DX_HASH_SIPHASH			6
+
+/* the htree depth, it's 3 if the largedir feature is enabled */
+#define EXT4_HTREE_LEVEL_COMPAT		2
+#define EXT4_HTREE_LEVEL		3
+
+#define EXT4_HTREE_EOF_32BIT		0x7fffffffU
+
+/* ext2_sblock.flags */
+#define EXT2_FLAGS_SIGNED_HASH		0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002
+
+/* the htree index block */
+struct dx_countlimit {
+	__le16	limit;
+	__le16	count;
+};
+
+struct dx_entry {
+	__le32	hash;
+	__le32	block;
+};
+
+struct dx_tail {
+	__le32	dt_reserved;
+	__le32	dt_checksum;	/* crc32c(uuid+inum+dirblock) */
+};
+
+/* The header of the extended attribute block */
+#define EXT4_XATTR_MAGIC		0xEA020000
+
+struct ext4_xattr_header {
+	__le32	h_magic;	/* magic number for identification */
+	__le32	h_refcount;	/* reference count */
+	__le32	h_blocks;	/* number of disk blocks used */
+	__le32	h_hash;		/* hash value of all attributes */
+	__le32	h_checksum;	/* crc32c(uuid+id+xattrblock) */
+	__u32	h_reserved[3];
+};
 
 #endif
@@ -4,12 +4,21 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "f2fs_fs.h"
 #include "structure.h"
 #include "libcrc.h"
 #include "string_helper.h"
 #include "bitmask.h"
+#include "threadpool.h"
+#include "list_head.h"
+#include "android_sparse.h"
+#include "json_helper.h"
+#include "minilzo.h"
 
 struct f2fs_editor;
 
@@ -320,23 +329,65 @@ static const struct structure_item st_f2fs_sit_entry[] = {
 	STRUCTURE_ITEM_END(),
 };
 
-struct f2fs_segment {
-	uint32_t			block_size;
-	uint32_t			blocks;
-	uint8_t				buffer[0];
+/* the NAT blocks are loaded on demand, F2FS_NAT_RANGE_BLOCKS blocks
+ * each time.
+ */
+#define F2FS_NAT_RANGE_BLOCKS		64
+
+enum f2fs_cache_type {
+	F2FS_CACHE_NAT,
+	F2FS_CACHE_NODE,
 };
 
-static inline void f2fs_free_segment(struct f2fs_segment *segment)
-{
-	free(segment);
-}
+/* the NAT ranges and the node blocks share one cache, the recently used
+ * ones are in the head of the lru list.
+ */
+struct f2fs_cache_entry {
+	struct list_head		lru;
+	enum f2fs_cache_type		type;
+	size_t				size;
+};
+
+struct f2fs_nat_range {
+	struct f2fs_cache_entry		cache;
+	uint8_t				*blocks;
+};
+
+#define F2FS_NODE_HASH_SIZE		4096
+#define F2FS_NODE_PREFETCH_BLOCKS	64
+
+struct f2fs_node_cache {
+	struct f2fs_cache_entry		cache;
+	struct f2fs_node_cache		*hash_next;
+	uint32_t			blkaddr;
+	uint8_t				buf[F2FS_BLKSIZE];
+};
 
 struct f2fs_editor {
 	int				fd;
 
 	struct f2fs_super_block		sblock;
 	struct f2fs_checkpoint		*checkpoint;
-	struct f2fs_segment		*nat;
+	uint32_t			cp_blkaddr; /* the valid cp pack */
+
+	/* the NAT block in the second segment of a pair is valid if the bit
+	 * is set, and the newer entries in the NAT journal override them.
+	 */
+	struct bitmask			*nat_bitmap;
+	uint32_t			max_nid;
+	struct nat_journal_entry	nat_journal[NAT_JOURNAL_ENTRIES];
+	size_t				n_nat_journal;
+
+	/* NAT and node blocks cache, the size of them is limited together.
+	 * protected by @cache_lock since the nodes are read by the unpack
+	 * workers.
+	 */
+	struct f2fs_nat_range		*nat_ranges;
+	size_t				n_nat_ranges;
+	struct f2fs_node_cache		*node_hash[F2FS_NODE_HASH_SIZE];
+	struct list_head		cache_lru;
+	size_t				cache_size;
+	pthread_mutex_t			cache_lock;
 
 	uint32_t			sector_size;
 	uint32_t			block_size;
@@ -357,9 +408,14 @@ static int f2fs_editor_init(void *private_data)
 	f2fs->crc32_algo.xor_result = 0;
 
 	libcrc32_init(&f2fs->crc32_algo);
+	pthread_mutex_init(&f2fs->cache_lock, NULL);
+	list_init(&f2fs->cache_lru);
 	return 0;
 }
 
+static void f2fs_cache_drop(struct f2fs_editor *f2fs,
+			    struct f2fs_cache_entry *e);
+
 static void f2fs_editor_exit(void *private_data)
 {
 	struct f2fs_editor *f2fs = private_data;
@@ -369,9 +425,26 @@ static void f2fs_editor_exit(void *private_data)
 		f2fs->checkpoint = NULL;
 	}
 
-	if (f2fs->nat) {
-		f2fs_free_segment(f2fs->nat);
-		f2fs->nat = NULL;
+	/* the NAT ranges in the lru list are saved in @nat_ranges, drop
+	 * them before freeing it.
+	 */
+	if (f2fs->cache_lru.next) {
+		while (!list_empty(&f2fs->cache_lru))
+			f2fs_cache_drop(f2fs,
+					list_first_entry(&f2fs->cache_lru,
+							 struct f2fs_cache_entry,
+							 lru));
+	}
+
+	if (f2fs->nat_ranges) {
+		free(f2fs->nat_ranges);
+		f2fs->nat_ranges = NULL;
+		f2fs->n_nat_ranges = 0;
+	}
+
+	if (f2fs->nat_bitmap) {
+		bitmask_free(f2fs->nat_bitmap);
+		f2fs->nat_bitmap = NULL;
 	}
 }
 
@@ -380,14 +453,12 @@ static int f2fs_read_blocks(struct f2fs_editor *p,
 			    void *buf, size_t bufsz)
 {
 	size_t sz = p->block_size * nblks;
-	int n;
 
 	if (sz > bufsz)
 		sz = bufsz;
 
-	fileseek(p->fd, blkno * p->block_size);
-	n = read(p->fd, buf, sz);
-	if (n <= 0 || (size_t)n != sz) {
+	/* positional read, the worker threads of unpack share the fd */
+	if (filepread(p->fd, buf, sz, (off64_t)blkno * p->block_size) < 0) {
 		fprintf(stderr, "Error: read %d blocks from #%lu failed\n",
 			nblks, blkno);
 		return -1;
@@ -418,53 +489,349 @@ static void *f2fs_alloc_read_block(struct f2fs_editor *f2fs,
 	return f2fs_alloc_read_blocks(f2fs, blkno, 1);
 }
 
-static struct f2fs_segment *
-	f2fs_alloc_read_segment(struct f2fs_editor *f2fs, uint32_t blkaddr,
-				uint32_t segment_count)
+static int f2fs_compare_nat_journal(const void *a, const void *b)
 {
-	size_t total_bytes = segment_count * f2fs->segment_size;
-	struct f2fs_segment *seg = malloc(sizeof(*seg) + total_bytes);
-	int ret;
+	uint32_t nid_a = le32_to_cpu(((const struct nat_journal_entry *)a)->nid);
+	uint32_t nid_b = le32_to_cpu(((const struct nat_journal_entry *)b)->nid);
+
+	if (nid_a < nid_b)
+		return -1;
+
+	return nid_a > nid_b;
+}
+
+/* the NAT area has two copies of each segment, the blocks of segment 2N
+ * and 2N + 1 are the same nid range. the checkpoint's NAT bitmap tells
+ * which one is valid.
+ */
+static uint32_t f2fs_nat_block_addr(struct f2fs_editor *f2fs,
+				    uint32_t block_off)
+{
+	uint32_t blkaddr = le32_to_cpu(f2fs->sblock.nat_blkaddr)
+			+ (block_off << 1)
+			- (block_off & (f2fs->blocks_per_segment - 1));
+
+	if (bitmask_get(f2fs->nat_bitmap, block_off) > 0)
+		blkaddr += f2fs->blocks_per_segment;
+
+	return blkaddr;
+}
+
+static struct f2fs_node_cache **
+	f2fs_node_cache_slot(struct f2fs_editor *f2fs, uint32_t blkaddr)
+{
+	struct f2fs_node_cache **slot =
+		&f2fs->node_hash[blkaddr % F2FS_NODE_HASH_SIZE];
+
+	while (*slot && (*slot)->blkaddr != blkaddr)
+		slot = &(*slot)->hash_next;
+
+	return slot;
+}
+
+/* the caller must hold @cache_lock for all f2fs_cache_* functions */
+static void f2fs_cache_add(struct f2fs_editor *f2fs,
+			   struct f2fs_cache_entry *e,
+			   enum f2fs_cache_type type, size_t size)
+{
+	e->type = type;
+	e->size = size;
+	list_add(&e->lru, &f2fs->cache_lru);
+	f2fs->cache_size += size;
+}
+
+static void f2fs_cache_touch(struct f2fs_editor *f2fs,
+			     struct f2fs_cache_entry *e)
+{
+	list_del(&e->lru);
+	list_add(&e->lru, &f2fs->cache_lru);
+}
+
+static void f2fs_cache_drop(struct f2fs_editor *f2fs,
+			    struct f2fs_cache_entry *e)
+{
+	struct f2fs_nat_range *r;
+	struct f2fs_node_cache *c;
+
+	list_del(&e->lru);
+	f2fs->cache_size -= e->size;
 
-	if (!seg) {
-		fprintf(stderr, "Error: failed to alloc %u segments\n",
-				segment_count);
-		return seg;
+	switch (e->type) {
+	case F2FS_CACHE_NAT:
+		r = container_of(e, struct f2fs_nat_range, cache);
+		free(r->blocks);
+		r->blocks = NULL;
+		break;
+	case F2FS_CACHE_NODE:
+		c = container_of(e, struct f2fs_node_cache, cache);
+		*f2fs_node_cache_slot(f2fs, c->blkaddr) = c->hash_next;
+		free(c);
+		break;
 	}
+}
 
-	seg->block_size = f2fs->block_size;
-	seg->blocks = segment_count * f2fs->blocks_per_segment;
-	ret = f2fs_read_blocks(f2fs, blkaddr, seg->blocks,
-			       seg->buffer, total_bytes);
-	if (ret < 0) {
-		free(seg);
+/* drop the least recently used entries, but the new entry is always
+ * loaded even if it is larger than the limit.
+ */
+static void f2fs_cache_shrink(struct f2fs_editor *f2fs, size_t needed)
+{
+	size_t limit = get_cache_size_limit();
+
+	while (!list_empty(&f2fs->cache_lru)
+	       && f2fs->cache_size + needed > limit)
+		f2fs_cache_drop(f2fs, list_entry(f2fs->cache_lru.prev,
+						 struct f2fs_cache_entry, lru));
+}
+
+static struct f2fs_nat_range *
+	f2fs_nat_cache_load(struct f2fs_editor *f2fs, size_t idx)
+{
+	struct f2fs_nat_range *r = &f2fs->nat_ranges[idx];
+	uint32_t nat_blocks = f2fs->nat_bitmap->total_bits;
+	uint32_t first = idx * F2FS_NAT_RANGE_BLOCKS;
+	size_t sz = F2FS_NAT_RANGE_BLOCKS * f2fs->block_size;
+	uint32_t nblks = F2FS_NAT_RANGE_BLOCKS;
+
+	if (r->blocks)
+		return r;
+
+	if (first + nblks > nat_blocks)
+		nblks = nat_blocks - first;
+
+	f2fs_cache_shrink(f2fs, sz);
+
+	r->blocks = calloc(1, sz);
+	if (!r->blocks) {
+		fprintf(stderr, "Error: alloc nat range #%zu failed\n", idx);
 		return NULL;
 	}
 
-	return seg;
+	/* the blocks select the same copy are continuous, read them
+	 * together.
+	 */
+	for (uint32_t i = 0, n; i < nblks; i += n) {
+		uint32_t blkaddr = f2fs_nat_block_addr(f2fs, first + i);
+
+		for (n = 1; i + n < nblks; n++) {
+			if (f2fs_nat_block_addr(f2fs, first + i + n)
+			    != blkaddr + n)
+				break;
+		}
+
+		if (f2fs_read_blocks(f2fs, blkaddr, n,
+				     r->blocks + (size_t)i * f2fs->block_size,
+				     n * f2fs->block_size) < 0) {
+			free(r->blocks);
+			r->blocks = NULL;
+			return NULL;
+		}
+	}
+
+	f2fs_cache_add(f2fs, &r->cache, F2FS_CACHE_NAT, sz);
+	return r;
+}
+
+static int f2fs_get_nat_entry(struct f2fs_editor *f2fs, uint32_t nid,
+			      struct f2fs_nat_entry *ret_entry)
+{
+	struct nat_journal_entry key = { .nid = cpu_to_le32(nid) };
+	uint32_t block_off = nid / NAT_ENTRY_PER_BLOCK;
+	struct nat_journal_entry *journal;
+	struct f2fs_nat_range *r;
+	int ret = 0;
+
+	if (nid >= f2fs->max_nid)
+		return -1;
+
+	journal = bsearch(&key, f2fs->nat_journal, f2fs->n_nat_journal,
+			  sizeof(key), f2fs_compare_nat_journal);
+	if (journal) {
+		*ret_entry = journal->ne;
+		return 0;
+	}
+
+	pthread_mutex_lock(&f2fs->cache_lock);
+
+	r = f2fs_nat_cache_load(f2fs, block_off / F2FS_NAT_RANGE_BLOCKS);
+	if (!r) {
+		ret = -1;
+	} else {
+		struct f2fs_nat_block *blk = (struct f2fs_nat_block *)
+			(r->blocks + (size_t)(block_off % F2FS_NAT_RANGE_BLOCKS)
+				* f2fs->block_size);
+
+		f2fs_cache_touch(f2fs, &r->cache);
+		*ret_entry = blk->entries[nid % NAT_ENTRY_PER_BLOCK];
+	}
+
+	pthread_mutex_unlock(&f2fs->cache_lock);
+	return ret;
 }
 
 static int f2fs_get_inode_block(struct f2fs_editor *f2fs, uint32_t ino,
 				uint32_t *ret_blkno)
 {
-	void *p_block = f2fs->nat->buffer;
+	struct f2fs_nat_entry entry;
+	uint32_t blkaddr;
 
-	for (size_t i = 0; i < f2fs->nat->blocks; i++) {
-		struct f2fs_nat_block *nat = p_block;
+	if (f2fs_get_nat_entry(f2fs, ino, &entry) < 0
+	    || le32_to_cpu(entry.ino) != ino)
+		return -1;
 
-		for (size_t j = 0; j < NAT_ENTRY_PER_BLOCK; j++) {
-			struct f2fs_nat_entry *entry = &nat->entries[j];
+	blkaddr = le32_to_cpu(entry.block_addr);
+	if (blkaddr == NULL_ADDR || blkaddr == NEW_ADDR)
+		return -1;
 
-			if (le32_to_cpu(entry->ino) == ino) {
-				*ret_blkno = le32_to_cpu(entry->block_addr);
-				return 0;
-			}
+	*ret_blkno = blkaddr;
+	return 0;
+}
+
+/* copy the cached node block to @buf, the caller must hold @cache_lock */
+static bool f2fs_node_cache_lookup(struct f2fs_editor *f2fs,
+				   uint32_t blkaddr, void *buf)
+{
+	struct f2fs_node_cache *c = *f2fs_node_cache_slot(f2fs, blkaddr);
+
+	if (!c)
+		return false;
+
+	f2fs_cache_touch(f2fs, &c->cache);
+	if (buf)
+		memcpy(buf, c->buf, sizeof(c->buf));
+
+	return true;
+}
+
+/* the caller must hold @cache_lock */
+static void f2fs_node_cache_insert(struct f2fs_editor *f2fs,
+				   uint32_t blkaddr, const void *buf)
+{
+	struct f2fs_node_cache **slot = f2fs_node_cache_slot(f2fs, blkaddr);
+	struct f2fs_node_cache *c = *slot;
+
+	if (c)
+		return;
+
+	f2fs_cache_shrink(f2fs, sizeof(*c));
+
+	/* the cache is only a speedup, the reading doesn't fail without it */
+	c = malloc(sizeof(*c));
+	if (!c)
+		return;
+
+	c->blkaddr = blkaddr;
+	memcpy(c->buf, buf, sizeof(c->buf));
+	slot = f2fs_node_cache_slot(f2fs, blkaddr);
+	c->hash_next = NULL;
+	*slot = c;
+	f2fs_cache_add(f2fs, &c->cache, F2FS_CACHE_NODE, sizeof(*c));
+}
+
+static int f2fs_read_node_block(struct f2fs_editor *f2fs, uint32_t blkaddr,
+				void *buf)
+{
+	bool hit;
+
+	pthread_mutex_lock(&f2fs->cache_lock);
+	hit = f2fs_node_cache_lookup(f2fs, blkaddr, buf);
+	pthread_mutex_unlock(&f2fs->cache_lock);
+
+	if (hit)
+		return 0;
+
+	if (f2fs_read_blocks(f2fs, blkaddr, 1, buf, f2fs->block_size) < 0)
+		return -1;
+
+	pthread_mutex_lock(&f2fs->cache_lock);
+	f2fs_node_cache_insert(f2fs, blkaddr, buf);
+	pthread_mutex_unlock(&f2fs->cache_lock);
+
+	return 0;
+}
+
+static void *f2fs_alloc_read_node_block(struct f2fs_editor *f2fs,
+					uint32_t blkaddr)
+{
+	void *buf = malloc(f2fs->block_size);
+
+	if (buf && f2fs_read_node_block(f2fs, blkaddr, buf) < 0) {
+		free(buf);
+		buf = NULL;
+	}
+
+	return buf;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t u32_a = *(const uint32_t *)a, u32_b = *(const uint32_t *)b;
+
+	if (u32_a < u32_b)
+		return -1;
+
+	return u32_a > u32_b;
+}
+
+/* load the child nodes of an indirect node to the cache before walking
+ * them. the siblings are usually adjacent in the node segments, so the
+ * blocks are sorted and the continuous ones are read together.
+ */
+static void f2fs_node_cache_prefetch(struct f2fs_editor *f2fs,
+				     const __le32 *nids, size_t count)
+{
+	uint32_t *blkaddrs = malloc(count * sizeof(*blkaddrs));
+	void *buf = malloc(F2FS_NODE_PREFETCH_BLOCKS * f2fs->block_size);
+	size_t n = 0;
+
+	if (!blkaddrs || !buf)
+		goto done;
+
+	for (size_t i = 0; i < count; i++) {
+		uint32_t nid = le32_to_cpu(nids[i]), blkaddr;
+		struct f2fs_nat_entry entry;
+
+		if (nid == 0 || f2fs_get_nat_entry(f2fs, nid, &entry) < 0)
+			continue;
+
+		blkaddr = le32_to_cpu(entry.block_addr);
+		if (blkaddr == NULL_ADDR || blkaddr == NEW_ADDR)
+			continue;
+
+		blkaddrs[n++] = blkaddr;
+	}
+
+	qsort(blkaddrs, n, sizeof(*blkaddrs), compare_u32);
+
+	pthread_mutex_lock(&f2fs->cache_lock);
+	for (size_t i = 0, run; i < n; i += run) {
+		/* skip the cached blocks and the duplicate addresses */
+		if (f2fs_node_cache_lookup(f2fs, blkaddrs[i], NULL)
+		    || (i > 0 && blkaddrs[i] == blkaddrs[i - 1])) {
+			run = 1;
+			continue;
+		}
+
+		for (run = 1; i + run < n && run < F2FS_NODE_PREFETCH_BLOCKS;
+		     run++) {
+			if (blkaddrs[i + run] != blkaddrs[i] + run)
+				break;
 		}
 
-		p_block += f2fs->nat->block_size;
+		pthread_mutex_unlock(&f2fs->cache_lock);
+		if (f2fs_read_blocks(f2fs, blkaddrs[i], run, buf,
+				     run * f2fs->block_size) < 0)
+			goto done;
+		pthread_mutex_lock(&f2fs->cache_lock);
+
+		for (size_t j = 0; j < run; j++)
+			f2fs_node_cache_insert(f2fs, blkaddrs[i] + j,
+					       buf + j * f2fs->block_size);
 	}
+	pthread_mutex_unlock(&f2fs->cache_lock);
 
-	return -1;
+done:
+	free(buf);
+	free(blkaddrs);
 }
 
 static struct f2fs_inode *_f2fs_alloc_read_inode(struct f2fs_editor *f2fs,
@@ -479,7 +846,7 @@ static struct f2fs_inode *_f2fs_alloc_read_inode(struct f2fs_editor *f2fs,
 		return inode;
 	}
 
-	inode = f2fs_alloc_read_block(f2fs, blkno);
+	inode = f2fs_alloc_read_node_block(f2fs, blkno);
 	if (!inode) {
 		fprintf(stderr, "Error: failed to alloc inode #%u\n", ino);
 		return inode;
@@ -497,29 +864,36 @@ static struct f2fs_inode *f2fs_alloc_read_inode(struct f2fs_editor *f2fs,
 	return _f2fs_alloc_read_inode(f2fs, ino, NULL);
 }
 
-static struct f2fs_nat_entry *
-	f2fs_get_nat_entry(struct f2fs_editor *f2fs, uint32_t nid)
+static bool f2fs_inode_has_nid(struct f2fs_inode *inode)
 {
-	struct f2fs_segment *nat = f2fs->nat;
-	size_t nat_entry_counts = nat->blocks * NAT_ENTRY_PER_BLOCK;
-	struct f2fs_nat_block *nat_block;
-
-	if (nid >= nat_entry_counts)
-		return NULL;
-
-	nat_block = (struct f2fs_nat_block *)
-		(nat->buffer + (nid / NAT_ENTRY_PER_BLOCK) * f2fs->block_size);
+	for (size_t i = 0; i < DEF_NIDS_PER_INODE; i++) {
+		if (le32_to_cpu(inode->i_nid[i]) != 0)
+			return true;
+	}
 
-	nid %= NAT_ENTRY_PER_BLOCK;
-	return &nat_block->entries[nid];
+	return false;
 }
 
+/* a run of continuous data blocks, the file blocks without any extent
+ * are holes.
+ */
+struct f2fs_block_extent {
+	uint64_t		fofs;
+	uint32_t		blkaddr;
+	uint32_t		len;
+};
+
+/* the COMPRESS_ADDR of a compressed cluster is saved as an extent with
+ * only one block, the compressed blocks are the following extents.
+ */
 struct f2fs_inode_blocks {
-	uint32_t		*blocks;
-	size_t			total;
+	struct f2fs_block_extent	*extents;
+	size_t				total;
 
 	/* private data */
-	size_t			__maxsize;
+	uint64_t			__fofs; /* the next file block */
+	size_t				__maxsize;
+	uint32_t			__addrs_per_block;
 };
 
 static int f2fs_inode_blocks_push(struct f2fs_editor *p,
@@ -527,81 +901,191 @@ static int f2fs_inode_blocks_push(struct f2fs_editor *p,
 				  uint32_t blkno,
 				  struct bitmask *indir_blocks)
 {
+	struct f2fs_block_extent *last = NULL;
+	uint64_t fofs = b->__fofs++;
+
+	/* NEW_ADDR is reserved but never written, it's a hole too */
+	if (blkno == NULL_ADDR || blkno == NEW_ADDR)
+		return 0;
+
+	if (indir_blocks && blkno != COMPRESS_ADDR)
+		bitmask_set(indir_blocks, blkno);
+
+	if (b->total > 0) {
+		last = &b->extents[b->total - 1];
+		if (last->fofs + last->len == fofs
+		    && last->blkaddr + last->len == blkno
+		    && last->len < UINT32_MAX) {
+			last->len++;
+			return 0;
+		}
+	}
+
 	if (b->__maxsize == 0) {
 		b->total = 0;
-		b->__maxsize = DEF_ADDRS_PER_INODE;
-		b->blocks = calloc(b->__maxsize, sizeof(*b->blocks));
+		b->__maxsize = 16;
+		b->extents = calloc(b->__maxsize, sizeof(*b->extents));
 	} else if (b->total + 1 > b->__maxsize) {
 		b->__maxsize *= 2;
-		b->blocks = realloc(b->blocks,
-				    b->__maxsize * sizeof(*b->blocks));
+		b->extents = realloc(b->extents,
+				     b->__maxsize * sizeof(*b->extents));
 	}
 
-	if (!b->blocks) {
-		fprintf(stderr, "Error: Alloc %zu inode indir blocks failed\n",
+	if (!b->extents) {
+		fprintf(stderr, "Error: Alloc %zu inode extents failed\n",
 			b->__maxsize);
 		return -1;
 	}
 
-	if (indir_blocks)
-		bitmask_set(indir_blocks, blkno);
-
-	b->blocks[b->total] = blkno;
+	b->extents[b->total].fofs = fofs;
+	b->extents[b->total].blkaddr = blkno;
+	b->extents[b->total].len = 1;
 	b->total++;
 
 	return 0;
 }
 
-#define f2fs_inode_read_block_define(name, todo, _maxcount)		\
+/* @_child_blocks: the file blocks addressed by each child of the node */
+#define f2fs_inode_read_block_define(name, todo, _maxcount, _child_blocks) \
 static int								\
 f2fs_inode_##name##_blocks_push(struct f2fs_editor *f2fs,		\
 				struct f2fs_inode_blocks *b,		\
 				uint32_t nid,				\
 				struct bitmask *indir_blocks)		\
 {									\
-	struct f2fs_nat_entry *entry = NULL;				\
+	struct f2fs_nat_entry entry;					\
 	__le32 *blkbuf = NULL; 						\
 	uint32_t blkno = 0;						\
 	size_t maxcount = _maxcount;					\
 	int ret = 0;							\
 									\
-	entry = f2fs_get_nat_entry(f2fs, nid);				\
-	if (!entry) {							\
+	if (f2fs_get_nat_entry(f2fs, nid, &entry) < 0) {		\
 		fprintf(stderr, "Error: get %s nat entry #%d failed\n",	\
 			#name, nid);					\
 		return -1;						\
 	}								\
 									\
-	blkno = le32_to_cpu(entry->block_addr);				\
-	blkbuf = f2fs_alloc_read_block(f2fs, blkno);			\
+	blkno = le32_to_cpu(entry.block_addr);				\
+	blkbuf = f2fs_alloc_read_node_block(f2fs, blkno);		\
 	if (!blkbuf) {							\
 		fprintf(stderr, "Error: read %s blk #%d failed\n",	\
 			#name, blkno);					\
 		return -1;						\
 	}								\
 									\
+	if ((_child_blocks) > 1)					\
+		f2fs_node_cache_prefetch(f2fs, blkbuf, maxcount);	\
+									\
 	if (indir_blocks)						\
 		bitmask_set(indir_blocks, blkno);			\
 									\
 	for (size_t i = 0; i < maxcount; i++) {				\
 		uint32_t n = le32_to_cpu(blkbuf[i]);			\
 									\
-		if (n == 0)						\
+		/* skip the file blocks of the unallocated child */	\
+		if (n == 0) {						\
+			b->__fofs += (_child_blocks);			\
 			continue;					\
+		}							\
 									\
 		if (indir_blocks)					\
 			bitmask_set(indir_blocks, n);			\
 		ret = todo(f2fs, b, n, indir_blocks);			\
 		if (ret < 0)						\
-			return ret;					\
+			break;						\
 	}								\
 									\
+	free(blkbuf);							\
 	return ret;							\
 }
 
-f2fs_inode_read_block_define(direct, f2fs_inode_blocks_push, DEF_ADDRS_PER_BLOCK);
-f2fs_inode_read_block_define(indirect, f2fs_inode_direct_blocks_push, NIDS_PER_BLOCK);
-f2fs_inode_read_block_define(double_indirect, f2fs_inode_indirect_blocks_push, NIDS_PER_BLOCK);
+f2fs_inode_read_block_define(direct, f2fs_inode_blocks_push,
+			     b->__addrs_per_block, 1);
+f2fs_inode_read_block_define(indirect, f2fs_inode_direct_blocks_push,
+			     NIDS_PER_BLOCK, b->__addrs_per_block);
+f2fs_inode_read_block_define(double_indirect, f2fs_inode_indirect_blocks_push,
+			     NIDS_PER_BLOCK,
+			     NIDS_PER_BLOCK * (uint64_t)b->__addrs_per_block);
+
+/* the blocks in a compressed cluster, return zero if @inode is not a
+ * compressed file.
+ */
+static uint32_t f2fs_inode_cluster_blocks(struct f2fs_inode *inode)
+{
+	if (!(le32_to_cpu(inode->i_flags) & F2FS_COMPR_FL)
+	    || !(inode->i_inline & F2FS_EXTRA_ATTR)
+	    || le16_to_cpu(inode->i_extra_isize)
+		< offsetof(struct f2fs_inode, i_extra_end)
+			- offsetof(struct f2fs_inode, i_extra_isize))
+		return 0;
+
+	if (inode->i_log_cluster_size < MIN_COMPRESS_LOG_SIZE
+	    || inode->i_log_cluster_size > MAX_COMPRESS_LOG_SIZE)
+		return 0;
+
+	return 1 << inode->i_log_cluster_size;
+}
+
+/* the addresses of a compressed file are aligned to the cluster size in
+ * both inode and direct node, see ADDRS_PER_BLOCK in linux kernel.
+ */
+static uint32_t f2fs_inode_addrs_per_block(struct f2fs_inode *inode)
+{
+	uint32_t cluster_blocks = f2fs_inode_cluster_blocks(inode);
+
+	if (cluster_blocks)
+		return DEF_ADDRS_PER_BLOCK / cluster_blocks * cluster_blocks;
+
+	return DEF_ADDRS_PER_BLOCK;
+}
+
+/* the data block addresses in i_addr, the extra attributes are saved
+ * before them and the inline xattrs after them.
+ */
+static int f2fs_inode_addrs(struct f2fs_editor *f2fs,
+			    struct f2fs_inode *inode,
+			    size_t *ret_first, size_t *ret_count)
+{
+	uint32_t cluster_blocks = f2fs_inode_cluster_blocks(inode);
+	size_t first = 0, xattr_addrs = 0;
+
+	if (inode->i_inline & F2FS_EXTRA_ATTR)
+		first = le16_to_cpu(inode->i_extra_isize) / sizeof(__le32);
+
+	if (inode->i_inline & F2FS_INLINE_XATTR) {
+		xattr_addrs = DEFAULT_INLINE_XATTR_ADDRS;
+		if ((inode->i_inline & F2FS_EXTRA_ATTR)
+		    && (le32_to_cpu(f2fs->sblock.feature)
+			& F2FS_FEATURE_FLEXIBLE_INLINE_XATTR))
+			xattr_addrs = le16_to_cpu(inode->i_inline_xattr_size);
+	}
+
+	if (first + xattr_addrs > DEF_ADDRS_PER_INODE)
+		return -1;
+
+	*ret_first = first;
+	*ret_count = DEF_ADDRS_PER_INODE - first - xattr_addrs;
+	if (cluster_blocks)
+		*ret_count = *ret_count / cluster_blocks * cluster_blocks;
+	return 0;
+}
+
+/* the inline data is saved after the reserved address of i_addr,
+ * see inline_data_addr and MAX_INLINE_DATA in linux kernel.
+ */
+static void *f2fs_inode_inline_data(struct f2fs_editor *f2fs,
+				    struct f2fs_inode *inode,
+				    size_t *ret_maxsz)
+{
+	size_t first = 0, count = 0;
+
+	if (f2fs_inode_addrs(f2fs, inode, &first, &count) < 0
+	    || count <= DEF_INLINE_RESERVED_SIZE)
+		return NULL;
+
+	*ret_maxsz = sizeof(__le32) * (count - DEF_INLINE_RESERVED_SIZE);
+	return &inode->i_addr[first + DEF_INLINE_RESERVED_SIZE];
+}
 
 static int _f2fs_inode_blocks_read(struct f2fs_editor *f2fs,
 				   struct f2fs_inode_blocks *b,
@@ -609,9 +1093,18 @@ static int _f2fs_inode_blocks_read(struct f2fs_editor *f2fs,
 				   uint32_t ino,
 				   struct bitmask *indir_blocks)
 {
+	size_t first = 0, count = 0;
 	int ret = 0;
 
-	for (size_t i = 0; i < DEF_ADDRS_PER_INODE; i++) {
+	if (f2fs_inode_addrs(f2fs, inode, &first, &count) < 0) {
+		fprintf(stderr, "Error: inode #%u has bad extra size\n", ino);
+		return -1;
+	}
+
+	b->__fofs = 0;
+	b->__addrs_per_block = f2fs_inode_addrs_per_block(inode);
+
+	for (size_t i = first; i < first + count; i++) {
 		uint32_t blkno = le32_to_cpu(inode->i_addr[i]);
 
 		/* Yes, the blkno can be zero,
@@ -629,20 +1122,45 @@ static int _f2fs_inode_blocks_read(struct f2fs_editor *f2fs,
 		 *                             : *
 		 *                             : 00000e70
 		 * i_nid                       : 0x00000000 0x00000000 0x00000000 0x00000000 0x00000000
+		 *
+		 * it's a hole and the file offset still moves forward.
 		 */
-		if (blkno == 0)
-			continue;
-
 		ret = f2fs_inode_blocks_push(f2fs, b, blkno, indir_blocks);
 		if (ret < 0)
 			goto done;
 	}
 
+	if (f2fs_inode_has_nid(inode)) {
+		__le32 nids[DEF_NIDS_PER_INODE];
+
+		memcpy(nids, inode->i_nid, sizeof(nids));
+		f2fs_node_cache_prefetch(f2fs, nids, DEF_NIDS_PER_INODE);
+	}
+
 	for (int i = 0; i < DEF_NIDS_PER_INODE; i++) {
 		uint32_t nid = le32_to_cpu(inode->i_nid[i]);
+		uint64_t child_blocks;
 
-		if (nid == 0)
+		switch (i) {
+		case 0:
+		case 1:
+			child_blocks = b->__addrs_per_block;
+			break;
+		case 2:
+		case 3:
+			child_blocks = NIDS_PER_BLOCK
+				* (uint64_t)b->__addrs_per_block;
+			break;
+		default:
+			child_blocks = NIDS_PER_BLOCK * NIDS_PER_BLOCK
+				* (uint64_t)b->__addrs_per_block;
+			break;
+		}
+
+		if (nid == 0) {
+			b->__fofs += child_blocks;
 			continue;
+		}
 
 		switch (i) {
 		case 0:
@@ -664,56 +1182,565 @@ static int _f2fs_inode_blocks_read(struct f2fs_editor *f2fs,
 
 done:
 	if (ret < 0) {
-		free(b->blocks);
-		b->blocks = 0;
+		free(b->extents);
+		b->extents = NULL;
 		b->total = b->__maxsize = 0;
 	}
 
 	return ret;
 }
 
+/* the largest extent cached in the inode, it is the whole file when the
+ * file is written continuously.
+ */
+static bool f2fs_inode_ext_covers_file(struct f2fs_editor *f2fs,
+				       struct f2fs_inode *inode)
+{
+	uint64_t blocks = aligned_length(le64_to_cpu(inode->i_size),
+					 f2fs->block_size) / f2fs->block_size;
+	uint32_t main_blkaddr = le32_to_cpu(f2fs->sblock.main_blkaddr);
+	uint32_t blkaddr = le32_to_cpu(inode->i_ext.blk);
+	uint32_t len = le32_to_cpu(inode->i_ext.len);
+
+	/* the extent cache is disabled for the compressed files */
+	if (le32_to_cpu(inode->i_flags) & F2FS_COMPR_FL)
+		return false;
+
+	return blocks > 0 && le32_to_cpu(inode->i_ext.fofs) == 0
+		&& len >= blocks && blkaddr >= main_blkaddr
+		&& (uint64_t)blkaddr + len
+			<= (uint64_t)main_blkaddr + le32_to_cpu(f2fs->sblock.segment_count_main)
+				* f2fs->blocks_per_segment;
+}
+
 static int f2fs_inode_blocks_read(struct f2fs_editor *p,
 				  struct f2fs_inode_blocks *b,
 				  struct f2fs_inode *inode,
 				  uint32_t ino)
 {
-	return _f2fs_inode_blocks_read(p, b, inode, ino, NULL);
-}
+	if (f2fs_inode_ext_covers_file(p, inode)) {
+		uint64_t blocks = aligned_length(le64_to_cpu(inode->i_size),
+						 p->block_size) / p->block_size;
 
-static int f2fs_super_block_check_crc(struct libcrc32 *crc,
-				      struct f2fs_super_block *sb,
-				      int force_type)
-{
-	uint32_t value;
+		b->extents = calloc(1, sizeof(*b->extents));
+		if (!b->extents)
+			return -1;
 
-	if (!(le32_to_cpu(sb->feature) & F2FS_FEATURE_SB_CHKSUM))
+		b->extents[0].fofs = 0;
+		b->extents[0].blkaddr = le32_to_cpu(inode->i_ext.blk);
+		b->extents[0].len = (uint32_t)blocks;
+		b->total = b->__maxsize = 1;
 		return 0;
-
-	if (le32_to_cpu(sb->checksum_offset)
-		!= offsetof(struct f2fs_super_block, crc)) {
-		fprintf_if_force_type("Error: bad checksum_offset\n");
-		return -1;
-	}
-
-	libcrc32_init(crc);
-	libcrc32_update(crc, sb, le32_to_cpu(sb->checksum_offset));
-	value = libcrc32_finish(crc);
-
-	if (value != le32_to_cpu(sb->crc)) {
-		fprintf_if_force_type("Error: checksum doesn't match. "
-				      "%x != %x\n",
-				      value, le32_to_cpu(sb->crc));
-		return -1;
 	}
 
-	return 0;
+	return _f2fs_inode_blocks_read(p, b, inode, ino, NULL);
 }
 
-static int f2fs_detect(void *private_data, int force_type, int fd)
+/* decode a raw lz4 block, return the decoded size or -1 if @src is bad */
+static int f2fs_lz4_decompress(const uint8_t *src, size_t srclen,
+			       uint8_t *dst, size_t dstlen)
 {
-	struct f2fs_editor *f2fs = private_data;
-	struct f2fs_super_block *sb = &f2fs->sblock;
-	int ret;
+	const uint8_t *ip = src, *iend = src + srclen;
+	uint8_t *op = dst, *oend = dst + dstlen;
+
+	while (ip < iend) {
+		size_t literals = *ip >> 4, matchlen = *ip & 0x0f;
+		size_t offset;
+
+		ip++;
+		if (literals == 15) {
+			uint8_t c;
+
+			do {
+				if (ip >= iend)
+					return -1;
+				c = *ip++;
+				literals += c;
+			} while (c == 255);
+		}
+
+		if (literals > (size_t)(iend - ip)
+		    || literals > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, literals);
+		ip += literals;
+		op += literals;
+
+		/* the last sequence has literals only */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - dst))
+			return -1;
+
+		matchlen += 4;
+		if (matchlen == 19) {
+			uint8_t c;
+
+			do {
+				if (ip >= iend)
+					return -1;
+				c = *ip++;
+				matchlen += c;
+			} while (c == 255);
+		}
+
+		if (matchlen > (size_t)(oend - op))
+			return -1;
+
+		/* the match can overlap the output */
+		for (size_t i = 0; i < matchlen; i++, op++)
+			*op = *(op - offset);
+	}
+
+	return op - dst;
+}
+
+/* read the compressed blocks of the cluster which COMPRESS_ADDR is
+ * @b->extents[*idx] and decompress them to @rbuf by @algorithm. the
+ * blocks are consumed from the following extents and *@idx is moved to
+ * the first extent not used. @cbuf and @rbuf have a cluster size at least.
+ */
+static int f2fs_read_compressed_cluster(struct f2fs_editor *f2fs,
+					int algorithm, uint32_t cluster_blocks,
+					struct f2fs_inode_blocks *b,
+					size_t *idx, uint8_t *cbuf,
+					uint8_t *rbuf)
+{
+	uint64_t start = b->extents[*idx].fofs;
+	size_t rlen = (size_t)cluster_blocks * f2fs->block_size;
+	struct compress_data *cd = (struct compress_data *)cbuf;
+	uint32_t nr_cpages = 0, clen;
+	size_t i = *idx + 1;
+	int ret;
+
+	if (cluster_blocks == 0 || start % cluster_blocks) {
+		fprintf(stderr, "Error: bad compressed cluster at %" PRIu64 "\n",
+			start);
+		return -1;
+	}
+
+	for (; i < b->total; i++) {
+		struct f2fs_block_extent *ext = &b->extents[i];
+		uint32_t n = ext->len;
+
+		if (ext->fofs >= start + cluster_blocks
+		    || ext->blkaddr == COMPRESS_ADDR)
+			break;
+
+		if (n > start + cluster_blocks - ext->fofs)
+			n = start + cluster_blocks - ext->fofs;
+		if (n > cluster_blocks - 1 - nr_cpages)
+			n = cluster_blocks - 1 - nr_cpages;
+
+		ret = f2fs_read_blocks(f2fs, ext->blkaddr, n,
+				       cbuf + nr_cpages * f2fs->block_size,
+				       n * f2fs->block_size);
+		if (ret < 0)
+			return ret;
+
+		nr_cpages += n;
+
+		/* the left blocks belong to the next cluster */
+		if (n < ext->len) {
+			ext->fofs += n;
+			ext->blkaddr += n;
+			ext->len -= n;
+			break;
+		}
+	}
+
+	*idx = i;
+
+	clen = le32_to_cpu(cd->clen);
+	if (nr_cpages == 0
+	    || clen > nr_cpages * f2fs->block_size - COMPRESS_HEADER_SIZE) {
+		fprintf(stderr, "Error: bad compressed cluster at %" PRIu64
+			" (%u blocks, clen %u)\n", start, nr_cpages, clen);
+		return -1;
+	}
+
+	switch (algorithm) {
+	case COMPRESS_LZO: {
+		lzo_uint dlen = rlen;
+
+		ret = lzo1x_decompress_safe(cd->cdata, clen, rbuf, &dlen, NULL);
+		if (ret != LZO_E_OK || dlen != rlen)
+			ret = -1;
+		break;
+	}
+	case COMPRESS_LZ4:
+		ret = f2fs_lz4_decompress(cd->cdata, clen, rbuf, rlen);
+		if (ret >= 0 && (size_t)ret != rlen)
+			ret = -1;
+		break;
+	default:
+		fprintf(stderr, "Error: compress algorithm %d is not supported\n",
+			algorithm);
+		return -1;
+	}
+
+	if (ret < 0) {
+		fprintf(stderr, "Error: decompress cluster at %" PRIu64
+			" failed\n", start);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int f2fs_super_block_check_crc(struct libcrc32 *crc,
+				      struct f2fs_super_block *sb,
+				      int force_type)
+{
+	uint32_t value;
+
+	if (!(le32_to_cpu(sb->feature) & F2FS_FEATURE_SB_CHKSUM))
+		return 0;
+
+	if (le32_to_cpu(sb->checksum_offset)
+		!= offsetof(struct f2fs_super_block, crc)) {
+		fprintf_if_force_type("Error: bad checksum_offset\n");
+		return -1;
+	}
+
+	libcrc32_init(crc);
+	libcrc32_update(crc, sb, le32_to_cpu(sb->checksum_offset));
+	value = libcrc32_finish(crc);
+
+	if (value != le32_to_cpu(sb->crc)) {
+		fprintf_if_force_type("Error: checksum doesn't match. "
+				      "%x != %x\n",
+				      value, le32_to_cpu(sb->crc));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* read and verify the cp pack starts at @blkaddr, the head and tail block
+ * must both have a valid crc and the same version.
+ */
+static struct f2fs_checkpoint *
+	f2fs_alloc_read_cp_pack(struct f2fs_editor *f2fs, uint32_t blkaddr,
+				uint64_t *ret_version)
+{
+	struct f2fs_checkpoint *cp = NULL, *tail = NULL;
+	uint32_t payload, total, offset;
+	uint64_t version;
+
+	cp = f2fs_alloc_read_block(f2fs, blkaddr);
+	if (!cp)
+		return NULL;
+
+	offset = le32_to_cpu(cp->checksum_offset);
+	payload = le32_to_cpu(f2fs->sblock.cp_payload);
+	total = le32_to_cpu(cp->cp_pack_total_block_count);
+	if (offset < CP_MIN_CHKSUM_OFFSET || offset > CP_CHKSUM_OFFSET
+	    || total < 2 + payload || total > f2fs->blocks_per_segment)
+		goto bad;
+
+	for (int i = 0; i < 2; i++) {
+		struct f2fs_checkpoint *blk = i == 0 ? cp : tail;
+		__le32 crc;
+
+		if (i == 1) {
+			tail = f2fs_alloc_read_block(f2fs, blkaddr + total - 1);
+			if (!tail)
+				goto bad;
+			blk = tail;
+		}
+
+		/* the checksum is moved ahead when the nat bitmap is saved
+		 * in the cp block (CP_LARGE_NAT_BITMAP_FLAG), and the data
+		 * after it is also covered. see f2fs_checkpoint_chksum.
+		 */
+		memcpy(&crc, (void *)blk + offset, sizeof(crc));
+		libcrc32_init(&f2fs->crc32_algo);
+		libcrc32_update(&f2fs->crc32_algo, blk, offset);
+		if (offset < CP_CHKSUM_OFFSET)
+			libcrc32_update(&f2fs->crc32_algo,
+					(void *)blk + offset + sizeof(crc),
+					F2FS_BLKSIZE - offset - sizeof(crc));
+		if (libcrc32_finish(&f2fs->crc32_algo) != le32_to_cpu(crc))
+			goto bad;
+	}
+
+	version = le64_to_cpu(cp->checkpoint_ver);
+	if (version != le64_to_cpu(tail->checkpoint_ver))
+		goto bad;
+
+	free(tail);
+
+	/* the bitmaps may overflow to the cp payload blocks */
+	if (payload > 0) {
+		struct f2fs_checkpoint *full;
+
+		full = realloc(cp, (1 + payload) * f2fs->block_size);
+		if (!full)
+			goto bad;
+
+		cp = full;
+		if (f2fs_read_blocks(f2fs, blkaddr + 1, payload,
+				     (void *)cp + f2fs->block_size,
+				     payload * f2fs->block_size) < 0)
+			goto bad;
+	}
+
+	*ret_version = version;
+	return cp;
+
+bad:
+	free(tail);
+	free(cp);
+	return NULL;
+}
+
+static int f2fs_load_checkpoint(struct f2fs_editor *f2fs)
+{
+	uint32_t cp_blkaddr = le32_to_cpu(f2fs->sblock.cp_blkaddr);
+	struct f2fs_checkpoint *cp1, *cp2;
+	uint64_t ver1 = 0, ver2 = 0;
+
+	cp1 = f2fs_alloc_read_cp_pack(f2fs, cp_blkaddr, &ver1);
+	cp2 = f2fs_alloc_read_cp_pack(f2fs,
+				      cp_blkaddr + f2fs->blocks_per_segment,
+				      &ver2);
+
+	if (cp1 && (!cp2 || ver1 >= ver2)) {
+		f2fs->checkpoint = cp1;
+		f2fs->cp_blkaddr = cp_blkaddr;
+		free(cp2);
+	} else if (cp2) {
+		f2fs->checkpoint = cp2;
+		f2fs->cp_blkaddr = cp_blkaddr + f2fs->blocks_per_segment;
+		free(cp1);
+	} else {
+		fprintf(stderr, "Error: no valid checkpoint\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* the version bitmaps of SIT and NAT, see __bitmap_ptr in linux kernel.
+ * a set bit means the second copy of the block is valid.
+ */
+static struct bitmask *f2fs_alloc_version_bitmap(struct f2fs_editor *f2fs,
+						 bool nat, size_t blocks)
+{
+	struct f2fs_checkpoint *cp = f2fs->checkpoint;
+	uint32_t nat_bytes = le32_to_cpu(cp->nat_ver_bitmap_bytesize);
+	uint32_t sit_bytes = le32_to_cpu(cp->sit_ver_bitmap_bytesize);
+	uint32_t bytes = nat ? nat_bytes : sit_bytes;
+	size_t limit = (1 + le32_to_cpu(f2fs->sblock.cp_payload))
+				* f2fs->block_size;
+	size_t offset = offsetof(struct f2fs_checkpoint, sit_nat_version_bitmap);
+	struct bitmask *b;
+
+	if (le32_to_cpu(cp->ckpt_flags) & CP_LARGE_NAT_BITMAP_FLAG)
+		offset += sizeof(__le32) + (nat ? 0 : nat_bytes);
+	else if (le32_to_cpu(f2fs->sblock.cp_payload) > 0)
+		offset = nat ? offset : f2fs->block_size;
+	else
+		offset += nat ? sit_bytes : 0;
+
+	if ((size_t)bytes * 8 < blocks || offset + bytes > limit) {
+		fprintf(stderr, "Error: bad %s bitmap (%u bytes)\n",
+			nat ? "nat" : "sit", bytes);
+		return NULL;
+	}
+
+	b = alloc_bitmask(blocks);
+	if (b)
+		bitmask_memcpy(b, (void *)cp + offset, b->bufsize);
+
+	return b;
+}
+
+static int f2fs_load_nat_bitmap(struct f2fs_editor *f2fs)
+{
+	uint32_t nat_blocks = le32_to_cpu(f2fs->sblock.segment_count_nat) / 2
+				* f2fs->blocks_per_segment;
+
+	f2fs->nat_bitmap = f2fs_alloc_version_bitmap(f2fs, true, nat_blocks);
+	if (!f2fs->nat_bitmap)
+		return -1;
+
+	f2fs->max_nid = NAT_ENTRY_PER_BLOCK * nat_blocks;
+
+	f2fs->n_nat_ranges = aligned_length(nat_blocks, F2FS_NAT_RANGE_BLOCKS)
+				/ F2FS_NAT_RANGE_BLOCKS;
+	f2fs->nat_ranges = calloc(f2fs->n_nat_ranges,
+				  sizeof(*f2fs->nat_ranges));
+	if (!f2fs->nat_ranges)
+		return -1;
+
+	return 0;
+}
+
+/* the journal of the current segments. the NAT journal is saved in
+ * CURSEG_HOT_DATA and the SIT journal is saved in CURSEG_COLD_DATA.
+ */
+static int f2fs_read_curseg_journal(struct f2fs_editor *f2fs, int type,
+				    struct f2fs_journal *journal)
+{
+	struct f2fs_checkpoint *cp = f2fs->checkpoint;
+	uint32_t flags = le32_to_cpu(cp->ckpt_flags);
+	struct f2fs_summary_block *sum;
+	uint32_t blkaddr;
+
+	if (flags & CP_COMPACT_SUM_FLAG) {
+		void *blk;
+
+		if (type != CURSEG_HOT_DATA && type != CURSEG_COLD_DATA)
+			return -1;
+
+		/* the NAT journal is followed by the SIT journal */
+		blk = f2fs_alloc_read_block(f2fs, f2fs->cp_blkaddr
+				+ le32_to_cpu(cp->cp_pack_start_sum));
+		if (!blk)
+			return -1;
+
+		memcpy(journal,
+		       blk + (type == CURSEG_HOT_DATA ? 0 : SUM_JOURNAL_SIZE),
+		       sizeof(*journal));
+		free(blk);
+		return 0;
+	}
+
+	blkaddr = f2fs->cp_blkaddr + le32_to_cpu(cp->cp_pack_total_block_count);
+	if (flags & (CP_UMOUNT_FLAG | CP_FASTBOOT_FLAG))
+		blkaddr -= NR_CURSEG_TYPE + 1;
+	else
+		blkaddr -= NR_CURSEG_DATA_TYPE + 1;
+
+	sum = f2fs_alloc_read_block(f2fs, blkaddr + type);
+	if (!sum)
+		return -1;
+
+	memcpy(journal, &sum->journal, sizeof(*journal));
+	free(sum);
+	return 0;
+}
+
+static int f2fs_load_nat_journal(struct f2fs_editor *f2fs)
+{
+	struct f2fs_journal journal;
+	size_t n;
+
+	if (f2fs_read_curseg_journal(f2fs, CURSEG_HOT_DATA, &journal) < 0) {
+		fprintf(stderr, "Error: read nat journal failed\n");
+		return -1;
+	}
+
+	n = le16_to_cpu(journal.n_nats);
+	if (n > NAT_JOURNAL_ENTRIES) {
+		fprintf(stderr, "Error: bad n_nats %zu\n", n);
+		return -1;
+	}
+
+	memcpy(f2fs->nat_journal, journal.nat_j.entries,
+	       n * sizeof(f2fs->nat_journal[0]));
+	f2fs->n_nat_journal = n;
+	qsort(f2fs->nat_journal, n, sizeof(f2fs->nat_journal[0]),
+	      f2fs_compare_nat_journal);
+
+	return 0;
+}
+
+/* the max SIT blocks read by one pread */
+#define F2FS_SIT_READ_BLOCKS		64
+
+/* load the SIT entries of all main segments, the entries in the SIT
+ * journal are newer than the SIT area.
+ */
+static struct f2fs_sit_entry *f2fs_alloc_read_sit(struct f2fs_editor *f2fs,
+						  uint32_t *ret_segments)
+{
+	uint32_t sit_blkaddr = le32_to_cpu(f2fs->sblock.sit_blkaddr);
+	uint32_t sit_blocks = le32_to_cpu(f2fs->sblock.segment_count_sit) / 2
+				* f2fs->blocks_per_segment;
+	uint32_t segments = le32_to_cpu(f2fs->sblock.segment_count_main);
+	uint32_t used_blocks = aligned_length(segments, SIT_ENTRY_PER_BLOCK)
+				/ SIT_ENTRY_PER_BLOCK;
+	struct f2fs_sit_entry *sit = NULL;
+	struct bitmask *bitmap = NULL;
+	struct f2fs_journal journal;
+	void *buf = NULL;
+
+	if (used_blocks > sit_blocks) {
+		fprintf(stderr, "Error: %u segments need %u sit blocks, "
+			"but only %u\n", segments, used_blocks, sit_blocks);
+		return NULL;
+	}
+
+	bitmap = f2fs_alloc_version_bitmap(f2fs, false, sit_blocks);
+	sit = calloc(segments, sizeof(*sit));
+	buf = malloc(F2FS_SIT_READ_BLOCKS * f2fs->block_size);
+	if (!bitmap || !sit || !buf)
+		goto fail;
+
+	/* the blocks select the same copy are read together */
+	for (uint32_t i = 0, n; i < used_blocks; i += n) {
+		int copy = bitmask_get(bitmap, i) > 0;
+
+		for (n = 1; i + n < used_blocks && n < F2FS_SIT_READ_BLOCKS; n++) {
+			if ((bitmask_get(bitmap, i + n) > 0) != copy)
+				break;
+		}
+
+		if (f2fs_read_blocks(f2fs, sit_blkaddr + i
+				     + (copy ? sit_blocks : 0),
+				     n, buf, n * f2fs->block_size) < 0)
+			goto fail;
+
+		for (uint32_t j = 0; j < n; j++) {
+			struct f2fs_sit_block *blk = buf + j * f2fs->block_size;
+			uint32_t segno = (i + j) * SIT_ENTRY_PER_BLOCK;
+
+			for (size_t k = 0; k < SIT_ENTRY_PER_BLOCK
+					   && segno + k < segments; k++)
+				sit[segno + k] = blk->entries[k];
+		}
+	}
+
+	if (f2fs_read_curseg_journal(f2fs, CURSEG_COLD_DATA, &journal) < 0) {
+		fprintf(stderr, "Error: read sit journal failed\n");
+		goto fail;
+	}
+
+	for (size_t i = 0; i < le16_to_cpu(journal.n_sits)
+			   && i < SIT_JOURNAL_ENTRIES; i++) {
+		struct sit_journal_entry *e = &journal.sit_j.entries[i];
+		uint32_t segno = le32_to_cpu(e->segno);
+
+		if (segno < segments)
+			sit[segno] = e->se;
+	}
+
+	bitmask_free(bitmap);
+	free(buf);
+	*ret_segments = segments;
+	return sit;
+
+fail:
+	if (bitmap)
+		bitmask_free(bitmap);
+	free(buf);
+	free(sit);
+	return NULL;
+}
+
+static int f2fs_detect(void *private_data, int force_type, int fd)
+{
+	struct f2fs_editor *f2fs = private_data;
+	struct f2fs_super_block *sb = &f2fs->sblock;
+	int ret;
 
 	fileseek(fd, F2FS_SUPER_OFFSET);
 
@@ -764,15 +1791,11 @@ static int f2fs_detect(void *private_data, int force_type, int fd)
 		return -1;
 	}
 
-	f2fs->checkpoint =
-		f2fs_alloc_read_block(f2fs, le32_to_cpu(f2fs->sblock.cp_blkaddr));
-	if (!f2fs->checkpoint)
+	if (f2fs_load_checkpoint(f2fs) < 0)
 		return -1;
 
-	f2fs->nat = f2fs_alloc_read_segment(f2fs,
-			le32_to_cpu(f2fs->sblock.nat_blkaddr),
-			le32_to_cpu(f2fs->sblock.segment_count_nat));
-	if (!f2fs->nat) {
+	/* the NAT blocks are loaded when the nodes are accessed */
+	if (f2fs_load_nat_bitmap(f2fs) < 0 || f2fs_load_nat_journal(f2fs) < 0) {
 		f2fs_editor_exit(f2fs);
 		return -1;
 	}
@@ -920,25 +1943,22 @@ static int f2fs_do_block_as_nat_block(struct f2fs_editor *f2fs, void *blk)
 static int f2fs_do_list_nat(void *private_data, int fd, int argc, char **argv)
 {
 	struct f2fs_editor *f2fs = private_data;
-	void *p_block = f2fs->nat->buffer;
 
-	printf("%-8s %-8s %-8s\n", "version", "ino", "block");
-	for (size_t i = 0; i < f2fs->nat->blocks; i++) {
-		struct f2fs_nat_block *nat = p_block;
-
-		for (size_t j = 0; j < NAT_ENTRY_PER_BLOCK; j++) {
-			struct f2fs_nat_entry *entry = &nat->entries[j];
+	printf("%-8s %-8s %-8s %-8s\n", "nid", "version", "ino", "block");
+	for (uint32_t nid = 0; nid < f2fs->max_nid; nid++) {
+		struct f2fs_nat_entry entry;
 
-			if (le32_to_cpu(entry->ino) == 0)
-				continue;
+		if (f2fs_get_nat_entry(f2fs, nid, &entry) < 0)
+			return -1;
 
-			printf("%-8u %-8u %-8u\n",
-				entry->version,
-				le32_to_cpu(entry->ino),
-				le32_to_cpu(entry->block_addr));
-		}
+		if (le32_to_cpu(entry.ino) == 0)
+			continue;
 
-		p_block += f2fs->nat->block_size;
+		printf("%-8u %-8u %-8u %-8u\n",
+			nid,
+			entry.version,
+			le32_to_cpu(entry.ino),
+			le32_to_cpu(entry.block_addr));
 	}
 
 	return 0;
@@ -947,7 +1967,7 @@ static int f2fs_do_list_nat(void *private_data, int fd, int argc, char **argv)
 static int f2fs_do_nat(void *private_data, int fd, int argc, char **argv)
 {
 	struct f2fs_editor *f2fs = private_data;
-	struct f2fs_nat_entry *entry = NULL;
+	struct f2fs_nat_entry entry;
 	int nid = -1;
 
 	if (argc == 1)
@@ -959,22 +1979,20 @@ static int f2fs_do_nat(void *private_data, int fd, int argc, char **argv)
 		return -1;
 	}
 
-	entry = f2fs_get_nat_entry(f2fs, nid);
-	if (!entry) {
+	if (f2fs_get_nat_entry(f2fs, nid, &entry) < 0) {
 		fprintf(stderr, "Error: get nat entry #%d failed\n", nid);
-		fprintf(stderr, "filesystem has %d segments for nat (%d blocks)"
-				", total %zu nat entrys\n",
+		fprintf(stderr, "filesystem has %d segments for nat"
+				", total %u nat entrys\n",
 				le32_to_cpu(f2fs->sblock.segment_count_nat),
-				f2fs->nat->blocks,
-				f2fs->nat->blocks * NAT_ENTRY_PER_BLOCK);
+				f2fs->max_nid);
 		return -1;
 	}
 
 	printf("%-8s %-8s %-8s\n", "version", "ino", "block");
 	printf("%-8u %-8u %-8u\n",
-		entry->version,
-		le32_to_cpu(entry->ino),
-		le32_to_cpu(entry->block_addr));
+		entry.version,
+		le32_to_cpu(entry.ino),
+		le32_to_cpu(entry.block_addr));
 
 	return 0;
 }
@@ -1069,11 +2087,26 @@ static int f2fs_do_checkpoint(void *private_data, int fd, int argc, char **argv)
 	return 0;
 }
 
+static int f2fs_print_inode(struct f2fs_editor *f2fs, uint32_t ino)
+{
+	struct f2fs_node *node;
+	uint32_t blkno;
+
+	node = (struct f2fs_node *)_f2fs_alloc_read_inode(f2fs, ino, &blkno);
+	if (!node)
+		return -1;
+
+	printf("inode #%u location on blk #%u\n", ino, blkno);
+	structure_print(PRINT_LEVEL0, &node->i, st_f2fs_inode);
+	structure_print(PRINT_LEVEL0, &node->footer, st_f2fs_node_footer);
+	free(node);
+
+	return 0;
+}
+
 static int f2fs_do_inode(void *private_data, int fd, int argc, char **argv)
 {
 	struct f2fs_editor *f2fs = private_data;
-	uint32_t blkno;
-	struct f2fs_node *node;
 	int ino = -1;
 
 	if (argc > 1)
@@ -1084,40 +2117,647 @@ static int f2fs_do_inode(void *private_data, int fd, int argc, char **argv)
 		return -1;
 	}
 
-	node = (struct f2fs_node *)_f2fs_alloc_read_inode(f2fs, ino, &blkno);
-	if (!node)
+	return f2fs_print_inode(f2fs, ino);
+}
+
+/* the address saved in a direct or indirect node, @nid 0 is a hole */
+static int f2fs_node_address(struct f2fs_editor *f2fs, uint32_t nid,
+			     uint32_t idx, uint32_t *ret)
+{
+	struct f2fs_nat_entry entry;
+	__le32 *buf;
+
+	if (nid == 0) {
+		*ret = 0;
+		return 0;
+	}
+
+	if (f2fs_get_nat_entry(f2fs, nid, &entry) < 0) {
+		fprintf(stderr, "Error: get nat entry #%u failed\n", nid);
 		return -1;
+	}
 
-	printf("inode #%d location on blk #%u\n", ino, blkno);
-	structure_print(PRINT_LEVEL0, &node->i, st_f2fs_inode);
-	structure_print(PRINT_LEVEL0, &node->footer, st_f2fs_node_footer);
-	free(node);
+	buf = f2fs_alloc_read_node_block(f2fs, le32_to_cpu(entry.block_addr));
+	if (!buf)
+		return -1;
 
+	*ret = le32_to_cpu(buf[idx]);
+	free(buf);
 	return 0;
 }
 
-static bool f2fs_inode_has_nid(struct f2fs_inode *inode)
+/* map the file block @fofs to the disk, see get_node_path in linux kernel.
+ * NULL_ADDR or NEW_ADDR is returned for the holes.
+ */
+static int f2fs_bmap(struct f2fs_editor *f2fs, struct f2fs_inode *inode,
+		     uint64_t fofs, uint32_t *ret_blkaddr)
 {
-	for (size_t i = 0; i < DEF_NIDS_PER_INODE; i++) {
-		if (le32_to_cpu(inode->i_nid[i]) != 0)
-			return true;
-	}
+	const uint64_t direct_blks = f2fs_inode_addrs_per_block(inode);
+	const uint64_t indirect_blks = NIDS_PER_BLOCK * direct_blks;
+	size_t first = 0, count = 0;
+	uint32_t nid;
 
-	return false;
-}
+	if (f2fs_inode_addrs(f2fs, inode, &first, &count) < 0)
+		return -1;
 
-typedef int (*foreach_dirent_todo_t)(struct f2fs_editor *f2fs,
-				     const char *path, int depth,
-				     struct f2fs_dir_entry *dentry,
-				     int *break_next,
-				     void *foreach_data);
+	if (fofs < count) {
+		*ret_blkaddr = le32_to_cpu(inode->i_addr[first + fofs]);
+		return 0;
+	}
+	fofs -= count;
 
-static int _foreach_dirent(struct f2fs_editor *f2fs, uint32_t ino,
-			   struct f2fs_inode *inode,
-			   struct f2fs_inode_blocks *data_blocks,
-			   const char *path, int depth,
-			   foreach_dirent_todo_t todo,
-			   void *foreach_data);
+	for (int i = 0; i < 2; i++, fofs -= direct_blks) {
+		if (fofs < direct_blks)
+			return f2fs_node_address(f2fs,
+					le32_to_cpu(inode->i_nid[i]),
+					fofs, ret_blkaddr);
+	}
+
+	for (int i = 2; i < 4; i++, fofs -= indirect_blks) {
+		if (fofs < indirect_blks) {
+			if (f2fs_node_address(f2fs, le32_to_cpu(inode->i_nid[i]),
+					      fofs / direct_blks, &nid) < 0)
+				return -1;
+			return f2fs_node_address(f2fs, nid, fofs % direct_blks,
+						 ret_blkaddr);
+		}
+	}
+
+	if (fofs >= NIDS_PER_BLOCK * indirect_blks) {
+		fprintf(stderr, "Error: file block %" PRIu64 " is too large\n",
+			fofs);
+		return -1;
+	}
+
+	if (f2fs_node_address(f2fs, le32_to_cpu(inode->i_nid[4]),
+			      fofs / indirect_blks, &nid) < 0
+	    || f2fs_node_address(f2fs, nid,
+				 (fofs / direct_blks) % NIDS_PER_BLOCK,
+				 &nid) < 0)
+		return -1;
+
+	return f2fs_node_address(f2fs, nid, fofs % direct_blks, ret_blkaddr);
+}
+
+static void f2fs_tea_transform(uint32_t buf[4], const uint32_t in[4])
+{
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+	for (int n = 0; n < 16; n++) {
+		sum += 0x9E3779B9;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	}
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+static void f2fs_str2hashbuf(const uint8_t *msg, size_t len, uint32_t *buf,
+			     int num)
+{
+	uint32_t pad, val;
+
+	pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+
+	val = pad;
+	if (len > (size_t)num * 4)
+		len = num * 4;
+
+	for (size_t i = 0; i < len; i++) {
+		if ((i % 4) == 0)
+			val = pad;
+		val = msg[i] + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+/* the TEA based hash of the dentry name, see f2fs_dentry_hash in linux */
+static uint32_t f2fs_dentry_hash(const char *name, size_t len)
+{
+	uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	const uint8_t *p = (const uint8_t *)name;
+	uint32_t in[8];
+
+	/* . and .. has zero hash */
+	if (len <= 2 && name[0] == '.' && (len == 1 || name[1] == '.'))
+		return 0;
+
+	while (1) {
+		f2fs_str2hashbuf(p, len, in, 4);
+		f2fs_tea_transform(buf, in);
+		p += 16;
+		if (len <= 16)
+			break;
+		len -= 16;
+	}
+
+	return buf[0];
+}
+
+static uint32_t f2fs_dir_buckets(uint32_t level, uint32_t dir_level)
+{
+	if (level + dir_level < MAX_DIR_HASH_DEPTH / 2)
+		return 1 << (level + dir_level);
+
+	return MAX_DIR_BUCKETS;
+}
+
+static uint32_t f2fs_bucket_blocks(uint32_t level)
+{
+	return level < MAX_DIR_HASH_DEPTH / 2 ? 2 : 4;
+}
+
+static uint64_t f2fs_dir_block_index(uint32_t level, uint32_t dir_level,
+				     uint32_t idx)
+{
+	uint64_t bidx = 0;
+
+	for (uint32_t i = 0; i < level; i++)
+		bidx += (uint64_t)f2fs_dir_buckets(i, dir_level)
+			* f2fs_bucket_blocks(i);
+
+	return bidx + (uint64_t)idx * f2fs_bucket_blocks(level);
+}
+
+/* the dentries of a dentry block or an inline dentry */
+struct f2fs_dentry_ptr {
+	const uint8_t			*bitmap;
+	const struct f2fs_dir_entry	*dentry;
+	const uint8_t			(*filename)[F2FS_SLOT_LEN];
+	size_t				max;
+};
+
+static int f2fs_find_target_dentry(struct f2fs_dentry_ptr *d, uint32_t hash,
+				   const char *name, int len,
+				   uint32_t *ret_ino)
+{
+	for (size_t pos = 0; pos < d->max; ) {
+		const struct f2fs_dir_entry *de = &d->dentry[pos];
+		int name_len;
+
+		/* the dentry bitmap is lsb first */
+		if (!(d->bitmap[pos / 8] & (1 << (pos % 8)))) {
+			pos++;
+			continue;
+		}
+
+		name_len = le16_to_cpu(de->name_len);
+		if (name_len == 0) {
+			pos++;
+			continue;
+		}
+
+		if (le32_to_cpu(de->hash_code) == hash && name_len == len
+		    && pos + GET_DENTRY_SLOTS(name_len) <= d->max
+		    && !memcmp(d->filename[pos], name, len)) {
+			*ret_ino = le32_to_cpu(de->ino);
+			return 1;
+		}
+
+		pos += GET_DENTRY_SLOTS(name_len);
+	}
+
+	return 0;
+}
+
+static int f2fs_find_in_inline_dir(struct f2fs_editor *f2fs,
+				   struct f2fs_inode *dir, uint32_t hash,
+				   const char *name, int len,
+				   uint32_t *ret_ino)
+{
+	size_t first = 0, count = 0, max_inline, nr, bitmap_size;
+	struct f2fs_dentry_ptr d;
+	const uint8_t *p;
+
+	if (f2fs_inode_addrs(f2fs, dir, &first, &count) < 0
+	    || count <= DEF_INLINE_RESERVED_SIZE)
+		return -1;
+
+	/* see NR_INLINE_DENTRY in linux kernel */
+	max_inline = sizeof(__le32) * (count - DEF_INLINE_RESERVED_SIZE);
+	nr = max_inline * BITS_PER_BYTE
+		/ ((SIZE_OF_DIR_ENTRY + F2FS_SLOT_LEN) * BITS_PER_BYTE + 1);
+	bitmap_size = aligned_length(nr, BITS_PER_BYTE) / BITS_PER_BYTE;
+
+	p = (const uint8_t *)&dir->i_addr[first + DEF_INLINE_RESERVED_SIZE];
+	d.bitmap = p;
+	d.dentry = (const void *)(p + max_inline
+			- (SIZE_OF_DIR_ENTRY + F2FS_SLOT_LEN) * nr);
+	d.filename = (const void *)(p + max_inline - F2FS_SLOT_LEN * nr);
+	d.max = nr;
+
+	if (p + bitmap_size > (const uint8_t *)d.dentry)
+		return -1;
+
+	return f2fs_find_target_dentry(&d, hash, name, len, ret_ino);
+}
+
+/* search @name in the directory. return 1 if found, 0 if not found. */
+static int f2fs_lookup(struct f2fs_editor *f2fs, uint32_t dir_ino,
+		       const char *name, int len, uint32_t *ret_ino)
+{
+	struct f2fs_inode *dir = f2fs_alloc_read_inode(f2fs, dir_ino);
+	struct f2fs_dentry_block *dblk = NULL;
+	uint32_t hash, max_depth, dir_level;
+	int ret = -1;
+
+	if (!dir)
+		return ret;
+
+	if ((le16_to_cpu(dir->i_mode) & S_IFMT) != S_IFDIR) {
+		fprintf(stderr, "Error: inode #%u is not a directory\n", dir_ino);
+		goto done;
+	}
+
+	/* the names of casefolded and encrypted directories are not hashed
+	 * from the raw name.
+	 */
+	if (le32_to_cpu(dir->i_flags) & (F2FS_CASEFOLD_FL | F2FS_ENCRYPT_FL)) {
+		fprintf(stderr, "Error: lookup in casefolded or encrypted "
+			"directory #%u is not supported\n", dir_ino);
+		goto done;
+	}
+
+	hash = f2fs_dentry_hash(name, len);
+
+	if (dir->i_inline & F2FS_INLINE_DENTRY) {
+		ret = f2fs_find_in_inline_dir(f2fs, dir, hash, name, len,
+					      ret_ino);
+		if (ret < 0)
+			fprintf(stderr, "Error: bad inline dentry of #%u\n",
+				dir_ino);
+		goto done;
+	}
+
+	dblk = malloc(sizeof(*dblk));
+	if (!dblk)
+		goto done;
+
+	max_depth = le32_to_cpu(dir->i_current_depth);
+	dir_level = dir->i_dir_level;
+	if (max_depth > MAX_DIR_HASH_DEPTH)
+		max_depth = MAX_DIR_HASH_DEPTH;
+
+	/* only one bucket in each level may have the name */
+	ret = 0;
+	for (uint32_t level = 0; level < max_depth && ret == 0; level++) {
+		uint32_t nbucket = f2fs_dir_buckets(level, dir_level);
+		uint64_t bidx = f2fs_dir_block_index(level, dir_level,
+						     hash % nbucket);
+		uint64_t end = bidx + f2fs_bucket_blocks(level);
+
+		for (; bidx < end && ret == 0; bidx++) {
+			struct f2fs_dentry_ptr d = {
+				.bitmap = dblk->dentry_bitmap,
+				.dentry = dblk->dentry,
+				.filename = (const void *)dblk->filename,
+				.max = NR_DENTRY_IN_BLOCK,
+			};
+			uint32_t blkaddr;
+
+			if (bidx * f2fs->block_size >= le64_to_cpu(dir->i_size))
+				break;
+
+			ret = f2fs_bmap(f2fs, dir, bidx, &blkaddr);
+			if (ret < 0)
+				goto done;
+
+			if (blkaddr == NULL_ADDR || blkaddr == NEW_ADDR)
+				continue;
+
+			ret = f2fs_read_blocks(f2fs, blkaddr, 1, dblk,
+					       sizeof(*dblk));
+			if (ret < 0)
+				goto done;
+
+			ret = f2fs_find_target_dentry(&d, hash, name, len,
+						      ret_ino);
+		}
+	}
+
+done:
+	free(dblk);
+	free(dir);
+	return ret;
+}
+
+#define F2FS_MAX_SYMLINKS		8
+
+static int _f2fs_namei(struct f2fs_editor *f2fs, uint32_t dir_ino,
+		       const char *path, bool follow, int *nlinks,
+		       uint32_t *ret_ino)
+{
+	uint32_t root_ino = le32_to_cpu(f2fs->sblock.root_ino);
+	uint32_t ino = path[0] == '/' ? root_ino : dir_ino;
+	const char *name = path;
+	int ret;
+
+	while (1) {
+		struct f2fs_inode *inode;
+		uint32_t parent = ino;
+		const char *end;
+		bool last;
+		int len;
+
+		while (*name == '/')
+			name++;
+		if (*name == '\0')
+			break;
+
+		end = strchr(name, '/');
+		if (!end)
+			end = name + strlen(name);
+		len = end - name;
+
+		if (len > F2FS_NAME_LEN) {
+			fprintf(stderr, "Error: %.*s: name is too long\n", len, name);
+			return -1;
+		}
+
+		ret = f2fs_lookup(f2fs, parent, name, len, &ino);
+		if (ret < 0)
+			return ret;
+		if (ret == 0) {
+			fprintf(stderr, "Error: %.*s is not found in %s\n",
+				len, name, path);
+			return -1;
+		}
+
+		for (name = end; *name == '/'; name++)
+			;
+		last = *name == '\0';
+
+		if (!last || follow) {
+			char target[F2FS_BLKSIZE] = { 0 };
+			size_t maxsz = 0;
+			void *data;
+			uint64_t size;
+
+			inode = f2fs_alloc_read_inode(f2fs, ino);
+			if (!inode)
+				return -1;
+
+			if ((le16_to_cpu(inode->i_mode) & S_IFMT) != S_IFLNK) {
+				free(inode);
+				continue;
+			}
+
+			if (++(*nlinks) > F2FS_MAX_SYMLINKS) {
+				fprintf(stderr, "Error: too many levels of "
+						"symbolic links in %s\n", path);
+				free(inode);
+				return -1;
+			}
+
+			size = le64_to_cpu(inode->i_size);
+			data = f2fs_inode_inline_data(f2fs, inode, &maxsz);
+			if (!(inode->i_inline & F2FS_DATA_EXIST) || !data
+			    || size > maxsz) {
+				fprintf(stderr, "Error: symlink #%u has no "
+						"inline data\n", ino);
+				free(inode);
+				return -1;
+			}
+
+			memcpy(target, data, size);
+			free(inode);
+
+			ret = _f2fs_namei(f2fs, parent, target, true, nlinks,
+					  &ino);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	*ret_ino = ino;
+	return 0;
+}
+
+/* resolve @path from the root directory, the symlinks in the middle of
+ * @path are always followed, and the last one is followed if @follow.
+ */
+static int f2fs_namei(struct f2fs_editor *f2fs, const char *path,
+		      bool follow, uint32_t *ret_ino)
+{
+	int nlinks = 0;
+
+	return _f2fs_namei(f2fs, le32_to_cpu(f2fs->sblock.root_ino), path,
+			   follow, &nlinks, ret_ino);
+}
+
+/* stat /path/of/file: the symlink itself is showed */
+static int f2fs_do_stat(void *private_data, int fd, int argc, char **argv)
+{
+	struct f2fs_editor *f2fs = private_data;
+	uint32_t ino;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: f2fs stat /path/of/file\n");
+		return -1;
+	}
+
+	ret = f2fs_namei(f2fs, argv[1], false, &ino);
+	if (ret < 0)
+		return ret;
+
+	return f2fs_print_inode(f2fs, ino);
+}
+
+#define F2FS_CAT_BUFSZ			(1 << 20)
+
+/* write [*@pos, @end) to stdout, the data is read from @blkaddr which is
+ * the address of @offset, or zero if @blkaddr is NULL_ADDR.
+ */
+static int f2fs_cat_range(struct f2fs_editor *f2fs, uint64_t *pos,
+			  uint64_t end, uint64_t offset, uint32_t blkaddr,
+			  uint8_t *buf, size_t bufsz)
+{
+	while (*pos < end) {
+		size_t chunk = bufsz;
+
+		if (chunk > end - *pos)
+			chunk = end - *pos;
+
+		if (blkaddr == NULL_ADDR) {
+			memset(buf, 0, chunk);
+		} else {
+			/* @pos is block aligned in the extents */
+			uint32_t blk = blkaddr
+				+ (*pos - offset) / f2fs->block_size;
+			int n = aligned_length(chunk, f2fs->block_size)
+				/ f2fs->block_size;
+
+			if (f2fs_read_blocks(f2fs, blk, n, buf, chunk) < 0)
+				return -1;
+		}
+
+		if (write(STDOUT_FILENO, buf, chunk) != (ssize_t)chunk) {
+			fprintf(stderr, "Error: write failed(%m)\n");
+			return -1;
+		}
+
+		*pos += chunk;
+	}
+
+	return 0;
+}
+
+/* cat /path/of/file: write the file to stdout */
+static int f2fs_do_cat(void *private_data, int fd, int argc, char **argv)
+{
+	struct f2fs_editor *f2fs = private_data;
+	struct f2fs_inode_blocks data_blocks = { .extents = NULL };
+	uint8_t *buf = NULL, *cbuf = NULL, *rbuf = NULL;
+	uint32_t ino, cluster_blocks;
+	struct f2fs_inode *inode;
+	uint64_t filesz, pos = 0;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: f2fs cat /path/of/file\n");
+		return -1;
+	}
+
+	ret = f2fs_namei(f2fs, argv[1], true, &ino);
+	if (ret < 0)
+		return ret;
+
+	inode = f2fs_alloc_read_inode(f2fs, ino);
+	if (!inode)
+		return -1;
+
+	ret = -1;
+	if ((le16_to_cpu(inode->i_mode) & S_IFMT) != S_IFREG) {
+		fprintf(stderr, "Error: %s is not a regular file\n", argv[1]);
+		goto done;
+	}
+
+	/* stdout is used for the file data */
+	fflush(stdout);
+
+	filesz = le64_to_cpu(inode->i_size);
+	if (inode->i_inline & F2FS_DATA_EXIST) {
+		size_t maxsz = 0;
+		void *data = f2fs_inode_inline_data(f2fs, inode, &maxsz);
+
+		if (!data || filesz > maxsz) {
+			fprintf(stderr, "Error: inode #%u has %" PRIu64
+				" bytes inline data, but only %zu bytes can be read\n",
+				ino, filesz, maxsz);
+			goto done;
+		}
+
+		if (write(STDOUT_FILENO, data, filesz)
+		    != (ssize_t)filesz) {
+			fprintf(stderr, "Error: write failed(%m)\n");
+			goto done;
+		}
+
+		ret = 0;
+		goto done;
+	}
+
+	buf = malloc(F2FS_CAT_BUFSZ);
+	if (!buf) {
+		fprintf(stderr, "Error: alloc %d bytes failed\n", F2FS_CAT_BUFSZ);
+		goto done;
+	}
+
+	cluster_blocks = f2fs_inode_cluster_blocks(inode);
+	if (cluster_blocks) {
+		cbuf = malloc((size_t)cluster_blocks * f2fs->block_size);
+		rbuf = malloc((size_t)cluster_blocks * f2fs->block_size);
+		if (!cbuf || !rbuf)
+			goto done;
+	}
+
+	ret = f2fs_inode_blocks_read(f2fs, &data_blocks, inode, ino);
+	if (ret < 0)
+		goto done;
+
+	for (size_t i = 0; i < data_blocks.total && ret == 0; ) {
+		struct f2fs_block_extent *ext = &data_blocks.extents[i];
+		uint64_t offset = ext->fofs * f2fs->block_size;
+		uint64_t end = offset + (uint64_t)ext->len * f2fs->block_size;
+
+		if (ext->blkaddr == COMPRESS_ADDR)
+			end = offset
+				+ (uint64_t)cluster_blocks * f2fs->block_size;
+
+		if (offset > filesz)
+			offset = filesz;
+		if (end > filesz)
+			end = filesz;
+
+		/* the hole before this extent */
+		ret = f2fs_cat_range(f2fs, &pos, offset, 0, NULL_ADDR,
+				     buf, F2FS_CAT_BUFSZ);
+		if (ret < 0)
+			break;
+
+		if (ext->blkaddr != COMPRESS_ADDR) {
+			ret = f2fs_cat_range(f2fs, &pos, end, offset,
+					     ext->blkaddr, buf, F2FS_CAT_BUFSZ);
+			i++;
+			continue;
+		}
+
+		ret = f2fs_read_compressed_cluster(f2fs,
+						   inode->i_compress_algorithm,
+						   cluster_blocks, &data_blocks,
+						   &i, cbuf, rbuf);
+		if (ret < 0)
+			break;
+
+		if (write(STDOUT_FILENO, rbuf, end - pos)
+		    != (ssize_t)(end - pos)) {
+			fprintf(stderr, "Error: write failed(%m)\n");
+			ret = -1;
+			break;
+		}
+		pos = end;
+	}
+
+	/* the hole at the end of file */
+	if (ret == 0)
+		ret = f2fs_cat_range(f2fs, &pos, filesz, 0, NULL_ADDR,
+				     buf, F2FS_CAT_BUFSZ);
+
+done:
+	free(data_blocks.extents);
+	free(rbuf);
+	free(cbuf);
+	free(buf);
+	free(inode);
+	return ret;
+}
+
+typedef int (*foreach_dirent_todo_t)(struct f2fs_editor *f2fs,
+				     const char *path, int depth,
+				     struct f2fs_dir_entry *dentry,
+				     int *break_next,
+				     void *foreach_data);
+
+static int _foreach_dirent(struct f2fs_editor *f2fs, uint32_t ino,
+			   struct f2fs_inode *inode,
+			   struct f2fs_inode_blocks *data_blocks,
+			   const char *path, int depth,
+			   foreach_dirent_todo_t todo,
+			   void *foreach_data);
 
 static int foreach_dirent(struct f2fs_editor *f2fs, uint32_t ino,
 			  const char *path, int depth,
@@ -1125,7 +2765,7 @@ static int foreach_dirent(struct f2fs_editor *f2fs, uint32_t ino,
 			  void *foreach_data)
 {
 	struct f2fs_inode *inode = f2fs_alloc_read_inode(f2fs, ino);
-	struct f2fs_inode_blocks data_blocks = { .blocks = NULL };
+	struct f2fs_inode_blocks data_blocks = { .extents = NULL };
 	int ret = -1;
 
 	if (!inode)
@@ -1154,7 +2794,7 @@ static int foreach_dirent(struct f2fs_editor *f2fs, uint32_t ino,
 			      todo, foreach_data);
 
 done:
-	free(data_blocks.blocks);
+	free(data_blocks.extents);
 	free(inode);
 
 	return ret;
@@ -1184,66 +2824,72 @@ static int _foreach_dirent(struct f2fs_editor *f2fs, uint32_t ino,
 		goto done;
 	}
 
-	for (size_t i = 0; i < data_blocks->total; i++) {
-		ret = f2fs_read_blocks(f2fs, data_blocks->blocks[i], 1,
-					dblk, f2fs->block_size);
+	for (size_t e = 0; e < data_blocks->total; e++) {
+		struct f2fs_block_extent *ext = &data_blocks->extents[e];
 
-		if (ret < 0) {
-			fprintf(stderr, "Error: failed to read dentry block #%u"
-				" of inode #%u\n",
-				data_blocks->blocks[i], ino);
-			goto done;
-		}
+		for (uint32_t j = 0; j < ext->len; j++) {
+			uint32_t blkno = ext->blkaddr + j;
 
-		bitmask_memcpy_lsbfirst(bitmap, dblk->dentry_bitmap,
-					sizeof(dblk->dentry_bitmap));
+			ret = f2fs_read_blocks(f2fs, blkno, 1,
+						dblk, f2fs->block_size);
 
-		bitmask_foreach(i, bitmap) {
-			struct f2fs_dir_entry *dentry;
+			if (ret < 0) {
+				fprintf(stderr, "Error: failed to read dentry block #%u"
+					" of inode #%u\n",
+					blkno, ino);
+				goto done;
+			}
 
-			if (i >= NR_DENTRY_IN_BLOCK)
-				break;
+			bitmask_memcpy_lsbfirst(bitmap, dblk->dentry_bitmap,
+						sizeof(dblk->dentry_bitmap));
 
-			dentry = &dblk->dentry[i];
+			bitmask_foreach(i, bitmap) {
+				struct f2fs_dir_entry *dentry;
 
-			/* . or .. has zero hash value */
-			if (le32_to_cpu(dentry->hash_code) == 0)
-				continue;
+				if (i >= NR_DENTRY_IN_BLOCK)
+					break;
 
-			/* it's ok if the filetype is 0 since the previous
-			* filename length is larger than F2FS_SLOT_LEN.
-			* it will use this entry's filename slot and mark
-			* this entry as used.
-			*/
-			if (dentry->file_type == 0)
-				continue;
+				dentry = &dblk->dentry[i];
 
-			if (dentry->file_type >= F2FS_FT_MAX
-			|| le16_to_cpu(dentry->name_len) > F2FS_NAME_LEN) {
-				fprintf(stderr, "Error: bad dentry at 0x04%lx\n",
-					pointsub(dentry, dblk));
-				structure_print(PRINT_LEVEL0, dentry, st_f2fs_dir_entry);
-				ret = -1;
-				goto done;
-			}
+				/* . or .. has zero hash value */
+				if (le32_to_cpu(dentry->hash_code) == 0)
+					continue;
 
-			snprintf(child_dir, sizeof(child_dir),
-				"%s/%.*s",
-				 path,
-				 le16_to_cpu(dentry->name_len),
-				 dblk->filename[i]);
+				/* it's ok if the filetype is 0 since the previous
+				* filename length is larger than F2FS_SLOT_LEN.
+				* it will use this entry's filename slot and mark
+				* this entry as used.
+				*/
+				if (dentry->file_type == 0)
+					continue;
 
-			ret = todo(f2fs, child_dir, depth, dentry,
-				   &break_next, foreach_data);
-			if (ret < 0 || break_next)
-				goto done;
+				if (dentry->file_type >= F2FS_FT_MAX
+				|| le16_to_cpu(dentry->name_len) > F2FS_NAME_LEN) {
+					fprintf(stderr, "Error: bad dentry at 0x04%lx\n",
+						pointsub(dentry, dblk));
+					structure_print(PRINT_LEVEL0, dentry, st_f2fs_dir_entry);
+					ret = -1;
+					goto done;
+				}
 
-			if (le16_to_cpu(dentry->file_type) == F2FS_FT_DIR) {
-				ret = foreach_dirent(f2fs, le32_to_cpu(dentry->ino),
-						     child_dir, depth + 1,
-						     todo, foreach_data);
-				if (ret < 0)
+				snprintf(child_dir, sizeof(child_dir),
+					"%s/%.*s",
+					 path,
+					 le16_to_cpu(dentry->name_len),
+					 dblk->filename[i]);
+
+				ret = todo(f2fs, child_dir, depth, dentry,
+					   &break_next, foreach_data);
+				if (ret < 0 || break_next)
 					goto done;
+
+				if (le16_to_cpu(dentry->file_type) == F2FS_FT_DIR) {
+					ret = foreach_dirent(f2fs, le32_to_cpu(dentry->ino),
+							     child_dir, depth + 1,
+							     todo, foreach_data);
+					if (ret < 0)
+						goto done;
+				}
 			}
 		}
 	}
@@ -1260,6 +2906,8 @@ done:
 static int print_file(struct f2fs_editor *f2fs, uint32_t ino, int indent)
 {
 	struct f2fs_inode *inode = f2fs_alloc_read_inode(f2fs, ino);
+	size_t maxsz = 0;
+	const char *data;
 
 	if (!inode)
 		return -1;
@@ -1275,9 +2923,14 @@ static int print_file(struct f2fs_editor *f2fs, uint32_t ino, int indent)
 			return -1;
 		}
 
-		/* i_addr[0] is reserved, the symlink data is from i_addr[1] */
-		printf("-> %.*s\n", (int)le64_to_cpu(inode->i_size),
-			(const char *)&inode->i_addr[1]);
+		data = f2fs_inode_inline_data(f2fs, inode, &maxsz);
+		if (!data || le64_to_cpu(inode->i_size) > maxsz) {
+			printf("Error: symlink #%u has bad inline data\n", ino);
+			free(inode);
+			return -1;
+		}
+
+		printf("-> %.*s\n", (int)le64_to_cpu(inode->i_size), data);
 		break;
 	}
 
@@ -1334,133 +2987,431 @@ static int print_dirent_callback(struct f2fs_editor *f2fs,
 	return ret;
 }
 
-static int unpack_symlink(struct f2fs_editor *f2fs, uint32_t ino,
-			  const char *filename)
+/* the max directory depth, each level takes 2 bytes at least in the 4096
+ * bytes path buffer of _foreach_dirent.
+ */
+#define F2FS_UNPACK_MAX_DEPTH		2048
+
+struct f2fs_unpack_context {
+	struct threadpool		*tp;
+
+	/* dirfds[depth] is the parent directory of the dentries in @depth */
+	int				dirfds[F2FS_UNPACK_MAX_DEPTH + 1];
+};
+
+/* the max blocks read by one pread when copying the file data */
+#define F2FS_UNPACK_READ_BLOCKS		256
+
+/* the clusters of a compressed file are split to the works which have
+ * F2FS_UNPACK_READ_BLOCKS file blocks at most, the works write the same
+ * file by their own fd.
+ */
+struct f2fs_unpack_work {
+	struct f2fs_editor		*f2fs;
+	uint32_t			ino;
+	int				fd;
+	char				filename[F2FS_NAME_LEN + 1];
+
+	/* for the clusters of a compressed file only */
+	struct f2fs_inode_blocks	clusters;
+	uint64_t			total_size;
+	int				algorithm;
+	uint32_t			cluster_blocks;
+};
+
+static int unpack_symlink(struct f2fs_editor *f2fs, uint32_t ino,
+			  int dirfd, const char *filename)
+{
+	struct f2fs_inode *inode = f2fs_alloc_read_inode(f2fs, ino);
+	uint64_t total_size;
+	int ret = -1;
+
+	if (!inode)
+		return -1;
+
+	total_size = le64_to_cpu(inode->i_size);
+	if (total_size == 0 || !(inode->i_inline & F2FS_DATA_EXIST)) {
+		fprintf(stderr, "Error: symlink #%u has no inline data\n",
+			ino);
+		goto done;
+	} else {
+		char target[F2FS_BLKSIZE] = { 0 };
+		size_t maxsz = 0;
+		void *data_start = f2fs_inode_inline_data(f2fs, inode, &maxsz);
+
+		if (!data_start || total_size > maxsz) {
+			fprintf(stderr, "Error: inode #%u has %" PRIu64
+				" bytes inline data, but only %zu bytes can be read\n",
+				ino, total_size, maxsz);
+			ret = -1;
+			goto done;
+		}
+
+		memcpy(target, data_start, total_size);
+		unlinkat(dirfd, filename, 0);
+		ret = symlinkat(target, dirfd, filename);
+	}
+
+done:
+	free(inode);
+	return ret;
+}
+
+/* copy the blocks of @ext to the file, the data after @total_size is not
+ * copied.
+ */
+static int unpack_copy_extent(struct f2fs_unpack_work *w,
+			      struct f2fs_block_extent *ext,
+			      uint64_t total_size, void *blkbuf)
+{
+	struct f2fs_editor *f2fs = w->f2fs;
+
+	for (uint32_t copied = 0; copied < ext->len; ) {
+		uint64_t offset = (ext->fofs + copied) * f2fs->block_size;
+		uint32_t nblks = ext->len - copied;
+		size_t chunk_sz;
+		int ret;
+
+		if (offset >= total_size)
+			break;
+
+		if (nblks > F2FS_UNPACK_READ_BLOCKS)
+			nblks = F2FS_UNPACK_READ_BLOCKS;
+
+		chunk_sz = (size_t)nblks * f2fs->block_size;
+		if (total_size - offset < chunk_sz)
+			chunk_sz = total_size - offset;
+
+		ret = f2fs_read_blocks(f2fs, ext->blkaddr + copied, nblks,
+				       blkbuf, chunk_sz);
+		if (ret < 0)
+			return ret;
+
+		if (pwrite64(w->fd, blkbuf, chunk_sz, offset)
+		    != (ssize_t)chunk_sz) {
+			fprintf(stderr, "Error: write %s failed(%m)\n",
+				w->filename);
+			return -1;
+		}
+
+		copied += nblks;
+	}
+
+	return 0;
+}
+
+static int unpack_compressed_work(void *arg)
+{
+	struct f2fs_unpack_work *w = arg;
+	struct f2fs_editor *f2fs = w->f2fs;
+	size_t cluster_sz = (size_t)w->cluster_blocks * f2fs->block_size;
+	uint8_t *cbuf = malloc(cluster_sz), *rbuf = malloc(cluster_sz);
+	void *blkbuf = malloc(F2FS_UNPACK_READ_BLOCKS * f2fs->block_size);
+	int ret = -1;
+
+	if (!cbuf || !rbuf || !blkbuf)
+		goto done;
+
+	ret = 0;
+	for (size_t i = 0; i < w->clusters.total && ret == 0; ) {
+		struct f2fs_block_extent *ext = &w->clusters.extents[i];
+		uint64_t offset = ext->fofs * f2fs->block_size;
+		size_t sz = cluster_sz;
+
+		/* the clusters not compressed are saved as normal blocks */
+		if (ext->blkaddr != COMPRESS_ADDR) {
+			ret = unpack_copy_extent(w, ext, w->total_size, blkbuf);
+			i++;
+			continue;
+		}
+
+		ret = f2fs_read_compressed_cluster(f2fs, w->algorithm,
+						   w->cluster_blocks,
+						   &w->clusters, &i,
+						   cbuf, rbuf);
+		if (ret < 0 || offset >= w->total_size)
+			continue;
+
+		if (sz > w->total_size - offset)
+			sz = w->total_size - offset;
+
+		if (pwrite64(w->fd, rbuf, sz, offset) != (ssize_t)sz) {
+			fprintf(stderr, "Error: write %s failed(%m)\n",
+				w->filename);
+			ret = -1;
+		}
+	}
+
+done:
+	close(w->fd);
+	free(blkbuf);
+	free(rbuf);
+	free(cbuf);
+	free(w->clusters.extents);
+	free(w);
+
+	return ret;
+}
+
+/* queue the clusters in [@lo, @hi) of @b, the extents cross @hi are split
+ * and *@idx is moved to the first extent after @hi.
+ */
+static int unpack_queue_clusters(struct f2fs_unpack_context *ctx,
+				 struct f2fs_unpack_work *tmpl,
+				 struct f2fs_inode_blocks *b, size_t *idx,
+				 uint64_t hi)
+{
+	struct f2fs_unpack_work *w;
+	size_t n = 0, i = *idx;
+	int ret;
+
+	while (i + n < b->total && b->extents[i + n].fofs < hi)
+		n++;
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return -1;
+
+	*w = *tmpl;
+	w->clusters.extents = calloc(n, sizeof(*w->clusters.extents));
+	w->clusters.total = n;
+	w->fd = dup(tmpl->fd);
+	if (!w->clusters.extents || w->fd < 0) {
+		fprintf(stderr, "Error: alloc work of %s failed\n",
+			tmpl->filename);
+		if (w->fd >= 0)
+			close(w->fd);
+		free(w->clusters.extents);
+		free(w);
+		return -1;
+	}
+
+	memcpy(w->clusters.extents, &b->extents[i], n * sizeof(*b->extents));
+	*idx = i + n;
+
+	/* the last extent is continued in the next work */
+	if (n > 0) {
+		struct f2fs_block_extent *last = &b->extents[i + n - 1];
+
+		if (last->fofs + last->len > hi) {
+			uint32_t len = hi - last->fofs;
+
+			w->clusters.extents[n - 1].len = len;
+			last->fofs += len;
+			last->blkaddr += len;
+			last->len -= len;
+			*idx = i + n - 1;
+		}
+	}
+
+	ret = threadpool_queue_work(ctx->tp, unpack_compressed_work, w);
+	if (ret < 0) {
+		close(w->fd);
+		free(w->clusters.extents);
+		free(w);
+	}
+
+	return ret;
+}
+
+/* the clusters are decompressed by the worker threads in parallel */
+static int unpack_compressed_file(struct f2fs_editor *f2fs,
+				  struct f2fs_unpack_context *ctx,
+				  struct f2fs_inode *inode, uint32_t ino,
+				  int fd, const char *filename)
+{
+	struct f2fs_inode_blocks b = { .extents = NULL };
+	struct f2fs_unpack_work tmpl = {
+		.f2fs = f2fs,
+		.ino = ino,
+		.fd = fd,
+		.total_size = le64_to_cpu(inode->i_size),
+		.algorithm = inode->i_compress_algorithm,
+		.cluster_blocks = f2fs_inode_cluster_blocks(inode),
+	};
+	int ret;
+
+	snprintf(tmpl.filename, sizeof(tmpl.filename), "%s", filename);
+
+	ret = f2fs_inode_blocks_read(f2fs, &b, inode, ino);
+	if (ret < 0)
+		goto done;
+
+	/* the unallocated blocks are holes */
+	ret = ftruncate(fd, tmpl.total_size);
+	if (ret < 0) {
+		fprintf(stderr, "Error: truncate %s failed(%m)\n", filename);
+		goto done;
+	}
+
+	/* F2FS_UNPACK_READ_BLOCKS is aligned to the max cluster size */
+	for (size_t i = 0; i < b.total && ret == 0; ) {
+		uint64_t lo = b.extents[i].fofs / F2FS_UNPACK_READ_BLOCKS
+				* F2FS_UNPACK_READ_BLOCKS;
+
+		ret = unpack_queue_clusters(ctx, &tmpl, &b, &i,
+					    lo + F2FS_UNPACK_READ_BLOCKS);
+	}
+
+done:
+	free(b.extents);
+	close(fd);
+	return ret;
+}
+
+static int unpack_reg_file_work(void *arg)
 {
-	struct f2fs_inode *inode = f2fs_alloc_read_inode(f2fs, ino);
+	struct f2fs_unpack_work *w = arg;
+	struct f2fs_editor *f2fs = w->f2fs;
+	struct f2fs_inode *inode = f2fs_alloc_read_inode(f2fs, w->ino);
+	struct f2fs_inode_blocks data_blocks = { .extents = NULL };
 	uint64_t total_size;
+	void *blkbuf = NULL;
 	int ret = -1;
 
 	if (!inode)
-		return -1;
+		goto done;
 
 	total_size = le64_to_cpu(inode->i_size);
-	if (total_size == 0 || !(inode->i_inline & F2FS_DATA_EXIST)) {
-		fprintf(stderr, "Error: symlink #%u has no inline data\n",
-			ino);
-		goto done;
-	} else {
-		void *data_start = &inode->i_addr[1];
-		size_t maxsz = sizeof(inode->i_addr) - sizeof(inode->i_addr[0]);
+	if (inode->i_inline & F2FS_DATA_EXIST) {
+		size_t maxsz = 0;
+		void *data_start = f2fs_inode_inline_data(f2fs, inode, &maxsz);
 
-		if (total_size > maxsz) {
+		if (!data_start || total_size > maxsz) {
 			fprintf(stderr, "Error: inode #%u has %" PRIu64
 				" bytes inline data, but only %zu bytes can be read\n",
-				ino, total_size, maxsz);
+				w->ino, total_size, maxsz);
 			ret = -1;
 			goto done;
 		}
 
-		unlink(filename);
-		ret = symlink(data_start, filename);
+		write(w->fd, data_start, total_size);
+		ret = 0;
+
+		goto done;
+	}
+
+	blkbuf = malloc(F2FS_UNPACK_READ_BLOCKS * f2fs->block_size);
+	if (!blkbuf)
+		goto done;
+
+	ret = f2fs_inode_blocks_read(f2fs, &data_blocks, inode, w->ino);
+	if (ret < 0)
+		goto done;
+
+	/* copy each extent by large reads, the holes between them are
+	 * skipped and left unallocated in the output file.
+	 */
+	for (size_t i = 0; i < data_blocks.total; i++) {
+		ret = unpack_copy_extent(w, &data_blocks.extents[i],
+					 total_size, blkbuf);
+		if (ret < 0)
+			goto done;
 	}
 
+	/* the unallocated blocks are holes */
+	ret = ftruncate(w->fd, total_size);
+
 done:
+	close(w->fd);
+	free(blkbuf);
+	free(data_blocks.extents);
 	free(inode);
+	free(w);
+
 	return ret;
 }
 
-static int unpack_reg_file(struct f2fs_editor *f2fs, uint32_t ino,
-			   const char *filename)
+static int unpack_reg_file(struct f2fs_editor *f2fs,
+			   struct f2fs_unpack_context *ctx, uint32_t ino,
+			   int dirfd, const char *filename)
 {
 	struct f2fs_inode *inode = f2fs_alloc_read_inode(f2fs, ino);
-	struct f2fs_inode_blocks data_blocks = { .blocks = NULL };
-	uint64_t total_size;
-	void *blkbuf = NULL;
+	struct f2fs_unpack_work *w;
 	int fd = -1, ret = -1;
 
 	if (!inode)
 		return -1;
 
-	fd = fileopen(filename, O_CREAT | O_WRONLY | O_TRUNC,
-		      le16_to_cpu(inode->i_mode) & ~ S_IFMT);
+	fd = openat(dirfd, filename, O_CREAT | O_WRONLY | O_TRUNC,
+		    le16_to_cpu(inode->i_mode) & ~ S_IFMT);
 	if (fd < 0) {
+		fprintf(stderr, "Error: open %s failed(%m)\n", filename);
 		ret = fd;
 		goto done;
 	}
 
-	total_size = le64_to_cpu(inode->i_size);
-	if (total_size == 0) {
+	if (le64_to_cpu(inode->i_size) == 0) {
+		close(fd);
 		ret = 0;
 		goto done;
 	}
 
-	if (inode->i_inline & F2FS_DATA_EXIST) {
-		void *data_start = &inode->i_addr[1];
-		size_t maxsz = sizeof(inode->i_addr) - sizeof(inode->i_addr[0]);
-
-		if (total_size > maxsz) {
-			fprintf(stderr, "Error: inode #%u has %" PRIu64
-				" bytes inline data, but only %zu bytes can be read\n",
-				ino, total_size, maxsz);
-			ret = -1;
-			goto done;
-		}
-
-		write(fd, data_start, total_size);
-		ret = 0;
-
+	if (f2fs_inode_cluster_blocks(inode)
+	    && !(inode->i_inline & F2FS_DATA_EXIST)) {
+		ret = unpack_compressed_file(f2fs, ctx, inode, ino, fd,
+					     filename);
 		goto done;
 	}
 
-	blkbuf = malloc(f2fs->block_size);
-	if (!blkbuf)
-		goto done;
-
-	ret = f2fs_inode_blocks_read(f2fs, &data_blocks, inode, ino);
-	if (ret < 0)
+	/* the file data is copied by the worker threads */
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		close(fd);
 		goto done;
+	}
 
-	for (size_t i = 0; i < data_blocks.total && total_size > 0; i++) {
-		uint32_t blkno = data_blocks.blocks[i];
-		size_t chunk_sz = f2fs->block_size;
-
-		if (blkno == 0)
-			continue;
-
-		if (total_size < chunk_sz)
-			chunk_sz = total_size;
-
-		ret = f2fs_read_blocks(f2fs, blkno, 1, blkbuf, f2fs->block_size);
-		if (ret < 0)
-			goto done;
+	w->f2fs = f2fs;
+	w->ino = ino;
+	w->fd = fd;
+	snprintf(w->filename, sizeof(w->filename), "%s", filename);
 
-		write(fd, blkbuf, chunk_sz);
-		total_size -= chunk_sz;
+	ret = threadpool_queue_work(ctx->tp, unpack_reg_file_work, w);
+	if (ret < 0) {
+		close(fd);
+		free(w);
 	}
 
 done:
-	if (!(fd < 0))
-		close(fd);
-	free(blkbuf);
-	free(data_blocks.blocks);
 	free(inode);
-
 	return ret;
 }
 
-static int unpack_dir(struct f2fs_editor *f2fs, uint32_t ino, const char *filename)
+static int unpack_dir(struct f2fs_editor *f2fs,
+		      struct f2fs_unpack_context *ctx, uint32_t ino,
+		      int depth, const char *filename)
 {
-	struct f2fs_inode *inode = f2fs_alloc_read_inode(f2fs, ino);
+	struct f2fs_inode *inode;
+	int fd;
+
+	if (depth + 1 > F2FS_UNPACK_MAX_DEPTH) {
+		fprintf(stderr, "Error: directory %s is too deep\n", filename);
+		return -1;
+	}
 
+	inode = f2fs_alloc_read_inode(f2fs, ino);
 	if (!inode) {
 		fprintf(stderr, "Error: read inode #%u failed\n", ino);
 		return -1;
 	}
 
-	mkdir(filename, le16_to_cpu(inode->i_mode) & ~ S_IFMT);
+	mkdirat(ctx->dirfds[depth], filename,
+		le16_to_cpu(inode->i_mode) & ~ S_IFMT);
 	free(inode);
 
+	fd = openat(ctx->dirfds[depth], filename, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		fprintf(stderr, "Error: open dir %s failed(%m)\n", filename);
+		return fd;
+	}
+
+	/* the children of this directory are walked after this callback,
+	 * the previous directory in the same level is already done.
+	 */
+	if (ctx->dirfds[depth + 1] >= 0)
+		close(ctx->dirfds[depth + 1]);
+	ctx->dirfds[depth + 1] = fd;
+
 	return 0;
 }
 
@@ -1470,17 +3421,23 @@ static int unpack_dirent_callback(struct f2fs_editor *f2fs,
 				  int *break_next,
 				  void *foreach_data)
 {
+	struct f2fs_unpack_context *ctx = foreach_data;
+	int dirfd = ctx->dirfds[depth];
+	const char *filename = const_basename(path);
 	int ret = -1;
 
 	switch (dentry->file_type) {
 	case F2FS_FT_REG_FILE:
-		ret = unpack_reg_file(f2fs, le32_to_cpu(dentry->ino), path);
+		ret = unpack_reg_file(f2fs, ctx, le32_to_cpu(dentry->ino),
+				      dirfd, filename);
 		break;
 	case F2FS_FT_SYMLINK:
-		ret = unpack_symlink(f2fs, le32_to_cpu(dentry->ino), path);
+		ret = unpack_symlink(f2fs, le32_to_cpu(dentry->ino),
+				     dirfd, filename);
 		break;
 	case F2FS_FT_DIR:
-		ret = unpack_dir(f2fs, le32_to_cpu(dentry->ino), path);
+		ret = unpack_dir(f2fs, ctx, le32_to_cpu(dentry->ino),
+				 depth, filename);
 		break;
 	default:
 		fprintf(stderr, "Error: unpack filetype %d not supported\n",
@@ -1491,6 +3448,351 @@ static int unpack_dirent_callback(struct f2fs_editor *f2fs,
 	return ret;
 }
 
+/* the valid blocks of a segment, counted by words instead of bits */
+static uint32_t f2fs_sit_valid_blocks(const struct f2fs_sit_entry *se)
+{
+	uint32_t n = 0;
+
+	for (size_t i = 0; i < SIT_VBLOCK_MAP_SIZE; i += sizeof(uint64_t)) {
+		uint64_t w;
+
+		memcpy(&w, &se->valid_map[i], sizeof(w));
+		n += __builtin_popcountll(w);
+	}
+
+	return n;
+}
+
+#define F2FS_SEGMENTS_HISTOGRAM_SIZE	10
+#define F2FS_SEGMENTS_MAX_FREE_RUNS	8
+
+struct f2fs_segments_type_stat {
+	uint32_t			segments;
+	uint64_t			valid_blocks;
+
+	/* the utilization of the used segments, 10% for each */
+	uint32_t			histogram[F2FS_SEGMENTS_HISTOGRAM_SIZE];
+};
+
+struct f2fs_free_run {
+	uint32_t			start;
+	uint32_t			segments;
+};
+
+/* keep the largest free runs in @runs ordered by length */
+static void f2fs_free_runs_add(struct f2fs_free_run *runs, size_t *count,
+			       uint32_t start, uint32_t segments)
+{
+	size_t i = *count;
+
+	if (segments == 0)
+		return;
+
+	if (i == F2FS_SEGMENTS_MAX_FREE_RUNS) {
+		if (runs[i - 1].segments >= segments)
+			return;
+		i--;
+	} else {
+		(*count)++;
+	}
+
+	for (; i > 0 && runs[i - 1].segments < segments; i--)
+		runs[i] = runs[i - 1];
+
+	runs[i].start = start;
+	runs[i].segments = segments;
+}
+
+/* the current segments of the logs are never free even if they have no
+ * valid blocks, the same as the free_segment_count of the checkpoint.
+ */
+static bool f2fs_is_current_segment(struct f2fs_editor *f2fs, uint32_t segno)
+{
+	for (int i = 0; i < 3; i++) {
+		if (le32_to_cpu(f2fs->checkpoint->cur_node_segno[i]) == segno
+		    || le32_to_cpu(f2fs->checkpoint->cur_data_segno[i]) == segno)
+			return true;
+	}
+
+	return false;
+}
+
+static int f2fs_segments_json_add_numbers(cJSON *root, const char *name,
+					  const uint32_t *numbers, size_t count)
+{
+	cJSON *array = cJSON_AddArrayToObject(root, name);
+
+	if (!array)
+		return -1;
+
+	for (size_t i = 0; i < count; i++) {
+		if (!cJSON_AddItemToArray(array, cJSON_CreateNumber(numbers[i])))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* segments [report.json]
+ * report the usage of the main segments based on the SIT
+ */
+static int f2fs_do_segments(void *private_data, int fd, int argc, char **argv)
+{
+	static const char *type_names[NR_CURSEG_TYPE] = {
+		[CURSEG_HOT_DATA] = "hot_data",
+		[CURSEG_WARM_DATA] = "warm_data",
+		[CURSEG_COLD_DATA] = "cold_data",
+		[CURSEG_HOT_NODE] = "hot_node",
+		[CURSEG_WARM_NODE] = "warm_node",
+		[CURSEG_COLD_NODE] = "cold_node",
+	};
+	struct f2fs_editor *f2fs = private_data;
+	struct f2fs_segments_type_stat types[NR_CURSEG_TYPE] = { 0 };
+	struct f2fs_free_run free_runs[F2FS_SEGMENTS_MAX_FREE_RUNS];
+	uint32_t free_segs = 0, dirty_segs = 0, full_segs = 0, cur_segs = 0;
+	uint32_t mismatch = 0;
+	uint32_t segments = 0, run_start = 0;
+	size_t n_free_runs = 0;
+	uint64_t valid_blocks = 0;
+	struct f2fs_sit_entry *sit;
+	cJSON *root = NULL, *json_types, *json_runs;
+	int ret = -1;
+
+	sit = f2fs_alloc_read_sit(f2fs, &segments);
+	if (!sit)
+		return ret;
+
+	for (uint32_t segno = 0; segno <= segments; segno++) {
+		struct f2fs_segments_type_stat *stat;
+		uint32_t vblocks = 0, type;
+		bool cur = false;
+
+		if (segno < segments) {
+			vblocks = f2fs_sit_valid_blocks(&sit[segno]);
+			if (vblocks != GET_SIT_VBLOCKS(&sit[segno]))
+				mismatch++;
+			cur = f2fs_is_current_segment(f2fs, segno);
+		}
+
+		/* the free segments run is end at the last segment too */
+		if (segno == segments || vblocks != 0 || cur) {
+			f2fs_free_runs_add(free_runs, &n_free_runs, run_start,
+					   segno - run_start);
+			run_start = segno + 1;
+			if (segno == segments)
+				break;
+		}
+
+		if (cur)
+			cur_segs++;
+		else if (vblocks == 0)
+			free_segs++;
+		else if (vblocks >= f2fs->blocks_per_segment)
+			full_segs++;
+		else
+			dirty_segs++;
+
+		if (vblocks == 0)
+			continue;
+
+		valid_blocks += vblocks;
+		type = GET_SIT_TYPE(&sit[segno]);
+		if (type >= NR_CURSEG_TYPE)
+			continue;
+
+		stat = &types[type];
+		stat->segments++;
+		stat->valid_blocks += vblocks;
+		stat->histogram[(uint64_t)(vblocks - 1) * F2FS_SEGMENTS_HISTOGRAM_SIZE
+				/ f2fs->blocks_per_segment]++;
+	}
+
+	root = cJSON_CreateObject();
+	if (!root)
+		goto done;
+
+	if (!cJSON_AddNumberToObject(root, "blocks_per_segment",
+				     f2fs->blocks_per_segment)
+	    || !cJSON_AddNumberToObject(root, "main_segments", segments)
+	    || !cJSON_AddNumberToObject(root, "valid_blocks", valid_blocks)
+	    || !cJSON_AddNumberToObject(root, "free_segments", free_segs)
+	    || !cJSON_AddNumberToObject(root, "dirty_segments", dirty_segs)
+	    || !cJSON_AddNumberToObject(root, "full_segments", full_segs)
+	    || !cJSON_AddNumberToObject(root, "current_segments", cur_segs)
+	    || !cJSON_AddNumberToObject(root, "vblocks_mismatch", mismatch))
+		goto done;
+
+	json_types = cJSON_AddObjectToObject(root, "types");
+	if (!json_types)
+		goto done;
+
+	for (int i = 0; i < NR_CURSEG_TYPE; i++) {
+		cJSON *t = cJSON_AddObjectToObject(json_types, type_names[i]);
+
+		if (!t
+		    || !cJSON_AddNumberToObject(t, "segments", types[i].segments)
+		    || !cJSON_AddNumberToObject(t, "valid_blocks",
+						types[i].valid_blocks)
+		    || f2fs_segments_json_add_numbers(t, "histogram",
+						types[i].histogram,
+						F2FS_SEGMENTS_HISTOGRAM_SIZE) < 0)
+			goto done;
+	}
+
+	json_runs = cJSON_AddArrayToObject(root, "largest_free_runs");
+	if (!json_runs)
+		goto done;
+
+	for (size_t i = 0; i < n_free_runs; i++) {
+		cJSON *run = cJSON_CreateObject();
+
+		if (!run || !cJSON_AddItemToArray(json_runs, run)) {
+			cJSON_Delete(run);
+			goto done;
+		}
+
+		if (!cJSON_AddNumberToObject(run, "start", free_runs[i].start)
+		    || !cJSON_AddNumberToObject(run, "segments",
+						free_runs[i].segments))
+			goto done;
+	}
+
+	if (argc > 1) {
+		ret = json_saveto_file(root, argv[1]);
+	} else {
+		char *s = cJSON_Print(root);
+
+		if (s) {
+			printf("%s\n", s);
+			cJSON_free(s);
+			ret = 0;
+		}
+	}
+
+done:
+	if (ret < 0)
+		fprintf(stderr, "Error: generate segments report failed\n");
+	cJSON_Delete(root);
+	free(sit);
+	return ret;
+}
+
+#ifdef CONFIG_ENABLE_ANDROID
+static int f2fs_write_sparse_chunk(int fd_target,
+				   struct android_sparse_chunk *chunk,
+				   void *private_data)
+{
+	off64_t target_offset = lseek64(fd_target, 0, SEEK_CUR);
+	struct f2fs_editor *f2fs = private_data;
+
+	dd64(f2fs->fd, fd_target,
+		(off64_t)chunk->fs_blocknr * f2fs->block_size,
+		target_offset,
+		(off64_t)chunk->count * f2fs->block_size,
+		NULL, NULL);
+	return 0;
+}
+
+/* the used blocks are the metadata area (super blocks, CP, SIT, NAT and
+ * SSA) and the valid blocks of the main segments recorded in the SIT.
+ */
+static int f2fs_do_sparse(void *private_data, int fd, int argc, char **argv)
+{
+	struct f2fs_editor *f2fs = private_data;
+	uint64_t total_blocks = le64_to_cpu(f2fs->sblock.block_count);
+	uint32_t main_blkaddr = le32_to_cpu(f2fs->sblock.main_blkaddr);
+	struct android_sparse_input input;
+	struct f2fs_sit_entry *sit = NULL;
+	struct bitmask *valid_map = NULL;
+	struct bitmask *b = NULL;
+	int ret = -1, fd_target = -1;
+	uint32_t segments = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: sparse output.simg\n");
+		return -1;
+	}
+
+	if (total_blocks > UINT32_MAX || main_blkaddr > total_blocks) {
+		fprintf(stderr, "Error: bad block_count %" PRIu64 "\n",
+			total_blocks);
+		return -1;
+	}
+
+	sit = f2fs_alloc_read_sit(f2fs, &segments);
+	if (!sit)
+		return -1;
+
+	b = alloc_bitmask(total_blocks);
+	valid_map = alloc_bitmask(SIT_VBLOCK_MAP_SIZE * 8);
+	if (!b || !valid_map)
+		goto done;
+
+	bitmask_set_bits(b, 0, main_blkaddr);
+
+	for (uint32_t segno = 0; segno < segments; segno++) {
+		uint64_t start = main_blkaddr
+			+ (uint64_t)segno * f2fs->blocks_per_segment;
+		uint32_t vblocks = GET_SIT_VBLOCKS(&sit[segno]);
+
+		if (vblocks == 0)
+			continue;
+
+		if (start + f2fs->blocks_per_segment > total_blocks) {
+			fprintf(stderr, "Error: segment %u is out of range\n",
+				segno);
+			goto done;
+		}
+
+		/* the valid_map is msb first, the same as the bitmask */
+		bitmask_memcpy(valid_map, sit[segno].valid_map,
+			       sizeof(sit[segno].valid_map));
+		if (vblocks == f2fs->blocks_per_segment) {
+			bitmask_set_bits(b, start, vblocks);
+			continue;
+		}
+
+		bitmask_foreach_continue(it, valid_map) {
+			if ((size_t)it.start >= f2fs->blocks_per_segment)
+				break;
+			bitmask_set_bits(b, start + it.start, it.bits);
+		}
+	}
+
+	fd_target = fileopen(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd_target < 0)
+		goto done;
+
+	android_sparse_init(&input, f2fs->block_size, total_blocks);
+
+	bitmask_foreach_continue(it, b) {
+		if (get_verbose_level() > 0)
+			printf("add chunk block started at %zd total %zu\n",
+				it.start, it.bits);
+
+		android_sparse_add_chunk(&input, it.start, it.bits);
+	}
+
+	if (input.error) {
+		fprintf(stderr, "Error: add sparse chunks failed. "
+				"(no enough memory?)\n");
+		goto done;
+	}
+
+	ret = android_sparse_finish(&input, fd_target,
+				    f2fs_write_sparse_chunk, f2fs);
+done:
+	if (valid_map)
+		bitmask_free(valid_map);
+	if (b)
+		bitmask_free(b);
+	if (fd_target >= 0)
+		close(fd_target);
+	free(sit);
+	return ret;
+}
+#endif
+
 static int f2fs_default_list(void *private_data, int fd, int argc, char **argv)
 {
 	struct f2fs_editor *f2fs = private_data;
@@ -1527,6 +3829,16 @@ static int f2fs_list_main(void *private_data, int fd, int argc, char **argv)
 			return f2fs_do_nat(private_data, fd, argc, argv);
 		else if (!strcmp(argv[0], "inode"))
 			return f2fs_do_inode(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "stat"))
+			return f2fs_do_stat(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "cat"))
+			return f2fs_do_cat(private_data, fd, argc, argv);
+		else if (!strcmp(argv[0], "segments"))
+			return f2fs_do_segments(private_data, fd, argc, argv);
+	#if CONFIG_ENABLE_ANDROID > 0
+		else if (!strcmp(argv[0], "sparse"))
+			return f2fs_do_sparse(private_data, fd, argc, argv);
+	#endif
 
 		fprintf(stderr, "Error: unknown command %s\n", argv[0]);
 		return -1;
@@ -1535,13 +3847,97 @@ static int f2fs_list_main(void *private_data, int fd, int argc, char **argv)
 	return f2fs_default_list(private_data, fd, argc, argv);
 }
 
+/* unpack one file or directory to @dirout */
+static int unpack_path(struct f2fs_editor *f2fs,
+		       struct f2fs_unpack_context *ctx, const char *path,
+		       const char *dirout)
+{
+	struct f2fs_inode *inode;
+	const char *filename;
+	uint32_t ino;
+	int ret;
+
+	ret = f2fs_namei(f2fs, path, false, &ino);
+	if (ret < 0)
+		return ret;
+
+	inode = f2fs_alloc_read_inode(f2fs, ino);
+	if (!inode)
+		return -1;
+
+	filename = const_basename(path);
+
+	switch (le16_to_cpu(inode->i_mode) & S_IFMT) {
+	case S_IFDIR:
+		ret = foreach_dirent(f2fs, ino, dirout, 0,
+				     unpack_dirent_callback, ctx);
+		break;
+	case S_IFREG:
+		ret = unpack_reg_file(f2fs, ctx, ino, ctx->dirfds[0], filename);
+		break;
+	case S_IFLNK:
+		ret = unpack_symlink(f2fs, ino, ctx->dirfds[0], filename);
+		break;
+	default:
+		fprintf(stderr, "Error: unpack %s is not supported\n", path);
+		ret = -1;
+		break;
+	}
+
+	free(inode);
+	return ret;
+}
+
+/* --unpack image -- [--path /path/of/file-or-dir] */
 static int f2fs_unpack(void *private_data, int fd, const char *dirout, int argc, char **argv)
 {
 	struct f2fs_editor *f2fs = private_data;
+	struct f2fs_unpack_context *ctx;
+	const char *path = NULL;
+	int ret = -1, ret_wait;
 
-	return foreach_dirent(f2fs, le32_to_cpu(f2fs->sblock.root_ino),
-			      dirout, 0,
-			      unpack_dirent_callback, NULL);
+	for (int i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "--path") && i + 1 < argc)
+			path = argv[++i];
+	}
+
+	ctx = malloc(sizeof(*ctx));
+	if (!ctx)
+		return ret;
+
+	for (int i = 0; i <= F2FS_UNPACK_MAX_DEPTH; i++)
+		ctx->dirfds[i] = -1;
+
+	ctx->dirfds[0] = open(dirout, O_RDONLY | O_DIRECTORY);
+	if (ctx->dirfds[0] < 0) {
+		fprintf(stderr, "Error: open dir %s failed(%m)\n", dirout);
+		goto done;
+	}
+
+	ctx->tp = alloc_threadpool(get_parallel_jobs(), 0);
+	if (!ctx->tp)
+		goto done;
+
+	if (path)
+		ret = unpack_path(f2fs, ctx, path, dirout);
+	else
+		ret = foreach_dirent(f2fs, le32_to_cpu(f2fs->sblock.root_ino),
+				     dirout, 0,
+				     unpack_dirent_callback, ctx);
+	ret_wait = threadpool_wait(ctx->tp);
+	if (ret == 0)
+		ret = ret_wait;
+
+	threadpool_free(ctx->tp);
+
+done:
+	for (int i = 0; i <= F2FS_UNPACK_MAX_DEPTH; i++) {
+		if (ctx->dirfds[i] >= 0)
+			close(ctx->dirfds[i]);
+	}
+	free(ctx);
+
+	return ret;
 }
 
 static struct imgeditor f2fs_editor = {
@@ -11,10 +11,14 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "imgeditor.h"
 #include "ubi.h"
 #include "structure.h"
 #include "minilzo.h"
+#include "threadpool.h"
 
 #define PRINT_LEVEL0					"%-30s: "
 #define PRINT_LEVEL1					"    %-26s: "
@@ -598,6 +602,8 @@ struct ubi_editor_private_data {
 	uint32_t			data_offset;
 
 	struct cache_peb		caches[UBI_EDITOR_CACHE_PEB_NUMBERS];
+	/* protect the caches and the file offset of @fd */
+	pthread_mutex_t			caches_lock;
 
 	struct ubifs_sb_node		sblock;
 	struct ubifs_mst_node		master;
@@ -1038,6 +1044,7 @@ static int ubi_editor_init(void *private_data)
 	for (int i = 0; i < UBI_EDITOR_CACHE_PEB_NUMBERS; i++)
 		memset(&p->caches[i], 0, sizeof(struct cache_peb));
 
+	pthread_mutex_init(&p->caches_lock, NULL);
 	return 0;
 }
 
@@ -1115,6 +1122,8 @@ static void ubi_editor_exit(void *private_data)
 
 	for (int i = 0; i < UBI_EDITOR_CACHE_PEB_NUMBERS; i++)
 		free(p->caches[i].peb);
+
+	pthread_mutex_destroy(&p->caches_lock);
 }
 
 static int ubi_peb_is_empty(void *buf, size_t bufsz)
@@ -1251,11 +1260,17 @@ static void *ubi_alloc_read_leb(struct ubi_editor_private_data *p, uint32_t lnum
 				uint32_t *ret_peb)
 {
 	void *buf = malloc(p->peb_size);
+	int ret;
 
 	if (!buf)
 		return buf;
 
-	if (ubi_read_leb(p, lnum, ret_peb, buf, p->peb_size) < 0) {
+	/* the unpack workers read the nodes in parallel */
+	pthread_mutex_lock(&p->caches_lock);
+	ret = ubi_read_leb(p, lnum, ret_peb, buf, p->peb_size);
+	pthread_mutex_unlock(&p->caches_lock);
+
+	if (ret < 0) {
 		free(buf);
 		return NULL;
 	}
@@ -2072,38 +2087,26 @@ static int ubi_main(void *private_data, int fd, int argc, char **argv)
 	return ubi_list(p);
 }
 
-static int ubi_unpack_file(struct ubi_editor_private_data *p, uint32_t ino,
-			   const char *filename)
+/* the regular file is created by the directory walker, and the data nodes
+ * are read and decompressed by the worker threads.
+ */
+struct ubi_unpack_work {
+	struct ubi_editor_private_data	*p;
+	uint32_t			ino;
+	uint64_t			filesz;
+	int				fd;
+};
+
+static int ubi_unpack_file_work(void *arg)
 {
-	struct ubifs_ino_node *inode;
-	void *inode_peb;
-	uint32_t data_block = 0;
-	uint64_t filesz, n = 0;
-	uint8_t zero = 0;
+	struct ubi_unpack_work *w = arg;
+	struct ubi_editor_private_data *p = w->p;
+	uint32_t data_block = 0, ino = w->ino;
+	uint64_t filesz = w->filesz, n = 0;
 	int ret = 0;
-	int fd;
-
-	inode = ubi_alloc_read_inode(p, ino, &inode_peb);
-	if (!inode)
-		return -1;
-
-	fd = fileopen(filename, O_RDWR | O_CREAT | O_TRUNC,
-			le32_to_cpu(inode->mode));
-	if (fd < 0) {
-		free(inode_peb);
-		return -1;
-	}
-
-	filesz = le64_to_cpu(inode->size);
-	free(inode_peb);
-	inode_peb = NULL;
-
-	if (filesz == 0)
-		goto done;
 
 	/* fill the file with zero */
-	lseek64(fd, filesz - sizeof(zero), SEEK_SET);
-	write(fd, &zero, sizeof(zero));
+	ftruncate(w->fd, filesz);
 
 	while (n < filesz) {
 		struct ubifs_data_node *dnode;
@@ -2137,23 +2140,74 @@ static int ubi_unpack_file(struct ubi_editor_private_data *p, uint32_t ino,
 		}
 
 		chunk_sz = le32_to_cpu(dnode->size);
-		n = blk_idx * UBIFS_BLOCK_SIZE;
-		lseek64(fd, n, SEEK_SET);
+		n = (uint64_t)blk_idx * UBIFS_BLOCK_SIZE;
 
-		write(fd, decompress, chunk_sz);
+		pwrite64(w->fd, decompress, chunk_sz, n);
 		data_block = blk_idx + 1;
 		n += chunk_sz;
 
 		free(data_peb);
 	}
 
-done:
-	close(fd);
+	close(w->fd);
+	free(w);
+	return ret;
+}
+
+static int ubi_unpack_file(struct ubi_editor_private_data *p,
+			   struct threadpool *tp, uint32_t ino,
+			   int dirfd, const char *filename)
+{
+	struct ubifs_ino_node *inode;
+	struct ubi_unpack_work *w;
+	void *inode_peb;
+	uint64_t filesz;
+	int ret;
+	int fd;
+
+	inode = ubi_alloc_read_inode(p, ino, &inode_peb);
+	if (!inode)
+		return -1;
+
+	fd = openat(dirfd, filename, O_RDWR | O_CREAT | O_TRUNC,
+		    le32_to_cpu(inode->mode));
+	if (fd < 0) {
+		fprintf(stderr, "Error: open %s failed(%m)\n", filename);
+		free(inode_peb);
+		return -1;
+	}
+
+	filesz = le64_to_cpu(inode->size);
+	free(inode_peb);
+	inode_peb = NULL;
+
+	if (filesz == 0) {
+		close(fd);
+		return 0;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		close(fd);
+		return -1;
+	}
+
+	w->p = p;
+	w->ino = ino;
+	w->filesz = filesz;
+	w->fd = fd;
+
+	ret = threadpool_queue_work(tp, ubi_unpack_file_work, w);
+	if (ret < 0) {
+		close(fd);
+		free(w);
+	}
+
 	return ret;
 }
 
 static int ubi_unpack_link(struct ubi_editor_private_data *p, uint32_t ino,
-			   const char *symlink_name)
+			   int dirfd, const char *symlink_name)
 {
 	char target[1024] = { 0 };
 	struct ubifs_ino_node *inode;
@@ -2169,13 +2223,14 @@ static int ubi_unpack_link(struct ubi_editor_private_data *p, uint32_t ino,
 	free(peb);
 	inode = NULL;
 
-	unlink(symlink_name);
-	symlink(target, symlink_name);
+	unlinkat(dirfd, symlink_name, 0);
+	symlinkat(target, dirfd, symlink_name);
 	return 0;
 }
 
-static int ubi_unpack_dent(struct ubi_editor_private_data *p, uint32_t ino,
-			   const char *parent_dir)
+static int ubi_unpack_dent(struct ubi_editor_private_data *p,
+			   struct threadpool *tp, uint32_t ino,
+			   int dirfd)
 {
 	struct ubi_bptree_leaf_node *leaf;
 	uint32_t hash_min = 0;
@@ -2217,8 +2272,8 @@ static int ubi_unpack_dent(struct ubi_editor_private_data *p, uint32_t ino,
 		else
 			hash_min = (leaf->key1 + 1) & UBIFS_S_KEY_BLOCK_MASK;
 
-		snprintf(filename, sizeof(filename), "%s/%s",
-			parent_dir, (const char *)dent->name);
+		snprintf(filename, sizeof(filename), "%s",
+			(const char *)dent->name);
 
 		inum = (uint32_t)le64_to_cpu(dent->inum);
 
@@ -2226,7 +2281,7 @@ static int ubi_unpack_dent(struct ubi_editor_private_data *p, uint32_t ino,
 		case UBIFS_ITYPE_DIR: {
 			struct ubifs_ino_node *inode;
 			void *inode_peb;
-			int mode;
+			int mode, fd;
 
 			inode = ubi_alloc_read_inode(p, dent->inum, &inode_peb);
 			if (!inode) {
@@ -2239,15 +2294,24 @@ static int ubi_unpack_dent(struct ubi_editor_private_data *p, uint32_t ino,
 			mode = le32_to_cpu(inode->mode);
 			free(inode_peb);
 
-			mkdir(filename, mode);
-			ret = ubi_unpack_dent(p, inum, filename);
+			mkdirat(dirfd, filename, mode);
+			fd = openat(dirfd, filename, O_RDONLY | O_DIRECTORY);
+			if (fd < 0) {
+				fprintf(stderr, "Error: open dir %s failed(%m)\n",
+					filename);
+				ret = fd;
+				break;
+			}
+
+			ret = ubi_unpack_dent(p, tp, inum, fd);
+			close(fd);
 			break;
 		}
 		case UBIFS_ITYPE_REG:
-			ret = ubi_unpack_file(p, inum, filename);
+			ret = ubi_unpack_file(p, tp, inum, dirfd, filename);
 			break;
 		case UBIFS_ITYPE_LNK:
-			ret = ubi_unpack_link(p, inum, filename);
+			ret = ubi_unpack_link(p, inum, dirfd, filename);
 			break;
 		default:
 			fprintf(stderr, "Error: unpack %s failed, unsupported "
@@ -2272,8 +2336,27 @@ static int ubi_unpack(void *private_data, int fd, const char *outdir,
 		      int argc, char **argv)
 {
 	struct ubi_editor_private_data *p = private_data;
+	struct threadpool *tp;
+	int dirfd, ret, ret_wait;
+
+	dirfd = open(outdir, O_RDONLY | O_DIRECTORY);
+	if (dirfd < 0) {
+		fprintf(stderr, "Error: open dir %s failed(%m)\n", outdir);
+		return dirfd;
+	}
+
+	tp = alloc_threadpool(get_parallel_jobs(), 0);
+	if (!tp) {
+		close(dirfd);
+		return -1;
+	}
+
+	ret = ubi_unpack_dent(p, tp, 1 /* root ino */, dirfd);
+	ret_wait = threadpool_wait(tp);
+	threadpool_free(tp);
+	close(dirfd);
 
-	return ubi_unpack_dent(p, 1 /* root ino */, outdir);
+	return ret < 0 ? ret : ret_wait;
 }
 
 static struct imgeditor ubi_editor = {
@@ -9,10 +9,14 @@
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "xfs_format.h"
 #include "xfs_da_format.h"
 #include "structure.h"
 #include "bitmask.h"
+#include "threadpool.h"
 #include "android_sparse.h"
 
 #define PRINT_LEVEL0					"%-30s: "
@@ -527,6 +531,12 @@ struct xfs_editor {
 	uint16_t			sector_size;
 	uint16_t			inode_per_block;
 	uint16_t			inode_size;
+
+	uint32_t			dir_block_size;
+	uint8_t				agblklog;
+	uint8_t				inopblog;
+	int				has_crc;
+	int				has_ftype;
 };
 
 static void xfs_editor_exit(void *private_data)
@@ -556,16 +566,16 @@ static int xfs_read_blocks(struct xfs_editor *xfs,
 			    uint64_t blkno, uint32_t nblks,
 			    void *buf, size_t bufsz)
 {
-	size_t sz = xfs->block_size * nblks;
+	size_t sz = (size_t)xfs->block_size * nblks;
 	int n;
 
 	if (sz > bufsz)
 		sz = bufsz;
 
-	fileseek(xfs->fd, blkno * xfs->block_size);
-	n = fileread(xfs->fd, buf, sz);
+	/* positional read, the unpack workers share the fd */
+	n = filepread(xfs->fd, buf, sz, blkno * xfs->block_size);
 	if (n < 0) {
-		fprintf(stderr, "Error: read %d blocks from #%" PRIu64 "failed\n",
+		fprintf(stderr, "Error: read %u blocks from #%" PRIu64 " failed\n",
 			nblks, blkno);
 		return -1;
 	}
@@ -576,7 +586,7 @@ static int xfs_read_blocks(struct xfs_editor *xfs,
 static void *xfs_alloc_read_blocks(struct xfs_editor *xfs,
 				    uint64_t blkno, uint32_t nblks)
 {
-	size_t sz = xfs->block_size * nblks;
+	size_t sz = (size_t)xfs->block_size * nblks;
 	void *buf = malloc(sz);
 
 	if (buf) {
@@ -599,6 +609,19 @@ static int xfs_init_alloc_ags(struct xfs_editor *xfs, struct xfs_dsb *primary_sb
 	xfs->inode_per_block = be16_to_cpu(primary_sb->sb_inopblock);
 	xfs->ag_count = be32_to_cpu(primary_sb->sb_agcount);
 	xfs->ag_blocks = be32_to_cpu(primary_sb->sb_agblocks);
+	xfs->agblklog = primary_sb->sb_agblklog;
+	xfs->inopblog = primary_sb->sb_inopblog;
+	xfs->dir_block_size = xfs->block_size << primary_sb->sb_dirblklog;
+
+	if ((be16_to_cpu(primary_sb->sb_versionnum) & XFS_SB_VERSION_NUMBITS)
+	    == XFS_SB_VERSION_5) {
+		xfs->has_crc = 1;
+		xfs->has_ftype = !!(be32_to_cpu(primary_sb->sb_features_incompat)
+				    & XFS_SB_FEAT_INCOMPAT_FTYPE);
+	} else {
+		xfs->has_ftype = !!(be32_to_cpu(primary_sb->sb_features2)
+				    & XFS_SB_VERSION2_FTYPE);
+	}
 
 	xfs->ags = calloc(xfs->ag_count, sizeof(*xfs->ags));
 	if (!xfs->ags)
@@ -782,54 +805,87 @@ static int xfs_detect(void *private_data, int force_type, int fd)
 	return 0;
 }
 
-static struct xfs_dinode *_xfs_alloc_read_inode(struct xfs_editor *xfs, int ino,
-						uint32_t *ret_blkno,
+/* 64-bit absolute inode numbers:
+ * | AG number | block in AG (sb_agblklog) | inode in block (sb_inopblog) |
+ */
+static uint64_t xfs_ino_to_blkno(struct xfs_editor *xfs, uint64_t ino,
+				 uint32_t *ret_blkoffset)
+{
+	uint64_t agno = ino >> (xfs->agblklog + xfs->inopblog);
+	uint64_t agbno = (ino >> xfs->inopblog)
+			 & ((1ULL << xfs->agblklog) - 1);
+
+	*ret_blkoffset = (ino & ((1ULL << xfs->inopblog) - 1))
+			 * xfs->inode_size;
+	return agno * xfs->ag_blocks + agbno;
+}
+
+/* the same as the inode numbers, the AG number of the filesystem block
+ * numbers in the bmbt is saved in the high bits.
+ */
+static uint64_t xfs_fsb_to_blkno(struct xfs_editor *xfs, uint64_t fsb)
+{
+	uint64_t agno = fsb >> xfs->agblklog;
+
+	return agno * xfs->ag_blocks + (fsb & ((1ULL << xfs->agblklog) - 1));
+}
+
+static struct xfs_dinode *_xfs_alloc_read_inode(struct xfs_editor *xfs,
+						uint64_t ino,
+						uint64_t *ret_blkno,
 						uint32_t *ret_blkoffset)
 
 
 {
 	struct xfs_dsb *sb = xfs->ags[0].sb;
-	uint32_t blkno, blkoffset;
 	struct xfs_dinode *inode;
 	char reason[128] = { 0 };
+	uint32_t blkoffset;
+	uint64_t blkno;
 	int ret;
 
-	if (ino < (int)be64_to_cpu(sb->sb_rootino)) {
-		fprintf(stderr, "Error: read ino #%u failed"
-			" (less than root ino %u)\n",
-			ino, (unsigned int)be64_to_cpu(sb->sb_rootino));
+	if (ino < be64_to_cpu(sb->sb_rootino)) {
+		fprintf(stderr, "Error: read ino #%" PRIu64 " failed"
+			" (less than root ino %" PRIu64 ")\n",
+			ino, be64_to_cpu(sb->sb_rootino));
 
 		return NULL;
 	}
 
-	blkno = ino / xfs->inode_per_block;
-	blkoffset = (ino % xfs->inode_per_block) * xfs->inode_size;
+	blkno = xfs_ino_to_blkno(xfs, ino, &blkoffset);
 	if (ret_blkno)
 		*ret_blkno = blkno;
 	if (ret_blkoffset)
 		*ret_blkoffset = blkoffset;
 
-	fileseek(xfs->fd, blkno * xfs->block_size + blkoffset);
+	if (blkno >= be64_to_cpu(sb->sb_dblocks)) {
+		fprintf(stderr, "Error: ino #%" PRIu64 " is out of range\n",
+			ino);
+		return NULL;
+	}
+
 	inode = malloc(xfs->inode_size);
 	if (!inode)
 		return inode;
 
-	ret = fileread(xfs->fd, inode, xfs->inode_size);
+	ret = filepread(xfs->fd, inode, xfs->inode_size,
+			blkno * xfs->block_size + blkoffset);
 	if (ret < 0) {
 		snprintf(reason, sizeof(reason), "io fault");
 	} else if (be16_to_cpu(inode->di_magic) != XFS_DINODE_MAGIC) {
 		snprintf(reason, sizeof(reason), "bad magic 0x%08x",
 			 be16_to_cpu(inode->di_magic));
 		ret = -1;
-	} else if (be64_to_cpu(inode->di_ino) != (uint64_t)ino) {
-		snprintf(reason, sizeof(reason), "bad ino %u != %" PRIu64 ")",
-			ino, be64_to_cpu(inode->di_ino));
+	} else if (inode->di_version == 3
+		   && be64_to_cpu(inode->di_ino) != ino) {
+		snprintf(reason, sizeof(reason), "bad ino %" PRIu64
+			 " != %" PRIu64 ")", ino, be64_to_cpu(inode->di_ino));
 		ret = -1;
 	}
 
 	if (ret < 0) {
-		fprintf(stderr, "Error: read inode #%u from block %u+%u"
-				" failed (%s)\n",
+		fprintf(stderr, "Error: read inode #%" PRIu64 " from block %"
+				PRIu64 "+%u failed (%s)\n",
 				ino, blkno, blkoffset, reason);
 		free(inode);
 		return NULL;
@@ -838,6 +894,12 @@ static struct xfs_dinode *_xfs_alloc_read_inode(struct xfs_editor *xfs, int ino,
 	return inode;
 }
 
+static struct xfs_dinode *xfs_alloc_read_inode(struct xfs_editor *xfs,
+					       uint64_t ino)
+{
+	return _xfs_alloc_read_inode(xfs, ino, NULL, NULL);
+}
+
 struct xfs_structure {
 	const char				*name;
 	uint32_t				magic;
@@ -1043,14 +1105,16 @@ static void print_xfs_dir2_sf(struct xfs_editor *xfs,
 		entry_offset += sizeof(*entry);
 		entry_offset += entry->namelen;
 
-		ftype = ((const uint8_t *)buf)[entry_offset];
-		ft = ksmap_find(ftmaps, ftype);
-		if (ft)
-			printf(" %s", ft->str);
-		else
-			printf(" ftype=%u", ftype);
+		if (xfs->has_ftype) {
+			ftype = ((const uint8_t *)buf)[entry_offset];
+			ft = ksmap_find(ftmaps, ftype);
+			if (ft)
+				printf(" %s", ft->str);
+			else
+				printf(" ftype=%u", ftype);
 
-		entry_offset += sizeof(ftype);
+			entry_offset += sizeof(ftype);
+		}
 
 		printf(" and inode=#");
 		if (hdr->i8count) {
@@ -1500,23 +1564,24 @@ static int xfs_do_ag_cmd(void *private_data, int fd, int argc, char **argv)
 static int xfs_do_inode(void *private_data, int fd, int argc, char **argv)
 {
 	struct xfs_editor *xfs = private_data;
-	uint32_t blkno, blkoffset;
 	struct xfs_dinode *inode;
-	int ino = -1;
-
-	if (argc > 1)
-		ino = (int)strtol(argv[1], NULL, 0); /* auto detect dec or hex */
+	uint32_t blkoffset;
+	uint64_t blkno;
+	uint64_t ino;
 
-	if (ino < 0) {
+	if (argc < 2) {
 		fprintf(stderr, "Usage: xfs inode #ino\n");
 		return -1;
 	}
 
+	/* auto detect dec or hex */
+	ino = strtoull(argv[1], NULL, 0);
 	inode = _xfs_alloc_read_inode(xfs, ino, &blkno, &blkoffset);
 	if (!inode)
 		return -1;
 
-	printf("inode #%d location on blk #%u+%u\n", ino, blkno, blkoffset);
+	printf("inode #%" PRIu64 " location on blk #%" PRIu64 "+%u\n",
+	       ino, blkno, blkoffset);
 	print_xfs_dinode(xfs, inode, xfs->inode_size);
 	free(inode);
 
@@ -1539,12 +1604,158 @@ static int xfs_write_sparse_chunk(int fd_target,
 	return 0;
 }
 
+/* the free extents of an AG, collected by the worker threads */
+struct xfs_sparse_ag {
+	struct xfs_editor		*xfs;
+	uint32_t			ag_idx;
+
+	struct xfs_alloc_rec_incore {
+		uint32_t		start;
+		uint32_t		count;
+	}				*recs;
+	size_t				total;
+	size_t				maxsize;
+	uint64_t			freeblks;
+
+	/* one block for each level below the root, the interior nodes
+	 * are kept while their children are walked.
+	 */
+	void				*levels[XFS_BTREE_MAXLEVELS];
+};
+
+static int xfs_sparse_ag_add(struct xfs_sparse_ag *s, uint32_t start,
+			     uint32_t count)
+{
+	struct xfs_editor *xfs = s->xfs;
+
+	if (count == 0 || start >= xfs->ag_blocks
+	    || count > xfs->ag_blocks - start) {
+		fprintf(stderr, "Error: ag%u has bad free extent %u+%u\n",
+			s->ag_idx, start, count);
+		return -1;
+	}
+
+	if (s->total >= s->maxsize) {
+		size_t maxsize = s->maxsize ? s->maxsize * 2 : 256;
+		struct xfs_alloc_rec_incore *recs;
+
+		recs = realloc(s->recs, maxsize * sizeof(*recs));
+		if (!recs) {
+			fprintf(stderr, "Error: alloc %zu free extents failed\n",
+				maxsize);
+			return -1;
+		}
+
+		s->recs = recs;
+		s->maxsize = maxsize;
+	}
+
+	s->recs[s->total].start = start;
+	s->recs[s->total].count = count;
+	s->total++;
+	s->freeblks += count;
+
+	return 0;
+}
+
+/* walk the bnobt block @b and all of its children depth-first */
+static int xfs_sparse_walk_bnobt(struct xfs_sparse_ag *s,
+				 const struct xfs_btree_block *b, int level)
+{
+	struct xfs_editor *xfs = s->xfs;
+	size_t hdr_size = xfs->has_crc ? XFS_BTREE_SBLOCK_CRC_LEN
+				       : XFS_BTREE_SBLOCK_LEN;
+	uint32_t magic = xfs->has_crc ? XFS_ABTB_CRC_MAGIC : XFS_ABTB_MAGIC;
+	uint16_t numrecs = be16_to_cpu(b->bb_numrecs);
+	int ret = 0;
+
+	if (be32_to_cpu(b->bb_magic) != magic
+	    || be16_to_cpu(b->bb_level) != level) {
+		fprintf(stderr, "Error: ag%u bnobt block is bad (magic 0x%08x"
+			" level %d, expected level %d)\n", s->ag_idx,
+			be32_to_cpu(b->bb_magic), be16_to_cpu(b->bb_level),
+			level);
+		return -1;
+	}
+
+	if (level == 0) {
+		const struct xfs_alloc_rec *ar = (const void *)b + hdr_size;
+
+		if (numrecs > (xfs->block_size - hdr_size) / sizeof(*ar))
+			goto bad_numrecs;
+
+		for (uint16_t i = 0; i < numrecs && ret == 0; i++)
+			ret = xfs_sparse_ag_add(s,
+					be32_to_cpu(ar[i].ar_startblock),
+					be32_to_cpu(ar[i].ar_blockcount));
+	} else {
+		/* the pointers are placed after the max number of keys */
+		size_t maxrecs = (xfs->block_size - hdr_size) /
+			(sizeof(struct xfs_alloc_rec) + sizeof(__be32));
+		const __be32 *ptrs = (const void *)b + hdr_size
+			+ maxrecs * sizeof(struct xfs_alloc_rec);
+		void *child = s->levels[level - 1];
+		uint64_t blk_base = (uint64_t)s->ag_idx * xfs->ag_blocks;
+
+		if (numrecs > maxrecs)
+			goto bad_numrecs;
+
+		for (uint16_t i = 0; i < numrecs && ret == 0; i++) {
+			uint32_t agbno = be32_to_cpu(ptrs[i]);
+
+			if (agbno >= xfs->ag_blocks) {
+				fprintf(stderr, "Error: ag%u bnobt has bad"
+					" pointer %u\n", s->ag_idx, agbno);
+				return -1;
+			}
+
+			ret = xfs_read_blocks(xfs, blk_base + agbno, 1,
+					      child, xfs->block_size);
+			if (ret == 0)
+				ret = xfs_sparse_walk_bnobt(s, child,
+							    level - 1);
+		}
+	}
+
+	return ret;
+
+bad_numrecs:
+	fprintf(stderr, "Error: ag%u bnobt block has too many records %u\n",
+		s->ag_idx, numrecs);
+	return -1;
+}
+
+static int xfs_sparse_ag_work(void *arg)
+{
+	struct xfs_sparse_ag *s = arg;
+	struct xfs_editor *xfs = s->xfs;
+	struct xfs_ag *ag = &xfs->ags[s->ag_idx];
+	uint32_t levels = be32_to_cpu(ag->agf->agf_bno_level);
+
+	if (levels == 0 || levels > XFS_BTREE_MAXLEVELS) {
+		fprintf(stderr, "Error: ag%u has bad bnobt level %u\n",
+			s->ag_idx, levels);
+		return -1;
+	}
+
+	for (uint32_t i = 0; i + 1 < levels; i++) {
+		s->levels[i] = malloc(xfs->block_size);
+		if (!s->levels[i])
+			return -1;
+	}
+
+	/* the root is already loaded by xfs_load_ags */
+	return xfs_sparse_walk_bnobt(s, ag->bnobt, levels - 1);
+}
+
 static int xfs_do_sparse(void *private_data, int fd, int argc, char **argv)
 {
 	struct xfs_editor *xfs = private_data;
 	struct xfs_dsb *sb = xfs->ags[0].sb;
 	struct android_sparse_input input;
-	int ret = -1, fd_target;
+	struct xfs_sparse_ag *sags = NULL;
+	struct threadpool *tp = NULL;
+	int ret = -1, fd_target = -1;
 	struct bitmask *b = NULL;
 
 	if (argc < 2) {
@@ -1553,8 +1764,9 @@ static int xfs_do_sparse(void *private_data, int fd, int argc, char **argv)
 	}
 
 	b = alloc_bitmask(be64_to_cpu(sb->sb_dblocks));
-	if (!b)
-		return -1;
+	sags = calloc(xfs->ag_count, sizeof(*sags));
+	if (!b || !sags)
+		goto done;
 
 	fd_target = fileopen(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0664);
 	if (fd_target < 0)
@@ -1562,43 +1774,61 @@ static int xfs_do_sparse(void *private_data, int fd, int argc, char **argv)
 
 	android_sparse_init(&input, xfs->block_size, be64_to_cpu(sb->sb_dblocks));
 
+	/* the free space of each AG is independent, the bnobt of them are
+	 * walked in parallel.
+	 */
+	tp = alloc_threadpool(get_parallel_jobs(), 0);
+	if (!tp)
+		goto done;
+
+	ret = 0;
 	for (uint32_t ag_idx = 0; ag_idx < xfs->ag_count; ag_idx++) {
-		struct xfs_ag *ag = &xfs->ags[ag_idx];
-		struct xfs_agf *agf = ag->agf;
-		struct xfs_btree_block *bnobt = ag->bnobt;
-		const struct xfs_alloc_rec *ar;
-		uint32_t blk_base = ag_idx * xfs->ag_blocks;
-		uint32_t freeblks = 0;
+		struct xfs_sparse_ag *s = &sags[ag_idx];
+
+		s->xfs = xfs;
+		s->ag_idx = ag_idx;
 
 		/* xfs save unused blocks in bnobt */
-		if (!bnobt)
+		if (!xfs->ags[ag_idx].bnobt)
 			continue;
 
-		ar = xfs_btree_block_get_data(xfs, bnobt, xfs->block_size, NULL);
+		ret = threadpool_queue_work(tp, xfs_sparse_ag_work, s);
+		if (ret < 0)
+			break;
+	}
 
-		for (int i = 0; i < be16_to_cpu(bnobt->bb_numrecs); i++) {
-			uint32_t abs_blk = blk_base +
-					be32_to_cpu(ar[i].ar_startblock);
+	if (threadpool_wait(tp) < 0 || ret < 0) {
+		ret = -1;
+		goto done;
+	}
 
-			ret = bitmask_set_bits(b, abs_blk,
-					be32_to_cpu(ar[i].ar_blockcount));
+	for (uint32_t ag_idx = 0; ag_idx < xfs->ag_count; ag_idx++) {
+		struct xfs_sparse_ag *s = &sags[ag_idx];
+		struct xfs_agf *agf = xfs->ags[ag_idx].agf;
+		uint64_t blk_base = (uint64_t)ag_idx * xfs->ag_blocks;
+
+		if (!xfs->ags[ag_idx].bnobt)
+			continue;
+
+		for (size_t i = 0; i < s->total; i++) {
+			ret = bitmask_set_bits(b, blk_base + s->recs[i].start,
+					       s->recs[i].count);
 			if (ret < 0) {
 				fprintf(stderr, "Error: set bitmask based for "
 						"ag%u's dnobt failed\n",
 						ag_idx);
 				goto done;
 			}
-
-			freeblks += be32_to_cpu(ar[i].ar_blockcount);
 		}
 
 		if (get_verbose_level())
-			printf("AG%u has %u free blocks\n", ag_idx, freeblks);
+			printf("AG%u has %" PRIu64 " free blocks in %zu extents\n",
+			       ag_idx, s->freeblks, s->total);
 
-		if (agf && freeblks != be32_to_cpu(agf->agf_freeblks)) {
-			fprintf(stderr, "Error: we find %u freeblks on AG%u, "
-				"but agf mark it has %u freeblks\n",
-				freeblks, ag_idx,
+		if (agf && s->freeblks != be32_to_cpu(agf->agf_freeblks)) {
+			fprintf(stderr, "Error: we find %" PRIu64 " freeblks on"
+				" AG%u, but agf mark it has %u freeblks\n",
+				s->freeblks, ag_idx,
 				be32_to_cpu(agf->agf_freeblks));
 			ret = -1;
 			goto done;
@@ -1609,7 +1839,7 @@ static int xfs_do_sparse(void *private_data, int fd, int argc, char **argv)
 	bitmask_not(b);
 	bitmask_foreach_continue(it, b) {
 		if (get_verbose_level() > 0)
-			printf("add chunk block started at %u total %u\n",
+			printf("add chunk block started at %zd total %zu\n",
 				it.start, it.bits);
 
 		android_sparse_add_chunk(&input, it.start, it.bits);
@@ -1618,19 +1848,817 @@ static int xfs_do_sparse(void *private_data, int fd, int argc, char **argv)
 	if (input.error) {
 		fprintf(stderr, "Error: add sparse chunks failed. "
 				"(no enough memory?)\n");
+		ret = -1;
 		goto done;
 	}
 
 	ret = android_sparse_finish(&input, fd_target,
 				    xfs_write_sparse_chunk, xfs);
 done:
+	if (tp)
+		threadpool_free(tp);
+	if (sags) {
+		for (uint32_t i = 0; i < xfs->ag_count; i++) {
+			for (int level = 0; level < XFS_BTREE_MAXLEVELS; level++)
+				free(sags[i].levels[level]);
+			free(sags[i].recs);
+		}
+		free(sags);
+	}
 	if (b)
 		bitmask_free(b);
-	close(fd_target);
+	if (fd_target >= 0)
+		close(fd_target);
 	return ret;
 }
 #endif
 
+struct xfs_extent_list {
+	struct xfs_bmbt_irec		*extents;
+	size_t				total;
+	size_t				maxsize;
+};
+
+/* Return the data fork of @inode and save its size to @ret_size */
+static const void *xfs_inode_dfork(struct xfs_editor *xfs,
+				   const struct xfs_dinode *inode,
+				   size_t *ret_size)
+{
+	size_t offset = xfs_dinode_size(inode->di_version);
+	size_t size = xfs->inode_size - offset;
+
+	/* the attr fork starts at di_forkoff << 3 if it is not zero */
+	if (inode->di_forkoff && ((size_t)inode->di_forkoff << 3) < size)
+		size = (size_t)inode->di_forkoff << 3;
+
+	*ret_size = size;
+	return (const void *)inode + offset;
+}
+
+static uint64_t xfs_inode_nextents(const struct xfs_dinode *inode)
+{
+	if (inode->di_version == 3
+	    && (be64_to_cpu(inode->di_flags2) & XFS_DIFLAG2_NREXT64))
+		return be64_to_cpu(inode->di_big_nextents);
+
+	return be32_to_cpu(inode->di_nextents);
+}
+
+static int xfs_extent_list_add(struct xfs_extent_list *l,
+			       const struct xfs_bmbt_rec *rec)
+{
+	struct xfs_bmbt_irec irec;
+	struct xfs_bmbt_rec r;
+
+	/* the data fork of v2 inodes is not 64-bit aligned */
+	memcpy(&r, rec, sizeof(r));
+	xfs_bmbt_rec_unpack(&r, &irec);
+
+	/* the unwritten extents are read back as zero, keep them as holes */
+	if (irec.br_state || irec.br_blockcount == 0)
+		return 0;
+
+	if (l->total >= l->maxsize) {
+		size_t maxsize = l->maxsize ? l->maxsize * 2 : 64;
+		struct xfs_bmbt_irec *extents;
+
+		extents = realloc(l->extents, maxsize * sizeof(*extents));
+		if (!extents) {
+			fprintf(stderr, "Error: alloc %zu extents failed\n",
+				maxsize);
+			return -1;
+		}
+
+		l->extents = extents;
+		l->maxsize = maxsize;
+	}
+
+	l->extents[l->total++] = irec;
+	return 0;
+}
+
+/* walk the bmbt block @fsb and all of its children, the leaf records are
+ * appended to @l in the file offset order.
+ */
+static int xfs_bmbt_walk(struct xfs_editor *xfs, uint64_t fsb, int level,
+			 struct xfs_extent_list *l)
+{
+	size_t hdr_size = xfs->has_crc ? XFS_BTREE_LBLOCK_CRC_LEN
+				       : XFS_BTREE_LBLOCK_LEN;
+	uint32_t magic = xfs->has_crc ? XFS_BMAP_CRC_MAGIC : XFS_BMAP_MAGIC;
+	struct xfs_btree_block *b;
+	uint16_t numrecs;
+	int ret = -1;
+
+	b = xfs_alloc_read_blocks(xfs, xfs_fsb_to_blkno(xfs, fsb), 1);
+	if (!b)
+		return ret;
+
+	if (be32_to_cpu(b->bb_magic) != magic
+	    || be16_to_cpu(b->bb_level) != level) {
+		fprintf(stderr, "Error: bmbt block %" PRIu64 " is bad"
+			" (magic 0x%08x level %d, expected level %d)\n",
+			fsb, be32_to_cpu(b->bb_magic),
+			be16_to_cpu(b->bb_level), level);
+		goto done;
+	}
+
+	numrecs = be16_to_cpu(b->bb_numrecs);
+	if (level == 0) {
+		const struct xfs_bmbt_rec *recs = (const void *)b + hdr_size;
+
+		if (numrecs > (xfs->block_size - hdr_size) / sizeof(*recs)) {
+			fprintf(stderr, "Error: bmbt block %" PRIu64
+				" has too many records %u\n", fsb, numrecs);
+			goto done;
+		}
+
+		for (uint16_t i = 0; i < numrecs; i++) {
+			ret = xfs_extent_list_add(l, &recs[i]);
+			if (ret < 0)
+				goto done;
+		}
+	} else {
+		size_t maxrecs = (xfs->block_size - hdr_size) /
+			(sizeof(xfs_bmbt_key_t) + sizeof(xfs_bmbt_ptr_t));
+		const xfs_bmbt_ptr_t *ptrs = (const void *)b + hdr_size
+			+ maxrecs * sizeof(xfs_bmbt_key_t);
+
+		if (numrecs > maxrecs) {
+			fprintf(stderr, "Error: bmbt block %" PRIu64
+				" has too many keys %u\n", fsb, numrecs);
+			goto done;
+		}
+
+		for (uint16_t i = 0; i < numrecs; i++) {
+			ret = xfs_bmbt_walk(xfs, be64_to_cpu(ptrs[i]),
+					    level - 1, l);
+			if (ret < 0)
+				goto done;
+		}
+	}
+
+	ret = 0;
+done:
+	free(b);
+	return ret;
+}
+
+/* load all extents of the data fork in the file offset order */
+static int xfs_inode_read_extents(struct xfs_editor *xfs,
+				  const struct xfs_dinode *inode,
+				  uint64_t ino, struct xfs_extent_list *l)
+{
+	const struct xfs_bmdr_block *root;
+	const xfs_bmdr_ptr_t *ptrs;
+	uint16_t level, numrecs;
+	const void *fork;
+	size_t fork_size, maxrecs;
+	uint64_t nextents;
+	int ret = 0;
+
+	fork = xfs_inode_dfork(xfs, inode, &fork_size);
+
+	switch (inode->di_format) {
+	case XFS_DINODE_FMT_EXTENTS:
+		nextents = xfs_inode_nextents(inode);
+		if (nextents > fork_size / sizeof(struct xfs_bmbt_rec)) {
+			fprintf(stderr, "Error: inode #%" PRIu64 " has too many"
+				" extents %" PRIu64 "\n", ino, nextents);
+			return -1;
+		}
+
+		for (uint64_t i = 0; i < nextents && ret == 0; i++)
+			ret = xfs_extent_list_add(l,
+				(const struct xfs_bmbt_rec *)fork + i);
+		break;
+	case XFS_DINODE_FMT_BTREE:
+		/* the root of bmbt is saved in the data fork, its pointers
+		 * are placed after the max number of keys.
+		 */
+		root = fork;
+		level = be16_to_cpu(root->bb_level);
+		numrecs = be16_to_cpu(root->bb_numrecs);
+		maxrecs = (fork_size - sizeof(*root)) /
+			(sizeof(xfs_bmdr_key_t) + sizeof(xfs_bmdr_ptr_t));
+		ptrs = fork + sizeof(*root) + maxrecs * sizeof(xfs_bmdr_key_t);
+
+		if (level == 0 || level > XFS_BTREE_MAXLEVELS
+		    || numrecs > maxrecs) {
+			fprintf(stderr, "Error: inode #%" PRIu64 " has bad bmbt"
+				" root (level %u, %u records)\n",
+				ino, level, numrecs);
+			return -1;
+		}
+
+		for (uint16_t i = 0; i < numrecs && ret == 0; i++) {
+			xfs_bmdr_ptr_t ptr;
+
+			/* the pointers in the inode are not 64-bit aligned */
+			memcpy(&ptr, &ptrs[i], sizeof(ptr));
+			ret = xfs_bmbt_walk(xfs, be64_to_cpu(ptr),
+					    level - 1, l);
+		}
+		break;
+	default:
+		fprintf(stderr, "Error: inode #%" PRIu64 " has no extents"
+			" (format %d)\n", ino, inode->di_format);
+		return -1;
+	}
+
+	return ret;
+}
+
+static const struct xfs_bmbt_irec *
+	xfs_extent_list_find(const struct xfs_extent_list *l, uint64_t fofs)
+{
+	size_t lo = 0, hi = l->total;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct xfs_bmbt_irec *e = &l->extents[mid];
+
+		if (fofs < e->br_startoff)
+			hi = mid;
+		else if (fofs >= e->br_startoff + e->br_blockcount)
+			lo = mid + 1;
+		else
+			return e;
+	}
+
+	return NULL;
+}
+
+/* a directory block is sb_dirblklog filesystem blocks, it maybe saved in
+ * more than one extent.
+ */
+static int xfs_read_dir_block(struct xfs_editor *xfs,
+			      const struct xfs_extent_list *l,
+			      uint64_t fofs, void *buf)
+{
+	uint32_t fsbs = xfs->dir_block_size / xfs->block_size;
+
+	for (uint32_t i = 0; i < fsbs; ) {
+		const struct xfs_bmbt_irec *e;
+		uint64_t skip, n;
+		int ret;
+
+		e = xfs_extent_list_find(l, fofs + i);
+		if (!e) {
+			fprintf(stderr, "Error: directory block %" PRIu64
+				" has a hole\n", fofs);
+			return -1;
+		}
+
+		skip = fofs + i - e->br_startoff;
+		n = e->br_blockcount - skip;
+		if (n > fsbs - i)
+			n = fsbs - i;
+
+		ret = xfs_read_blocks(xfs,
+			xfs_fsb_to_blkno(xfs, e->br_startblock + skip), n,
+			buf + (size_t)i * xfs->block_size,
+			(size_t)n * xfs->block_size);
+		if (ret < 0)
+			return ret;
+
+		i += n;
+	}
+
+	return 0;
+}
+
+typedef int (*xfs_dirent_callback_t)(struct xfs_editor *xfs, uint64_t ino,
+				     const char *name, void *arg);
+
+static int xfs_dirent_call(struct xfs_editor *xfs, uint64_t ino,
+			   const uint8_t *name, int namelen,
+			   xfs_dirent_callback_t callback, void *arg)
+{
+	char filename[256];
+
+	/* skip '.' and '..' */
+	if (namelen == 1 && name[0] == '.')
+		return 0;
+	if (namelen == 2 && name[0] == '.' && name[1] == '.')
+		return 0;
+
+	snprintf(filename, sizeof(filename), "%.*s", namelen, name);
+	if (strchr(filename, '/') || strlen(filename) != (size_t)namelen) {
+		fprintf(stderr, "Error: bad filename %s\n", filename);
+		return -1;
+	}
+
+	return callback(xfs, ino, filename, arg);
+}
+
+/* 18.3.2 shortform directories, the entries are saved in the data fork */
+static int xfs_foreach_sf_dirent(struct xfs_editor *xfs,
+				 const struct xfs_dinode *inode, uint64_t ino,
+				 xfs_dirent_callback_t callback, void *arg)
+{
+	const struct xfs_dir2_sf_hdr *hdr;
+	size_t fork_size, offset, ino_size;
+	const void *fork;
+
+	fork = xfs_inode_dfork(xfs, inode, &fork_size);
+	hdr = fork;
+	ino_size = hdr->i8count ? XFS_INO64_SIZE : XFS_INO32_SIZE;
+	offset = xfs_dir2_sf_hdr_size(hdr->i8count);
+
+	for (int i = 0; i < hdr->count; i++) {
+		const struct xfs_dir2_sf_entry *entry = fork + offset;
+		const uint8_t *p;
+		uint64_t child = 0;
+		int ret;
+
+		if (offset + sizeof(*entry) > fork_size
+		    || offset + sizeof(*entry) + entry->namelen
+		       + xfs->has_ftype + ino_size > fork_size) {
+			fprintf(stderr, "Error: shortform directory #%" PRIu64
+				" is corrupted\n", ino);
+			return -1;
+		}
+
+		/* [ftype] and the big endian inode number after the name */
+		p = entry->name + entry->namelen + xfs->has_ftype;
+		for (size_t n = 0; n < ino_size; n++)
+			child = (child << 8) | p[n];
+
+		ret = xfs_dirent_call(xfs, child, entry->name, entry->namelen,
+				      callback, arg);
+		if (ret < 0)
+			return ret;
+
+		offset = p + ino_size - (const uint8_t *)fork;
+	}
+
+	return 0;
+}
+
+/* the entries of a block or data directory block */
+static int xfs_foreach_data_dirent(struct xfs_editor *xfs, const void *buf,
+				   uint64_t ino, uint64_t fofs,
+				   xfs_dirent_callback_t callback, void *arg)
+{
+	uint32_t magic = be32_to_cpu(*(const __be32 *)buf);
+	size_t end = xfs->dir_block_size, hdr_size;
+	const xfs_dir2_block_tail_t *tail;
+	uint64_t leaf_bytes;
+
+	switch (magic) {
+	case XFS_DIR2_BLOCK_MAGIC:
+	case XFS_DIR3_BLOCK_MAGIC:
+		/* the leaf entries and tail are saved at the end of block */
+		tail = buf + end - sizeof(*tail);
+		leaf_bytes = sizeof(*tail) + (uint64_t)be32_to_cpu(tail->count)
+			     * sizeof(xfs_dir2_leaf_entry_t);
+		if (leaf_bytes > end) {
+			fprintf(stderr, "Error: directory #%" PRIu64 " block %"
+				PRIu64 " has bad tail\n", ino, fofs);
+			return -1;
+		}
+		end -= leaf_bytes;
+		break;
+	case XFS_DIR2_DATA_MAGIC:
+	case XFS_DIR3_DATA_MAGIC:
+		break;
+	default:
+		fprintf(stderr, "Error: directory #%" PRIu64 " block %" PRIu64
+			" has bad magic 0x%08x\n", ino, fofs, magic);
+		return -1;
+	}
+
+	if (magic == XFS_DIR3_BLOCK_MAGIC || magic == XFS_DIR3_DATA_MAGIC)
+		hdr_size = sizeof(struct xfs_dir3_data_hdr);
+	else
+		hdr_size = sizeof(struct xfs_dir2_data_hdr);
+
+	for (size_t offset = hdr_size; offset < end; ) {
+		const xfs_dir2_data_unused_t *dup = buf + offset;
+		const xfs_dir2_data_entry_t *dep = buf + offset;
+		size_t entsize;
+		int ret;
+
+		if (offset + sizeof(*dup) > end)
+			goto corrupted;
+
+		if (be16_to_cpu(dup->freetag) == XFS_DIR2_DATA_FREE_TAG) {
+			entsize = be16_to_cpu(dup->length);
+			if (entsize == 0 || entsize % XFS_DIR2_DATA_ALIGN
+			    || offset + entsize > end)
+				goto corrupted;
+
+			offset += entsize;
+			continue;
+		}
+
+		/* inumber, namelen, name, [ftype] and a 2 bytes tag */
+		entsize = offsetof(xfs_dir2_data_entry_t, name) + dep->namelen
+			  + xfs->has_ftype + sizeof(__be16);
+		entsize = aligned_length(entsize, XFS_DIR2_DATA_ALIGN);
+		if (offset + entsize > end)
+			goto corrupted;
+
+		ret = xfs_dirent_call(xfs, be64_to_cpu(dep->inumber),
+				      dep->name, dep->namelen,
+				      callback, arg);
+		if (ret < 0)
+			return ret;
+
+		offset += entsize;
+	}
+
+	return 0;
+
+corrupted:
+	fprintf(stderr, "Error: directory #%" PRIu64 " block %" PRIu64
+		" is corrupted\n", ino, fofs);
+	return -1;
+}
+
+/* Call @callback for each entry of the directory @ino except '.' and '..'.
+ *
+ * The entries of block, leaf and node directories are all saved in the
+ * data blocks below XFS_DIR2_LEAF_OFFSET, the leaf and freeindex blocks
+ * are only the indexes of them and not used here.
+ */
+static int xfs_foreach_dirent(struct xfs_editor *xfs,
+			      const struct xfs_dinode *inode, uint64_t ino,
+			      xfs_dirent_callback_t callback, void *arg)
+{
+	uint64_t leaf_fofs = XFS_DIR2_LEAF_OFFSET / xfs->block_size;
+	uint32_t fsbs = xfs->dir_block_size / xfs->block_size;
+	struct xfs_extent_list l = { .extents = NULL };
+	uint64_t next_fofs = 0;
+	void *buf = NULL;
+	int ret;
+
+	if (inode->di_format == XFS_DINODE_FMT_LOCAL)
+		return xfs_foreach_sf_dirent(xfs, inode, ino, callback, arg);
+
+	ret = xfs_inode_read_extents(xfs, inode, ino, &l);
+	if (ret < 0)
+		goto done;
+
+	buf = malloc(xfs->dir_block_size);
+	if (!buf) {
+		ret = -1;
+		goto done;
+	}
+
+	for (size_t i = 0; i < l.total && ret == 0; i++) {
+		const struct xfs_bmbt_irec *e = &l.extents[i];
+		uint64_t end = e->br_startoff + e->br_blockcount;
+		uint64_t fofs = aligned_length(e->br_startoff, fsbs);
+
+		/* the directory block started in the previous extent */
+		if (fofs < next_fofs)
+			fofs = next_fofs;
+
+		for (; fofs < end && fofs < leaf_fofs; fofs += fsbs) {
+			ret = xfs_read_dir_block(xfs, &l, fofs, buf);
+			if (ret < 0)
+				break;
+
+			ret = xfs_foreach_data_dirent(xfs, buf, ino, fofs,
+						      callback, arg);
+			if (ret < 0)
+				break;
+		}
+
+		next_fofs = fofs;
+	}
+
+done:
+	free(buf);
+	free(l.extents);
+	return ret;
+}
+
+#define XFS_UNPACK_MAX_DEPTH		1024
+
+struct xfs_unpack_context {
+	struct threadpool		*tp;
+	int				dirfd;
+	int				depth;
+};
+
+struct xfs_unpack_work {
+	struct xfs_editor		*xfs;
+	struct xfs_dinode		*inode;
+	uint64_t			ino;
+	int				fd;
+};
+
+static int unpack_reg_file_work(void *arg)
+{
+	struct xfs_unpack_work *w = arg;
+	struct xfs_editor *xfs = w->xfs;
+	struct xfs_extent_list l = { .extents = NULL };
+	uint64_t total_size = be64_to_cpu(w->inode->di_size);
+	int ret = -1;
+
+	if (w->inode->di_format == XFS_DINODE_FMT_LOCAL) {
+		size_t fork_size;
+		const void *fork = xfs_inode_dfork(xfs, w->inode, &fork_size);
+
+		if (total_size > fork_size) {
+			fprintf(stderr, "Error: inode #%" PRIu64 " has %" PRIu64
+				" bytes local data, but only %zu bytes can be"
+				" read\n", w->ino, total_size, fork_size);
+			goto done;
+		}
+
+		if (pwrite(w->fd, fork, total_size, 0) != (ssize_t)total_size)
+			goto done;
+
+		ret = 0;
+		goto done;
+	}
+
+	ret = xfs_inode_read_extents(xfs, w->inode, w->ino, &l);
+	if (ret < 0)
+		goto done;
+
+	/* copy each extent by large positional reads, the holes between
+	 * them are skipped and left unallocated in the output file.
+	 */
+	for (size_t i = 0; i < l.total; i++) {
+		const struct xfs_bmbt_irec *e = &l.extents[i];
+		uint64_t offset = e->br_startoff * xfs->block_size;
+		uint64_t sz = (uint64_t)e->br_blockcount * xfs->block_size;
+
+		if (offset >= total_size)
+			break;
+		if (sz > total_size - offset)
+			sz = total_size - offset;
+
+		if (pdd64(xfs->fd, w->fd,
+			  xfs_fsb_to_blkno(xfs, e->br_startblock)
+			  * xfs->block_size,
+			  offset, sz) != sz) {
+			fprintf(stderr, "Error: copy %" PRIu64 " bytes of inode"
+				" #%" PRIu64 " failed\n", sz, w->ino);
+			ret = -1;
+			goto done;
+		}
+	}
+
+	/* the unallocated blocks are holes */
+	ret = ftruncate(w->fd, total_size);
+
+done:
+	close(w->fd);
+	free(l.extents);
+	free(w->inode);
+	free(w);
+
+	return ret;
+}
+
+static int unpack_reg_file(struct xfs_editor *xfs,
+			   struct xfs_unpack_context *ctx, uint64_t ino,
+			   struct xfs_dinode *inode, const char *filename)
+{
+	struct xfs_unpack_work *w;
+	int fd, ret;
+
+	fd = openat(ctx->dirfd, filename, O_CREAT | O_WRONLY | O_TRUNC,
+		    be16_to_cpu(inode->di_mode) & ~S_IFMT);
+	if (fd < 0) {
+		fprintf(stderr, "Error: open %s failed(%m)\n", filename);
+		free(inode);
+		return fd;
+	}
+
+	if (be64_to_cpu(inode->di_size) == 0) {
+		close(fd);
+		free(inode);
+		return 0;
+	}
+
+	/* the file data is copied by the worker threads */
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		close(fd);
+		free(inode);
+		return -1;
+	}
+
+	w->xfs = xfs;
+	w->inode = inode;
+	w->ino = ino;
+	w->fd = fd;
+
+	ret = threadpool_queue_work(ctx->tp, unpack_reg_file_work, w);
+	if (ret < 0) {
+		close(fd);
+		free(inode);
+		free(w);
+	}
+
+	return ret;
+}
+
+/* 18.3.3 symbolic links, the target is saved in the data fork or in the
+ * remote blocks which have a header on the CRC enabled filesystems.
+ */
+static int unpack_symlink(struct xfs_editor *xfs,
+			  struct xfs_unpack_context *ctx, uint64_t ino,
+			  const struct xfs_dinode *inode, const char *filename)
+{
+	uint64_t total_size = be64_to_cpu(inode->di_size);
+	struct xfs_extent_list l = { .extents = NULL };
+	char target[XFS_SYMLINK_MAXLEN + 1];
+	void *blkbuf = NULL;
+	size_t copied = 0;
+	int ret = -1;
+
+	if (total_size == 0 || total_size > XFS_SYMLINK_MAXLEN) {
+		fprintf(stderr, "Error: symlink #%" PRIu64 " has bad size %"
+			PRIu64 "\n", ino, total_size);
+		return ret;
+	}
+
+	if (inode->di_format == XFS_DINODE_FMT_LOCAL) {
+		size_t fork_size;
+		const void *fork = xfs_inode_dfork(xfs, inode, &fork_size);
+
+		if (total_size > fork_size) {
+			fprintf(stderr, "Error: symlink #%" PRIu64 " is larger"
+				" than the data fork\n", ino);
+			return ret;
+		}
+
+		memcpy(target, fork, total_size);
+		copied = total_size;
+		goto create;
+	}
+
+	blkbuf = malloc(xfs->block_size);
+	if (!blkbuf)
+		return ret;
+
+	ret = xfs_inode_read_extents(xfs, inode, ino, &l);
+	if (ret < 0)
+		goto done;
+
+	for (size_t i = 0; i < l.total && copied < total_size; i++) {
+		const struct xfs_bmbt_irec *e = &l.extents[i];
+
+		for (uint32_t blk = 0; blk < e->br_blockcount
+				       && copied < total_size; blk++) {
+			const struct xfs_dsymlink_hdr *hdr = blkbuf;
+			const void *data = blkbuf;
+			size_t n = xfs->block_size;
+
+			ret = xfs_read_blocks(xfs,
+				xfs_fsb_to_blkno(xfs, e->br_startblock + blk),
+				1, blkbuf, xfs->block_size);
+			if (ret < 0)
+				goto done;
+
+			if (xfs->has_crc
+			    && be32_to_cpu(hdr->sl_magic) != XFS_SYMLINK_MAGIC) {
+				fprintf(stderr, "Error: symlink #%" PRIu64
+					" has bad remote block\n", ino);
+				ret = -1;
+				goto done;
+			} else if (xfs->has_crc) {
+				data += sizeof(*hdr);
+				n -= sizeof(*hdr);
+			}
+
+			if (n > total_size - copied)
+				n = total_size - copied;
+
+			memcpy(target + copied, data, n);
+			copied += n;
+		}
+	}
+
+	if (copied != total_size) {
+		fprintf(stderr, "Error: symlink #%" PRIu64 " is incomplete\n",
+			ino);
+		ret = -1;
+		goto done;
+	}
+
+create:
+	target[copied] = '\0';
+	unlinkat(ctx->dirfd, filename, 0);
+	ret = symlinkat(target, ctx->dirfd, filename);
+	if (ret < 0)
+		fprintf(stderr, "Error: create symlink %s failed(%m)\n",
+			filename);
+
+done:
+	free(blkbuf);
+	free(l.extents);
+	return ret;
+}
+
+static int unpack_dir(struct xfs_editor *xfs, struct xfs_unpack_context *ctx,
+		      uint64_t ino, const struct xfs_dinode *inode,
+		      const char *filename);
+
+static int unpack_dirent_callback(struct xfs_editor *xfs, uint64_t ino,
+				  const char *filename, void *arg)
+{
+	struct xfs_unpack_context *ctx = arg;
+	struct xfs_dinode *inode;
+	int ret = 0;
+
+	inode = xfs_alloc_read_inode(xfs, ino);
+	if (!inode)
+		return -1;
+
+	/* the file type in the dirent is optional, use the inode mode */
+	switch (be16_to_cpu(inode->di_mode) & S_IFMT) {
+	case S_IFREG:
+		/* the inode is owned by the unpack work */
+		return unpack_reg_file(xfs, ctx, ino, inode, filename);
+	case S_IFDIR:
+		ret = unpack_dir(xfs, ctx, ino, inode, filename);
+		break;
+	case S_IFLNK:
+		ret = unpack_symlink(xfs, ctx, ino, inode, filename);
+		break;
+	default:
+		printf("Warning: ignore %s(ino #%" PRIu64 "): "
+			"file mode 0%o is not impl now\n",
+			filename, ino, be16_to_cpu(inode->di_mode));
+		break;
+	}
+
+	free(inode);
+	return ret;
+}
+
+static int unpack_dir(struct xfs_editor *xfs, struct xfs_unpack_context *ctx,
+		      uint64_t ino, const struct xfs_dinode *inode,
+		      const char *filename)
+{
+	struct xfs_unpack_context child = *ctx;
+	int mode = be16_to_cpu(inode->di_mode) & ~S_IFMT;
+	int ret;
+
+	if (ctx->depth + 1 > XFS_UNPACK_MAX_DEPTH) {
+		fprintf(stderr, "Error: directory %s is too deep\n", filename);
+		return -1;
+	}
+
+	ret = mkdirat(ctx->dirfd, filename, mode);
+	if (ret < 0 && errno != EEXIST) {
+		fprintf(stderr, "Error: create dir %s with mode %o failed: %m\n",
+			filename, mode);
+		return ret;
+	}
+
+	child.dirfd = openat(ctx->dirfd, filename, O_RDONLY | O_DIRECTORY);
+	if (child.dirfd < 0) {
+		fprintf(stderr, "Error: open dir %s failed(%m)\n", filename);
+		return child.dirfd;
+	}
+	child.depth++;
+
+	ret = xfs_foreach_dirent(xfs, inode, ino, unpack_dirent_callback,
+				 &child);
+	close(child.dirfd);
+
+	return ret;
+}
+
+static int xfs_unpack(void *private_data, int fd, const char *dirout,
+		      int argc, char **argv)
+{
+	struct xfs_editor *xfs = private_data;
+	uint64_t rootino = be64_to_cpu(xfs->ags[0].sb->sb_rootino);
+	struct xfs_unpack_context ctx = { .dirfd = AT_FDCWD };
+	struct xfs_dinode *root;
+	int ret = -1, ret_wait;
+
+	root = xfs_alloc_read_inode(xfs, rootino);
+	if (!root)
+		return ret;
+
+	ctx.tp = alloc_threadpool(get_parallel_jobs(), 0);
+	if (!ctx.tp)
+		goto done;
+
+	ret = unpack_dir(xfs, &ctx, rootino, root, dirout);
+	ret_wait = threadpool_wait(ctx.tp);
+	if (ret == 0)
+		ret = ret_wait;
+
+	threadpool_free(ctx.tp);
+
+done:
+	free(root);
+	return ret;
+}
+
 static int xfs_list_main(void *private_data, int fd, int argc, char **argv)
 {
 	if (argc >= 1) {
@@ -1680,5 +2708,6 @@ static struct imgeditor xfs_editor = {
 	.exit			= xfs_editor_exit,
 	.detect			= xfs_detect,
 	.list			= xfs_list_main,
+	.unpack			= xfs_unpack,
 };
 REGISTER_IMGEDITOR(xfs_editor);
@@ -693,6 +693,24 @@ typedef struct xfs_bmbt_rec {
 #define XFS_BMAP_MAGIC		0x424d4150	/* 'BMAP' */
 #define XFS_BMAP_CRC_MAGIC	0x424d4133	/* 'BMA3' */
 
+/*
+ * Bmap root header, on-disk form only.
+ */
+typedef struct xfs_bmdr_block {
+	__be16		bb_level;	/* 0 is a leaf */
+	__be16		bb_numrecs;	/* current # of data records */
+} xfs_bmdr_block_t;
+
+/*
+ * Key structure for non-leaf levels of the tree.
+ */
+typedef struct xfs_bmbt_key {
+	__be64		br_startoff;	/* starting file offset */
+} xfs_bmbt_key_t, xfs_bmdr_key_t;
+
+/* btree pointer type */
+typedef __be64 xfs_bmbt_ptr_t, xfs_bmdr_ptr_t;
+
 /*
  * Generic Btree block format definitions
  *
@@ -742,4 +760,42 @@ struct xfs_btree_block {
 	} bb_u;				/* rest */
 };
 
+/* the max levels of the btrees, the same as the old kernel's definition */
+#define XFS_BTREE_MAXLEVELS	9
+
+/* size of a short form block */
+#define XFS_BTREE_SBLOCK_LEN \
+	(offsetof(struct xfs_btree_block, bb_u) + \
+	 offsetof(struct xfs_btree_block_shdr, bb_blkno))
+/* size of a long form block */
+#define XFS_BTREE_LBLOCK_LEN \
+	(offsetof(struct xfs_btree_block, bb_u) + \
+	 offsetof(struct xfs_btree_block_lhdr, bb_blkno))
+
+/* sizes of CRC enabled btree blocks */
+#define XFS_BTREE_SBLOCK_CRC_LEN \
+	(offsetof(struct xfs_btree_block, bb_u) + \
+	 sizeof(struct xfs_btree_block_shdr))
+#define XFS_BTREE_LBLOCK_CRC_LEN \
+	(offsetof(struct xfs_btree_block, bb_u) + \
+	 sizeof(struct xfs_btree_block_lhdr))
+
+/*
+ * Symlink remote blocks, the header is only present on CRC enabled
+ * filesystems.
+ */
+#define XFS_SYMLINK_MAGIC	0x58534c4d	/* 'XSLM' */
+#define XFS_SYMLINK_MAXLEN	1024
+
+struct xfs_dsymlink_hdr {
+	__be32		sl_magic;
+	__be32		sl_offset;
+	__be32		sl_bytes;
+	__be32		sl_crc;
+	uuid_t		sl_uuid;
+	__be64		sl_owner;
+	__be64		sl_blkno;
+	__be64		sl_lsn;
+};
+
 #endif
@@ -120,6 +120,38 @@ int imgeditor_in_search_mode(void)
 	return imgeditor_get_gd()->search_mode;
 }
 
+int get_parallel_jobs(void)
+{
+	int jobs = imgeditor_get_gd()->jobs;
+
+	if (jobs <= 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		jobs = n > 0 ? (int)n : 1;
+	}
+
+	return jobs;
+}
+
+#define IMGEDITOR_DEFAULT_CACHE_SIZE_MB		64
+
+size_t get_cache_size_limit(void)
+{
+	unsigned long mb = imgeditor_get_gd()->cache_size;
+
+	if (mb == 0)
+		mb = IMGEDITOR_DEFAULT_CACHE_SIZE_MB;
+
+	return (size_t)mb << 20;
+}
+
+const char *get_metadata_snapshot(void)
+{
+	const char *snapshot = imgeditor_get_gd()->snapshot;
+
+	return snapshot[0] ? snapshot : NULL;
+}
+
 void gd_export_imgeditor(struct imgeditor *imgeditor)
 {
 	struct global_data *gd = imgeditor_get_gd();
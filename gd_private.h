@@ -35,6 +35,15 @@ struct global_data {
 	struct virtual_file		vfps[MAX_VIRTUAL_FILE];
 
 	int				search_mode;
+
+	/* the number of worker threads, zero means auto detect */
+	int				jobs;
+
+	/* the memory limit of the metadata caches in MiB, zero means default */
+	unsigned long			cache_size;
+
+	/* the file that saves the parsed metadata, empty if not used */
+	char				snapshot[1024];
 };
 
 struct global_data *imgeditor_get_gd(void);
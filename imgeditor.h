@@ -21,6 +21,11 @@ int virtual_file_close(int fd);
 
 int get_verbose_level(void);
 int imgeditor_in_search_mode(void);
+int get_parallel_jobs(void);
+/* the memory limit of the metadata caches in bytes */
+size_t get_cache_size_limit(void);
+/* the path of the metadata snapshot file, NULL if it is not used */
+const char *get_metadata_snapshot(void);
 
 #define SIZE_KB(x)				((x) << 10)
 #define SIZE_MB(x)				((x) << 20)
@@ -56,6 +61,8 @@ off64_t filestart(int fd);
 off64_t fileseek(int fd, off64_t offset);
 /* Return zero on successful */
 int fileread(int fd, void *buf, size_t sz);
+/* Positional read, the file offset is not changed. Return zero on successful */
+int filepread(int fd, void *buf, size_t sz, off64_t offset);
 
 void hexdump(const void *buf, size_t bufsz, unsigned long baseaddr);
 
@@ -176,6 +183,13 @@ uint64_t dd64(int fdsrc, int fddst, off64_t offt_src, off64_t offt_dst, uint64_t
 	      void (*bufscan)(uint8_t *buf, size_t sz_buster, void *p),
 	      void *private_data);
 
+/* the same as dd64 but using copy_file_range or pread/pwrite, it doesn't
+ * touch the file offset and can be called from multiple threads on the
+ * same fd.
+ */
+uint64_t pdd64(int fdsrc, int fddst, off64_t offt_src, off64_t offt_dst,
+	       uint64_t sz);
+
 void hexdump(const void *buf, size_t sz, unsigned long baseaddr);
 void hexdump_indent(const char *indent_fmt, const void *buf, size_t sz,
 		    unsigned long baseaddr);
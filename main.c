@@ -597,6 +597,9 @@ static void usage(void)
 	fprintf(stderr, "   --type type         select the image type\n");
 	fprintf(stderr, "-s --search            search supported images\n");
 	fprintf(stderr, "-v --verbose:          set the verbose mode\n");
+	fprintf(stderr, "-j --jobs N            use N worker threads when unpacking. Default is the cpu number\n");
+	fprintf(stderr, "   --cache-size MiB    set the memory limit of the metadata caches. Default is 64\n");
+	fprintf(stderr, "   --snapshot file     save the parsed metadata to file and reuse it in the next time\n");
 	fprintf(stderr, "   --plugin path       set the plugin library's path. Default %s\n", CONFIG_IMGEDITOR_PLUGIN_PATH);
 	fprintf(stderr, "   --list-plugin       show all registed plugins\n");
 	fprintf(stderr, "   --disable-plugin    disable all plugins\n");
@@ -620,6 +623,8 @@ enum {
 	ARG_PLUGIN,
 	ARG_DISABLE_PLUGIN,
 	ARG_VERSION,
+	ARG_CACHE_SIZE,
+	ARG_SNAPSHOT,
 
 	ACTION_LIST_PLUGIN,
 	ACTION_MAIN,
@@ -630,6 +635,7 @@ enum {
 	ACTION_PEEK,
 
 	ACTION_SEARCH = 's',
+	ARG_JOBS = 'j',
 
 	ACTION_LIST = 'l',
 	ACTION_HELP = 'h',
@@ -649,6 +655,9 @@ static struct option imgeditor_options[] = {
 	{ "peek",		required_argument,	NULL,	ACTION_PEEK	},
 	{ "search",		no_argument,		NULL,	ACTION_SEARCH	},
 	{ "verbose",		no_argument,		NULL,	ARG_VERBOSE	},
+	{ "jobs",		required_argument,	NULL,	ARG_JOBS	},
+	{ "cache-size",		required_argument,	NULL,	ARG_CACHE_SIZE	},
+	{ "snapshot",		required_argument,	NULL,	ARG_SNAPSHOT	},
 	{ "help",		no_argument,		NULL,	ACTION_HELP	},
 	{ "version",		no_argument,		NULL,	ARG_VERSION	},
 	{ NULL,			0,			NULL,	0		},
@@ -719,7 +728,7 @@ int main(int argc, char *argv[])
 	const char *plugin_path = CONFIG_IMGEDITOR_PLUGIN_PATH;
 	char tmpbuf[1024];
 	unsigned long long offset = 0;
-	unsigned long offset_sector = 0, sector_size = 512;
+	unsigned long offset_sector = 0, sector_size = 512, jobs = 0;
 	int main_argc = 0, sub_argc = argc;
 	int search_mode = 0, action = ACTION_LIST; /* default action */
 	int disable_plugin = 0;
@@ -746,7 +755,7 @@ int main(int argc, char *argv[])
 		int option_index = 0;
 		int c;
 
-		c = getopt_long(main_argc, argv, "hvs", imgeditor_options, &option_index);
+		c = getopt_long(main_argc, argv, "hvsj:", imgeditor_options, &option_index);
 		if (c == -1)
 			break;
 
@@ -773,6 +782,24 @@ int main(int argc, char *argv[])
 		case ARG_VERBOSE:
 			gd->verbose_level++;
 			break;
+		case ARG_JOBS:
+			ret = arg_to_ul("--jobs", optarg, &jobs);
+			if (ret < 0)
+				return ret;
+			gd->jobs = (int)jobs;
+			break;
+		case ARG_CACHE_SIZE:
+			ret = arg_to_ul("--cache-size", optarg, &gd->cache_size);
+			if (ret < 0)
+				return ret;
+			break;
+		case ARG_SNAPSHOT:
+			if (strlen(optarg) >= sizeof(gd->snapshot)) {
+				fprintf(stderr, "Error: snapshot path is too long\n");
+				return -1;
+			}
+			strcpy(gd->snapshot, optarg);
+			break;
 		case ARG_PLUGIN:
 			plugin_path = optarg;
 			break;
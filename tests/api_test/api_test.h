@@ -52,5 +52,6 @@ void xopt_test();
 void crc_test();
 void hash_compatible_test();
 void bitmask_test();
+void threadpool_test();
 
 #endif
@@ -6,6 +6,7 @@ void bitmask_test(void)
 	struct bitmask *b = alloc_bitmask(511);
 	int continue_count = 0;
 	int count_one = 0;
+	uint8_t lsb[4];
 
 	assert_inteq((int)b->bufsize, 512 / 8);
 
@@ -49,39 +50,39 @@ void bitmask_test(void)
 	/* bit index  0  1  2  3  4  5  6 ... 30 31 32 33 ... 500
 	 * bit value  0  1  0  1  0  1  0 ...  0  1  1  0 ... 1
 	 */
-	assert_inteq(bitmask_next_zero(b, 0), 0);
-	assert_inteq(bitmask_next_zero(b, 1), 2);
-	assert_inteq(bitmask_next_zero(b, 3), 4);
-	assert_inteq(bitmask_next_zero(b, 31), 33);
-
-	assert_inteq(bitmask_next_one(b, 0), 1);
-	assert_inteq(bitmask_next_one(b, 2), 3);
-	assert_inteq(bitmask_next_one(b, 6), 31);
-	assert_inteq(bitmask_next_one(b, 32), 32);
-	assert_inteq(bitmask_next_one(b, 33), 500);
-	assert_inteq(bitmask_next_one(b, 501), -1);
+	assert_inteq((int)bitmask_next_zero(b, 0), 0);
+	assert_inteq((int)bitmask_next_zero(b, 1), 2);
+	assert_inteq((int)bitmask_next_zero(b, 3), 4);
+	assert_inteq((int)bitmask_next_zero(b, 31), 33);
+
+	assert_inteq((int)bitmask_next_one(b, 0), 1);
+	assert_inteq((int)bitmask_next_one(b, 2), 3);
+	assert_inteq((int)bitmask_next_one(b, 6), 31);
+	assert_inteq((int)bitmask_next_one(b, 32), 32);
+	assert_inteq((int)bitmask_next_one(b, 33), 500);
+	assert_inteq((int)bitmask_next_one(b, 501), -1);
 
 	bitmask_foreach_continue(it, b) {
 		switch (continue_count) {
 		case 0:
-			assert_inteq(it.start, 1);
-			assert_inteq(it.bits,  1);
+			assert_inteq((int)it.start, 1);
+			assert_inteq((int)it.bits,  1);
 			break;
 		case 1:
-			assert_inteq(it.start, 3);
-			assert_inteq(it.bits,  1);
+			assert_inteq((int)it.start, 3);
+			assert_inteq((int)it.bits,  1);
 			break;
 		case 2:
-			assert_inteq(it.start, 5);
-			assert_inteq(it.bits,  1);
+			assert_inteq((int)it.start, 5);
+			assert_inteq((int)it.bits,  1);
 			break;
 		case 3:
-			assert_inteq(it.start, 31);
-			assert_inteq(it.bits,   2);
+			assert_inteq((int)it.start, 31);
+			assert_inteq((int)it.bits,   2);
 			break;
 		case 4:
-			assert_inteq(it.start, 500);
-			assert_inteq(it.bits,  1);
+			assert_inteq((int)it.start, 500);
+			assert_inteq((int)it.bits,  1);
 			break;
 		}
 
@@ -91,4 +92,25 @@ void bitmask_test(void)
 
 	bitmask_unset(b, 32);
 	assert_inteq(bitmask_get(b, 32), 0);
+
+	/* bit 1, 3, 5 and 31 in LSB first order */
+	bitmask_export_lsbfirst(b, lsb, sizeof(lsb));
+	assert_xinteq(lsb[0], 0x2a);
+	assert_xinteq(lsb[1], 0x00);
+	assert_xinteq(lsb[3], 0x80);
+
+	bitmask_memcpy_lsbfirst(b, lsb, sizeof(lsb));
+	assert_inteq(bitmask_get(b, 31), 1);
+	assert_inteq(bitmask_get(b, 30), 0);
+
+	/* the leading bits, whole bytes and trailing bits of a range */
+	bitmask_memset(b, 0);
+	assert_inteq(bitmask_set_bits(b, 13, 300), 0);
+	assert_inteq((int)bitmask_next_one(b, 0), 13);
+	assert_inteq((int)bitmask_next_zero(b, 13), 313);
+
+	/* the bits in range are written even if the range overflows */
+	assert_inteq(bitmask_set_bits(b, 505, 10), -1);
+	assert_inteq(bitmask_get(b, 504), 0);
+	assert_inteq(bitmask_get(b, 510), 1);
 }
@@ -10,6 +10,7 @@ int main(int argc, char **argv)
 	crc_test();
 	hash_compatible_test();
 	bitmask_test();
+	threadpool_test();
 
 	printf("total %zu, failed %zu\n", test_total, test_failed);
 	if (test_failed)
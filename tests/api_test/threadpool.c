@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "api_test.h"
+#include "threadpool.h"
+
+static pthread_mutex_t counter_lock = PTHREAD_MUTEX_INITIALIZER;
+static int counter;
+
+static int threadpool_test_add(void *arg)
+{
+	int *n = arg;
+
+	pthread_mutex_lock(&counter_lock);
+	counter += *n;
+	pthread_mutex_unlock(&counter_lock);
+
+	free(n);
+	return 0;
+}
+
+static int threadpool_test_fail(void *arg)
+{
+	return -1;
+}
+
+static void threadpool_test_sum(int nthreads)
+{
+	struct threadpool *tp = alloc_threadpool(nthreads, 0);
+	int expected = 0;
+
+	assert_good(tp != NULL);
+	if (!tp)
+		return;
+
+	counter = 0;
+	for (int i = 0; i < 1000; i++) {
+		int *n = malloc(sizeof(*n));
+
+		*n = i;
+		expected += i;
+		assert_inteq(threadpool_queue_work(tp, threadpool_test_add, n), 0);
+	}
+
+	assert_inteq(threadpool_wait(tp), 0);
+	assert_inteq(counter, expected);
+	threadpool_free(tp);
+}
+
+static void threadpool_test_error(int nthreads)
+{
+	struct threadpool *tp = alloc_threadpool(nthreads, 0);
+
+	assert_good(tp != NULL);
+	if (!tp)
+		return;
+
+	threadpool_queue_work(tp, threadpool_test_fail, NULL);
+	assert_inteq(threadpool_wait(tp), -1);
+
+	/* no more works are accepted after failed */
+	assert_inteq(threadpool_queue_work(tp, threadpool_test_fail, NULL), -1);
+	threadpool_free(tp);
+}
+
+void threadpool_test(void)
+{
+	threadpool_test_sum(0);
+	threadpool_test_sum(4);
+	threadpool_test_error(0);
+	threadpool_test_error(4);
+}
@@ -41,28 +41,77 @@ function gen_ext4fs() {
     assert_success "Create ${dir}.ext4 failed"
 }
 
+# the owner of all data blocks of the first regular file reported by
+# whohas is the inode of it in debugfs.
+# $1: the unpacked directory
+# $2...: extra whohas options
+function assert_whohas_file() {
+    local dir=$1 file ino
+
+    shift
+    file=$(cd ${dir} && find . -type f | sort | head -n 1)
+    if [ -z "${file}" ] ; then
+        return 0
+    fi
+
+    file=${file#.}
+    ino=$(debugfs -R "stat \"${file}\"" ${dir}.${FSTYPE} 2>/dev/null \
+          | awk '$1 == "Inode:" { print $2; exit }')
+    debugfs -R "blocks \"${file}\"" ${dir}.${FSTYPE} 2>/dev/null \
+        | tr ' ' '\n' | awk 'NF' > ${dir}.blocks
+    if [ ! -s ${dir}.blocks ] ; then
+        return 0
+    fi
+
+    assert_imgeditor_successful ${dir}.${FSTYPE} -- whohas "$@" --file ${dir}.blocks > /dev/null \
+        || return $?
+    if ! awk -v owner="inode #${ino}" '{ n++; sub(/^[^:]*: /, "") }
+            $0 != owner { bad++ } END { exit bad || n == 0 }' \
+            ${TEST_TMPDIR}/imgeditor-stdio.txt ; then
+        log:error "the blocks of ${file} are not owned by inode #${ino}"
+        return 1
+    fi
+}
+
 # $1: unit name
 # $2: image size
+# $3...: extra mkfs options
 function imgeditor_unpack_ext4_test() {
     local unit=$1 img_size=$2
     local dir=${TEST_TMPDIR}/${unit}
 
+    shift 2
+
     # create the basic directory and generate ext image
     mkdir -p ${dir}
     ${unit} ${dir}
 
     case ${FSTYPE} in
         ext2)
-            gen_ext2fs ${dir} ${img_size} || exit $?
+            gen_ext2fs ${dir} ${img_size} "$@" || exit $?
             ;;
         ext4)
-            gen_ext4fs ${dir} ${img_size} || exit $?
+            gen_ext4fs ${dir} ${img_size} "$@" || exit $?
             ;;
     esac
 
     # make sure we can read it
     assert_imgeditor_successful ${dir}.${FSTYPE} || exit $?
 
+    # the layout map should cover all blocks continuously
+    assert_imgeditor_successful ${dir}.${FSTYPE} -- layout-map > /dev/null || exit $?
+    if ! awk 'NR > 1 { if ($1 != blk) exit 1; blk = $2 + 1 }' blk=0 \
+            ${TEST_TMPDIR}/imgeditor-stdio.txt ; then
+        log:error "layout-map of ${dir}.${FSTYPE} is not continuous"
+        exit 1
+    fi
+
+    # the data blocks of a file are owned by its inode, the second whohas
+    # loads the reverse map from cache
+    assert_whohas_file ${dir} || exit $?
+    assert_whohas_file ${dir} --cache ${dir}.rmap || exit $?
+    assert_whohas_file ${dir} --cache ${dir}.rmap || exit $?
+
     # unpack and compare
     assert_imgeditor_successful --unpack ${dir}.${FSTYPE} || exit $?
     assert_direq ${dir}.${FSTYPE}.dump ${dir} || exit $?
@@ -77,6 +126,10 @@ function imgeditor_unpack_ext4_test() {
     assert_imgeditor_successful -v ${dir}.${FSTYPE} -- sparse ${dir}.${FSTYPE}.simg || exit $?
     simg2img ${dir}.${FSTYPE}.simg ${dir}.${FSTYPE}.img || exit $?
     assert_fileeq ${dir}.${FSTYPE}.img ${dir}.${FSTYPE} || exit $?
+
+    # the blocks used by inodes are already marked in the block bitmaps
+    assert_imgeditor_successful ${dir}.${FSTYPE} -- sparse --verify ${dir}.${FSTYPE}.verify.simg || exit $?
+    assert_fileeq ${dir}.${FSTYPE}.verify.simg ${dir}.${FSTYPE}.simg || exit $?
 }
 
 function simple_abc() {
@@ -166,6 +219,319 @@ function large_file() {
     )
 }
 
+# the group descriptors are started at block 2 if the block size is 1KiB
+function blocksize_1k() {
+    simple_abc $1
+
+    (
+        cd $1
+
+        dd if=/dev/urandom of=1.bin bs=1K count=1000 status=none
+    )
+}
+
+function simple_abc_64bit() {
+    simple_abc $1
+}
+
+function many_longname_files_csum() {
+    many_longname_files $1
+}
+
+function sparse_file() {
+    (
+        cd $1
+
+        truncate -s 8M sparse.bin
+        dd if=/dev/urandom of=sparse.bin bs=4096 count=2 seek=100 conv=notrunc status=none
+        dd if=/dev/urandom of=sparse.bin bs=4096 count=1 seek=1000 conv=notrunc status=none
+    )
+}
+
+# the holes should not be allocated in the unpacked file.
+function imgeditor_unpack_sparse_test() {
+    local dir=${TEST_TMPDIR}/sparse_file
+    local blocks
+
+    imgeditor_unpack_ext4_test sparse_file 16MiB || return $?
+
+    blocks=$(stat -c %b ${dir}.${FSTYPE}.dump/sparse.bin)
+    if [ ${blocks} -ge 1024 ] ; then
+        log:error "the unpacked sparse.bin allocated ${blocks} blocks"
+        return 1
+    fi
+}
+
+# a file with 400 data blocks and holes between them, it's extent tree
+# is two levels in the 1KiB blocks filesystem.
+function fragmented_file() {
+    (
+        cd $1
+
+        truncate -s 1000K fragmented.bin
+        for i in $(seq 0 399) ; do
+            dd if=/dev/urandom of=fragmented.bin bs=1024 count=1 \
+                seek=$((i * 2 + 1)) conv=notrunc status=none
+        done
+    )
+}
+
+# the logical blocks are mapped the same as debugfs.
+function imgeditor_bmap_test() {
+    local dir=${TEST_TMPDIR}/fragmented_file
+    local ino
+
+    imgeditor_unpack_ext4_test fragmented_file 16MiB -b 1024 || return $?
+
+    ino=$(debugfs -R "stat /fragmented.bin" ${dir}.${FSTYPE} 2>/dev/null \
+          | awk '$1 == "Inode:" { print $2; exit }')
+    for i in $(seq 0 999) ; do
+        echo "bmap /fragmented.bin $i"
+    done | debugfs -f - ${dir}.${FSTYPE} 2>/dev/null \
+         | awk '!/^debugfs/ { print n++ ": " ($1 == 0 ? "hole" : $1) }' \
+         > ${dir}.bmap
+
+    assert_imgeditor_successful ${dir}.${FSTYPE} -- bmap ${ino} 0 1000 || return $?
+    assert_fileeq ${dir}.bmap ${TEST_TMPDIR}/imgeditor-stdio.txt || return $?
+
+    # seek to the middle of the file
+    assert_imgeditor_successful ${dir}.${FSTYPE} -- bmap ${ino} 501 100 || return $?
+    sed -n '502,601p' ${dir}.bmap > ${dir}.bmap.501
+    assert_fileeq ${dir}.bmap.501 ${TEST_TMPDIR}/imgeditor-stdio.txt || return $?
+}
+
+# the names in the large directory are found by the htree which is
+# built by e2fsck.
+function imgeditor_path_test() {
+    local dir=${TEST_TMPDIR}/many_longname_files
+    local name=a/very_lonoooooooooooooooooooooooooooooooooooooooooog_name_567.bin
+    local img=${dir}.htree.${FSTYPE}
+
+    cp ${dir}.${FSTYPE} ${img}
+    e2fsck -fyD ${img} > /dev/null 2>&1
+
+    assert_imgeditor_successful -v ${img} -- stat /${name} || return $?
+    if ! grep -q "htree lookup" ${TEST_TMPDIR}/imgeditor-stdio.txt ; then
+        log:error "${name} is not found by htree"
+        return 1
+    fi
+
+    assert_imgeditor_successful ${img} -- cat /a/../${name} > /dev/null || return $?
+    assert_fileeq ${dir}/${name} ${TEST_TMPDIR}/imgeditor-stdio.txt || return $?
+
+    # the symlink is followed
+    dir=${TEST_TMPDIR}/simple_link
+    assert_imgeditor_successful ${dir}.${FSTYPE} -- cat /symlink_of_a > /dev/null || return $?
+    assert_fileeq ${dir}/a ${TEST_TMPDIR}/imgeditor-stdio.txt || return $?
+
+    # unpack the directory only
+    dir=${TEST_TMPDIR}/simple_abc
+    img=${dir}.path.${FSTYPE}
+    cp ${dir}.${FSTYPE} ${img}
+    assert_imgeditor_successful --unpack ${img} -- --path /a/b || return $?
+    assert_direq ${img}.dump ${dir}/a/b || return $?
+}
+
+# the holes in a directory are skipped, the names in the other blocks are
+# still found.
+function imgeditor_dir_hole_test() {
+    local dir=${TEST_TMPDIR}/many_files
+    local img=${dir}.hole.${FSTYPE}
+    local count
+
+    cp ${dir}.${FSTYPE} ${img}
+    debugfs -w -R "punch /a 2 2" ${img} > /dev/null 2>&1
+    assert_success "punch the directory block by debugfs failed" || return $?
+
+    count=$(debugfs -R "ls -p /a" ${img} 2>/dev/null \
+            | awk -F/ 'NF > 5 && $6 != "." && $6 != ".."' | wc -l)
+
+    assert_imgeditor_successful --unpack ${img} -- --path /a || return $?
+    if [ $(ls ${img}.dump | wc -l) -ne ${count} ] ; then
+        log:error "the names after the hole of /a are lost"
+        return 1
+    fi
+}
+
+# the second run loads the metadata from the snapshot, and the snapshot
+# is rebuilt after the image is changed.
+function imgeditor_snapshot_test() {
+    local dir=${TEST_TMPDIR}/simple_abc
+    local img=${dir}.snapshot.${FSTYPE} snapshot=${dir}.snapshot
+
+    cp ${dir}.${FSTYPE} ${img}
+    rm -f ${snapshot}
+
+    assert_imgeditor_successful ${img} -- whohas 0-1023 > /dev/null || return $?
+    cp ${TEST_TMPDIR}/imgeditor-stdio.txt ${dir}.snapshot.whohas
+    assert_imgeditor_successful --snapshot ${snapshot} ${img} -- whohas 0-1023 > /dev/null || return $?
+    assert_fileeq ${dir}.snapshot.whohas ${TEST_TMPDIR}/imgeditor-stdio.txt || return $?
+
+    assert_imgeditor_successful -v --snapshot ${snapshot} ${img} -- whohas 0-1023 > /dev/null || return $?
+    if ! grep -q "loaded from snapshot" ${TEST_TMPDIR}/imgeditor-stdio.txt ; then
+        log:error "the metadata is not loaded from snapshot"
+        return 1
+    fi
+    assert_imgeditor_successful --snapshot ${snapshot} ${img} -- layout-map > /dev/null || return $?
+    cp ${TEST_TMPDIR}/imgeditor-stdio.txt ${dir}.snapshot.layout
+    assert_imgeditor_successful ${img} -- layout-map > /dev/null || return $?
+    assert_fileeq ${dir}.snapshot.layout ${TEST_TMPDIR}/imgeditor-stdio.txt || return $?
+
+    # the snapshot doesn't match the changed image
+    gen_random_file_silence ${dir}.snapshot.data 65536
+    debugfs -w -R "write ${dir}.snapshot.data data" ${img} > /dev/null 2>&1
+    assert_success "write file by debugfs failed" || return $?
+
+    assert_imgeditor_successful ${img} -- whohas 0-4095 > /dev/null || return $?
+    cp ${TEST_TMPDIR}/imgeditor-stdio.txt ${dir}.snapshot.whohas
+    assert_imgeditor_successful -v --snapshot ${snapshot} ${img} -- whohas 0-4095 > /dev/null || return $?
+    if grep -q "loaded from snapshot" ${TEST_TMPDIR}/imgeditor-stdio.txt ; then
+        log:error "the outdated snapshot is loaded"
+        return 1
+    fi
+    assert_imgeditor_successful --snapshot ${snapshot} ${img} -- whohas 0-4095 > /dev/null || return $?
+    assert_fileeq ${dir}.snapshot.whohas ${TEST_TMPDIR}/imgeditor-stdio.txt || return $?
+}
+
+# build the image by --pack and check it by e2fsck, the unpacked files
+# should be the same as the source directory.
+function imgeditor_pack_test() {
+    local name=$1 dir=${TEST_TMPDIR}/$1
+    local img=${TEST_TMPDIR}/$1.pack.${FSTYPE}
+
+    shift
+
+    rm -rf ${img} ${img}.dump
+    assert_imgeditor_successful --type ext2 --pack ${dir} ${img} -- "$@" || return $?
+    e2fsck -fn ${img}
+    assert_success "e2fsck ${img} failed" || return $?
+
+    assert_imgeditor_successful --unpack ${img} || return $?
+    assert_direq ${img}.dump ${dir} || return $?
+}
+
+# the same tree is packed to the same image if the uuid and the timestamp
+# are fixed, even if the times of the source files are changed.
+function imgeditor_pack_reproducible_test() {
+    local dir=${TEST_TMPDIR}/many_longname_files
+    local img=${dir}.reproducible.${FSTYPE}
+    local uuid=0a1b2c3d-4e5f-6071-8293-a4b5c6d7e8f9
+    local args="-U ${uuid} --hash-seed ${uuid} --timestamp 1700000000"
+
+    rm -f ${img} ${img}.2
+    assert_imgeditor_successful --type ext2 --pack ${dir} ${img} -- ${args} || return $?
+    sleep 1
+    find ${dir} -exec touch -a {} +
+    assert_imgeditor_successful --type ext2 --pack ${dir} ${img}.2 -- ${args} || return $?
+    assert_fileeq ${img}.2 ${img} || return $?
+}
+
+# the raw image of the sparse image is the same as the image without
+# --sparse if the uuid and the timestamp are fixed.
+function imgeditor_pack_sparse_test() {
+    local dir=${TEST_TMPDIR}/large_file
+    local img=${dir}.pack.${FSTYPE}
+    local uuid=0a1b2c3d-4e5f-6071-8293-a4b5c6d7e8f9
+    local args="-U ${uuid} --hash-seed ${uuid} --timestamp 1700000000"
+
+    rm -f ${img} ${img}.simg ${img}.img
+    assert_imgeditor_successful --type ext2 --pack ${dir} ${img} -- ${args} || return $?
+    assert_imgeditor_successful --type ext2 --pack ${dir} ${img}.simg -- ${args} --sparse || return $?
+    simg2img ${img}.simg ${img}.img || return $?
+    assert_fileeq ${img}.img ${img} || return $?
+}
+
+# write three transactions by debugfs: the first one logs block 300 and
+# 301, the second one revokes block 300 and the last one logs block 302.
+function gen_journal_transactions() {
+    local img=$1 data=$2
+
+    debugfs -w -f - ${img} > /dev/null <<EOF
+jo
+jw -b 300,301 ${data}
+jc
+jo
+jw -r 300
+jw -b 302 ${data}
+jc
+EOF
+}
+
+function imgeditor_journal_test() {
+    local dir=${TEST_TMPDIR}/journal
+    local pending
+
+    imgeditor_unpack_ext4_test simple_abc 16MiB || return $?
+    cp ${TEST_TMPDIR}/simple_abc.${FSTYPE} ${dir}.${FSTYPE}
+
+    gen_random_file_silence ${dir}.data 8192
+    gen_journal_transactions ${dir}.${FSTYPE} ${dir}.data
+    assert_success "write journal transactions failed" || return $?
+
+    assert_imgeditor_successful ${dir}.${FSTYPE} -- journal trans || return $?
+    if [ $(grep -c pending ${TEST_TMPDIR}/imgeditor-stdio.txt) -ne 3 ] ; then
+        log:error "there should be 3 pending transactions"
+        return 1
+    fi
+
+    # block 300 is revoked by the second transaction
+    assert_imgeditor_successful ${dir}.${FSTYPE} -- journal pending || return $?
+    pending=$(awk '{ printf "%s ", $3 }' ${TEST_TMPDIR}/imgeditor-stdio.txt)
+    if [ "${pending}" != "301 302 " ] ; then
+        log:error "the pending blocks are ${pending}"
+        return 1
+    fi
+
+    # the lookup agrees with the pending blocks
+    assert_imgeditor_successful ${dir}.${FSTYPE} -- journal lookup 300 301 || return $?
+    if ! grep -q "^FS blocknr 300 .* revoked by tid .*, not replayed" \
+            ${TEST_TMPDIR}/imgeditor-stdio.txt \
+        || ! grep -q "^FS blocknr 301 .*, will be replayed" \
+            ${TEST_TMPDIR}/imgeditor-stdio.txt ; then
+        log:error "the revoke of block 300 is not reported"
+        return 1
+    fi
+
+    # the replayed image is the same as e2fsck's, except the timestamps
+    # in the super block.
+    cp ${dir}.${FSTYPE} ${dir}.e2fsck.${FSTYPE}
+    e2fsck -fy -E journal_only ${dir}.e2fsck.${FSTYPE} > /dev/null 2>&1
+    assert_imgeditor_successful ${dir}.${FSTYPE} -- replay ${dir}.replay.${FSTYPE} || return $?
+    cmp -s -i 2048 ${dir}.replay.${FSTYPE} ${dir}.e2fsck.${FSTYPE}
+    assert_success "the replayed image is different with e2fsck" || return $?
+    e2fsck -fn ${dir}.replay.${FSTYPE} > /dev/null 2>&1
+    assert_success "the replayed image is broken" || return $?
+
+    # list and unpack the recovered filesystem without writting the image
+    assert_imgeditor_successful ${dir}.${FSTYPE} -- --replay list > /dev/null || return $?
+    assert_imgeditor_successful --unpack ${dir}.${FSTYPE} -- --replay || return $?
+    assert_imgeditor_successful --unpack ${dir}.e2fsck.${FSTYPE} || return $?
+    assert_direq ${dir}.${FSTYPE}.dump ${dir}.e2fsck.${FSTYPE}.dump || return $?
+}
+
+# the metadata checksums of a good image are passed, and the corrupted
+# inode bitmap should be reported.
+function imgeditor_fsck_csum_test() {
+    local dir=${TEST_TMPDIR}/many_longname_files_csum
+    local blkno
+
+    imgeditor_unpack_ext4_test many_longname_files_csum 64MiB \
+        -b 4096 -O metadata_csum || return $?
+    assert_imgeditor_successful ${dir}.${FSTYPE} -- fsck-csum || return $?
+
+    assert_imgeditor_successful ${dir}.${FSTYPE} -- layout-map > /dev/null || return $?
+    blkno=$(awk '$4 == "inode" && $5 == "bitmap" { print $1; exit }' \
+            ${TEST_TMPDIR}/imgeditor-stdio.txt)
+
+    printf 'Z' | dd of=${dir}.${FSTYPE} bs=1 seek=$((blkno * 4096 + 1)) \
+        conv=notrunc status=none
+    if ${CMAKE_CURRENT_BINARY_DIR}/imgeditor --disable-plugin \
+            ${dir}.${FSTYPE} -- fsck-csum ; then
+        log:error "the corrupted inode bitmap is not reported"
+        return 1
+    fi
+}
+
 imgeditor_unpack_ext4_test simple_abc 16MiB || exit $?
 imgeditor_unpack_ext4_test file_unaligned 16MiB || exit $?
 imgeditor_unpack_ext4_test many_files 16MiB || exit $?
@@ -174,3 +540,19 @@ imgeditor_unpack_ext4_test simple_link 16MiB || exit $?
 imgeditor_unpack_ext4_test symlink_60 16MiB || exit $?
 imgeditor_unpack_ext4_test long_link_target_name 16MiB || exit $?
 imgeditor_unpack_ext4_test large_file 64MiB || exit $?
+imgeditor_unpack_sparse_test || exit $?
+imgeditor_unpack_ext4_test blocksize_1k 16MiB -b 1024 || exit $?
+imgeditor_bmap_test || exit $?
+imgeditor_path_test || exit $?
+imgeditor_dir_hole_test || exit $?
+imgeditor_snapshot_test || exit $?
+if [ "${FSTYPE}" = "ext4" ] ; then
+    imgeditor_unpack_ext4_test simple_abc_64bit 16MiB -O 64bit || exit $?
+    imgeditor_fsck_csum_test || exit $?
+    imgeditor_journal_test || exit $?
+    imgeditor_pack_test many_longname_files || exit $?
+    imgeditor_pack_test simple_link -b 1024 -I 128 -O ^metadata_csum || exit $?
+    imgeditor_pack_test large_file -b 2048 -O 64bit --size 64M || exit $?
+    imgeditor_pack_sparse_test || exit $?
+    imgeditor_pack_reproducible_test || exit $?
+fi
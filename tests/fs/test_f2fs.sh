@@ -29,6 +29,38 @@ function gen_f2fs() {
     assert_success "Create ${dir}.f2fs failed"
 }
 
+# every main segment is counted as free, dirty, full or current, and the
+# free segments and valid blocks agree with the checkpoint.
+# $1: f2fs image
+# $2: segments report of it
+function assert_segments_report() {
+    local img=$1 report=$2
+
+    assert_imgeditor_successful ${img} -- checkpoint > /dev/null || return $?
+
+    # the first key is the top level one, the types have the same keys.
+    if awk -F '[":, ]+' '
+        FNR == NR { cp[$1] = $2; next }
+        !($2 in v) { v[$2] = $3 }
+        END {
+            if (v["free_segments"] + v["dirty_segments"] + v["full_segments"] \
+                + v["current_segments"] != v["main_segments"])
+                exit 1
+            if (v["vblocks_mismatch"] != 0)
+                exit 1
+            if (v["free_segments"] != cp["free_segment_count"])
+                exit 1
+            if (v["valid_blocks"] != cp["valid_block_count"])
+                exit 1
+        }' ${TEST_TMPDIR}/imgeditor-stdio.txt ${report} ; then
+        return 0
+    fi
+
+    log:error "bad segments report ${report}"
+    print_bash_error_stack
+    return 1
+}
+
 # $1: unit name
 # $2: image size
 function imgeditor_unpack_test() {
@@ -47,10 +79,19 @@ function imgeditor_unpack_test() {
 
     # check list function
     assert_imgeditor_successful ${dir}.f2fs || exit $?
+    assert_imgeditor_successful ${dir}.f2fs -- segments ${dir}.segments.json || exit $?
+    assert_segments_report ${dir}.f2fs ${dir}.segments.json || exit $?
 
     # unpack and compare
     assert_imgeditor_successful --unpack ${dir}.f2fs || exit $?
     assert_direq ${dir}.f2fs.dump ${dir} || exit $?
+
+    # test sparse function, the unused blocks may have stale data, so
+    # compare the files in it.
+    assert_imgeditor_successful -v ${dir}.f2fs -- sparse ${dir}.f2fs.simg || exit $?
+    simg2img ${dir}.f2fs.simg ${dir}.f2fs.img || exit $?
+    assert_imgeditor_successful --unpack ${dir}.f2fs.img || exit $?
+    assert_direq ${dir}.f2fs.img.dump ${dir} || exit $?
 }
 
 function simple_abc() {
@@ -172,6 +213,149 @@ function large_file() {
     )
 }
 
+function compress_files() {
+    (
+        cd $1
+
+        for i in $(seq 1 2000) ; do
+            echo "line $i of the compressed file"
+        done > small.txt
+
+        for i in $(seq 1 100) ; do
+            cat small.txt
+        done > large.txt
+
+        gen_random_file_silence random.txt 65536
+    )
+}
+
+# the files are compressed by sload.f2fs and decompressed when unpacking.
+function imgeditor_compress_test() {
+    local algorithm=$1
+    local dir=${TEST_TMPDIR}/compress_${algorithm}
+
+    mkdir -p ${dir}
+    compress_files ${dir}
+
+    MKFS_F2FS_OPTIONS="-O extra_attr,compression" \
+        gen_f2fs ${dir} 64M -c -a ${algorithm} -i txt || return $?
+
+    assert_imgeditor_successful --unpack ${dir}.f2fs || return $?
+    assert_direq ${dir}.f2fs.dump ${dir} || return $?
+
+    assert_imgeditor_successful ${dir}.f2fs -- cat /large.txt > /dev/null || return $?
+    assert_fileeq ${dir}/large.txt ${TEST_TMPDIR}/imgeditor-stdio.txt || return $?
+}
+
+# the holes are not allocated, and the file ends with a hole.
+function holey_file() {
+    (
+        cd $1
+
+        for i in $(seq 0 63) ; do
+            dd if=/dev/urandom of=holey bs=4096 count=1 seek=$((i * 3)) \
+                conv=notrunc status=none
+        done
+
+        truncate -s $((4096 * 256)) holey
+    )
+}
+
+# mkfs.f2fs -i enlarges the nat bitmap, it is saved in the cp block and the
+# checksum is moved ahead of it.
+function large_nat_bitmap() {
+    simple_abc $1
+}
+
+function extra_attr_inline() {
+    (
+        cd $1
+
+        mkdir -p d
+        echo "inline data after the extra attributes" > d/f
+        ln -s d symlink_of_d
+        ln -s d/f symlink_of_f
+    )
+}
+
+# the names are found in the hash buckets of each level.
+function imgeditor_path_test() {
+    local dir=${TEST_TMPDIR}/many_longname_files
+    local name=a/very_lonoooooooooooooooooooooooooooooooooooooooooog_name_567.bin
+    local img
+
+    assert_imgeditor_successful ${dir}.f2fs -- stat /${name} || return $?
+    assert_imgeditor_successful ${dir}.f2fs -- cat /a/../${name} > /dev/null || return $?
+    assert_fileeq ${dir}/${name} ${TEST_TMPDIR}/imgeditor-stdio.txt || return $?
+
+    # the symlink is followed
+    dir=${TEST_TMPDIR}/simple_link
+    assert_imgeditor_successful ${dir}.f2fs -- cat /symlink_of_a > /dev/null || return $?
+    assert_fileeq ${dir}/a ${TEST_TMPDIR}/imgeditor-stdio.txt || return $?
+
+    # unpack the directory only
+    dir=${TEST_TMPDIR}/simple_abc
+    img=${dir}.path.f2fs
+    cp ${dir}.f2fs ${img}
+    assert_imgeditor_successful --unpack ${img} -- --path /a || return $?
+    assert_direq ${img}.dump ${dir}/a || return $?
+
+    # the inline data and symlink target are saved after the extra attributes
+    dir=${TEST_TMPDIR}/extra_attr_inline
+    mkdir -p ${dir}
+    extra_attr_inline ${dir}
+    MKFS_F2FS_OPTIONS="-O extra_attr" gen_f2fs ${dir} 64M || return $?
+
+    assert_imgeditor_successful ${dir}.f2fs -- cat /d/f > /dev/null || return $?
+    assert_fileeq ${dir}/d/f ${TEST_TMPDIR}/imgeditor-stdio.txt || return $?
+    assert_imgeditor_successful ${dir}.f2fs -- cat /symlink_of_f > /dev/null || return $?
+    assert_fileeq ${dir}/d/f ${TEST_TMPDIR}/imgeditor-stdio.txt || return $?
+    assert_imgeditor_successful ${dir}.f2fs -- cat /symlink_of_d/f > /dev/null || return $?
+    assert_fileeq ${dir}/d/f ${TEST_TMPDIR}/imgeditor-stdio.txt || return $?
+
+    assert_imgeditor_successful --unpack ${dir}.f2fs || return $?
+    assert_direq ${dir}.f2fs.dump ${dir} || return $?
+}
+
+# delete every other file written by sload.f2fs, the full data segments
+# become dirty. mount the image needs root permission.
+function imgeditor_dirty_segments_test() {
+    local dir=${TEST_TMPDIR}/dirty_segments
+
+    if [ "$EUID" -ne 0 ]; then
+        return 0
+    fi
+
+    mkdir -p ${dir}
+    for i in $(seq 1 2000) ; do
+        gen_random_file_silence ${dir}/$i.bin 4096
+    done
+
+    gen_f2fs ${dir} 64M || return $?
+
+    mkdir -p ${dir}.mount
+    mount -o loop ${dir}.f2fs ${dir}.mount || return $?
+    for i in $(seq 1 2 2000) ; do
+        rm ${dir}/$i.bin ${dir}.mount/$i.bin
+    done
+    umount ${dir}.mount
+
+    if [ -n "${SUDO_UID}" ] && [ -n "${SUDO_GID}" ] ; then
+        chown -R ${SUDO_UID}:${SUDO_GID} ${TEST_TMPDIR}
+    fi
+
+    assert_imgeditor_successful ${dir}.f2fs -- segments ${dir}.segments.json || return $?
+    assert_segments_report ${dir}.f2fs ${dir}.segments.json || return $?
+    if awk -F '[":, ]+' '$2 == "dirty_segments" { n = $3 }
+            END { exit n == 0 }' \
+            ${dir}.segments.json ; then
+        return 0
+    fi
+
+    log:error "no dirty segments after deleting the files"
+    return 1
+}
+
 imgeditor_unpack_test simple_abc || exit $?
 imgeditor_unpack_test longname || exit $?
 imgeditor_unpack_test inline_data 256M || exit $?
@@ -182,3 +366,9 @@ imgeditor_unpack_test many_files || exit $?
 imgeditor_unpack_test many_longname_files || exit $?
 imgeditor_unpack_test simple_link || exit $?
 imgeditor_unpack_test long_link_target_name || exit $?
+imgeditor_unpack_test holey_file || exit $?
+MKFS_F2FS_OPTIONS="-i" imgeditor_unpack_test large_nat_bitmap || exit $?
+imgeditor_path_test || exit $?
+imgeditor_compress_test lz4 || exit $?
+imgeditor_compress_test lzo || exit $?
+imgeditor_dirty_segments_test || exit $?
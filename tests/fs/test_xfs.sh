@@ -70,6 +70,10 @@ function imgeditor_unpack_test() {
     assert_imgeditor_successful -v ${dir}.xfs -- sparse ${dir}.xfs.simg || exit $?
     simg2img ${dir}.xfs.simg ${dir}.xfs.img || exit $?
     assert_fileeq ${dir}.xfs.img ${dir}.xfs || exit $?
+
+    # unpack and compare
+    assert_imgeditor_successful --unpack ${dir}.xfs || exit $?
+    assert_direq ${dir}.xfs.dump ${dir} || exit $?
 }
 
 function simple_abc() {
@@ -150,6 +154,65 @@ function long_link_target_name() {
     )
 }
 
+# a data block every 8K, the extents of it are saved in the bmbt blocks
+function holey_file() {
+    (
+        cd $1
+
+        for i in $(seq 0 511) ; do
+            dd if=/dev/urandom of=holey bs=4096 count=1 seek=$((i * 2)) \
+                conv=notrunc status=none
+        done
+    )
+}
+
+# delete every other small file to fragment the free space, the bnobt
+# can not hold all free extents in the root block and grows more levels.
+function imgeditor_fragment_free_space_test() {
+    local dir=${TEST_TMPDIR}/fragment_free_space
+    local level max_level=0
+
+    mkdir -p ${dir}
+    for i in $(seq 1 2000) ; do
+        gen_random_file_silence ${dir}/$i.bin 4096
+    done
+
+    # 4 AGs with 32M size, all files are saved in the same AG as the parent
+    MKFS_XFS_OPTIONS="-d agcount=4" gen_xfs ${dir} 128M || exit $?
+
+    mount -o loop ${dir}.xfs ${dir}.mount || exit $?
+    for i in $(seq 1 2 2000) ; do
+        rm ${dir}/$i.bin ${dir}.mount/$i.bin
+    done
+    umount ${dir}.mount
+
+    if [ -n "${SUDO_UID}" ] && [ -n "${SUDO_GID}" ] ; then
+        chown -R ${SUDO_UID}:${SUDO_GID} ${TEST_TMPDIR}
+    fi
+
+    for ag in 0 1 2 3 ; do
+        assert_imgeditor_successful ${dir}.xfs -- agf ${ag} > /dev/null \
+            || exit $?
+        level=$(awk '$1 == "agf_bno_level" { print $3 }' \
+                ${TEST_TMPDIR}/imgeditor-stdio.txt)
+        if [ "${level}" -gt ${max_level} ] ; then
+            max_level=${level}
+        fi
+    done
+
+    if [ ${max_level} -le 1 ] ; then
+        log:error "the free space is not fragmented, agf_bno_level ${max_level}"
+        exit 1
+    fi
+
+    assert_imgeditor_successful -v ${dir}.xfs -- sparse ${dir}.xfs.simg || exit $?
+    simg2img ${dir}.xfs.simg ${dir}.xfs.img || exit $?
+    assert_fileeq ${dir}.xfs.img ${dir}.xfs || exit $?
+
+    assert_imgeditor_successful --unpack ${dir}.xfs || exit $?
+    assert_direq ${dir}.xfs.dump ${dir} || exit $?
+}
+
 imgeditor_unpack_test simple_abc || exit $?
 imgeditor_unpack_test longname || exit $?
 imgeditor_unpack_test file_unaligned || exit $?
@@ -157,3 +220,6 @@ imgeditor_unpack_test many_files || exit $?
 imgeditor_unpack_test many_longname_files || exit $?
 imgeditor_unpack_test simple_link || exit $?
 imgeditor_unpack_test long_link_target_name || exit $?
+imgeditor_unpack_test holey_file || exit $?
+
+imgeditor_fragment_free_space_test || exit $?
@@ -0,0 +1,194 @@
+/*
+ * simple worker thread pool
+ * qianfan Zhao <qianfanguijin@163.com>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "threadpool.h"
+
+struct threadpool_work {
+	threadpool_work_t		work;
+	void				*arg;
+};
+
+struct threadpool {
+	pthread_mutex_t			lock;
+	pthread_cond_t			not_empty;
+	pthread_cond_t			not_full;
+	pthread_cond_t			idle;
+
+	int				nthreads;
+	pthread_t			*threads;
+	int				exiting;
+	int				error;
+
+	/* a ring buffer of the pending works */
+	struct threadpool_work		*works;
+	size_t				max_pending;
+	size_t				head;
+	size_t				pending;
+	size_t				running;
+};
+
+static void threadpool_report_error(struct threadpool *tp, int ret)
+{
+	if (ret < 0 && tp->error == 0)
+		tp->error = ret;
+}
+
+static void *threadpool_worker(void *arg)
+{
+	struct threadpool *tp = arg;
+
+	pthread_mutex_lock(&tp->lock);
+
+	while (1) {
+		struct threadpool_work w;
+		int ret;
+
+		while (tp->pending == 0 && !tp->exiting)
+			pthread_cond_wait(&tp->not_empty, &tp->lock);
+
+		if (tp->pending == 0) /* exiting */
+			break;
+
+		w = tp->works[tp->head];
+		tp->head = (tp->head + 1) % tp->max_pending;
+		tp->pending--;
+		tp->running++;
+		pthread_cond_signal(&tp->not_full);
+		pthread_mutex_unlock(&tp->lock);
+
+		ret = w.work(w.arg);
+
+		pthread_mutex_lock(&tp->lock);
+		threadpool_report_error(tp, ret);
+		tp->running--;
+		if (tp->pending == 0 && tp->running == 0)
+			pthread_cond_broadcast(&tp->idle);
+	}
+
+	pthread_mutex_unlock(&tp->lock);
+	return NULL;
+}
+
+struct threadpool *alloc_threadpool(int nthreads, size_t max_pending)
+{
+	struct threadpool *tp = calloc(1, sizeof(*tp));
+
+	if (!tp)
+		return tp;
+
+	pthread_mutex_init(&tp->lock, NULL);
+	pthread_cond_init(&tp->not_empty, NULL);
+	pthread_cond_init(&tp->not_full, NULL);
+	pthread_cond_init(&tp->idle, NULL);
+
+	if (nthreads < 2)
+		return tp;
+
+	if (max_pending == 0)
+		max_pending = nthreads * 4;
+
+	tp->max_pending = max_pending;
+	tp->works = calloc(max_pending, sizeof(*tp->works));
+	tp->threads = calloc(nthreads, sizeof(*tp->threads));
+	if (!tp->works || !tp->threads)
+		goto failed;
+
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&tp->threads[i], NULL, threadpool_worker, tp))
+			break;
+		tp->nthreads++;
+	}
+
+	/* we can still work without threads, but it should not happen */
+	if (tp->nthreads == 0)
+		fprintf(stderr, "Warnning: create worker threads failed\n");
+
+	return tp;
+
+failed:
+	fprintf(stderr, "Error: alloc threadpool with %d threads failed\n",
+		nthreads);
+	threadpool_free(tp);
+	return NULL;
+}
+
+int threadpool_queue_work(struct threadpool *tp, threadpool_work_t work,
+			  void *arg)
+{
+	int ret;
+
+	if (tp->nthreads == 0) {
+		/* run it now in the caller's thread */
+		if (tp->error < 0)
+			return tp->error;
+
+		/* @arg is consumed by @work, the error is reported in the
+		 * next queue or wait.
+		 */
+		threadpool_report_error(tp, work(arg));
+		return 0;
+	}
+
+	pthread_mutex_lock(&tp->lock);
+
+	while (tp->pending == tp->max_pending && tp->error == 0)
+		pthread_cond_wait(&tp->not_full, &tp->lock);
+
+	ret = tp->error;
+	if (ret == 0) {
+		size_t tail = (tp->head + tp->pending) % tp->max_pending;
+
+		tp->works[tail].work = work;
+		tp->works[tail].arg = arg;
+		tp->pending++;
+		pthread_cond_signal(&tp->not_empty);
+	}
+
+	pthread_mutex_unlock(&tp->lock);
+	return ret;
+}
+
+int threadpool_wait(struct threadpool *tp)
+{
+	int ret;
+
+	pthread_mutex_lock(&tp->lock);
+	while (tp->pending > 0 || tp->running > 0)
+		pthread_cond_wait(&tp->idle, &tp->lock);
+	ret = tp->error;
+	pthread_mutex_unlock(&tp->lock);
+
+	return ret;
+}
+
+int threadpool_threads(struct threadpool *tp)
+{
+	return tp->nthreads;
+}
+
+void threadpool_free(struct threadpool *tp)
+{
+	if (!tp)
+		return;
+
+	pthread_mutex_lock(&tp->lock);
+	tp->exiting = 1;
+	pthread_cond_broadcast(&tp->not_empty);
+	pthread_mutex_unlock(&tp->lock);
+
+	for (int i = 0; i < tp->nthreads; i++)
+		pthread_join(tp->threads[i], NULL);
+
+	pthread_mutex_destroy(&tp->lock);
+	pthread_cond_destroy(&tp->not_empty);
+	pthread_cond_destroy(&tp->not_full);
+	pthread_cond_destroy(&tp->idle);
+
+	free(tp->threads);
+	free(tp->works);
+	free(tp);
+}
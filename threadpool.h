@@ -0,0 +1,38 @@
+/*
+ * simple worker thread pool
+ * qianfan Zhao <qianfanguijin@163.com>
+ */
+#ifndef IMGEDITOR_THREADPOOL_H
+#define IMGEDITOR_THREADPOOL_H
+
+#include <stdio.h>
+
+/* @arg is owned by the work function, it should free it before return.
+ * Return negative number means failed.
+ */
+typedef int (*threadpool_work_t)(void *arg);
+
+struct threadpool;
+
+/* @nthreads: the number of worker threads, works are run synchronously in
+ *            the caller's thread if it is less than 2.
+ * @max_pending: the max number of works waiting in the queue, the caller
+ *               will block in threadpool_queue_work if the queue is full.
+ */
+struct threadpool *alloc_threadpool(int nthreads, size_t max_pending);
+
+/* Return the first error reported by the works that already finished,
+ * the new work is not queued in this case and the caller still owns @arg.
+ */
+int threadpool_queue_work(struct threadpool *tp, threadpool_work_t work,
+			  void *arg);
+
+/* wait all queued works finished and return the first error */
+int threadpool_wait(struct threadpool *tp);
+
+int threadpool_threads(struct threadpool *tp);
+
+/* wait and destroy the pool */
+void threadpool_free(struct threadpool *tp);
+
+#endif
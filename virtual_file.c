@@ -83,6 +83,26 @@ int fileread(int fd, void *buf, size_t sz)
 	return n == sz ? 0 : -1;
 }
 
+int filepread(int fd, void *buf, size_t sz, off64_t offset)
+{
+	off64_t start = filestart(fd) + offset;
+	size_t n = 0;
+
+	while (n < sz) {
+		ssize_t ret = pread64(fd, buf + n, sz - n, start + n);
+
+		if (ret < 0)
+			return ret;
+
+		if (ret == 0) /* end of file */
+			break;
+
+		n += ret;
+	}
+
+	return n == sz ? 0 : -1;
+}
+
 static struct virtual_file *virtual_file_get_unused()
 {
 	struct global_data *gd = imgeditor_get_gd();